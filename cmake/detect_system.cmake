@@ -14,6 +14,20 @@ check_cxx_source_compiles("
     int main() {}" 
 HAVE_NETLINK)
 
+check_cxx_source_compiles("
+    #include <sys/inotify.h>
+    int main() { 
+        return inotify_init1(IN_NONBLOCK | IN_CLOEXEC); 
+    }" 
+HAVE_INOTIFY)
+
+check_cxx_source_compiles("
+    #include <sys/sdt.h>
+    int main(int argc, char **) { 
+        STAP_PROBEV(wsddn, test, argc, 1);
+    }" 
+HAVE_USDT)
+
 if (NOT HAVE_NETLINK)
 
     check_cxx_source_compiles("
@@ -0,0 +1,116 @@
+// Copyright (c) 2022, Eugene Gershnik
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "announcement_scheduler.h"
+#include "config.h"
+
+//APP_MAX_DELAY in the spec
+static constexpr auto g_appMaxDelay = std::chrono::milliseconds(500);
+
+auto AnnouncementScheduler::intervalFor(unsigned packetsPerSecond) -> Clock::duration {
+    if (packetsPerSecond == 0)
+        return Clock::duration::zero();
+    return std::chrono::duration_cast<Clock::duration>(std::chrono::seconds(g_WsdMulticastRepeatCount)) / packetsPerSecond;
+}
+
+void AnnouncementScheduler::request(const Strand & strand, Kind kind, Callback callback) {
+    asio::dispatch(m_strand, [this, holder = refcnt_retain(this), req = Request{strand, kind, std::move(callback)}]() mutable {
+        doRequest(std::move(req));
+    });
+}
+
+void AnnouncementScheduler::setRate(unsigned packetsPerSecond) {
+    asio::dispatch(m_strand, [this, holder = refcnt_retain(this), packetsPerSecond]() {
+        m_interval = intervalFor(packetsPerSecond);
+        pump();
+    });
+}
+
+void AnnouncementScheduler::shutdown(std::chrono::steady_clock::duration deadline) {
+    asio::dispatch(m_strand, [this, holder = refcnt_retain(this), deadline]() {
+        doShutdown(deadline);
+    });
+}
+
+void AnnouncementScheduler::doRequest(Request && req) {
+
+    auto now = Clock::now();
+
+    Clock::time_point notBefore;
+    if (req.kind == Hello) {
+        if (m_deadline) {
+            complete(std::move(req), false);
+            return;
+        }
+        std::uniform_int_distribution<Clock::rep> distrib(0, Clock::duration(g_appMaxDelay).count());
+        notBefore = now + Clock::duration(distrib(g_Random));
+    } else {
+        if (m_deadline && now >= *m_deadline) {
+            complete(std::move(req), false);
+            return;
+        }
+        //ahead of everything but earlier Byes
+        notBefore = Clock::time_point::min();
+    }
+    m_queue.emplace(notBefore, std::move(req));
+    pump();
+}
+
+void AnnouncementScheduler::doShutdown(std::chrono::steady_clock::duration deadline) {
+
+    auto newDeadline = Clock::now() + deadline;
+    if (m_deadline && *m_deadline <= newDeadline)
+        return;
+    m_deadline = newDeadline;
+
+    for (auto it = m_queue.begin(); it != m_queue.end(); ) {
+        if (it->second.kind != Hello) {
+            ++it;
+            continue;
+        }
+        complete(std::move(it->second), false);
+        it = m_queue.erase(it);
+    }
+    pump();
+}
+
+void AnnouncementScheduler::pump() {
+
+    auto now = Clock::now();
+    while (!m_queue.empty()) {
+        auto it = m_queue.begin();
+        auto when = std::max(it->first, m_nextSlot);
+
+        //only Byes are left by now and none of them would make it
+        if (m_deadline && when > *m_deadline) {
+            WSDLOG_DEBUG("Dropping {} announcements that cannot be sent before shutdown deadline", m_queue.size());
+            for (auto & [_, req]: m_queue)
+                complete(std::move(req), false);
+            m_queue.clear();
+            m_timer.cancel();
+            return;
+        }
+
+        if (when > now) {
+            //re-arming cancels any earlier wait
+            m_timer.expires_at(when);
+            m_timer.async_wait([this, holder = refcnt_retain(this)](asio::error_code ec) {
+                if (ec)
+                    return;
+                pump();
+            });
+            return;
+        }
+
+        auto req = std::move(it->second);
+        m_queue.erase(it);
+        complete(std::move(req), true);
+        m_nextSlot = now + m_interval;
+    }
+}
+
+void AnnouncementScheduler::complete(Request && req, bool granted) {
+    asio::post(req.strand, [callback = std::move(req.callback), granted]() {
+        callback(granted);
+    });
+}
@@ -0,0 +1,72 @@
+// Copyright (c) 2022, Eugene Gershnik
+// SPDX-License-Identifier: BSD-3-Clause
+
+#ifndef HEADER_ANNOUNCEMENT_SCHEDULER_H_INCLUDED
+#define HEADER_ANNOUNCEMENT_SCHEDULER_H_INCLUDED
+
+#include "util.h"
+
+/*
+ Paces multicast Hello and Bye announcements of all servers so that hosts with many
+ interfaces do not emit them in one burst.
+
+ Each Hello is delayed by a random time of up to APP_MAX_DELAY as WS-Discovery requires
+ and then all announcements share a budget of packets per second (including the repeats
+ UdpServer makes). Byes go ahead of Hellos. Once shutdown() is called Hellos are dropped
+ and Byes that cannot be sent by its deadline are refused so that stopping cannot stall.
+ */
+class AnnouncementScheduler : public ref_counted<AnnouncementScheduler> {
+    friend ref_counted<AnnouncementScheduler>;
+public:
+    enum Kind {
+        Hello,
+        Bye
+    };
+    //Called on the requester's strand with true if the announcement can be sent now
+    //or false if it has been dropped
+    using Callback = std::function<void (bool)>;
+public:
+    //packetsPerSecond of 0 means no limit
+    AnnouncementScheduler(asio::io_context & ctxt, unsigned packetsPerSecond):
+        m_strand(asio::make_strand(ctxt)),
+        m_timer(m_strand),
+        m_interval(intervalFor(packetsPerSecond)) {
+    }
+
+    //These can be called from any thread
+    void request(const Strand & strand, Kind kind, Callback callback);
+    void setRate(unsigned packetsPerSecond);
+    void shutdown(std::chrono::steady_clock::duration deadline);
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Request {
+        Strand strand;
+        Kind kind;
+        Callback callback;
+    };
+
+    ~AnnouncementScheduler() noexcept {
+    }
+
+    static auto intervalFor(unsigned packetsPerSecond) -> Clock::duration;
+
+    void doRequest(Request && req);
+    void doShutdown(std::chrono::steady_clock::duration deadline);
+    void pump();
+    static void complete(Request && req, bool granted);
+
+private:
+    Strand m_strand;
+    asio::steady_timer m_timer;
+    Clock::duration m_interval;
+    //earliest time the next announcement can go out
+    Clock::time_point m_nextSlot;
+    //by the earliest time each can go out
+    std::multimap<Clock::time_point, Request> m_queue;
+    //set by shutdown()
+    std::optional<Clock::time_point> m_deadline;
+};
+
+#endif
@@ -2,11 +2,18 @@
 // SPDX-License-Identifier: BSD-3-Clause
 
 #include "app_state.h"
+#include "async_log.h"
+#include "flight_recorder.h"
 
 AppState::AppState(int argc, char ** argv, std::set<int> untouchedSignals):
     m_untouchedSignals(std::move(untouchedSignals)),
+    m_args(argv, argv + argc),
     m_envColorStatus(Argum::environmentColorStatus()),
     m_mainPid(getpid()) {
+    
+    //daemonize() changes current directory so the executable path must not be relative to it
+    if (!m_args.empty() && m_args[0].find('/') != std::string::npos)
+        m_args[0] = std::filesystem::absolute(m_args[0]).string();
         
     m_origCommandLine.parse(argc, argv, m_envColorStatus);
     m_currentCommandLine = m_origCommandLine;
@@ -24,11 +31,19 @@ AppState::AppState(int argc, char ** argv, std::set<int> untouchedSignals):
             WSDLOG_CRITICAL("systemd mode requested but cannot find _sd_notify in libsystemd.so: {}", dlerror());
             exit(EXIT_FAILURE);
         }
+        //optional, we can always log to stdout
+        m_sdJournalSendv = (decltype(m_sdJournalSendv))dlsym(systemd, "sd_journal_sendv");
     }
 #endif
 }
 
 void AppState::reload() {
+    if (m_isPreloaded) {
+        m_isPreloaded = false;
+        refresh();
+        return;
+    }
+    
     if (m_origCommandLine.configFile) {
         
         m_currentCommandLine = m_origCommandLine;
@@ -44,7 +59,85 @@ void AppState::reload() {
         init();
     }
     
-    m_config = Config::make(m_currentCommandLine);
+    m_config = Config::make(m_currentCommandLine, false);
+}
+
+auto AppState::identityDetection() const -> std::function<auto () -> refcnt_ptr<Config>> {
+    
+    if (!m_config->isIdentityProvisional())
+        return nullptr;
+    
+    return [config = m_config, commandLine = m_currentCommandLine]() -> refcnt_ptr<Config> {
+        try {
+            return config->withDetectedIdentity(commandLine);
+        } catch(std::exception & ex) {
+            WSDLOG_ERROR("Unable to detect identity: {}", ex.what());
+        }
+        return nullptr;
+    };
+}
+
+auto AppState::fileRefresh(const std::set<std::filesystem::path> & changed) const -> std::function<auto () -> refcnt_ptr<Config>> {
+    
+    return [config = m_config, commandLine = m_currentCommandLine, changed]() -> refcnt_ptr<Config> {
+        try {
+            return config->withChangedFiles(commandLine, changed);
+        } catch(std::exception & ex) {
+            WSDLOG_ERROR("Unable to apply changed configuration files: {}", ex.what());
+        }
+        return nullptr;
+    };
+}
+
+auto AppState::completeUpdate(const refcnt_ptr<Config> & base, const refcnt_ptr<Config> & updated) -> bool {
+    
+    //a reload or another update since then has its own result
+    if (m_config.get() != base.get())
+        return false;
+    m_config = updated;
+    return true;
+}
+
+auto AppState::reloadInPlace() -> std::optional<Config::Changes> {
+    
+    CommandLine commandLine = m_origCommandLine;
+    if (m_origCommandLine.configFile)
+        commandLine.mergeConfigFile(*m_origCommandLine.configFile);
+    ensureNonRoot(commandLine);
+    
+    //detection would block whoever handles the reload, it is completed via identityDetection() instead
+    auto config = Config::makeProvisional(commandLine, *m_config);
+    auto changes = config->changesFrom(*m_config);
+    
+    auto sameIdentity = [](const std::optional<Identity> & lhs, const std::optional<Identity> & rhs) {
+        if (!lhs || !rhs)
+            return !lhs && !rhs;
+        return lhs->uid() == rhs->uid() && lhs->gid() == rhs->gid();
+    };
+    
+    //running servers cannot switch log destination or privileges
+    bool needsRestart = changes.requiresRestart() ||
+                        commandLine.logFile != m_logFilePath ||
+#if HAVE_OS_LOG
+                        commandLine.logToOsLog != m_logToOsLog ||
+#endif
+                        commandLine.logAsync != m_logAsync ||
+                        commandLine.flightRecorderFile != m_flightRecorderFilePath ||
+                        commandLine.chrootDir != m_currentCommandLine.chrootDir ||
+                        !sameIdentity(commandLine.runAs, m_currentCommandLine.runAs);
+    
+    if (!needsRestart)
+        config->continueInstanceOf(*m_config);
+    
+    m_currentCommandLine = std::move(commandLine);
+    m_config = std::move(config);
+    
+    if (needsRestart) {
+        m_isPreloaded = true;
+        return std::nullopt;
+    }
+    refresh();
+    return changes;
 }
 
 void AppState::init() {
@@ -68,8 +161,9 @@ void AppState::init() {
     }
 
     setPidFile();
+    setFlightRecorderFile();
     
-    ensureNonRoot();
+    ensureNonRoot(m_currentCommandLine);
 
     m_mainPid = getpid();
     m_isInitialized = true;
@@ -77,36 +171,43 @@ void AppState::init() {
 
 void AppState::refresh() {
 
-    ensureNonRoot();
+    ensureNonRoot(m_currentCommandLine);
     
     if (m_currentCommandLine.logLevel != m_logLevel)
         setLogLevel();
     
-    if ( m_currentCommandLine.logFile != m_logFilePath 
+    bool logFileChanged = (m_currentCommandLine.logFile != m_logFilePath);
+    if ( logFileChanged
 #if HAVE_OS_LOG
         || m_logToOsLog != m_currentCommandLine.logToOsLog
 #endif
+        || m_logAsync != m_currentCommandLine.logAsync
     )
         setLogOutput(false);
 
     if ( m_currentCommandLine.pidFile != m_pidFilePath)
         setPidFile();
+
+    //the default flight recorder file depends on whether there is a log file
+    if (m_currentCommandLine.flightRecorderFile != m_flightRecorderFilePath ||
+        (!m_flightRecorderFilePath && logFileChanged))
+        setFlightRecorderFile();
 }
 
-void AppState::ensureNonRoot() {
+void AppState::ensureNonRoot(CommandLine & cmdline) {
     if (getuid() != 0) 
         return;
         
-    if (!m_currentCommandLine.runAs) {
+    if (!cmdline.runAs) {
         WSDLOG_DEBUG("Running as root but no account to run under is specified in configuration. Using {}", WSDDN_DEFAULT_USER_NAME);
         auto pwd = ptl::Passwd::getByName(WSDDN_DEFAULT_USER_NAME);
         if (pwd) {
-            m_currentCommandLine.runAs = Identity(pwd->pw_uid, pwd->pw_gid);
+            cmdline.runAs = Identity(pwd->pw_uid, pwd->pw_gid);
         } else  {
             WSDLOG_INFO("User {} does not exist, trying to create", WSDDN_DEFAULT_USER_NAME);
-            m_currentCommandLine.runAs = Identity::createDaemonUser(WSDDN_DEFAULT_USER_NAME);
+            cmdline.runAs = Identity::createDaemonUser(WSDDN_DEFAULT_USER_NAME);
         
-            if (!m_currentCommandLine.runAs) {
+            if (!cmdline.runAs) {
                 WSDLOG_INFO("User creation is not supported on this platform");
                 WSDLOG_CRITICAL("Running network service as a root is extremely insecure and is not allowed.\n"
                                 "Please use one of the following approaches: \n"
@@ -117,20 +218,34 @@ void AppState::ensureNonRoot() {
             }
         }
     }
-    if (!m_currentCommandLine.chrootDir) {
+    if (!cmdline.chrootDir) {
         WSDLOG_DEBUG("Running as root but no chroot specified in configuration. Using {}", WSDDN_DEFAULT_CHROOT_DIR);
         createMissingDirs(WSDDN_DEFAULT_CHROOT_DIR, S_IRUSR | S_IWUSR | S_IXUSR | S_IRGRP | S_IXGRP, Identity::admin());
-        m_currentCommandLine.chrootDir = WSDDN_DEFAULT_CHROOT_DIR;
+        cmdline.chrootDir = WSDDN_DEFAULT_CHROOT_DIR;
     }
 }
 
 void AppState::preFork() {
     spdlog::default_logger()->flush();
+    //the writer thread would not exist in the child
+    if (m_asyncLogSink)
+        m_asyncLogSink->suspend();
     fflush(stdout);
     fflush(stderr);
 }
 
+void AppState::postFork() noexcept {
+    if (!m_asyncLogSink)
+        return;
+    try {
+        m_asyncLogSink->resume();
+    } catch(std::exception & ex) {
+        WSDLOG_ERROR("Unable to restart log writer thread, logging synchronously: {}", ex.what());
+    }
+}
+
 void AppState::postForkInServerProcess() noexcept {
+    postFork();
     m_savedStdOut.close();
     m_savedStdErr.close();
     m_pidFile = PidFile();
@@ -146,6 +261,27 @@ void AppState::postForkInServerProcess() noexcept {
     }
 }
 
+auto AppState::canHandOver() const -> bool {
+#if HAVE_LAUNCHD
+    //launchd tracks the process it started and would consider the job gone
+    if (m_currentCommandLine.daemonType && *m_currentCommandLine.daemonType == DaemonType::Launchd)
+        return false;
+#endif
+    return true;
+}
+
+void AppState::handOver(pid_t successor) {
+    //the successor creates its own once we release ours
+    m_pidFile = PidFile();
+    m_pidFilePath.reset();
+#if HAVE_SYSTEMD
+    if (m_sdNotify) {
+        auto env = fmt::format("MAINPID={}", successor);
+        m_sdNotify(0, env.c_str());
+    }
+#endif
+}
+
 void AppState::notify([[maybe_unused]] DaemonStatus status) {
 #if HAVE_SYSTEMD
     if (m_sdNotify) {
@@ -154,6 +290,7 @@ void AppState::notify([[maybe_unused]] DaemonStatus status) {
             case DaemonStatus::Ready: env += "READY=1"; break;
             case DaemonStatus::Reloading: env += "RELOADING=1"; break;
             case DaemonStatus::Stopping: env += "STOPPING=1"; break;
+            case DaemonStatus::Alive: m_sdNotify(0, "WATCHDOG=1"); return;
         }
         env += "\nMAINPID=";
         env += std::to_string(m_mainPid);
@@ -162,6 +299,28 @@ void AppState::notify([[maybe_unused]] DaemonStatus status) {
 #endif
 }
 
+auto AppState::watchdogInterval() const -> std::optional<std::chrono::microseconds> {
+#if HAVE_SYSTEMD
+    //same logic as sd_watchdog_enabled() which we do not load
+    if (!m_sdNotify)
+        return std::nullopt;
+    auto * usecStr = getenv("WATCHDOG_USEC");
+    if (!usecStr)
+        return std::nullopt;
+    //only the main process may notify, a forked child goes through it
+    if (auto * pidStr = getenv("WATCHDOG_PID"); pidStr && std::to_string(m_mainPid) != pidStr)
+        return std::nullopt;
+    char * end;
+    errno = 0;
+    auto usec = strtoull(usecStr, &end, 10);
+    if (errno || *end || usec == 0)
+        return std::nullopt;
+    return std::chrono::microseconds(usec);
+#else
+    return std::nullopt;
+#endif
+}
+
 void AppState::setLogLevel() {
     if (m_currentCommandLine.logLevel) {
         spdlog::set_level(*m_currentCommandLine.logLevel);
@@ -173,9 +332,15 @@ void AppState::setLogLevel() {
 
 void AppState::setLogOutput(bool firstTime) {
 
+    //the old logger may live on in spdlog registry so make it write directly from now on
+    if (m_asyncLogSink) {
+        m_asyncLogSink->stop();
+        m_asyncLogSink.reset();
+    }
+
 #if HAVE_OS_LOG
     if (m_currentCommandLine.logToOsLog && *m_currentCommandLine.logToOsLog) {
-        using Sink = OsLogSink<spdlog::details::null_mutex>;
+        using Sink = OsLogSink<std::mutex>;
 
         auto sink = std::make_shared<Sink>();
         auto logger = std::make_shared<spdlog::logger>("os_log", std::move(sink));
@@ -188,7 +353,7 @@ void AppState::setLogOutput(bool firstTime) {
             auto fileFd = openLogFile(*m_currentCommandLine.logFile);
             redirectStdFile(stdout, fileFd);
             redirectStdFile(stderr, fileFd);
-            auto logger = spdlog::stdout_logger_st("file");
+            auto logger = spdlog::stdout_logger_mt("file");
             spdlog::set_default_logger(logger);
             spdlog::set_pattern("[%Y-%m-%d %H:%M:%S.%e] [%P] %L -- %v");
         } else {
@@ -198,14 +363,14 @@ void AppState::setLogOutput(bool firstTime) {
             }
 
             if (Argum::shouldUseColor(m_envColorStatus, stdout)) {
-                auto sink = std::make_shared<spdlog::sinks::stdout_color_sink_st>(spdlog::color_mode::always);
+                auto sink = std::make_shared<spdlog::sinks::stdout_color_sink_mt>(spdlog::color_mode::always);
                 sink->set_color(spdlog::level::trace, Argum::makeColor<Argum::Color::faint>());
                 sink->set_color(spdlog::level::info, "");
                 sink->set_color(spdlog::level::critical, Argum::makeColor<Argum::Color::bold, Argum::Color::bright_white, Argum::Color::bg_red>());
                 auto logger = std::make_shared<spdlog::logger>("console", std::move(sink));
                 spdlog::set_default_logger(logger);
             } else {
-                auto logger = spdlog::stdout_logger_st("console");
+                auto logger = spdlog::stdout_logger_mt("console");
                 spdlog::set_default_logger(logger);
             }
             
@@ -214,6 +379,11 @@ void AppState::setLogOutput(bool firstTime) {
                 auto formatter = std::make_unique<spdlog::pattern_formatter>();
                 formatter->add_flag<SystemdLevelFormatter>('l').set_pattern("%l%v");
                 spdlog::set_formatter(std::move(formatter));
+                //stdout stays as the fallback for whatever journald does not take
+                if (m_sdJournalSendv && JournaldSink::isStdoutJournal()) {
+                    auto & sinks = spdlog::default_logger()->sinks();
+                    sinks.front() = std::make_shared<JournaldSink>(m_sdJournalSendv, sinks.front());
+                }
             } else 
         #endif
             {
@@ -221,10 +391,16 @@ void AppState::setLogOutput(bool firstTime) {
             }
         }
     }
+    if (m_currentCommandLine.logAsync) {
+        auto & sinks = spdlog::default_logger()->sinks();
+        m_asyncLogSink = std::make_shared<AsyncLogSink>(sinks.front(), *m_currentCommandLine.logAsync);
+        sinks.front() = m_asyncLogSink;
+    }
     m_logFilePath = m_currentCommandLine.logFile;
 #if HAVE_OS_LOG
     m_logToOsLog = m_currentCommandLine.logToOsLog;
 #endif
+    m_logAsync = m_currentCommandLine.logAsync;
     //changing logger drops level so let's restore it, if needed
     if (m_logLevel)
         spdlog::set_level(*m_logLevel);
@@ -242,6 +418,26 @@ void AppState::setPidFile() {
     m_pidFilePath = m_currentCommandLine.pidFile;
 }
 
+//Opened here, before changing root and identity, so that the server process can always write it
+void AppState::setFlightRecorderFile() {
+    if (m_currentCommandLine.flightRecorderFile) {
+        FlightRecorder::setDumpFile(openLogFile(*m_currentCommandLine.flightRecorderFile));
+    } else if (m_currentCommandLine.daemonType && !m_currentCommandLine.logFile) {
+        //standard error of a daemon that is not logging to a file usually goes nowhere
+        auto path = cacheDirectory() / "flight-recorder.log";
+        try {
+            FlightRecorder::setDumpFile(openLogFile(path));
+            WSDLOG_INFO("Flight recorder will be written to {}", path.c_str());
+        } catch(std::exception & ex) {
+            WSDLOG_WARN("Unable to open {}, flight recorder will be written to standard error: {}", path.c_str(), ex.what());
+            FlightRecorder::setDumpFile(ptl::FileDescriptor());
+        }
+    } else {
+        FlightRecorder::setDumpFile(ptl::FileDescriptor());
+    }
+    m_flightRecorderFilePath = m_currentCommandLine.flightRecorderFile;
+}
+
 auto AppState::openLogFile(const std::filesystem::path & filename) -> ptl::FileDescriptor {
         
     std::optional<Identity> owner;
@@ -395,4 +591,6 @@ void AppState::daemonize() {
 
     reportBuf[0] = 0;
     writeFile(reportPipeWrite, reportBuf, 1);
+    
+    postFork();
 }
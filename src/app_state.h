@@ -8,49 +8,83 @@
 #include "command_line.h"
 #include "pid_file.h"
 #include "config.h"
+#include "journald_sink.h"
+
+class AsyncLogSink;
 
 class AppState {
 public:
     AppState(int argc, char ** argv, std::set<int> untouchedSignals);
     
     void reload();
+    //Re-reads configuration while servers keep running. Returns what changed if the new configuration
+    //can be applied to them in place or nothing if a full restart is needed, in which case the following
+    //reload() completes the job. Like with reload() the new configuration has a provisional identity
+    auto reloadInPlace() -> std::optional<Config::Changes>;
     
     auto config() const -> const refcnt_ptr<Config> {
         return m_config;
     }
     
+    //Configuration made by reload() has a provisional Windows identity since detecting it may take a while.
+    //Returns a function, safe to call on any thread, that detects it or nullptr if there is nothing to detect
+    auto identityDetection() const -> std::function<auto () -> refcnt_ptr<Config>>;
+    //Returns a function, safe to call on any thread, that re-reads the parts of the current configuration 
+    //that come from changed files. It returns the new configuration or nullptr if it is unaffected
+    auto fileRefresh(const std::set<std::filesystem::path> & changed) const -> std::function<auto () -> refcnt_ptr<Config>>;
+    //Makes the result of identityDetection() or fileRefresh() called with base current configuration current.
+    //Returns false if it is stale because another configuration has become current in the meantime
+    auto completeUpdate(const refcnt_ptr<Config> & base, const refcnt_ptr<Config> & updated) -> bool;
+    
     auto shouldFork() const -> bool {
         return m_currentCommandLine.chrootDir || m_currentCommandLine.runAs;
     }
     
     
     void preFork();
+    //Undoes what preFork() did that the process needs. Call in every process that continues after fork
+    void postFork() noexcept;
     
     void postForkInServerProcess() noexcept;
+    
+    //Command line to start a copy of ourselves, possibly upgraded, with
+    auto successorArgs() const -> const std::vector<std::string> & {
+        return m_args;
+    }
+    //Whether the service manager lets another process take over from us
+    auto canHandOver() const -> bool;
+    //Gives up pid file and main process status in favor of the successor
+    void handOver(pid_t successor);
 
     enum class DaemonStatus {
         Ready,
         Reloading,
-        Stopping
+        Stopping,
+        Alive       //watchdog keep-alive
     };
+    //Can be called from any thread
     void notify(DaemonStatus status);
+    //How often the service manager expects Alive notifications, if it does
+    auto watchdogInterval() const -> std::optional<std::chrono::microseconds>;
 
 private:
     void init();
     void refresh();
-    void ensureNonRoot();
+    void ensureNonRoot(CommandLine & cmdline);
 
     void daemonize();
 
     void setLogLevel();
     void setLogOutput(bool firstTime);
     void setPidFile();
+    void setFlightRecorderFile();
 
     static auto openLogFile(const std::filesystem::path & filename) -> ptl::FileDescriptor;
     static void redirectStdFile(FILE * from, const ptl::FileDescriptor & to);
     static void closeAllExcept(const int * first, const int * last);
 private:
     std::set<int> m_untouchedSignals;
+    std::vector<std::string> m_args;
     Argum::ColorStatus m_envColorStatus;
     CommandLine m_origCommandLine;
     CommandLine m_currentCommandLine;
@@ -58,14 +92,19 @@ private:
     XmlParserInit m_xmlInit;
     
     bool m_isInitialized = false;
+    bool m_isPreloaded = false;
     std::optional<spdlog::level::level_enum> m_logLevel;
     std::optional<std::filesystem::path> m_logFilePath;
     std::optional<std::filesystem::path> m_pidFilePath;
+    std::optional<std::filesystem::path> m_flightRecorderFilePath;
 #if HAVE_OS_LOG
     std::optional<bool> m_logToOsLog;
 #endif
+    std::optional<LogOverflow> m_logAsync;
+    std::shared_ptr<AsyncLogSink> m_asyncLogSink;
 #if HAVE_SYSTEMD
     decltype(sd_notify) * m_sdNotify = nullptr;
+    JournaldSink::SendFunc * m_sdJournalSendv = nullptr;
 #endif
     PidFile m_pidFile;
     ptl::FileDescriptor m_savedStdOut;
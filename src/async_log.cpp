@@ -0,0 +1,216 @@
+// Copyright (c) 2022, Eugene Gershnik
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "async_log.h"
+#include "metrics.h"
+
+AsyncLogSink::AsyncLogSink(spdlog::sink_ptr dest, LogOverflow overflow, size_t capacity):
+    m_dest(std::move(dest)),
+    m_overflow(overflow),
+    m_slots(new Slot[std::bit_ceil(capacity)]),
+    m_mask(std::bit_ceil(capacity) - 1) {
+
+    for (size_t i = 0; i <= m_mask; ++i)
+        m_slots[i].sequence.store(i, std::memory_order_relaxed);
+
+    {
+        std::lock_guard lock(s_currentMutex);
+        s_current = this;
+    }
+    static std::once_flag atExitRegistered;
+    std::call_once(atExitRegistered, []() {
+        std::atexit(stopCurrentAtExit);
+    });
+
+    resume();
+}
+
+AsyncLogSink::~AsyncLogSink() noexcept {
+    stop();
+}
+
+void AsyncLogSink::stopCurrentAtExit() {
+    //exit() does not unwind so whatever is still in the ring would be lost otherwise
+    std::lock_guard lock(s_currentMutex);
+    if (s_current)
+        s_current->suspend();
+}
+
+void AsyncLogSink::log(const spdlog::details::log_msg & msg) {
+
+    while (m_running.load(std::memory_order_acquire)) {
+        if (tryPush(msg)) {
+            wakeWriter(false);
+            return;
+        }
+        if (m_overflow == LogOverflow::Drop) {
+            m_dropped.fetch_add(1, std::memory_order_relaxed);
+            Metrics::logMessagesDropped().add();
+            return;
+        }
+        wakeWriter(true);
+        std::this_thread::yield();
+    }
+    m_dest->log(msg);
+}
+
+void AsyncLogSink::flush() {
+
+    if (!m_running.load(std::memory_order_acquire)) {
+        m_dest->flush();
+        return;
+    }
+    auto target = m_enqueuePos.load(std::memory_order_acquire);
+    wakeWriter(true);
+    std::unique_lock lock(m_mutex);
+    m_batchWritten.wait(lock, [&]() {
+        return m_dequeuePos.load(std::memory_order_acquire) >= target || !m_running.load(std::memory_order_acquire);
+    });
+}
+
+void AsyncLogSink::suspend() {
+
+    std::unique_lock lock(m_mutex);
+    if (!m_writer.joinable())
+        return;
+    m_running.store(false, std::memory_order_release);
+    m_stopRequested = true;
+    lock.unlock();
+    m_wakeWriter.notify_one();
+    m_writer.join();
+
+    //a producer may have seen us running just before the writer's final pass
+    lock.lock();
+    drain();
+    m_batchWritten.notify_all();
+}
+
+void AsyncLogSink::resume() {
+
+    std::lock_guard lock(m_mutex);
+    if (m_writer.joinable() || m_stopped)
+        return;
+    m_stopRequested = false;
+    m_writer = std::thread([this]() {
+        writerLoop();
+    });
+    m_running.store(true, std::memory_order_release);
+}
+
+void AsyncLogSink::stop() {
+    suspend();
+    {
+        std::lock_guard lock(m_mutex);
+        m_stopped = true;
+    }
+    std::lock_guard lock(s_currentMutex);
+    if (s_current == this)
+        s_current = nullptr;
+}
+
+auto AsyncLogSink::tryPush(const spdlog::details::log_msg & msg) -> bool {
+
+    auto pos = m_enqueuePos.load(std::memory_order_relaxed);
+    for ( ; ; ) {
+        auto & slot = m_slots[pos & m_mask];
+        auto seq = slot.sequence.load(std::memory_order_acquire);
+        auto diff = intptr_t(seq) - intptr_t(pos);
+        if (diff == 0) {
+            if (m_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = m_enqueuePos.load(std::memory_order_relaxed);
+        }
+    }
+    //the slot is ours until its sequence is published. Short messages fit in the
+    //buffer's inline storage so this does not allocate
+    auto & slot = m_slots[pos & m_mask];
+    slot.msg = spdlog::details::log_msg_buffer(msg);
+    if (auto * fields = LogFields::current())
+        slot.fields = *fields;
+    else
+        slot.fields.reset();
+    slot.sequence.store(pos + 1, std::memory_order_release);
+    return true;
+}
+
+auto AsyncLogSink::front() const -> Slot * {
+    auto pos = m_dequeuePos.load(std::memory_order_relaxed);
+    auto & slot = m_slots[pos & m_mask];
+    if (slot.sequence.load(std::memory_order_acquire) != pos + 1)
+        return nullptr;
+    return &slot;
+}
+
+void AsyncLogSink::popFront(Slot & slot) {
+    auto pos = m_dequeuePos.load(std::memory_order_relaxed);
+    slot.sequence.store(pos + m_mask + 1, std::memory_order_release);
+    m_dequeuePos.store(pos + 1, std::memory_order_release);
+}
+
+void AsyncLogSink::drain() {
+
+    size_t count = 0;
+    while (auto * slot = front()) {
+        try {
+            LogFieldsScope fieldsScope(slot->fields ? &*slot->fields : nullptr);
+            m_dest->log(slot->msg);
+        } catch (std::exception &) {
+            //nowhere to report it
+        }
+        popFront(*slot);
+        ++count;
+    }
+    reportDropped();
+    if (count) {
+        try {
+            m_dest->flush();
+        } catch (std::exception &) {
+        }
+    }
+}
+
+void AsyncLogSink::reportDropped() {
+
+    auto dropped = m_dropped.load(std::memory_order_relaxed);
+    if (dropped == m_droppedReported)
+        return;
+    auto text = fmt::format("{} log messages dropped because the log buffer was full", dropped - m_droppedReported);
+    m_droppedReported = dropped;
+    try {
+        m_dest->log(spdlog::details::log_msg(spdlog::source_loc{}, "", spdlog::level::warn, text));
+    } catch (std::exception &) {
+    }
+}
+
+void AsyncLogSink::wakeWriter(bool always) {
+    //pairs with the fence in writerLoop: either we see it sleeping or it sees what we published
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!always && !m_writerSleeping.load(std::memory_order_relaxed))
+        return;
+    {
+        std::lock_guard lock(m_mutex);
+    }
+    m_wakeWriter.notify_one();
+}
+
+void AsyncLogSink::writerLoop() {
+
+    for ( ; ; ) {
+        drain();
+
+        std::unique_lock lock(m_mutex);
+        m_batchWritten.notify_all();
+        if (m_stopRequested)
+            break;
+        m_writerSleeping.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        m_wakeWriter.wait(lock, [this]() {
+            return m_stopRequested || front() != nullptr;
+        });
+        m_writerSleeping.store(false, std::memory_order_relaxed);
+    }
+    //suspend() does the final pass
+}
@@ -0,0 +1,97 @@
+// Copyright (c) 2022, Eugene Gershnik
+// SPDX-License-Identifier: BSD-3-Clause
+
+#ifndef HEADER_ASYNC_LOG_H_INCLUDED
+#define HEADER_ASYNC_LOG_H_INCLUDED
+
+#include "util.h"
+#include "log_fields.h"
+
+/*
+ An spdlog sink that moves writing off the threads that log.
+
+ Messages are copied into a bounded ring of preallocated slots (a Vyukov style
+ multi-producer queue, so producers never take a lock) and a dedicated writer thread
+ passes them in batches to the destination sink, flushing it once per batch. When the ring
+ is full a message is either dropped and counted or the producer waits for space, per the
+ overflow policy.
+
+ LogFields in effect when a message is logged are passed on with it.
+
+ Threads do not survive fork() and a destination's mutex may be held by the writer when it
+ happens, so suspend() must be called before forking and resume() after it in each
+ process. While suspended, or once stopped, messages are written synchronously.
+ */
+class AsyncLogSink : public spdlog::sinks::sink {
+public:
+    static constexpr size_t defaultCapacity = 4096;
+
+    AsyncLogSink(spdlog::sink_ptr dest, LogOverflow overflow, size_t capacity = defaultCapacity);
+    ~AsyncLogSink() noexcept;
+    AsyncLogSink(const AsyncLogSink &) = delete;
+    AsyncLogSink & operator=(const AsyncLogSink &) = delete;
+
+    void log(const spdlog::details::log_msg & msg) override;
+    //Waits until everything logged so far is written and flushes the destination
+    void flush() override;
+    void set_pattern(const std::string & pattern) override {
+        m_dest->set_pattern(pattern);
+    }
+    void set_formatter(std::unique_ptr<spdlog::formatter> formatter) override {
+        m_dest->set_formatter(std::move(formatter));
+    }
+
+    //Drain the ring and stop the writer thread
+    void suspend();
+    //Start the writer thread again after suspend()
+    void resume();
+    //Suspend for good. Also done at exit for the most recently created sink
+    void stop();
+
+    auto dropped() const noexcept -> uint64_t {
+        return m_dropped.load(std::memory_order_relaxed);
+    }
+private:
+    struct Slot {
+        std::atomic<size_t> sequence;
+        spdlog::details::log_msg_buffer msg;
+        std::optional<LogFields> fields;
+    };
+
+    auto tryPush(const spdlog::details::log_msg & msg) -> bool;
+    auto front() const -> Slot *;
+    void popFront(Slot & slot);
+
+    void writerLoop();
+    void drain();
+    void wakeWriter(bool always);
+    void reportDropped();
+
+    static void stopCurrentAtExit();
+private:
+    spdlog::sink_ptr m_dest;
+    LogOverflow m_overflow;
+
+    std::unique_ptr<Slot[]> m_slots;
+    size_t m_mask;
+    alignas(64) std::atomic<size_t> m_enqueuePos = 0;
+    //only changed by whoever drains: the writer thread or, while it is not running, a caller holding m_mutex
+    alignas(64) std::atomic<size_t> m_dequeuePos = 0;
+    std::atomic<uint64_t> m_dropped = 0;
+    uint64_t m_droppedReported = 0;
+
+    //writer thread state and its wake-ups. Producers only touch the mutex when the writer sleeps
+    std::mutex m_mutex;
+    std::condition_variable m_wakeWriter;
+    std::condition_variable m_batchWritten;
+    std::atomic<bool> m_writerSleeping = false;
+    std::atomic<bool> m_running = false;
+    bool m_stopRequested = false;
+    bool m_stopped = false;
+    std::thread m_writer;
+
+    static inline std::mutex s_currentMutex;
+    static inline AsyncLogSink * s_current = nullptr;
+};
+
+#endif
@@ -2,6 +2,7 @@
 // SPDX-License-Identifier: BSD-3-Clause
 
 #include "command_line.h"
+#include "name_matcher.h"
 #include "sys_config.h"
 #include "util.h"
 
@@ -66,7 +67,7 @@ static auto addPattern(CommandLine & cmdline, bool include, sys_string val) {
         throw Parser::ValidationError("interface pattern cannot be empty");
     
     try {
-        std::regex(sys_string::char_access(val).c_str(), std::regex::ECMAScript);
+        NameMatcher(sys_string::char_access(val).c_str());
     } catch (std::regex_error & ex) {
         throw Parser::ValidationError("invalid interface pattern: "s + ex.what());
     }
@@ -94,6 +95,16 @@ static auto setAllowedAddressFamily(CommandLine & cmdline, sys_string val) {
         throw Parser::ValidationError("allowed-address-families must be one of: IPv4, IPv6 or Both");
 }
 
+static auto setHttpListenerMode(CommandLine & cmdline, sys_string val) {
+    sys_string mode = val.to_lower();
+    if (mode == S("per-address"))
+        cmdline.httpListenerMode = HttpListenerMode::PerAddress;
+    else if (mode == S("shared"))
+        cmdline.httpListenerMode = HttpListenerMode::Shared;
+    else
+        throw Parser::ValidationError("http-listener must be one of: per-address or shared");
+}
+
 static auto setHostname(CommandLine & cmdline, sys_string val) {
     if (val.empty())
         throw Parser::ValidationError("hostname cannot be empty");
@@ -184,6 +195,23 @@ static auto setLogToOsLog(CommandLine & cmdline, bool val) {
 
 #endif
 
+static auto setLogAsync(CommandLine & cmdline, sys_string val) {
+    sys_string policy = val.to_lower();
+    if (policy == S("drop"))
+        cmdline.logAsync = LogOverflow::Drop;
+    else if (policy == S("block"))
+        cmdline.logAsync = LogOverflow::Block;
+    else
+        throw Parser::ValidationError("log-async must be one of: drop or block");
+}
+
+static auto setFlightRecorderFile(CommandLine & cmdline, std::string_view val) {
+    if (val.empty())
+        throw Parser::ValidationError("flight recorder file path cannot be empty");
+    auto value = absolute(std::filesystem::path(val));
+    cmdline.flightRecorderFile.emplace(std::move(value));
+}
+
 static auto setPidFile(CommandLine & cmdline, std::string_view val) {
     if (val.empty())
         throw Parser::ValidationError("pid file path cannot be empty");
@@ -407,6 +435,86 @@ void CommandLine::parse(int argc, char * argv[], ColorStatus envColorStatus) {
                handler([this](std::string_view val){
         this->sourcePort = Argum::parseIntegral<unsigned>(val);
     }));
+    parser.add(Option("--settle-time").
+               argName("MILLISECONDS").
+               help(colorTagged(
+                    "time to wait for network interface changes to settle before applying them (default = {bold}500{norm}). "
+                    "Pass {bold}0{norm} to apply changes immediately")).
+               occurs(Argum::neverOrOnce).
+               handler([this](std::string_view val){
+        this->settleTime = Argum::parseIntegral<unsigned>(val);
+    }));
+    parser.add(Option("--announce-rate").
+               argName("NUMBER").
+               help(colorTagged(
+                    "maximum number of Hello/Bye packets per second sent over all interfaces (default = {bold}200{norm}). "
+                    "Pass {bold}0{norm} for no limit")).
+               occurs(Argum::neverOrOnce).
+               handler([this](std::string_view val){
+        this->announceRate = Argum::parseIntegral<unsigned>(val);
+    }));
+    parser.add(Option("--recv-buffer-max").
+               argName("BYTES").
+               help(colorTagged(
+                    "largest size UDP receive buffers are grown to when datagrams are dropped (default = {bold}1048576{norm}). "
+                    "Pass {bold}0{norm} to keep the system default")).
+               occurs(Argum::neverOrOnce).
+               handler([this](std::string_view val){
+        this->recvBufferMax = Argum::parseIntegral<unsigned>(val);
+    }));
+    parser.add(Option("--http-listener").
+               argName("MODE").
+               help(colorTagged(
+                    "how to listen for HTTP connections. {bold}per-address{norm} (the default) uses a separate listening socket "
+                    "for each address. {bold}shared{norm} uses one listening socket per address family for all addresses")).
+               occurs(Argum::neverOrOnce).
+               handler([this](std::string_view val){
+        setHttpListenerMode(*this, sys_string(val).trim());
+    }));
+    parser.add(Option("--http-idle-timeout").
+               argName("SECONDS").
+               help(colorTagged(
+                    "open HTTP listener on an interface only when a Probe or Resolve is received there and close it "
+                    "after this many seconds without activity. By default ({bold}0{norm}) listeners are always open")).
+               occurs(Argum::neverOrOnce).
+               handler([this](std::string_view val){
+        this->httpIdleTimeout = Argum::parseIntegral<unsigned>(val);
+    }));
+    parser.add(Option("--threads").
+               argName("NUMBER").
+               help(colorTagged(
+                    "number of threads processing network traffic (default = {bold}1{norm}). "
+                    "Pass {bold}0{norm} to use one thread per CPU")).
+               occurs(Argum::neverOrOnce).
+               handler([this](std::string_view val){
+        this->threads = Argum::parseIntegral<unsigned>(val);
+    }));
+    parser.add(Option("--thread-affinity").
+               help(colorTagged(
+                    "pin each processing thread to its own CPU. Only has effect with {longopt}--threads{norm} other than 1 "
+                    "and only on platforms that support it")).
+               occurs(Argum::neverOrOnce).
+               handler([this](){
+        this->threadAffinity = true;
+    }));
+    parser.add(Option("--metrics-port").
+               argName("NUMBER").
+               help(colorTagged(
+                    "serve metrics in Prometheus format at {bold}/metrics{norm} over HTTP on this port of the loopback "
+                    "interface. By default metrics are not served")).
+               occurs(Argum::neverOrOnce).
+               handler([this](std::string_view val){
+        this->metricsPort = Argum::parseIntegral<uint16_t>(val);
+    }));
+    parser.add(Option("--reply-slo").
+               argName("MILLISECONDS").
+               help(colorTagged(
+                    "log a warning for every reply sent later than this after the request arrived. "
+                    "By default ({bold}0{norm}) nothing is logged")).
+               occurs(Argum::neverOrOnce).
+               handler([this](std::string_view val){
+        this->replySlo = Argum::parseIntegral<unsigned>(val);
+    }));
     
     //Machine info
     parser.add(Option("--uuid").
@@ -499,6 +607,26 @@ void CommandLine::parse(int argc, char * argv[], ColorStatus envColorStatus) {
         setLogToOsLog(*this, true);
     }));
 #endif
+    parser.add(Option("--log-async").
+               argName("POLICY").
+               help(colorTagged(
+                    "write the log on a separate thread so that logging never waits for output. "
+                    "{arg}POLICY{norm} says what happens when messages are produced faster than they can be "
+                    "written: {bold}drop{norm} discards and counts them, {bold}block{norm} waits for space")).
+               occurs(Argum::neverOrOnce).
+               handler([this](std::string_view val){
+        setLogAsync(*this, sys_string(val).trim());
+    }));
+    parser.add(Option("--flight-recorder").
+               argName("PATH").
+               help(colorTagged(
+                    "file to append the history of recent protocol events to on {bold}SIGUSR1{norm}, fatal errors "
+                    "and crashes. If not specified, it is written to standard error or, when running as a daemon without "
+                    "{longopt}--log-file{norm}, appended to {bold}flight-recorder.log{norm} in the cache directory")).
+               occurs(Argum::neverOrOnce).
+               handler([this](std::string_view val){
+        setFlightRecorderFile(*this, val);
+    }));
     parser.add(Option("--pid-file").
                argName("PATH").
                help(colorTagged(
@@ -607,6 +735,74 @@ void CommandLine::parseConfigKey(std::string_view keyName, const toml::node & va
             this->sourcePort = uint16_t(*val);
         });
         
+    } else if (keyName == "settle-time"sv) {
+        
+        setConfigValue<int64_t>(bool(this->settleTime), keyName, value, [this](const toml::value<int64_t> & val) {
+            if (*val < 0 || *val > std::numeric_limits<unsigned>::max())
+                throw ConfigFileError("settle-time value must be a non-negative number of milliseconds", spdlog::level::err, val.source());
+            this->settleTime = unsigned(*val);
+        });
+        
+    } else if (keyName == "announce-rate"sv) {
+        
+        setConfigValue<int64_t>(bool(this->announceRate), keyName, value, [this](const toml::value<int64_t> & val) {
+            if (*val < 0 || *val > std::numeric_limits<unsigned>::max())
+                throw ConfigFileError("announce-rate value must be a non-negative number of packets per second", spdlog::level::err, val.source());
+            this->announceRate = unsigned(*val);
+        });
+        
+    } else if (keyName == "recv-buffer-max"sv) {
+        
+        setConfigValue<int64_t>(bool(this->recvBufferMax), keyName, value, [this](const toml::value<int64_t> & val) {
+            if (*val < 0 || *val > std::numeric_limits<unsigned>::max())
+                throw ConfigFileError("recv-buffer-max value must be a non-negative number of bytes", spdlog::level::err, val.source());
+            this->recvBufferMax = unsigned(*val);
+        });
+        
+    } else if (keyName == "http-listener"sv) {
+        
+        setConfigValue<std::string>(bool(this->httpListenerMode), keyName, value, [this](const toml::value<std::string> & val) {
+            setHttpListenerMode(*this, sys_string(*val).trim());
+        });
+        
+    } else if (keyName == "http-idle-timeout"sv) {
+        
+        setConfigValue<int64_t>(bool(this->httpIdleTimeout), keyName, value, [this](const toml::value<int64_t> & val) {
+            if (*val < 0 || *val > std::numeric_limits<unsigned>::max())
+                throw ConfigFileError("http-idle-timeout value must be a non-negative number of seconds", spdlog::level::err, val.source());
+            this->httpIdleTimeout = unsigned(*val);
+        });
+        
+    } else if (keyName == "threads"sv) {
+        
+        setConfigValue<int64_t>(bool(this->threads), keyName, value, [this](const toml::value<int64_t> & val) {
+            if (*val < 0 || *val > std::numeric_limits<unsigned>::max())
+                throw ConfigFileError("threads value must be a non-negative number", spdlog::level::err, val.source());
+            this->threads = unsigned(*val);
+        });
+        
+    } else if (keyName == "thread-affinity"sv) {
+        
+        setConfigValue<bool>(bool(this->threadAffinity), keyName, value, [this](const toml::value<bool> & val) {
+            this->threadAffinity = *val;
+        });
+        
+    } else if (keyName == "metrics-port"sv) {
+        
+        setConfigValue<int64_t>(bool(this->metricsPort), keyName, value, [this](const toml::value<int64_t> & val) {
+            if (*val < 0 || *val >= 65536)
+                throw ConfigFileError("metrics-port value must be in [0, 65536) range", spdlog::level::err, val.source());
+            this->metricsPort = uint16_t(*val);
+        });
+        
+    } else if (keyName == "reply-slo"sv) {
+        
+        setConfigValue<int64_t>(bool(this->replySlo), keyName, value, [this](const toml::value<int64_t> & val) {
+            if (*val < 0 || *val > std::numeric_limits<unsigned>::max())
+                throw ConfigFileError("reply-slo value must be a non-negative number of milliseconds", spdlog::level::err, val.source());
+            this->replySlo = unsigned(*val);
+        });
+        
     } else
         
     //Machine info
@@ -667,6 +863,18 @@ void CommandLine::parseConfigKey(std::string_view keyName, const toml::node & va
         });
 #endif
 
+    } else if (keyName == "log-async"sv) {
+        
+        setConfigValue<std::string>(bool(this->logAsync), keyName, value, [this](const toml::value<std::string> & val) {
+            setLogAsync(*this, sys_string(*val).trim());
+        });
+
+    } else if (keyName == "flight-recorder"sv) {
+        
+        setConfigValue<std::string>(bool(this->flightRecorderFile), keyName, value, [this](const toml::value<std::string> & val) {
+            setFlightRecorderFile(*this, *val);
+        });
+
     } else if (keyName == "pid-file"sv) {
         
         setConfigValue<std::string>(bool(this->pidFile), keyName, value, [this](const toml::value<std::string> & val) {
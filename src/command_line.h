@@ -17,6 +17,15 @@ struct CommandLine {
     std::optional<AllowedAddressFamily> allowedAddressFamily;
     std::optional<int> hoplimit;
     std::optional<uint16_t> sourcePort;
+    std::optional<unsigned> settleTime;
+    std::optional<unsigned> announceRate;
+    std::optional<HttpListenerMode> httpListenerMode;
+    std::optional<unsigned> httpIdleTimeout;
+    std::optional<unsigned> threads;
+    std::optional<bool> threadAffinity;
+    std::optional<uint16_t> metricsPort;
+    std::optional<unsigned> replySlo;
+    std::optional<unsigned> recvBufferMax;
     
     std::optional<Uuid> uuid;
     std::optional<sys_string> hostname;
@@ -31,6 +40,8 @@ struct CommandLine {
 #if HAVE_OS_LOG
     std::optional<bool> logToOsLog;
 #endif
+    std::optional<LogOverflow> logAsync;
+    std::optional<std::filesystem::path> flightRecorderFile;
     std::optional<std::filesystem::path> pidFile;
     std::optional<Identity> runAs;
     std::optional<std::filesystem::path> chrootDir;
@@ -4,7 +4,7 @@
 #include "config.h"
 #include "command_line.h"
 
-Config::Config(const CommandLine & cmdline):
+Config::Config(const CommandLine & cmdline, bool detectIdentity, const WinNetInfo * assumedWinNetInfo):
     m_instanceIdentifier(time(nullptr)),
     m_pageSize(size_t(ptl::systemConfig(_SC_PAGESIZE).value_or(4096))) {
         
@@ -13,19 +13,24 @@ Config::Config(const CommandLine & cmdline):
     m_interfaceWhitelist.insert(cmdline.interfaces.begin(), cmdline.interfaces.end());
     m_interfacePatternsWhitelist.reserve(cmdline.includePatterns.size());
     for(auto & str: cmdline.includePatterns) {
-        m_interfacePatternsWhitelist.emplace_back(sys_string::char_access(str).c_str(), 
-                                                    std::regex::ECMAScript |
-                                                    std::regex::optimize |
-                                                    std::regex::nosubs);
+        m_interfacePatternsWhitelist.emplace_back(std::string(sys_string::char_access(str).c_str()));
     }
     m_interfacePatternsBlacklist.reserve(cmdline.excludePatterns.size());
     for(auto & str: cmdline.excludePatterns) {
-        m_interfacePatternsBlacklist.emplace_back(sys_string::char_access(str).c_str(), 
-                                                    std::regex::ECMAScript |
-                                                    std::regex::optimize |
-                                                    std::regex::nosubs);
+        m_interfacePatternsBlacklist.emplace_back(std::string(sys_string::char_access(str).c_str()));
     }
     m_sourcePort = cmdline.sourcePort.value_or(0);
+    m_settleTime = std::chrono::milliseconds(cmdline.settleTime.value_or(500));
+    m_announceRate = cmdline.announceRate.value_or(200);
+    m_recvBufferMax = cmdline.recvBufferMax.value_or(1024 * 1024);
+    m_httpListenerMode = cmdline.httpListenerMode.value_or(HttpListenerMode::PerAddress);
+    m_httpIdleTimeout = std::chrono::seconds(cmdline.httpIdleTimeout.value_or(0));
+    m_threadCount = cmdline.threads.value_or(1);
+    if (m_threadCount == 0)
+        m_threadCount = std::max(std::thread::hardware_concurrency(), 1u);
+    m_threadAffinity = cmdline.threadAffinity.value_or(false);
+    m_metricsPort = cmdline.metricsPort.value_or(0);
+    m_replySlo = std::chrono::milliseconds(cmdline.replySlo.value_or(0));
 
     m_fullHostName = getHostName();
     m_simpleHostName = m_fullHostName.prefix_before_first(U'.').value_or(m_fullHostName);
@@ -39,20 +44,44 @@ Config::Config(const CommandLine & cmdline):
     }
     m_strUuid = to_sys_string(m_uuid);
     m_urnUuid = to_urn(m_uuid);
+    
+    if (detectIdentity) {
+        resolveWinNetInfo(cmdline, detectSystemWinNetInfo(cmdline));
+    } else {
+        m_identityProvisional = true;
+        if (assumedWinNetInfo)
+            resolveWinNetInfo(cmdline, *assumedWinNetInfo);
+        else
+            resolveWinNetInfo(cmdline, std::nullopt);
+    }
         
+    if (cmdline.metadataFile) {
+        m_metadataFile = *cmdline.metadataFile;
+        m_metadataDoc = loadMetadataFile(m_metadataFile->native());
+    }
+
+    logConfiguration(cmdline);
+}
+
+auto Config::detectSystemWinNetInfo(const CommandLine & cmdline) -> std::optional<WinNetInfo> {
+    
     bool useNetbiosHostName = cmdline.hostname && cmdline.hostname->empty();
-        
-    std::optional<WinNetInfo> systemWinNetInfo;
+    
 #if CAN_HAVE_APPLE_SAMBA
     int darwinVer = darwinMajor();
-    if (cmdline.smbConf || darwinVer < 11) {
-        systemWinNetInfo = detectWinNetInfo(cmdline.smbConf, useNetbiosHostName);
-    } else {
-        systemWinNetInfo = detectAppleWinNetInfo(useNetbiosHostName);
-    }
+    if (cmdline.smbConf || darwinVer < 11)
+        return detectWinNetInfo(cmdline.smbConf, useNetbiosHostName);
+    return detectAppleWinNetInfo(useNetbiosHostName);
 #else
-    systemWinNetInfo = detectWinNetInfo(cmdline.smbConf, useNetbiosHostName);
+    return detectWinNetInfo(cmdline.smbConf, useNetbiosHostName);
 #endif
+}
+
+void Config::resolveWinNetInfo(const CommandLine & cmdline, const std::optional<WinNetInfo> & systemWinNetInfo) {
+    
+    bool useNetbiosHostName = cmdline.hostname && cmdline.hostname->empty();
+    
+    m_winNetInfo = WinNetInfo();
        
     if (cmdline.memberOf) {
         m_winNetInfo.memberOf = *cmdline.memberOf;
@@ -84,7 +113,9 @@ Config::Config(const CommandLine & cmdline):
         else
             m_winNetInfo.hostDescription = m_simpleHostName;
     }
-    
+}
+
+void Config::logConfiguration(const CommandLine & cmdline) const {
     
     auto [memberOfType, memberOfName] = std::visit([](auto & val) {
         
@@ -98,17 +129,14 @@ Config::Config(const CommandLine & cmdline):
             static_assert(makeDependentOn<ArgType>(false), "unhandled type");
         
     }, m_winNetInfo.memberOf);
-        
-    if (cmdline.metadataFile) {
-        m_metadataDoc = loadMetadataFile(cmdline.metadataFile->native());
-    }
 
-    WSDLOG_INFO("Configuration:\n"
+    WSDLOG_INFO("Configuration{}:\n"
                 "    Hostname: {}\n"
                 "    {}: {}\n"
                 "    Description: {}\n"
                 "    Identifier: {}\n"
                 "    Metadata: {}",
+                m_identityProvisional ? " (provisional)" : "",
                 m_winNetInfo.hostName,
                 memberOfType, memberOfName,
                 m_winNetInfo.hostDescription,
@@ -116,14 +144,254 @@ Config::Config(const CommandLine & cmdline):
                 m_metadataDoc ? cmdline.metadataFile->c_str() : "default");
 }
 
+auto Config::withDetectedIdentity(const CommandLine & cmdline) const -> refcnt_ptr<Config> {
+    
+    auto ret = refcnt_attach(new Config(serialize()));
+    ret->m_identityProvisional = false;
+    ret->resolveWinNetInfo(cmdline, ret->detectSystemWinNetInfo(cmdline));
+    ret->continueInstanceOf(*this);
+    ret->logConfiguration(cmdline);
+    return ret;
+}
+
+auto Config::withChangedFiles(const CommandLine & cmdline, const std::set<std::filesystem::path> & changed) const -> refcnt_ptr<Config> {
+    
+    //a provisional identity is about to be detected anyway
+    bool sambaChanged = !m_identityProvisional && std::any_of(m_sambaSources.begin(), m_sambaSources.end(), [&](auto & path) {
+        return changed.contains(path);
+    });
+    bool metadataChanged = m_metadataFile && changed.contains(*m_metadataFile);
+    if (!sambaChanged && !metadataChanged)
+        return nullptr;
+    
+    auto ret = refcnt_attach(new Config(serialize()));
+    if (sambaChanged) {
+        WSDLOG_INFO("Samba configuration has changed");
+        ret->resolveWinNetInfo(cmdline, ret->detectSystemWinNetInfo(cmdline));
+    }
+    if (metadataChanged) {
+        WSDLOG_INFO("Metadata file {} has changed", m_metadataFile->c_str());
+        ret->m_metadataDoc = ret->loadMetadataFile(m_metadataFile->native());
+    }
+    ret->continueInstanceOf(*this);
+    ret->logConfiguration(cmdline);
+    return ret;
+}
+
+auto Config::watchedFiles() const -> std::set<std::filesystem::path> {
+    
+    std::set<std::filesystem::path> ret(m_sambaSources.begin(), m_sambaSources.end());
+    if (m_metadataFile)
+        ret.insert(*m_metadataFile);
+    return ret;
+}
+
+void Config::continueInstanceOf(const Config & previous) {
+    
+    m_instanceIdentifier = previous.m_instanceIdentifier;
+    m_metadataVersion = previous.m_metadataVersion;
+    auto changes = changesFrom(previous);
+    if (changes.identity || changes.metadata)
+        ++m_metadataVersion;
+}
+
 auto Config::isAllowedInterface(const sys_string & name) const -> bool {
     if (m_interfaceWhitelist.contains(name))
         return true;
 
-    bool includeViaPattern = false;
+    if (m_interfacePatternsWhitelist.empty() && m_interfacePatternsBlacklist.empty())
+        return m_interfaceWhitelist.empty();
+
+    constexpr size_t maxCacheSize = 4096;
+
+    std::lock_guard lock(m_interfaceCacheMutex);
+    if (auto it = m_interfaceCache.find(name); it != m_interfaceCache.end())
+        return it->second;
+    
+    bool res = matchInterface(name);
+    //names of transient interfaces are rarely reused, don't let them accumulate
+    if (m_interfaceCache.size() == maxCacheSize)
+        m_interfaceCache.clear();
+    m_interfaceCache.emplace(name, res);
+    return res;
+}
+
+Config::Config(const toml::table & data):
+    m_pageSize(size_t(ptl::systemConfig(_SC_PAGESIZE).value_or(4096))) {
+    
+    auto get = [&]<class T>(const char * key, std::type_identity<T>) -> T {
+        if (auto val = data[key].value<T>())
+            return *val;
+        throw std::runtime_error(fmt::format("serialized configuration is missing {}", key));
+    };
+    auto getString = [&](const char * key) -> sys_string {
+        return sys_string(get(key, std::type_identity<std::string>{}));
+    };
+    auto getStrings = [&](const char * key) -> std::vector<std::string> {
+        std::vector<std::string> ret;
+        auto * arr = data[key].as_array();
+        if (!arr)
+            throw std::runtime_error(fmt::format("serialized configuration is missing {}", key));
+        for (auto & item: *arr) {
+            if (auto val = item.value<std::string>())
+                ret.push_back(*val);
+        }
+        return ret;
+    };
+    
+    m_instanceIdentifier = size_t(get("instance-id", std::type_identity<int64_t>{}));
+    m_fullHostName = getString("full-hostname");
+    m_simpleHostName = m_fullHostName.prefix_before_first(U'.').value_or(m_fullHostName);
+    auto uuidStr = getString("uuid");
+    auto maybeUuid = Uuid::from_chars(std::span(uuidStr.c_str(), uuidStr.storage_size()));
+    if (!maybeUuid)
+        throw std::runtime_error("serialized configuration has invalid uuid");
+    m_uuid = *maybeUuid;
+    m_strUuid = to_sys_string(m_uuid);
+    m_urnUuid = to_urn(m_uuid);
+    
+    m_winNetInfo.hostName = getString("hostname");
+    m_winNetInfo.hostDescription = getString("description");
+    if (get("is-domain", std::type_identity<bool>{}))
+        m_winNetInfo.memberOf.emplace<WindowsDomain>(getString("member-of"));
+    else
+        m_winNetInfo.memberOf.emplace<WindowsWorkgroup>(getString("member-of"));
+    if (auto metadata = data["metadata"].value<std::string>())
+        m_metadataDoc = XmlDoc::readMemory(metadata->data(), int(metadata->size()));
+    m_metadataVersion = size_t(get("metadata-version", std::type_identity<int64_t>{}));
+    m_identityProvisional = get("identity-provisional", std::type_identity<bool>{});
+    for (auto & path: getStrings("samba-sources"))
+        m_sambaSources.emplace_back(path);
+    if (auto metadataFile = data["metadata-file"].value<std::string>())
+        m_metadataFile = *metadataFile;
+    
+    m_allowedAddressFamily = AllowedAddressFamily(get("allowed-address-family", std::type_identity<int64_t>{}));
+    m_hopLimit = int(get("hoplimit", std::type_identity<int64_t>{}));
+    for (auto & name: getStrings("interfaces"))
+        m_interfaceWhitelist.insert(sys_string(name));
+    for (auto & pattern: getStrings("include-patterns"))
+        m_interfacePatternsWhitelist.emplace_back(pattern);
+    for (auto & pattern: getStrings("exclude-patterns"))
+        m_interfacePatternsBlacklist.emplace_back(pattern);
+    m_sourcePort = uint16_t(get("source-port", std::type_identity<int64_t>{}));
+    m_settleTime = std::chrono::milliseconds(get("settle-time", std::type_identity<int64_t>{}));
+    m_announceRate = unsigned(get("announce-rate", std::type_identity<int64_t>{}));
+    m_recvBufferMax = unsigned(get("recv-buffer-max", std::type_identity<int64_t>{}));
+    m_httpListenerMode = HttpListenerMode(get("http-listener", std::type_identity<int64_t>{}));
+    m_httpIdleTimeout = std::chrono::seconds(get("http-idle-timeout", std::type_identity<int64_t>{}));
+    m_threadCount = unsigned(get("threads", std::type_identity<int64_t>{}));
+    m_threadAffinity = get("thread-affinity", std::type_identity<bool>{});
+    m_metricsPort = uint16_t(get("metrics-port", std::type_identity<int64_t>{}));
+    m_replySlo = std::chrono::milliseconds(get("reply-slo", std::type_identity<int64_t>{}));
+}
+
+auto Config::deserialize(const toml::table & data) -> refcnt_ptr<Config> {
+    return refcnt_attach(new Config(data));
+}
+
+auto Config::serialize() const -> toml::table {
+    
+    auto toArray = [](auto first, auto last, auto conv) {
+        toml::array ret;
+        for ( ; first != last; ++first)
+            ret.push_back(conv(*first));
+        return ret;
+    };
+    auto str = [](const sys_string & val) {
+        return std::string(sys_string::char_access(val).c_str());
+    };
+    
+    toml::table table;
+    table.insert("instance-id", int64_t(m_instanceIdentifier));
+    table.insert("full-hostname", str(m_fullHostName));
+    table.insert("uuid", str(m_strUuid));
+    table.insert("hostname", str(m_winNetInfo.hostName));
+    table.insert("description", str(m_winNetInfo.hostDescription));
+    table.insert("is-domain", std::holds_alternative<WindowsDomain>(m_winNetInfo.memberOf));
+    table.insert("member-of", std::visit([&](auto & val) { return str(val.name); }, m_winNetInfo.memberOf));
+    if (m_metadataDoc)
+        table.insert("metadata", dumpMetadata(m_metadataDoc.get()));
+    table.insert("metadata-version", int64_t(m_metadataVersion));
+    table.insert("identity-provisional", m_identityProvisional);
+    auto pathStr = [](const std::filesystem::path & path) { return path.native(); };
+    table.insert("samba-sources", toArray(m_sambaSources.begin(), m_sambaSources.end(), pathStr));
+    if (m_metadataFile)
+        table.insert("metadata-file", m_metadataFile->native());
+    
+    table.insert("allowed-address-family", int64_t(m_allowedAddressFamily));
+    table.insert("hoplimit", int64_t(m_hopLimit));
+    table.insert("interfaces", toArray(m_interfaceWhitelist.begin(), m_interfaceWhitelist.end(), str));
+    auto pattern = [](const NameMatcher & matcher) { return matcher.pattern(); };
+    table.insert("include-patterns", toArray(m_interfacePatternsWhitelist.begin(), m_interfacePatternsWhitelist.end(), pattern));
+    table.insert("exclude-patterns", toArray(m_interfacePatternsBlacklist.begin(), m_interfacePatternsBlacklist.end(), pattern));
+    table.insert("source-port", int64_t(m_sourcePort));
+    table.insert("settle-time", int64_t(m_settleTime.count()));
+    table.insert("announce-rate", int64_t(m_announceRate));
+    table.insert("recv-buffer-max", int64_t(m_recvBufferMax));
+    table.insert("http-listener", int64_t(m_httpListenerMode));
+    table.insert("http-idle-timeout", int64_t(m_httpIdleTimeout.count()));
+    table.insert("threads", int64_t(m_threadCount));
+    table.insert("thread-affinity", m_threadAffinity);
+    table.insert("metrics-port", int64_t(m_metricsPort));
+    table.insert("reply-slo", int64_t(m_replySlo.count()));
+    return table;
+}
+
+auto Config::changesFrom(const Config & previous) const -> Changes {
+    
+    Changes ret;
+    
+    auto sameMembership = [](const MemberOf & lhs, const MemberOf & rhs) {
+        if (lhs.index() != rhs.index())
+            return false;
+        return std::visit([&](auto & val) { 
+            return val.name == std::get<std::remove_cvref_t<decltype(val)>>(rhs).name; 
+        }, lhs);
+    };
+    auto samePatterns = [](const std::vector<NameMatcher> & lhs, const std::vector<NameMatcher> & rhs) {
+        return std::equal(lhs.begin(), lhs.end(), rhs.begin(), rhs.end(), [](auto & l, auto & r) {
+            return l.pattern() == r.pattern();
+        });
+    };
+    
+    //everything else only shows in metadata, which clients re-fetch when its version changes
+    ret.identity = m_uuid != previous.m_uuid;
+    ret.runtime = m_threadCount != previous.m_threadCount ||
+                  m_threadAffinity != previous.m_threadAffinity ||
+                  m_metricsPort != previous.m_metricsPort ||
+                  m_httpListenerMode != previous.m_httpListenerMode;
+    ret.interfaces = m_allowedAddressFamily != previous.m_allowedAddressFamily ||
+                     m_interfaceWhitelist != previous.m_interfaceWhitelist ||
+                     !samePatterns(m_interfacePatternsWhitelist, previous.m_interfacePatternsWhitelist) ||
+                     !samePatterns(m_interfacePatternsBlacklist, previous.m_interfacePatternsBlacklist);
+    ret.transport = m_hopLimit != previous.m_hopLimit ||
+                    m_sourcePort != previous.m_sourcePort ||
+                    m_recvBufferMax != previous.m_recvBufferMax;
+    ret.metadata = m_winNetInfo.hostName != previous.m_winNetInfo.hostName ||
+                   !sameMembership(m_winNetInfo.memberOf, previous.m_winNetInfo.memberOf) ||
+                   m_metadataVersion != previous.m_metadataVersion ||
+                   m_winNetInfo.hostDescription != previous.m_winNetInfo.hostDescription ||
+                   bool(m_metadataDoc) != bool(previous.m_metadataDoc) ||
+                   (m_metadataDoc && dumpMetadata(m_metadataDoc.get()) != dumpMetadata(previous.m_metadataDoc.get()));
+    ret.settings = m_settleTime != previous.m_settleTime ||
+                   m_announceRate != previous.m_announceRate ||
+                   m_replySlo != previous.m_replySlo ||
+                   m_httpIdleTimeout != previous.m_httpIdleTimeout;
+    return ret;
+}
+
+auto Config::dumpMetadata(XmlDoc * doc) -> std::string {
+    auto buf = doc->dump();
+    return std::string((const char *)buf.data(), buf.size());
+}
+
+auto Config::matchInterface(const sys_string & name) const -> bool {
     sys_string::char_access access(name);
-    for (auto & exp: m_interfacePatternsWhitelist) {
-        if (std::regex_match(access.c_str(), exp)) {
+    std::string_view nameView(access.c_str());
+
+    bool includeViaPattern = false;
+    for (auto & matcher: m_interfacePatternsWhitelist) {
+        if (matcher.matches(nameView)) {
             includeViaPattern = true;
             break;
         }
@@ -133,8 +401,8 @@ auto Config::isAllowedInterface(const sys_string & name) const -> bool {
     if (!includeViaPattern && !includeByDefault)
         return false;
 
-    for (auto & exp: m_interfacePatternsBlacklist) {
-        if (std::regex_match(access.c_str(), exp))
+    for (auto & matcher: m_interfacePatternsBlacklist) {
+        if (matcher.matches(nameView))
             return false;
     }
     return true;
@@ -7,6 +7,7 @@
 #include "sys_util.h"
 #include "util.h"
 #include "xml_wrapper.h"
+#include "name_matcher.h"
 
 constexpr uint16_t g_WsdUdpPort = 3702;
 constexpr uint16_t g_WsdHttpPort = 5357;
@@ -14,6 +15,9 @@ constexpr uint16_t g_WsdHttpPort = 5357;
 constexpr const char * g_WsdMulticastGroupV4 = "239.255.255.250";
 constexpr const char * g_WsdMulticastGroupV6 = "ff02::c";  // link-local
 
+//How many times each multicast message is sent (MULTICAST_UDP_REPEAT in the spec)
+constexpr int g_WsdMulticastRepeatCount = 4;
+
 constexpr size_t g_maxLogFileSize = 1024 * 1024;
 constexpr size_t g_maxRotatedLogs = 5;
 
@@ -34,9 +38,53 @@ public:
         std::optional<sys_string> hostName;
         std::optional<sys_string> hostDescription;
     };
+
+    //What differs between two configurations, grouped by what it takes to apply
+    struct Changes {
+        bool identity = false;      //endpoint identifier: needs Bye/Hello
+        bool runtime = false;       //threading, HTTP listener mode or metrics port: cannot be applied to running servers
+        bool interfaces = false;    //interface selection or address families
+        bool transport = false;     //multicast sending or receive buffer parameters: needs new UDP sockets
+        bool metadata = false;      //hostname, membership, description or metadata document
+        bool settings = false;      //everything else that is only read when used
+        
+        auto requiresRestart() const -> bool
+            { return identity || runtime; }
+        auto any() const -> bool
+            { return identity || runtime || interfaces || transport || metadata || settings; }
+    };
 public:
-    static refcnt_ptr<Config> make(const CommandLine & cmdline) {
-        return refcnt_attach(new Config(cmdline));
+    //Without detectIdentity Windows identity is not detected from the system (which may take a while)
+    //and the configuration is provisional until completed by withDetectedIdentity()
+    static refcnt_ptr<Config> make(const CommandLine & cmdline, bool detectIdentity = true) {
+        return refcnt_attach(new Config(cmdline, detectIdentity, nullptr));
+    }
+    //Provisional configuration that assumes the identity of the previous one until its own is detected,
+    //so that reloading does not flip servers to an identity based on the host name in the meantime
+    static refcnt_ptr<Config> makeProvisional(const CommandLine & cmdline, const Config & previous) {
+        return refcnt_attach(new Config(cmdline, false, &previous.m_winNetInfo));
+    }
+    //Reconstructs configuration produced by serialize(), possibly in another process
+    static refcnt_ptr<Config> deserialize(const toml::table & data);
+    
+    auto serialize() const -> toml::table;
+    
+    auto changesFrom(const Config & previous) const -> Changes;
+    
+    //Returns a copy of this configuration with Windows identity detected from the system. 
+    //Can be called on any thread
+    auto withDetectedIdentity(const CommandLine & cmdline) const -> refcnt_ptr<Config>;
+    //Returns a copy of this configuration with the parts that come from the changed files re-read 
+    //or nullptr if none of them matter. Can be called on any thread
+    auto withChangedFiles(const CommandLine & cmdline, const std::set<std::filesystem::path> & changed) const -> refcnt_ptr<Config>;
+    //Files that withChangedFiles() cares about
+    auto watchedFiles() const -> std::set<std::filesystem::path>;
+    
+    //Keeps reporting the same WS-Discovery instance as the previous configuration.
+    //Must only be called before this object is shared.
+    void continueInstanceOf(const Config & previous);
+    void continueInstanceOf(size_t instanceIdentifier) {
+        m_instanceIdentifier = instanceIdentifier;
     }
 
     auto instanceIdentifier() const -> size_t               { return m_instanceIdentifier; };
@@ -44,28 +92,47 @@ public:
     auto httpPath() const -> const sys_string &             { return m_strUuid; }
     auto winNetInfo() const -> const WinNetInfo &           { return m_winNetInfo; }
     auto metadataDoc() const -> XmlDoc *                    { return m_metadataDoc.get(); }
+    auto metadataVersion() const -> size_t                  { return m_metadataVersion; }
+    auto isIdentityProvisional() const -> bool              { return m_identityProvisional; }
     
     auto enableIPv4() const -> bool                         { return m_allowedAddressFamily != IPv6Only; }
     auto enableIPv6() const -> bool                         { return m_allowedAddressFamily != IPv4Only; }
     auto hopLimit() const -> int                            { return m_hopLimit; }
     auto isAllowedInterface(const sys_string & name) const -> bool;
     auto sourcePort() const -> uint16_t                     { return m_sourcePort; }
+    auto settleTime() const -> std::chrono::milliseconds    { return m_settleTime; }
+    auto announceRate() const -> unsigned                   { return m_announceRate; }
+    auto recvBufferMax() const -> unsigned                  { return m_recvBufferMax; }
+    auto httpListenerMode() const -> HttpListenerMode       { return m_httpListenerMode; }
+    auto httpIdleTimeout() const -> std::chrono::seconds    { return m_httpIdleTimeout; }
+    auto threadCount() const -> unsigned                    { return m_threadCount; }
+    auto threadAffinity() const -> bool                     { return m_threadAffinity; }
+    auto metricsPort() const -> uint16_t                    { return m_metricsPort; }
+    auto replySlo() const -> std::chrono::milliseconds      { return m_replySlo; }
     
     auto pageSize() const -> size_t                         { return m_pageSize; }
 
 private:
-    Config(const CommandLine & cmdline);
+    Config(const CommandLine & cmdline, bool detectIdentity, const WinNetInfo * assumedWinNetInfo);
+    Config(const toml::table & data);
     ~Config() {};
 
 #if CAN_HAVE_APPLE_SAMBA
     auto detectAppleWinNetInfo(bool useNetbiosHostName) -> std::optional<WinNetInfo>;
 #endif
     auto detectWinNetInfo(std::optional<std::filesystem::path> smbConf, bool useNetbiosHostName) -> std::optional<WinNetInfo>;
+    auto detectSystemWinNetInfo(const CommandLine & cmdline) -> std::optional<WinNetInfo>;
+    void resolveWinNetInfo(const CommandLine & cmdline, const std::optional<WinNetInfo> & systemWinNetInfo);
+    void logConfiguration(const CommandLine & cmdline) const;
     auto sambaParamsToWinNetInfo(const SambaParams & params, bool useNetbiosHostName) -> WinNetInfo;
     
     auto getHostName() const -> sys_string;
     
     auto loadMetadataFile(const std::string & filename) const -> std::unique_ptr<XmlDoc>;
+
+    auto matchInterface(const sys_string & name) const -> bool;
+    
+    static auto dumpMetadata(XmlDoc * doc) -> std::string;
 private:
     size_t m_instanceIdentifier;
     sys_string m_fullHostName;
@@ -75,13 +142,32 @@ private:
     sys_string m_urnUuid;
     WinNetInfo m_winNetInfo;
     std::unique_ptr<XmlDoc> m_metadataDoc;
+    //incremented whenever metadata changes so clients know to fetch it again
+    size_t m_metadataVersion = 1;
+    bool m_identityProvisional = false;
+    //where the above come from
+    std::vector<std::filesystem::path> m_sambaSources;
+    std::optional<std::filesystem::path> m_metadataFile;
     
     AllowedAddressFamily m_allowedAddressFamily = BothIPv4AndIPv6;
     int m_hopLimit = 1;
     std::set<sys_string> m_interfaceWhitelist;
-    std::vector<std::regex> m_interfacePatternsWhitelist;
-    std::vector<std::regex> m_interfacePatternsBlacklist;
+    std::vector<NameMatcher> m_interfacePatternsWhitelist;
+    std::vector<NameMatcher> m_interfacePatternsBlacklist;
+    //Memoized results of isAllowedInterface. Interface names repeat a lot (veth churn etc.)
+    //and the answer cannot change for the lifetime of this object
+    mutable std::mutex m_interfaceCacheMutex;
+    mutable std::map<sys_string, bool> m_interfaceCache;
     uint16_t m_sourcePort;
+    std::chrono::milliseconds m_settleTime;
+    unsigned m_announceRate;
+    unsigned m_recvBufferMax;
+    HttpListenerMode m_httpListenerMode;
+    std::chrono::seconds m_httpIdleTimeout;
+    unsigned m_threadCount;
+    bool m_threadAffinity;
+    uint16_t m_metricsPort;
+    std::chrono::milliseconds m_replySlo;
     
     size_t m_pageSize;
 };
@@ -2,6 +2,7 @@
 // SPDX-License-Identifier: BSD-3-Clause
 
 #include "config.h"
+#include "smb_conf_scanner.h"
 #include "util.h"
 #include "sys_util.h"
 
@@ -70,126 +71,208 @@ static auto findSmbConf() -> std::optional<std::filesystem::path> {
     #endif
 }
 
-static auto paramsFromSmbConf(const std::filesystem::path & path) -> std::optional<Config::SambaParams> {
+//Detected parameters and the files they came from
+struct DetectedSambaParams {
+    Config::SambaParams params;
+    std::vector<std::filesystem::path> sources;
+};
 
-    std::error_code ec;
-    auto file = ptl::FileDescriptor::open(path.c_str(), O_RDONLY, ec);
-    if (!file)
-        return {};
+static auto paramsFromSmbConf(const std::filesystem::path & path) -> std::optional<DetectedSambaParams> {
 
-    struct ::stat st;
-    getStatus(file, st, ec);
-    if (ec)
+    SmbConfScanner scanner(true);
+    if (!scanner.read(path))
         return {};
-
-    ptl::MemoryMap bytes(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, c_fd(file), 0, ec);
-    if (ec)
+    if (!scanner.isComplete()) {
+        WSDLOG_DEBUG("smb.conf cannot be fully read directly");
         return {};
-    
-
-    WSDLOG_TRACE("reading smb.conf");
-
-    std::string_view content((const char *)bytes.data(), bytes.size());
-
-    std::regex sectionRe(R"##(\s*\[([^\]]*)\].*)##", std::regex_constants::ECMAScript);
-    std::regex entryRe(R"##(\s*([^ \t#;=][^=#;]*)\s*=\s*((?:[^ \t#;][^#;]*)?).*)##", std::regex_constants::ECMAScript);
-
-    Config::SambaParams ret;
-    bool inGlobalSection = false;
-    
-    auto processed_end = content.begin();
-    for(auto cur = processed_end, end = content.end(); cur != end; ) {
+    }
+    auto sources = scanner.files();
+    return DetectedSambaParams{std::move(scanner).result(), std::move(sources)};
+}
 
-        if (*cur != '\n') {
-            ++cur;
-            continue;
-        }
+auto paramsFromTestParm() -> std::optional<Config::SambaParams> {
 
-        std::string_view line(processed_end, cur - processed_end);
-        processed_end = ++cur;
+    WSDLOG_DEBUG("trying to use testparm to detect samba config");
 
-        std::match_results<std::string_view::const_iterator> m;
+    try {
+        //A single run dumping the whole global section, including defaults, 
+        //costs the same as asking for one parameter
+        SmbConfScanner scanner(false);
+        shell({"testparm", "-slv", "--section-name=global"}, true, LineReader(1024, [&](std::string_view line) {
+            scanner.scan(line);
+        }));
+        auto ret = std::move(scanner).result();
+        
+        WSDLOG_TRACE("testparm workgroup is: {}", ret.workgroup.value_or(S("")));
+        WSDLOG_TRACE("testparm security is: {}", ret.security.value_or(S("")));
+        WSDLOG_TRACE("testparm netbios name is: {}", ret.hostName.value_or(S("")));
+        WSDLOG_TRACE("testparm server string is: {}", ret.hostDescription.value_or(S("")));
 
-        if (std::regex_match(line.begin(), line.end(), m, sectionRe)) {
-            if (inGlobalSection) {
-                WSDLOG_TRACE("smb.conf global section has ended");
-                break;
-            }
-            inGlobalSection = (std::string_view(m[1].first, m[1].length()) == "global"sv);
-            WSDLOG_TRACE("found smb.conf global section");
-            continue;
-        }
+        WSDLOG_INFO("found samba config via testparm tool");
+        return ret;
 
-        if (!inGlobalSection)
-            continue;
-
-        if (!std::regex_match(line.begin(), line.end(), m, entryRe))
-            continue;
-        std::string_view key(m[1].first, m[1].length());
-        while(!key.empty() && (key.back() == ' ' || key.back() == '\t'))
-            key.remove_suffix(1);
-        std::string_view value(m[2].first, m[2].length());
-        while(!value.empty() && (value.back() == ' ' || value.back() == '\t'))
-            value.remove_suffix(1);
-
-        if (key == "workgroup"sv) {
-            WSDLOG_TRACE("smb.conf workgroup is: {}", value);
-            ret.workgroup.emplace(value);
-        } else if (key == "security"sv) {
-            WSDLOG_TRACE("smb.conf security is: {}", value);
-            ret.security.emplace(value);
-        } else if (key == "netbios name"sv) {
-            WSDLOG_TRACE("smb.conf netbios name is: {}", value);
-            ret.hostName.emplace(value);
-        } else if (key == "server string"sv) {
-            WSDLOG_TRACE("smb.conf server string is: {}", value);
-            ret.hostDescription.emplace(value);
-        }
+    } catch(std::exception & ex) {
+        WSDLOG_DEBUG("testparm detection failed: {}", ex.what());
     }
 
-    WSDLOG_TRACE("smb.conf reading done");
-    return ret;
+    return {};
 }
 
-static auto runTestParm(std::string_view name) -> std::optional<sys_string> {
-
-    std::string arg = "--parameter-name=";
-    arg += name;
+/*
+ Parameters read directly from smb.conf are cached on disk together with the smb.conf and
+ included files they came from. The cache is keyed by the smb.conf path. When the path was
+ located rather than specified it is remembered too, so as long as that file and all the
+ sources have the same size and modification time, subsequent starts neither ask samba
+ where its configuration is nor parse it.
+ testparm does not tell which files it read, so its results are never cached: an edit to
+ an included file would go unnoticed.
+ */
 
-    std::optional<sys_string> ret;
+constexpr int64_t g_sambaCacheVersion = 4;
 
-    shell({"testparm", "-sl", arg.c_str()}, true, LineReader(1024, [&](std::string_view line) {
-        ret = line;
-    }));
+static auto sambaCacheFile() -> std::filesystem::path {
+    return cacheDirectory() / "samba.toml";
+}
 
-    return ret;
+static auto fileStamp(const std::filesystem::path & path) -> std::optional<std::pair<int64_t, int64_t>> {
+    
+    std::error_code ec;
+    auto mtime = last_write_time(path, ec);
+    if (ec)
+        return {};
+    auto size = file_size(path, ec);
+    if (ec)
+        return {};
+    return std::pair(int64_t(mtime.time_since_epoch().count()), int64_t(size));
 }
 
-auto paramsFromTestParm() -> std::optional<Config::SambaParams> {
+//Without smbConf only an entry for a located smb.conf is acceptable
+static auto loadCachedSambaParams(const std::optional<std::filesystem::path> & specifiedSmbConf) -> std::optional<DetectedSambaParams> {
 
-    WSDLOG_DEBUG("trying to use testparm to detect samba config");
+    auto cacheFile = sambaCacheFile();
 
     try {
-        Config::SambaParams ret;
-        ret.workgroup = runTestParm("workgroup"sv);
-        WSDLOG_TRACE("testparm workgroup is: {}", ret.workgroup.value_or(S("")));
-        ret.security = runTestParm("security"sv);
-        WSDLOG_TRACE("testparm security is: {}", ret.security.value_or(S("")));
-        ret.hostName = runTestParm("netbios name"sv);
-        WSDLOG_TRACE("testparm netbios name is: {}", ret.hostName.value_or(S("")));
-        ret.hostDescription = runTestParm("server string"sv);
-        WSDLOG_TRACE("testparm server string is: {}", ret.hostDescription.value_or(S("")));
-
-        WSDLOG_INFO("found samba config via testparm tool");
+        std::error_code ec;
+        if (!exists(cacheFile, ec))
+            return {};
+        
+        auto cache = toml::parse_file(cacheFile.native());
+        
+        if (cache["version"].value<int64_t>() != g_sambaCacheVersion)
+            return {};
+        std::filesystem::path smbConf = cache["smb-conf"].value_or(""s);
+        if (smbConf.empty())
+            return {};
+        if (specifiedSmbConf ? smbConf != *specifiedSmbConf : !cache["located"].value_or(false))
+            return {};
+        
+        auto * sources = cache["sources"].as_array();
+        if (!sources || sources->empty())
+            return {};
+        DetectedSambaParams ret;
+        for (auto & sourceNode: *sources) {
+            auto * source = sourceNode.as_table();
+            if (!source)
+                return {};
+            auto path = (*source)["path"].value<std::string>();
+            auto stamp = path ? fileStamp(*path) : std::nullopt;
+            if (!stamp || 
+                (*source)["mtime"].value<int64_t>() != stamp->first || 
+                (*source)["size"].value<int64_t>() != stamp->second) {
+                
+                WSDLOG_DEBUG("cached samba parameters for '{}' are out of date", smbConf.c_str());
+                return {};
+            }
+            ret.sources.emplace_back(*path);
+        }
+        if (std::find(ret.sources.begin(), ret.sources.end(), smbConf) == ret.sources.end())
+            return {};
+
+        auto params = cache["params"];
+        auto get = [&](std::string_view key) -> std::optional<sys_string> {
+            if (auto val = params[key].value<std::string>())
+                return sys_string(*val);
+            return {};
+        };
+        ret.params.workgroup = get("workgroup");
+        ret.params.security = get("security");
+        ret.params.hostName = get("netbios-name");
+        ret.params.hostDescription = get("server-string");
+
+        WSDLOG_INFO("using cached samba config parameters for '{}'", smbConf.c_str());
         return ret;
 
     } catch(std::exception & ex) {
-        WSDLOG_DEBUG("testparm detection failed: {}", ex.what());
+        WSDLOG_DEBUG("unable to read samba parameters cache {}: {}", cacheFile.c_str(), ex.what());
     }
-
     return {};
 }
 
+static void saveCachedSambaParams(const std::filesystem::path & smbConf, bool located, const DetectedSambaParams & detected) {
+    
+    toml::array sources;
+    for (auto & path: detected.sources) {
+        auto stamp = fileStamp(path);
+        if (!stamp)
+            return;
+        sources.push_back(toml::table{
+            {"path", path.native()},
+            {"mtime", stamp->first},
+            {"size", stamp->second}
+        });
+    }
+    if (sources.empty())
+        return;
+    
+    auto & params = detected.params;
+    
+    auto str = [](const sys_string & val) {
+        return std::string(sys_string::char_access(val).c_str());
+    };
+    
+    toml::table paramsTable;
+    if (params.workgroup)
+        paramsTable.insert("workgroup", str(*params.workgroup));
+    if (params.security)
+        paramsTable.insert("security", str(*params.security));
+    if (params.hostName)
+        paramsTable.insert("netbios-name", str(*params.hostName));
+    if (params.hostDescription)
+        paramsTable.insert("server-string", str(*params.hostDescription));
+    
+    toml::table cache;
+    cache.insert("version", g_sambaCacheVersion);
+    cache.insert("smb-conf", smbConf.native());
+    cache.insert("located", located);
+    cache.insert("sources", std::move(sources));
+    cache.insert("params", std::move(paramsTable));
+    
+    std::ostringstream out;
+    out << cache << '\n';
+    auto content = std::move(out).str();
+    
+    auto cacheFile = sambaCacheFile();
+    auto tempFile = cacheFile;
+    tempFile += ".tmp";
+    
+    try {
+        createMissingDirs(cacheFile.parent_path(), 0755, std::nullopt);
+        
+        auto fd = ptl::FileDescriptor::open(tempFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if ((size_t)writeFile(fd, content.data(), content.size()) != content.size())
+            throw std::runtime_error("short write");
+        fd.close();
+        //readers never see a partially written cache
+        std::filesystem::rename(tempFile, cacheFile);
+        
+        WSDLOG_DEBUG("saved samba parameters to {}", cacheFile.c_str());
+    } catch(std::exception & ex) {
+        WSDLOG_DEBUG("unable to save samba parameters cache {}: {}", cacheFile.c_str(), ex.what());
+        std::error_code ec;
+        std::filesystem::remove(tempFile, ec);
+    }
+}
+
 auto Config::sambaParamsToWinNetInfo(const SambaParams & params, bool useNetbiosHostName) -> WinNetInfo {
     
     bool isDomain = (params.security == S("domain") || params.security == S("ads"));
@@ -234,16 +317,31 @@ auto Config::sambaParamsToWinNetInfo(const SambaParams & params, bool useNetbios
 
 auto Config::detectWinNetInfo(std::optional<std::filesystem::path> smbConf, bool useNetbiosHostName) -> std::optional<WinNetInfo> {
 
-    if (!smbConf)
+    m_sambaSources.clear();
+
+    if (auto cached = loadCachedSambaParams(smbConf)) {
+        m_sambaSources = std::move(cached->sources);
+        return sambaParamsToWinNetInfo(cached->params, useNetbiosHostName);
+    }
+
+    bool located = !smbConf;
+    if (located)
         smbConf = findSmbConf();
     
-    std::optional<Config::SambaParams> params;
-    if (smbConf)
-        params = paramsFromSmbConf(*smbConf);
-    if (!params)
-        params = paramsFromTestParm();
-    if (params)
+    if (smbConf && !smbConf->empty()) {
+        if (auto detected = paramsFromSmbConf(*smbConf)) {
+            saveCachedSambaParams(*smbConf, located, *detected);
+            m_sambaSources = std::move(detected->sources);
+            return sambaParamsToWinNetInfo(detected->params, useNetbiosHostName);
+        }
+    }
+    
+    if (auto params = paramsFromTestParm()) {
+        //not cached, see above, but watching the main file still catches most edits
+        if (smbConf && !smbConf->empty())
+            m_sambaSources.push_back(*smbConf);
         return sambaParamsToWinNetInfo(*params, useNetbiosHostName);
+    }
 
     return {};
 }
@@ -0,0 +1,39 @@
+// Copyright (c) 2022, Eugene Gershnik
+// SPDX-License-Identifier: BSD-3-Clause
+
+#ifndef HEADER_FILE_WATCHER_H_INCLUDED
+#define HEADER_FILE_WATCHER_H_INCLUDED
+
+#include "util.h"
+
+/*
+ Reports changes to a set of files: via inotify where available, by polling their size 
+ and modification time elsewhere. Files that are replaced by rename, as editors and package 
+ managers do, or that do not exist yet are noticed too.
+ */
+class FileWatcher : public ref_counted<FileWatcher> {
+    friend ref_counted<FileWatcher>;
+public:
+    class Handler {
+    public:
+        virtual void onFilesChanged(const std::set<std::filesystem::path> & files) = 0;
+    protected:
+        ~Handler() {}
+    };
+
+public:
+    virtual void start(Handler & handler) = 0;
+    virtual void stop() = 0;
+protected:
+    FileWatcher() {
+    }
+    virtual ~FileWatcher() noexcept {
+    }
+};
+
+using FileWatcherFactoryT = auto (const Strand & strand, const std::set<std::filesystem::path> & files) -> refcnt_ptr<FileWatcher>;
+using FileWatcherFactory = std::function<FileWatcherFactoryT>;
+
+FileWatcherFactoryT createFileWatcher;
+
+#endif
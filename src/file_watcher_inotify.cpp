@@ -0,0 +1,145 @@
+// Copyright (c) 2022, Eugene Gershnik
+// SPDX-License-Identifier: BSD-3-Clause
+
+#if HAVE_INOTIFY
+
+#include "file_watcher.h"
+
+#include <sys/inotify.h>
+
+//files are rarely written in one go so changes are reported once they stop for this long
+static constexpr auto g_fileSettleTime = std::chrono::milliseconds(500);
+
+class FileWatcherImpl : public FileWatcher {
+public:
+    FileWatcherImpl(const Strand & strand, const std::set<std::filesystem::path> & files):
+        m_descriptor(strand),
+        m_settleTimer(strand) {
+        
+        int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (fd < 0)
+            ptl::throwErrorCode(errno, "inotify_init1()");
+        m_descriptor.assign(fd);
+        
+        //Watching directories rather than files catches replacement by rename and creation
+        std::map<std::filesystem::path, Directory> directories;
+        for (auto & file: files) {
+            std::error_code ec;
+            auto absPath = absolute(file, ec);
+            if (ec)
+                continue;
+            auto & dir = directories[absPath.parent_path()];
+            dir.files.emplace(absPath.filename().native(), file);
+        }
+        
+        for (auto & [path, dir]: directories) {
+            int wd = inotify_add_watch(fd, path.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE);
+            if (wd < 0) {
+                WSDLOG_WARN("Unable to watch directory {} for changes: {}", path.c_str(), 
+                            std::error_code(errno, std::system_category()).message());
+                continue;
+            }
+            WSDLOG_DEBUG("Watching directory {} for changes", path.c_str());
+            m_directories.emplace(wd, std::move(dir));
+        }
+    }
+    
+    void start(Handler & handler) override {
+        m_handler = &handler;
+        read();
+    }
+    
+    void stop() override {
+        m_handler = nullptr;
+        m_settleTimer.cancel();
+        m_descriptor.close();
+        m_pending.clear();
+    }
+    
+private:
+    struct Directory {
+        //name in directory -> path as given to us
+        std::map<std::string, std::filesystem::path, std::less<>> files;
+    };
+    
+    ~FileWatcherImpl() noexcept {
+    }
+    
+    void read() {
+        m_descriptor.async_wait(asio::posix::stream_descriptor::wait_read, 
+                                [this, holder = refcnt_retain(this)](const asio::error_code & ec) {
+            if (!m_handler)
+                return;
+            if (ec) {
+                if (ec != asio::error::operation_aborted)
+                    WSDLOG_ERROR("Waiting for file changes failed: {}", ec.message());
+                return;
+            }
+            if (drain() && !m_pending.empty())
+                scheduleReport();
+            read();
+        });
+    }
+    
+    auto drain() -> bool {
+        
+        alignas(inotify_event) char buf[4096];
+        for ( ; ; ) {
+            auto count = ::read(m_descriptor.native_handle(), buf, sizeof(buf));
+            if (count < 0) {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    return true;
+                WSDLOG_ERROR("Reading file change events failed: {}", std::error_code(errno, std::system_category()).message());
+                return false;
+            }
+            
+            for (auto * ptr = buf; ptr < buf + count; ) {
+                auto * event = reinterpret_cast<const inotify_event *>(ptr);
+                ptr += sizeof(inotify_event) + event->len;
+                
+                if (event->mask & IN_Q_OVERFLOW) {
+                    //we do not know what we have missed
+                    for (auto & [_, dir]: m_directories) {
+                        for (auto & entry: dir.files)
+                            m_pending.insert(entry.second);
+                    }
+                    continue;
+                }
+                if (event->len == 0)
+                    continue;
+                auto dirIt = m_directories.find(event->wd);
+                if (dirIt == m_directories.end())
+                    continue;
+                auto & files = dirIt->second.files;
+                if (auto fileIt = files.find(std::string_view(event->name)); fileIt != files.end())
+                    m_pending.insert(fileIt->second);
+            }
+        }
+    }
+    
+    void scheduleReport() {
+        m_settleTimer.expires_after(g_fileSettleTime);
+        m_settleTimer.async_wait([this, holder = refcnt_retain(this)](const asio::error_code & ec) {
+            if (ec || !m_handler || m_pending.empty())
+                return;
+            auto changed = std::move(m_pending);
+            m_pending.clear();
+            m_handler->onFilesChanged(changed);
+        });
+    }
+    
+private:
+    asio::posix::stream_descriptor m_descriptor;
+    asio::steady_timer m_settleTimer;
+    std::map<int, Directory> m_directories;
+    std::set<std::filesystem::path> m_pending;
+    Handler * m_handler = nullptr;
+};
+
+auto createFileWatcher(const Strand & strand, const std::set<std::filesystem::path> & files) -> refcnt_ptr<FileWatcher> {
+    return refcnt_attach(new FileWatcherImpl(strand, files));
+}
+
+#endif
@@ -0,0 +1,82 @@
+// Copyright (c) 2022, Eugene Gershnik
+// SPDX-License-Identifier: BSD-3-Clause
+
+#if !HAVE_INOTIFY
+
+#include "file_watcher.h"
+
+static constexpr auto g_filePollInterval = std::chrono::seconds(5);
+
+class FileWatcherImpl : public FileWatcher {
+public:
+    FileWatcherImpl(const Strand & strand, const std::set<std::filesystem::path> & files):
+        m_timer(strand) {
+        
+        for (auto & file: files)
+            m_stamps.emplace(file, stamp(file));
+    }
+    
+    void start(Handler & handler) override {
+        m_handler = &handler;
+        schedulePoll();
+    }
+    
+    void stop() override {
+        m_handler = nullptr;
+        m_timer.cancel();
+    }
+    
+private:
+    //nullopt if the file does not exist
+    using Stamp = std::optional<std::pair<std::filesystem::file_time_type, uintmax_t>>;
+    
+    ~FileWatcherImpl() noexcept {
+    }
+    
+    static auto stamp(const std::filesystem::path & path) -> Stamp {
+        std::error_code ec;
+        auto mtime = last_write_time(path, ec);
+        if (ec)
+            return std::nullopt;
+        auto size = file_size(path, ec);
+        if (ec)
+            return std::nullopt;
+        return std::pair(mtime, size);
+    }
+    
+    void schedulePoll() {
+        m_timer.expires_after(g_filePollInterval);
+        m_timer.async_wait([this, holder = refcnt_retain(this)](const asio::error_code & ec) {
+            if (ec || !m_handler)
+                return;
+            poll();
+            //the handler might have stopped us
+            if (m_handler)
+                schedulePoll();
+        });
+    }
+    
+    void poll() {
+        std::set<std::filesystem::path> changed;
+        for (auto & [path, oldStamp]: m_stamps) {
+            auto newStamp = stamp(path);
+            if (newStamp != oldStamp) {
+                oldStamp = newStamp;
+                changed.insert(path);
+            }
+        }
+        if (!changed.empty())
+            m_handler->onFilesChanged(changed);
+    }
+    
+private:
+    asio::steady_timer m_timer;
+    std::map<std::filesystem::path, Stamp> m_stamps;
+    Handler * m_handler = nullptr;
+};
+
+auto createFileWatcher(const Strand & strand, const std::set<std::filesystem::path> & files) -> refcnt_ptr<FileWatcher> {
+    return refcnt_attach(new FileWatcherImpl(strand, files));
+}
+
+#endif
@@ -0,0 +1,267 @@
+// Copyright (c) 2022, Eugene Gershnik
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "flight_recorder.h"
+
+namespace {
+
+    struct FlightRecord {
+        int64_t timeNs;     //system clock, to match against logs
+        uint32_t ifIndex;
+        uint32_t bytesIn;
+        uint32_t bytesOut;
+        uint16_t port;
+        uint8_t addrSize;   //0, 4 or 16
+        FlightEvent event;
+        FlightOutcome outcome;
+        WsdAction action;
+        uint8_t payloadSize;
+        std::array<uint8_t, 16> addr;
+        std::array<char, FlightRecorder::payloadCapacity> payload;
+    };
+
+    /*
+     Each slot is a seqlock: the sequence is odd while the record is being written and
+     2 * (index + 1) once event number index is in it. A reader that sees the same even
+     value before and after copying the record got it whole.
+     */
+    struct FlightSlot {
+        std::atomic<uint64_t> sequence = 0;
+        FlightRecord record;
+    };
+}
+
+static std::array<FlightSlot, FlightRecorder::capacity> g_flightSlots;
+static std::atomic<uint64_t> g_flightNext = 0;
+static std::atomic<int> g_flightDumpFd = -1;
+static std::atomic<int64_t> g_lastErrorDumpNs = 0;   //0 means never
+
+static const char * const g_flightEventNames[] = {
+    "udp-received",
+    "udp-sent",
+    "http-request",
+    "request",
+    "server-added",
+    "server-removed",
+    "fatal-error"
+};
+static_assert(std::size(g_flightEventNames) == size_t(FlightEvent::FatalError) + 1);
+
+static const char * const g_flightOutcomeNames[] = {
+    "ok",
+    "truncated",
+    "malformed",
+    "duplicate",
+    "ignored",
+    "replied",
+    "rejected",
+    "failed"
+};
+static_assert(std::size(g_flightOutcomeNames) == size_t(FlightOutcome::Failed) + 1);
+
+static inline auto saturate32(size_t val) noexcept -> uint32_t {
+    return uint32_t(std::min(val, size_t(std::numeric_limits<uint32_t>::max())));
+}
+
+void FlightRecorder::record(const FlightEntry & entry, const ip::address & peer, uint16_t port,
+                            const void * payload, size_t payloadSize) noexcept {
+
+    auto idx = g_flightNext.fetch_add(1, std::memory_order_relaxed);
+    auto & slot = g_flightSlots[idx % capacity];
+    slot.sequence.store(2 * idx + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    auto & rec = slot.record;
+    rec.timeNs = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    rec.ifIndex = entry.ifIndex;
+    rec.bytesIn = saturate32(entry.bytesIn);
+    rec.bytesOut = saturate32(entry.bytesOut);
+    rec.port = port;
+    rec.event = entry.event;
+    rec.outcome = entry.outcome;
+    rec.action = entry.action;
+    if (peer.is_unspecified()) {
+        rec.addrSize = 0;
+    } else if (peer.is_v4()) {
+        auto bytes = peer.to_v4().to_bytes();
+        memcpy(rec.addr.data(), bytes.data(), bytes.size());
+        rec.addrSize = uint8_t(bytes.size());
+    } else {
+        auto bytes = peer.to_v6().to_bytes();
+        memcpy(rec.addr.data(), bytes.data(), bytes.size());
+        rec.addrSize = uint8_t(bytes.size());
+    }
+    rec.payloadSize = uint8_t(std::min(payloadSize, payloadCapacity));
+    if (rec.payloadSize)
+        memcpy(rec.payload.data(), payload, rec.payloadSize);
+
+    slot.sequence.store(2 * (idx + 1), std::memory_order_release);
+}
+
+//Nothing here may allocate or lock: it runs in signal handlers
+
+static void writeAllTo(int fd, const char * data, size_t size) noexcept {
+    while (size) {
+        auto res = ::write(fd, data, size);
+        if (res < 0) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        data += res;
+        size -= size_t(res);
+    }
+}
+
+template<size_t N, class... Args>
+static void formatTo(std::array<char, N> & buf, size_t & used, fmt::format_string<Args...> format, Args && ...args) noexcept {
+    try {
+        auto res = fmt::format_to_n(buf.data() + used, buf.size() - used, format, std::forward<Args>(args)...);
+        used = std::min(buf.size(), used + res.size);
+    } catch(...) {
+        //cannot happen with the formats used here
+    }
+}
+
+//gmtime_r is not async-signal-safe, this is Howard Hinnant's civil_from_days
+template<size_t N>
+static void formatUtcTime(std::array<char, N> & buf, size_t & used, int64_t timeNs) noexcept {
+
+    constexpr int64_t nsPerDay = 86'400'000'000'000;
+    auto days = timeNs / nsPerDay;
+    auto nsOfDay = timeNs % nsPerDay;
+    if (nsOfDay < 0) {
+        nsOfDay += nsPerDay;
+        --days;
+    }
+
+    days += 719468;
+    auto era = (days >= 0 ? days : days - 146096) / 146097;
+    auto dayOfEra = days - era * 146097;                                                //[0, 146096]
+    auto yearOfEra = (dayOfEra - dayOfEra / 1460 + dayOfEra / 36524 - dayOfEra / 146096) / 365;  //[0, 399]
+    auto dayOfYear = dayOfEra - (365 * yearOfEra + yearOfEra / 4 - yearOfEra / 100);    //[0, 365]
+    auto monthFromMarch = (5 * dayOfYear + 2) / 153;                                    //[0, 11]
+    auto day = dayOfYear - (153 * monthFromMarch + 2) / 5 + 1;                          //[1, 31]
+    auto month = monthFromMarch < 10 ? monthFromMarch + 3 : monthFromMarch - 9;         //[1, 12]
+    auto year = yearOfEra + era * 400 + (month <= 2);
+
+    auto secOfDay = nsOfDay / 1'000'000'000;
+    formatTo(buf, used, "{:04}-{:02}-{:02}T{:02}:{:02}:{:02}.{:06}Z",
+             year, month, day, secOfDay / 3600, secOfDay / 60 % 60, secOfDay % 60, nsOfDay % 1'000'000'000 / 1000);
+}
+
+static void writeRecord(int fd, const FlightRecord & rec) noexcept {
+
+    std::array<char, 640> line;
+    size_t used = 0;
+
+    formatUtcTime(line, used, rec.timeNs);
+    formatTo(line, used, " if={} {}", rec.ifIndex, g_flightEventNames[size_t(rec.event)]);
+    if (rec.event == FlightEvent::Request)
+        formatTo(line, used, " {}", wsdActionName(rec.action));
+    if (rec.addrSize) {
+        char addr[INET6_ADDRSTRLEN] = {};
+        bool isV4 = (rec.addrSize == 4);
+        inet_ntop(isV4 ? AF_INET : AF_INET6, rec.addr.data(), addr, sizeof(addr));
+        if (rec.port && isV4)
+            formatTo(line, used, " addr={}:{}", std::string_view(addr), rec.port);
+        else if (rec.port)
+            formatTo(line, used, " addr=[{}]:{}", std::string_view(addr), rec.port);
+        else
+            formatTo(line, used, " addr={}", std::string_view(addr));
+    }
+    if (rec.bytesIn)
+        formatTo(line, used, " in={}", rec.bytesIn);
+    if (rec.bytesOut)
+        formatTo(line, used, " out={}", rec.bytesOut);
+    formatTo(line, used, " {}", g_flightOutcomeNames[size_t(rec.outcome)]);
+    if (rec.payloadSize) {
+        formatTo(line, used, " payload=\"");
+        for (size_t i = 0; i < rec.payloadSize; ++i) {
+            auto c = uint8_t(rec.payload[i]);
+            if (c >= 0x20 && c < 0x7F && c != '"' && c != '\\')
+                formatTo(line, used, "{}", char(c));
+            else
+                formatTo(line, used, "\\x{:02X}", c);
+        }
+        formatTo(line, used, "\"");
+    }
+    formatTo(line, used, "\n");
+    writeAllTo(fd, line.data(), used);
+}
+
+void FlightRecorder::dump(const char * reason) noexcept {
+
+    int fd = g_flightDumpFd.load(std::memory_order_acquire);
+    if (fd < 0)
+        fd = STDERR_FILENO;
+
+    auto end = g_flightNext.load(std::memory_order_acquire);
+    auto start = end > capacity ? end - capacity : 0;
+
+    std::array<char, 256> header;
+    size_t used = 0;
+    formatTo(header, used, "---- flight recorder dump ({}), pid {}, last {} events ----\n",
+             std::string_view(reason), getpid(), end - start);
+    writeAllTo(fd, header.data(), used);
+
+    for (auto idx = start; idx < end; ++idx) {
+        auto & slot = g_flightSlots[idx % capacity];
+        auto sequence = slot.sequence.load(std::memory_order_acquire);
+        if (sequence != 2 * (idx + 1))
+            continue;
+        //a torn copy is detected and discarded below
+        FlightRecord rec;
+        memcpy(&rec, &slot.record, sizeof(rec));
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.sequence.load(std::memory_order_relaxed) != sequence)
+            continue;
+        writeRecord(fd, rec);
+    }
+
+    static constexpr std::string_view footer = "---- end of flight recorder dump ----\n";
+    writeAllTo(fd, footer.data(), footer.size());
+}
+
+void FlightRecorder::dumpAfterError(const char * reason) noexcept {
+
+    auto now = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    auto last = g_lastErrorDumpNs.load(std::memory_order_relaxed);
+    do {
+        if (last != 0 && now - last < std::chrono::nanoseconds(std::chrono::minutes(1)).count())
+            return;
+    } while(!g_lastErrorDumpNs.compare_exchange_weak(last, now, std::memory_order_relaxed));
+    dump(reason);
+}
+
+void FlightRecorder::setDumpFile(ptl::FileDescriptor fd) noexcept {
+
+    int newFd = fd.get();
+    fd.detach();
+    int oldFd = g_flightDumpFd.exchange(newFd, std::memory_order_acq_rel);
+    if (oldFd >= 0)
+        ::close(oldFd);
+}
+
+static void crashHandler(int sig) {
+
+    std::array<char, 32> reason;
+    size_t used = 0;
+    formatTo(reason, used, "signal {}", sig);
+    reason[std::min(used, reason.size() - 1)] = 0;
+    FlightRecorder::dump(reason.data());
+    //the handler has been reset to default, this takes effect once we return
+    raise(sig);
+}
+
+void FlightRecorder::installCrashHandlers() {
+
+    struct sigaction act{};
+    act.sa_handler = crashHandler;
+    sigemptyset(&act.sa_mask);
+    act.sa_flags = SA_RESETHAND;
+    for (int sig: {SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT}) {
+        if (sigaction(sig, &act, nullptr) != 0)
+            throw std::system_error(errno, std::system_category(), "sigaction() failed");
+    }
+}
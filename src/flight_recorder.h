@@ -0,0 +1,76 @@
+// Copyright (c) 2022, Eugene Gershnik
+// SPDX-License-Identifier: BSD-3-Clause
+
+#ifndef HEADER_FLIGHT_RECORDER_H_INCLUDED
+#define HEADER_FLIGHT_RECORDER_H_INCLUDED
+
+#include "metrics.h"
+
+/*
+ Always-on in-memory history of recent protocol events, for finding out what led to a
+ problem in the field without running with trace logging.
+
+ Events are fixed size binary records in a ring of the last FlightRecorder::capacity of
+ them. Recording one takes a slot with an atomic increment and copies about a hundred
+ bytes, so it can be done from any thread on every message. Only failures, such as
+ malformed requests, capture the first payloadCapacity bytes of what was received: the
+ beginning of a valid SOAP envelope says nothing.
+
+ The ring is written out as text on SIGUSR1, after fatal network errors, on exceptions
+ that stop the process and on crashes. Dumping only uses memory it owns and write(2) so
+ it is safe in a signal handler. Records being written while a dump runs are skipped.
+ */
+
+enum class FlightEvent : uint8_t {
+    UdpReceived,    //datagram read and parsed
+    UdpSent,        //first copy of a datagram sent or failed
+    HttpRequest,    //HTTP request read, successfully or not
+    Request,        //WSD message handled, action is set
+    ServerAdded,
+    ServerRemoved,
+    FatalError      //error that stopped a server
+};
+
+enum class FlightOutcome : uint8_t {
+    Ok,
+    Truncated,
+    Malformed,
+    Duplicate,      //MessageID seen before
+    Ignored,        //well formed but not acted upon
+    Replied,
+    Rejected,       //error response sent
+    Failed
+};
+
+//What a caller describes. Which fields matter depends on the event
+struct FlightEntry {
+    FlightEvent event;
+    FlightOutcome outcome = FlightOutcome::Ok;
+    unsigned ifIndex = 0;
+    WsdAction action = WsdAction::Other;
+    size_t bytesIn = 0;
+    size_t bytesOut = 0;
+};
+
+class FlightRecorder {
+public:
+    static constexpr size_t capacity = 1024;
+    static constexpr size_t payloadCapacity = 64;
+
+    static void record(const FlightEntry & entry, const ip::address & peer = {}, uint16_t port = 0,
+                       const void * payload = nullptr, size_t payloadSize = 0) noexcept;
+
+    //Writes the recorded events to the dump file, or standard error if there isn't one
+    static void dump(const char * reason) noexcept;
+    //Same but does nothing if there was an automatic dump within the last minute, so that
+    //many servers failing at once produce one dump
+    static void dumpAfterError(const char * reason) noexcept;
+
+    //Takes ownership. An invalid descriptor means standard error
+    static void setDumpFile(ptl::FileDescriptor fd) noexcept;
+
+    //Dumps on SIGSEGV, SIGBUS, SIGILL, SIGFPE and SIGABRT before letting the signal kill us
+    static void installCrashHandlers();
+};
+
+#endif
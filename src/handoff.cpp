@@ -0,0 +1,414 @@
+// Copyright (c) 2022, Eugene Gershnik
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "handoff.h"
+#include "sys_util.h"
+
+static constexpr const char * g_handoffChannelVariable = "WSDDN_HANDOFF_FD";
+static constexpr const char * g_watchdogPidVariable = "WATCHDOG_PID";
+//well below SCM_MAX_FD and friends on all platforms
+static constexpr size_t g_maxDescriptorsPerMessage = 64;
+static constexpr uint32_t g_maxHandoffSize = 16 * 1024 * 1024;
+
+static std::mutex g_installedMutex;
+static refcnt_ptr<SocketHandoff> g_installed;
+
+/*
+ Wire format: a header of two native endian uint32_t - the size of TOML body and the number of
+ descriptors, followed by the body, followed by the descriptors in batches each attached to a
+ single dummy byte. The body refers to descriptors by their index.
+ */
+
+static void sendAll(const ptl::FileDescriptor & channel, const void * data, size_t size) {
+    auto * ptr = static_cast<const std::byte *>(data);
+    while (size) {
+        ptl::AllowedErrors<EINTR> ec;
+        auto written = size_t(writeFile(channel, ptr, size, ec));
+        if (ec)
+            continue;
+        ptr += written;
+        size -= written;
+    }
+}
+
+static void receiveAll(const ptl::FileDescriptor & channel, void * data, size_t size) {
+    auto * ptr = static_cast<std::byte *>(data);
+    while (size) {
+        ptl::AllowedErrors<EINTR> ec;
+        auto read = size_t(readFile(channel, ptr, size, ec));
+        if (ec)
+            continue;
+        if (read == 0)
+            throw std::runtime_error("handoff channel closed prematurely");
+        ptr += read;
+        size -= read;
+    }
+}
+
+static void sendDescriptors(const ptl::FileDescriptor & channel, const int * first, size_t count) {
+
+    alignas(cmsghdr) uint8_t control[CMSG_SPACE(g_maxDescriptorsPerMessage * sizeof(int))];
+    while (count) {
+        size_t batch = std::min(count, g_maxDescriptorsPerMessage);
+
+        char dummy = 0;
+        iovec iov[] = {{&dummy, 1}};
+        msghdr msg{};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = std::size(iov);
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(batch * sizeof(int));
+
+        auto * cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(batch * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), first, batch * sizeof(int));
+
+        while (::sendmsg(channel.get(), &msg, 0) < 0) {
+            if (errno != EINTR)
+                ptl::throwErrorCode(errno, "sendmsg(SCM_RIGHTS)");
+        }
+        first += batch;
+        count -= batch;
+    }
+}
+
+static auto receiveDescriptors(const ptl::FileDescriptor & channel, size_t count) -> std::vector<ptl::FileDescriptor> {
+
+    std::vector<ptl::FileDescriptor> ret;
+    ret.reserve(count);
+
+    alignas(cmsghdr) uint8_t control[CMSG_SPACE(g_maxDescriptorsPerMessage * sizeof(int))];
+    int flags = 0;
+#ifdef MSG_CMSG_CLOEXEC
+    flags |= MSG_CMSG_CLOEXEC;
+#endif
+    while (ret.size() < count) {
+        char dummy;
+        iovec iov[] = {{&dummy, 1}};
+        msghdr msg{};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = std::size(iov);
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        ssize_t res;
+        while ((res = ::recvmsg(channel.get(), &msg, flags)) < 0) {
+            if (errno != EINTR)
+                ptl::throwErrorCode(errno, "recvmsg(SCM_RIGHTS)");
+        }
+        if (res == 0)
+            throw std::runtime_error("handoff channel closed prematurely");
+
+        size_t received = 0;
+        for (cmsghdr * cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+                continue;
+            size_t fdCount = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (size_t i = 0; i < fdCount; ++i) {
+                int fd;
+                memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+                ret.emplace_back(fd);
+            #ifndef MSG_CMSG_CLOEXEC
+                setCloseOnExec(ret.back(), true);
+            #endif
+            }
+            received += fdCount;
+        }
+        if (msg.msg_flags & MSG_CTRUNC)
+            throw std::runtime_error("handoff descriptors were truncated");
+        if (received == 0)
+            throw std::runtime_error("handoff message carries no descriptors");
+    }
+    if (ret.size() != count)
+        throw std::runtime_error("unexpected number of handoff descriptors");
+    return ret;
+}
+
+auto SocketHandoff::startSuccessor(const std::vector<std::string> & args) -> std::pair<pid_t, ptl::FileDescriptor> {
+
+    auto [ours, theirs] = createSocketPair();
+
+    //only the successor's end is inherited
+    setCloseOnExec(theirs, false);
+    setenv(g_handoffChannelVariable, std::to_string(theirs.get()).c_str(), 1);
+    //systemd's watchdog is meant for our pid but the successor becomes the main process
+    //and must feed it. Without the variable it does, just like sd_watchdog_enabled()
+    std::optional<std::string> watchdogPid;
+    if (auto * value = getenv(g_watchdogPidVariable)) {
+        watchdogPid = value;
+        unsetenv(g_watchdogPidVariable);
+    }
+    auto restoreEnvironment = [&]() {
+        unsetenv(g_handoffChannelVariable);
+        if (watchdogPid)
+            setenv(g_watchdogPidVariable, watchdogPid->c_str(), 1);
+    };
+    pid_t pid;
+    try {
+        pid = spawnDetached(args);
+    } catch(...) {
+        restoreEnvironment();
+        throw;
+    }
+    restoreEnvironment();
+    return {pid, std::move(ours)};
+}
+
+auto SocketHandoff::receiveFromPredecessor() -> refcnt_ptr<SocketHandoff> {
+
+    auto * value = getenv(g_handoffChannelVariable);
+    if (!value)
+        return nullptr;
+
+    //copy before unsetenv invalidates it
+    std::string str(value);
+    int fd = -1;
+    auto res = std::from_chars(str.data(), str.data() + str.size(), fd);
+    unsetenv(g_handoffChannelVariable);
+    if (res.ec != std::errc{} || res.ptr != str.data() + str.size() || fd < 0)
+        throw std::runtime_error(fmt::format("invalid value of {}: {}", g_handoffChannelVariable, str));
+
+    ptl::FileDescriptor channel(fd);
+    setCloseOnExec(channel, true);
+    return receive(channel);
+}
+
+void SocketHandoff::send(const ptl::FileDescriptor & channel) const {
+
+    std::lock_guard lock(m_mutex);
+
+    std::vector<int> fds;
+    auto addDescriptor = [&](const ptl::FileDescriptor & fd) {
+        fds.push_back(fd.get());
+        return int64_t(fds.size() - 1);
+    };
+
+    auto str = [](const sys_string & val) {
+        return std::string(sys_string::char_access(val).c_str());
+    };
+
+    toml::table body;
+    body.insert("instance-id", int64_t(m_instanceIdentifier));
+    body.insert("endpoint-id", str(m_endpointIdentifier));
+
+    toml::array servers;
+    for (auto & [key, server]: m_servers) {
+        auto & [iface, addr] = key;
+        toml::table entry;
+        entry.insert("interface", str(iface.name));
+        entry.insert("interface-index", int64_t(iface.index));
+        entry.insert("address", addr.to_string());
+        toml::array udpSockets;
+        for (auto & fd: server.udpSockets)
+            udpSockets.push_back(addDescriptor(fd));
+        entry.insert("udp-sockets", std::move(udpSockets));
+        if (server.state) {
+            entry.insert("message-number", int64_t(server.state->messageNumber));
+            toml::array knownMessages;
+            for (auto & id: server.state->knownMessageIds)
+                knownMessages.push_back(str(id));
+            entry.insert("known-messages", std::move(knownMessages));
+            entry.insert("http-active", server.state->httpActive);
+        }
+        servers.push_back(std::move(entry));
+    }
+    body.insert("servers", std::move(servers));
+
+    toml::array httpListeners;
+    for (auto & [endpoint, fd]: m_httpListeners) {
+        toml::table entry;
+        entry.insert("address", endpoint.address().to_string());
+        entry.insert("port", int64_t(endpoint.port()));
+        entry.insert("socket", addDescriptor(fd));
+        httpListeners.push_back(std::move(entry));
+    }
+    body.insert("http-listeners", std::move(httpListeners));
+
+    std::ostringstream out;
+    out << body;
+    auto bodyStr = std::move(out).str();
+
+    uint32_t header[2] = {uint32_t(bodyStr.size()), uint32_t(fds.size())};
+    sendAll(channel, header, sizeof(header));
+    sendAll(channel, bodyStr.data(), bodyStr.size());
+    sendDescriptors(channel, fds.data(), fds.size());
+}
+
+auto SocketHandoff::receive(const ptl::FileDescriptor & channel) -> refcnt_ptr<SocketHandoff> {
+
+    uint32_t header[2];
+    receiveAll(channel, header, sizeof(header));
+    if (header[0] > g_maxHandoffSize)
+        throw std::runtime_error("handoff message is too big");
+    std::string bodyStr(header[0], '\0');
+    receiveAll(channel, bodyStr.data(), bodyStr.size());
+    auto fds = receiveDescriptors(channel, header[1]);
+
+    auto body = toml::parse(bodyStr);
+
+    auto takeDescriptor = [&](const toml::node * node) {
+        auto idx = node ? node->value<int64_t>() : std::nullopt;
+        if (!idx || *idx < 0 || size_t(*idx) >= fds.size() || !fds[size_t(*idx)])
+            throw std::runtime_error("invalid descriptor reference in handoff");
+        return std::move(fds[size_t(*idx)]);
+    };
+    auto getString = [](const toml::table & table, std::string_view key) {
+        auto val = table[key].value<std::string>();
+        if (!val)
+            throw std::runtime_error(fmt::format("missing {} in handoff", key));
+        return std::move(*val);
+    };
+    auto getInt = [](const toml::table & table, std::string_view key) {
+        auto val = table[key].value<int64_t>();
+        if (!val)
+            throw std::runtime_error(fmt::format("missing {} in handoff", key));
+        return *val;
+    };
+
+    auto ret = make_refcnt<SocketHandoff>(size_t(getInt(body, "instance-id")), sys_string(getString(body, "endpoint-id")));
+
+    if (auto * servers = body["servers"].as_array()) {
+        for (auto & serverNode: *servers) {
+            auto * entry = serverNode.as_table();
+            if (!entry)
+                throw std::runtime_error("invalid server entry in handoff");
+            NetworkInterface iface(int(getInt(*entry, "interface-index")), sys_string(getString(*entry, "interface")));
+            auto addr = ip::make_address(getString(*entry, "address"));
+
+            Server server;
+            if (auto * udpSockets = (*entry)["udp-sockets"].as_array()) {
+                for (auto & fdNode: *udpSockets)
+                    server.udpSockets.push_back(takeDescriptor(&fdNode));
+            }
+            if (entry->contains("message-number")) {
+                ServerState state;
+                state.messageNumber = size_t(getInt(*entry, "message-number"));
+                if (auto * knownMessages = (*entry)["known-messages"].as_array()) {
+                    for (auto & idNode: *knownMessages) {
+                        if (auto id = idNode.value<std::string>())
+                            state.knownMessageIds.emplace_back(*id);
+                    }
+                }
+                state.httpActive = (*entry)["http-active"].value_or(false);
+                server.state = std::move(state);
+            }
+            ret->m_servers.insert_or_assign(ServerKey(iface, addr), std::move(server));
+        }
+    }
+
+    if (auto * httpListeners = body["http-listeners"].as_array()) {
+        for (auto & listenerNode: *httpListeners) {
+            auto * entry = listenerNode.as_table();
+            if (!entry)
+                throw std::runtime_error("invalid HTTP listener entry in handoff");
+            ip::tcp::endpoint endpoint(ip::make_address(getString(*entry, "address")), uint16_t(getInt(*entry, "port")));
+            ret->m_httpListeners.insert_or_assign(endpoint, takeDescriptor((*entry).get("socket")));
+        }
+    }
+
+    return ret;
+}
+
+void SocketHandoff::addServer(const NetworkInterface & iface, const ip::address & addr,
+                              ServerState && state, std::vector<ptl::FileDescriptor> && udpSockets) {
+
+    //nothing else we start may inherit them
+    for (auto & fd: udpSockets)
+        setCloseOnExec(fd, true);
+
+    std::lock_guard lock(m_mutex);
+    m_servers.insert_or_assign(ServerKey(iface, addr), Server{std::move(state), std::move(udpSockets)});
+}
+
+void SocketHandoff::addHttpListener(const ip::tcp::endpoint & endpoint, ptl::FileDescriptor && socket) {
+
+    setCloseOnExec(socket, true);
+
+    std::lock_guard lock(m_mutex);
+    m_httpListeners.insert_or_assign(endpoint, std::move(socket));
+}
+
+auto SocketHandoff::serverCount() const -> size_t {
+    std::lock_guard lock(m_mutex);
+    return m_servers.size();
+}
+
+void SocketHandoff::forgetProtocolState() {
+    std::lock_guard lock(m_mutex);
+    for (auto & [_, server]: m_servers)
+        server.state.reset();
+}
+
+void SocketHandoff::install(const refcnt_ptr<SocketHandoff> & handoff) {
+    std::lock_guard lock(g_installedMutex);
+    g_installed = handoff;
+}
+
+auto SocketHandoff::isInstalled() -> bool {
+    std::lock_guard lock(g_installedMutex);
+    return bool(g_installed);
+}
+
+auto SocketHandoff::takeUdpSockets(const NetworkInterface & iface, const ip::address & addr) -> std::optional<std::vector<ptl::FileDescriptor>> {
+
+    std::lock_guard lock(g_installedMutex);
+    if (!g_installed)
+        return std::nullopt;
+
+    std::lock_guard innerLock(g_installed->m_mutex);
+    auto it = g_installed->m_servers.find(ServerKey(iface, addr));
+    if (it == g_installed->m_servers.end() || it->second.udpSockets.empty())
+        return std::nullopt;
+    auto ret = std::move(it->second.udpSockets);
+    it->second.udpSockets.clear();
+    return ret;
+}
+
+auto SocketHandoff::takeServerState(const NetworkInterface & iface, const ip::address & addr) -> std::optional<ServerState> {
+
+    std::lock_guard lock(g_installedMutex);
+    if (!g_installed)
+        return std::nullopt;
+
+    std::lock_guard innerLock(g_installed->m_mutex);
+    auto it = g_installed->m_servers.find(ServerKey(iface, addr));
+    if (it == g_installed->m_servers.end())
+        return std::nullopt;
+    auto ret = std::move(it->second.state);
+    g_installed->m_servers.erase(it);
+    return ret;
+}
+
+auto SocketHandoff::takeHttpListener(const ip::tcp::endpoint & endpoint) -> std::optional<ptl::FileDescriptor> {
+
+    std::lock_guard lock(g_installedMutex);
+    if (!g_installed)
+        return std::nullopt;
+
+    std::lock_guard innerLock(g_installed->m_mutex);
+    auto node = g_installed->m_httpListeners.extract(endpoint);
+    if (!node)
+        return std::nullopt;
+    return std::move(node.mapped());
+}
+
+void SocketHandoff::uninstall(bool logUnclaimed) {
+
+    refcnt_ptr<SocketHandoff> handoff;
+    {
+        std::lock_guard lock(g_installedMutex);
+        handoff = std::move(g_installed);
+    }
+    if (!handoff || !logUnclaimed)
+        return;
+
+    std::lock_guard lock(handoff->m_mutex);
+    for (auto & [key, server]: handoff->m_servers) {
+        if (!server.udpSockets.empty())
+            WSDLOG_INFO("Closing sockets for interface {}, addr {} not claimed after handoff", key.first, key.second.to_string());
+    }
+    for (auto & [endpoint, _]: handoff->m_httpListeners)
+        WSDLOG_INFO("Closing HTTP listener on {} not claimed after handoff", endpoint.address().to_string());
+}
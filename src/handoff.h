@@ -0,0 +1,83 @@
+// Copyright (c) 2022, Eugene Gershnik
+// SPDX-License-Identifier: BSD-3-Clause
+
+#ifndef HEADER_HANDOFF_H_INCLUDED
+#define HEADER_HANDOFF_H_INCLUDED
+
+#include "util.h"
+
+/*
+ Sockets and protocol state passed from a running instance to the one replacing it.
+
+ The outgoing instance collects them from its servers, which stop without saying Bye,
+ and sends them over a Unix socket: descriptors via SCM_RIGHTS, everything else as TOML.
+ The incoming instance installs them before creating its servers. Servers then adopt
+ matching sockets instead of opening new ones (so multicast memberships and queued
+ datagrams survive) and continue the message sequence instead of saying Hello.
+ */
+class SocketHandoff : public ref_counted<SocketHandoff> {
+    friend ref_counted<SocketHandoff>;
+public:
+    struct ServerState {
+        size_t messageNumber = 0;
+        //oldest first
+        std::vector<sys_string> knownMessageIds;
+        bool httpActive = false;
+    };
+public:
+    SocketHandoff(size_t instanceIdentifier, sys_string endpointIdentifier):
+        m_instanceIdentifier(instanceIdentifier),
+        m_endpointIdentifier(std::move(endpointIdentifier)) {
+    }
+
+    //Starts a new process with the channel to send the handoff to. Returns its pid and our end of the channel
+    static auto startSuccessor(const std::vector<std::string> & args) -> std::pair<pid_t, ptl::FileDescriptor>;
+    //Returns the handoff if this process has been started by startSuccessor() or nullptr otherwise
+    static auto receiveFromPredecessor() -> refcnt_ptr<SocketHandoff>;
+
+    static auto receive(const ptl::FileDescriptor & channel) -> refcnt_ptr<SocketHandoff>;
+    void send(const ptl::FileDescriptor & channel) const;
+
+    //These can be called from any thread
+    void addServer(const NetworkInterface & iface, const ip::address & addr,
+                   ServerState && state, std::vector<ptl::FileDescriptor> && udpSockets);
+    void addHttpListener(const ip::tcp::endpoint & endpoint, ptl::FileDescriptor && socket);
+
+    auto instanceIdentifier() const -> size_t               { return m_instanceIdentifier; }
+    auto endpointIdentifier() const -> const sys_string &   { return m_endpointIdentifier; }
+    auto serverCount() const -> size_t;
+
+    //Keeps the sockets but makes servers announce themselves as if they were new
+    void forgetProtocolState();
+
+    //Makes the handoff available to servers created from now on. The take functions
+    //below return nothing if there is no installed handoff or it has nothing matching
+    static void install(const refcnt_ptr<SocketHandoff> & handoff);
+    static auto isInstalled() -> bool;
+    static auto takeUdpSockets(const NetworkInterface & iface, const ip::address & addr) -> std::optional<std::vector<ptl::FileDescriptor>>;
+    static auto takeServerState(const NetworkInterface & iface, const ip::address & addr) -> std::optional<ServerState>;
+    static auto takeHttpListener(const ip::tcp::endpoint & endpoint) -> std::optional<ptl::FileDescriptor>;
+    //Closes whatever has not been claimed by now, logging it if requested
+    static void uninstall(bool logUnclaimed);
+
+private:
+    ~SocketHandoff() noexcept {
+    }
+
+private:
+    using ServerKey = std::pair<NetworkInterface, ip::address>;
+
+    struct Server {
+        std::optional<ServerState> state;
+        std::vector<ptl::FileDescriptor> udpSockets;
+    };
+
+    const size_t m_instanceIdentifier;
+    const sys_string m_endpointIdentifier;
+
+    mutable std::mutex m_mutex;
+    std::map<ServerKey, Server> m_servers;
+    std::map<ip::tcp::endpoint, ptl::FileDescriptor> m_httpListeners;
+};
+
+#endif
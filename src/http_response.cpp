@@ -140,6 +140,16 @@ auto HttpResponse::makeReply(XmlCharBuffer && xml) -> HttpResponse {
     return ret;
 }
 
+auto HttpResponse::makeTextReply(sys_string text, const sys_string & contentType) -> HttpResponse {
+    HttpResponse ret(Ok);
+    
+    ret.m_headers.reserve(2);
+    ret.addHeader(S("Content-Type"), contentType);
+    ret.addHeader(S("Content-Length"), std::to_string(text.storage_size()));
+    ret.m_content = std::move(text);
+    return ret;
+}
+
 void HttpResponse::addHeader(const sys_string & name, const sys_string & value) {
 
     sys_string_builder builder;
@@ -37,6 +37,7 @@ public:
     }
     static auto makeStockResponse(Status status) -> HttpResponse;
     static auto makeReply(XmlCharBuffer && xml) -> HttpResponse;
+    static auto makeTextReply(sys_string text, const sys_string & contentType) -> HttpResponse;
 
     void addHeader(const sys_string & name, const sys_string & value);
 
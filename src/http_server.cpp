@@ -4,6 +4,12 @@
 #include "http_server.h"
 #include "http_request_parser.h"
 #include "http_response.h"
+#include "metrics.h"
+#include "latency.h"
+#include "tracing.h"
+#include "log_fields.h"
+#include "log_limiter.h"
+#include "flight_recorder.h"
 #include "xml_wrapper.h"
 #include "util.h"
 #include "exc_handling.h"
@@ -13,7 +19,7 @@ using namespace sysstr;
 
 namespace ip = asio::ip;
 
-class HttpServerImpl;
+class HttpListener;
 
 static constexpr size_t g_httpMaxConnectionsFromSameAddress = 20;
 static constexpr size_t g_httpMaxContentLength = 256 * 1024;
@@ -33,22 +39,33 @@ private:
         Done
     };
 public:
-    HttpConnection(const refcnt_ptr<Config> & config, ip::tcp::socket && socket):
+    HttpConnection(const refcnt_ptr<Config> & config, ip::tcp::socket && socket, const ip::address & routeAddr,
+                   int ifIndex, ServerMetrics * metrics):
         m_config(config),
         m_socket(std::move(socket)),
         m_remoteAddr(m_socket.remote_endpoint().address()),
-        m_startTime(std::chrono::steady_clock::now())
+        m_routeAddr(routeAddr),
+        m_ifIndex(ifIndex),
+        m_startTime(std::chrono::steady_clock::now()),
+        m_metrics(metrics)
     {}
 
-    void start(HttpServerImpl & owner);
+    void start(HttpListener & owner);
     void stop();
 
     auto remoteAddress() const -> const ip::address & {
         return m_remoteAddr;
     }
+    auto routeAddress() const -> const ip::address & {
+        return m_routeAddr;
+    }
     auto startTime() const -> const std::chrono::steady_clock::time_point & {
         return m_startTime;
     }
+    //nullptr for connections to the metrics endpoint itself
+    auto metrics() const -> ServerMetrics * {
+        return m_metrics;
+    }
 private:
     ~HttpConnection() noexcept {
     }
@@ -64,10 +81,13 @@ private:
     refcnt_ptr<Config> m_config;
     ip::tcp::socket m_socket;
     ip::address m_remoteAddr;
+    ip::address m_routeAddr;
+    int m_ifIndex;
     std::chrono::steady_clock::time_point m_startTime;
+    ServerMetrics * m_metrics;
     sys_string m_connDesc;
     
-    HttpServerImpl * m_owner = nullptr;
+    HttpListener * m_owner = nullptr;
     bool m_stopRequested = false;
     std::array<std::byte, 8192> m_readBuffer;
 
@@ -75,90 +95,331 @@ private:
     HttpRequestParser m_headerParser;
     HttpRequest m_request;
     HttpResponse m_response;
+    size_t m_contentLength = 0;
     size_t m_contentRemaining = 0;
     bool m_keepAlive = false;
     std::unique_ptr<XmlParserContext> m_contentParser;
+    //when the first bytes of the current request arrived
+    std::optional<std::chrono::steady_clock::time_point> m_requestStart;
+    std::chrono::steady_clock::duration m_bodyParseTime{};
 };
 
-class HttpServerImpl : public HttpServer {
+/*
+ Owns a listening socket and the connections accepted on it. Requests are routed
+ to a handler by the connection's local address. A dedicated listener is bound to
+ a single address and has exactly one route. A shared listener is bound to the 
+ wildcard address of its family and serves every WSD server of that family.
+ A metrics listener answers GET /metrics instead of WSD requests.
+*/
+class HttpListener : public ref_counted<HttpListener> {
+    friend ref_counted<HttpListener>;
+public:
+    enum Kind {
+        Dedicated,
+        Shared,
+        MetricsOnly
+    };
 public:
-    HttpServerImpl(asio::io_context & ctxt, const refcnt_ptr<Config> & config,
-                   const NetworkInterface & iface, const ip::tcp::endpoint & endpoint);
+    HttpListener(const Strand & strand, const refcnt_ptr<Config> & config,
+                 const ip::tcp::endpoint & endpoint, Kind kind, sys_string serverDesc);
 
-    void start(Handler & handler) override {
-        WSDLOG_INFO("{}: starting server", m_serverDesc);
-        m_handler = &handler;
-        accept();
-    }
-    
-    void stop() override {
-        WSDLOG_INFO("{}: stopping server", m_serverDesc);
-        m_handler = nullptr;
-        m_acceptor.close();
-        m_gcTimer.cancel();
-        for(auto & con: m_connections) {
-            con->stop();
-        }
-        m_connections.clear();
-    }
+    void addRoute(const ip::address & localAddr, int ifIndex, HttpServer::Handler & handler, ServerMetrics * metrics);
+    void removeRoute(const ip::address & localAddr);
+    void stop();
+    void handOff(SocketHandoff & dest);
 
-    auto handleHttpRequest(std::unique_ptr<XmlDoc> doc) -> std::optional<XmlCharBuffer>;
+    auto handleHttpRequest(const ip::address & routeAddr, const ip::address & peer, std::unique_ptr<XmlDoc> doc) -> std::optional<XmlCharBuffer>;
     void onConnectionFinished(const refcnt_ptr<HttpConnection> & con);
 
     auto serverDesc() const -> const sys_string & 
         { return m_serverDesc; }
-private:
-    void accept();
-    void scheduleGC();
+    auto servesMetrics() const -> bool
+        { return m_kind == MetricsOnly; }
 
+    static auto getShared(const Strand & strand, const refcnt_ptr<Config> & config, bool isV6) -> refcnt_ptr<HttpListener>;
 private:
-    ~HttpServerImpl() noexcept {
+    ~HttpListener() noexcept {
+        unregisterShared();
+    }
+
+    void unregisterShared() {
+        if (m_kind == Shared && s_shared[m_isV6] == this)
+            s_shared[m_isV6] = nullptr;
     }
 
+    void open();
+    void accept();
+    void scheduleGC();
+    void notifyFatalError();
+    auto findRoute(const ip::address & localAddr) const -> std::optional<ip::address>;
+
     void handleConnection(ip::tcp::socket && socket);
 private:
+    struct Route {
+        HttpServer::Handler * handler;
+        int ifIndex;
+        ServerMetrics * metrics;
+    };
+    
     refcnt_ptr<Config> m_config;
-    Handler * m_handler = nullptr;
+    ip::tcp::endpoint m_endpoint;
     ip::tcp::acceptor m_acceptor;
     asio::steady_timer m_gcTimer;
     sys_string m_serverDesc;
+    Kind m_kind;
+    bool m_isV6;
+    //bumped on every stop so that completions from before it are ignored
+    unsigned m_generation = 0;
 
+    std::map<ip::address, Route> m_routes;
     std::set<refcnt_ptr<HttpConnection>> m_connections;
+
+    //Servers using shared listeners all run on one strand, so no locking is needed
+    static inline std::array<HttpListener *, 2> s_shared = {nullptr, nullptr};
 };
 
-auto createHttpServer(asio::io_context & ctxt, 
+class HttpServerImpl : public HttpServer {
+public:
+    HttpServerImpl(const Strand & strand, const refcnt_ptr<Config> & config,
+                   const NetworkInterface & iface, const ip::tcp::endpoint & endpoint):
+        m_address(endpoint.address()),
+        m_ifIndex(iface.index),
+        m_listener(make_refcnt<HttpListener>(strand, config, endpoint, HttpListener::Dedicated, 
+                                             sys_format("HTTP on {}({})", iface.name, endpoint.address().is_v6() ? "v6" : "v4"))),
+        m_metrics(&Metrics::forServer(iface.name, endpoint.address().is_v6())) {
+    }
+    
+    HttpServerImpl(const Strand & strand, const refcnt_ptr<Config> & config, const ip::tcp::endpoint & endpoint):
+        m_address(endpoint.address()),
+        m_ifIndex(0),
+        m_listener(make_refcnt<HttpListener>(strand, config, endpoint, HttpListener::MetricsOnly, 
+                                             sys_format("Metrics HTTP on {}", makeHttpUrl(endpoint)))),
+        m_metrics(nullptr) {
+    }
+
+    void start(Handler & handler) override {
+        WSDLOG_INFO("{}: starting server", m_listener->serverDesc());
+        m_listener->addRoute(m_address, m_ifIndex, handler, m_metrics);
+    }
+    
+    void stop() override {
+        WSDLOG_INFO("{}: stopping server", m_listener->serverDesc());
+        m_listener->stop();
+    }
+
+    void handOff(SocketHandoff & dest) override {
+        WSDLOG_INFO("{}: handing off listener", m_listener->serverDesc());
+        m_listener->handOff(dest);
+    }
+
+private:
+    ~HttpServerImpl() noexcept {
+    }
+
+private:
+    ip::address m_address;
+    int m_ifIndex;
+    refcnt_ptr<HttpListener> m_listener;
+    ServerMetrics * m_metrics;
+};
+
+class SharedHttpServer : public HttpServer {
+public:
+    SharedHttpServer(const Strand & strand, const refcnt_ptr<Config> & config,
+                     const NetworkInterface & iface, const ip::tcp::endpoint & endpoint):
+        m_address(endpoint.address()),
+        m_ifIndex(iface.index),
+        m_listener(HttpListener::getShared(strand, config, endpoint.address().is_v6())),
+        m_serverDesc(sys_format("HTTP on {}({})", iface.name, endpoint.address().is_v6() ? "v6" : "v4")),
+        m_metrics(Metrics::forServer(iface.name, endpoint.address().is_v6())) {
+    }
+
+    void start(Handler & handler) override {
+        WSDLOG_INFO("{}: starting server", m_serverDesc);
+        m_listener->addRoute(m_address, m_ifIndex, handler, &m_metrics);
+    }
+    
+    void stop() override {
+        WSDLOG_INFO("{}: stopping server", m_serverDesc);
+        m_listener->removeRoute(m_address);
+    }
+
+    void handOff(SocketHandoff & dest) override {
+        //the first server to get here hands off the listener for everybody
+        m_listener->handOff(dest);
+    }
+
+private:
+    ~SharedHttpServer() noexcept {
+    }
+
+private:
+    ip::address m_address;
+    int m_ifIndex;
+    refcnt_ptr<HttpListener> m_listener;
+    sys_string m_serverDesc;
+    ServerMetrics & m_metrics;
+};
+
+auto createHttpServer(const Strand & strand, 
                       const refcnt_ptr<Config> & config,
                       const NetworkInterface & iface,
                       const ip::tcp::endpoint & endpoint) -> refcnt_ptr<HttpServer> {
-    return make_refcnt<HttpServerImpl>(ctxt, config, iface, endpoint);
+    return make_refcnt<HttpServerImpl>(strand, config, iface, endpoint);
+}
+
+auto createSharedHttpServer(const Strand & strand, 
+                            const refcnt_ptr<Config> & config,
+                            const NetworkInterface & iface,
+                            const ip::tcp::endpoint & endpoint) -> refcnt_ptr<HttpServer> {
+    return make_refcnt<SharedHttpServer>(strand, config, iface, endpoint);
 }
 
-HttpServerImpl::HttpServerImpl(asio::io_context & ctxt, const refcnt_ptr<Config> & config,
-                               const NetworkInterface & iface, const ip::tcp::endpoint & endpoint):
+auto createMetricsHttpServer(const Strand & strand, 
+                             const refcnt_ptr<Config> & config,
+                             const ip::tcp::endpoint & endpoint) -> refcnt_ptr<HttpServer> {
+    return make_refcnt<HttpServerImpl>(strand, config, endpoint);
+}
+
+HttpListener::HttpListener(const Strand & strand, const refcnt_ptr<Config> & config,
+                           const ip::tcp::endpoint & endpoint, Kind kind, sys_string serverDesc):
     m_config(config),
-    m_acceptor(ctxt),
-    m_gcTimer(ctxt),
-    m_serverDesc(sys_format("HTTP on {}({})", iface.name, endpoint.address().is_v6() ? "v6" : "v4")) {
+    m_endpoint(endpoint),
+    m_acceptor(strand),
+    m_gcTimer(strand),
+    m_serverDesc(std::move(serverDesc)),
+    m_kind(kind),
+    m_isV6(endpoint.address().is_v6()) {
+
+    open();
+}
+
+void HttpListener::open() {
+    if (auto adopted = SocketHandoff::takeHttpListener(m_endpoint)) {
+        WSDLOG_DEBUG("{}: adopting handed off listener", m_serverDesc);
+        m_acceptor.assign(m_endpoint.protocol(), adopted->get());
+        adopted->detach();
+        return;
+    }
 
-    m_acceptor.open(endpoint.protocol());
+    m_acceptor.open(m_endpoint.protocol());
     m_acceptor.set_option(ip::tcp::socket::reuse_address(true));
-    if (endpoint.address().is_v6()) {
+    if (m_isV6) {
         m_acceptor.set_option(ip::v6_only(true));
     }
-    m_acceptor.bind(endpoint);
+    m_acceptor.bind(m_endpoint);
+}
+
+auto HttpListener::getShared(const Strand & strand, const refcnt_ptr<Config> & config, bool isV6) -> refcnt_ptr<HttpListener> {
+    auto & existing = s_shared[isV6];
+    if (existing)
+        return refcnt_retain(existing);
+
+    auto endpoint = isV6 ? ip::tcp::endpoint(ip::address_v6::any(), g_WsdHttpPort) :
+                           ip::tcp::endpoint(ip::address_v4::any(), g_WsdHttpPort);
+    auto ret = make_refcnt<HttpListener>(strand, config, endpoint, Shared, 
+                                         sys_format("HTTP on *({})", isV6 ? "v6" : "v4"));
+    existing = ret.get();
+    return ret;
+}
+
+void HttpListener::addRoute(const ip::address & localAddr, int ifIndex, HttpServer::Handler & handler, ServerMetrics * metrics) {
+    bool wasEmpty = m_routes.empty();
+    //a listener stopped when its last route was removed is still shared and can be reused
+    if (wasEmpty && !m_acceptor.is_open())
+        open();
+    m_routes[localAddr] = Route{&handler, ifIndex, metrics};
+    if (wasEmpty) {
+        if (m_kind == Shared)
+            WSDLOG_INFO("{}: starting listener", m_serverDesc);
+        accept();
+    }
+}
+
+void HttpListener::removeRoute(const ip::address & localAddr) {
+    m_routes.erase(localAddr);
+    for (auto it = m_connections.begin(), last = m_connections.end(); it != last; ) {
+        auto & con = *it;
+        if (con->routeAddress() == localAddr) {
+            con->stop();
+            it = m_connections.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    if (m_routes.empty())
+        stop();
+}
+
+void HttpListener::stop() {
+    if (m_kind == Shared)
+        WSDLOG_INFO("{}: stopping listener", m_serverDesc);
+    ++m_generation;
+    m_routes.clear();
+    m_acceptor.close();
+    m_gcTimer.cancel();
+    for(auto & con: m_connections) {
+        con->stop();
+    }
+    m_connections.clear();
+}
+
+void HttpListener::handOff(SocketHandoff & dest) {
+    if (!m_acceptor.is_open())
+        return;
+    //pending connections stay queued in the socket for the next owner
+    dest.addHttpListener(m_endpoint, ptl::FileDescriptor(m_acceptor.release()));
+    stop();
+}
+
+void HttpListener::notifyFatalError() {
+    //handlers are likely to stop us in response, so don't iterate the live map
+    std::vector<HttpServer::Handler *> handlers;
+    for (auto & [_, route]: m_routes)
+        handlers.push_back(route.handler);
+    for (auto handler: handlers)
+        handler->onFatalHttpError();
+}
+
+auto HttpListener::findRoute(const ip::address & localAddr) const -> std::optional<ip::address> {
+    
+    if (m_kind != Shared) {
+        if (m_routes.empty())
+            return std::nullopt;
+        return m_routes.begin()->first;
+    }
+    
+    if (m_routes.contains(localAddr))
+        return localAddr;
+    
+    //Platforms differ in whether they report scope of link-local local addresses,
+    //so fall back on an unambiguous match ignoring it
+    if (localAddr.is_v6()) {
+        auto bytes = localAddr.to_v6().to_bytes();
+        std::optional<ip::address> res;
+        for (auto & [addr, _]: m_routes) {
+            if (addr.is_v6() && addr.to_v6().to_bytes() == bytes) {
+                if (res)
+                    return std::nullopt;
+                res = addr;
+            }
+        }
+        return res;
+    }
+    return std::nullopt;
 }
 
-void HttpServerImpl::accept() {
+void HttpListener::accept() {
     m_acceptor.listen();
     m_acceptor.async_accept(
-        [this, holder = refcnt_retain(this)](asio::error_code ec, ip::tcp::socket socket) {
+        [this, holder = refcnt_retain(this), generation = m_generation](asio::error_code ec, ip::tcp::socket socket) {
 
-        if (!m_handler)
+        if (m_routes.empty() || generation != m_generation)
             return;
         if (ec) {
             if (ec != asio::error::operation_aborted) {
                 WSDLOG_ERROR("{}: error accepting: {}", m_serverDesc, ec.message());
-                m_handler->onFatalHttpError();
+                notifyFatalError();
             }
             
             return;
@@ -169,7 +430,24 @@ void HttpServerImpl::accept() {
     });
 }
 
-void HttpServerImpl::handleConnection(ip::tcp::socket && socket) {
+void HttpListener::handleConnection(ip::tcp::socket && socket) {
+
+    asio::error_code ec;
+    auto localAddr = socket.local_endpoint(ec).address();
+    if (ec) {
+        WSDLOG_DEBUG("{}: unable to obtain local address of connection: {}", m_serverDesc, ec.message());
+        return;
+    }
+    auto routeAddr = findRoute(localAddr);
+    if (!routeAddr) {
+        WSDLOG_DEBUG("{}: connection to {} is not for any known server, dropping", m_serverDesc, localAddr.to_string());
+        Metrics::unroutedHttpConnections().add();
+        return;
+    }
+    auto & route = m_routes[*routeAddr];
+    auto * metrics = route.metrics;
+    if (metrics)
+        metrics->httpConnectionsAccepted.add();
 
     bool wasEmpty = m_connections.empty();
     
@@ -184,29 +462,32 @@ void HttpServerImpl::handleConnection(ip::tcp::socket && socket) {
         }
     }
     if (sameAddrCount >= g_httpMaxConnectionsFromSameAddress) {
-        WSDLOG_INFO("{}: too many simultaneous connections from {}, dropping oldest", m_serverDesc, remoteAddr.to_string());
+        WSDLOG_INFO_LIMITED(remoteAddr, "{}: too many simultaneous connections from {}, dropping oldest", m_serverDesc, remoteAddr.to_string());
+        if (auto * oldestMetrics = oldestWithTheSameAddr->metrics())
+            oldestMetrics->httpConnectionsDropped.add();
         oldestWithTheSameAddr->stop();
         m_connections.erase(oldestWithTheSameAddr);
     }
 
-    auto connection = make_refcnt<HttpConnection>(m_config, std::move(socket));
+    auto connection = make_refcnt<HttpConnection>(m_config, std::move(socket), *routeAddr, route.ifIndex, metrics);
     m_connections.insert(connection);
+    WSDDN_PROBE(http_accept, route.ifIndex, m_connections.size());
     connection->start(*this);
     if (wasEmpty)
         scheduleGC();
 }
 
-void HttpServerImpl::scheduleGC() {
+void HttpListener::scheduleGC() {
     m_gcTimer.expires_after(g_httpMaxConnectionDuration);
     m_gcTimer.async_wait([this, holder = refcnt_retain(this)](asio::error_code ec) {
 
-        if (!m_handler)
+        if (m_routes.empty())
             return;
 
         if (ec) {
             if (ec != asio::error::operation_aborted) {
                 WSDLOG_ERROR("{}: error waiting for gc timer: {}", m_serverDesc, ec.message());
-                m_handler->onFatalHttpError();
+                notifyFatalError();
             }
             
             return;
@@ -216,7 +497,9 @@ void HttpServerImpl::scheduleGC() {
         for (auto it = m_connections.begin(), last = m_connections.end(); it != last; ) {
             auto & con = *it;
             if (now - con->startTime() > g_httpMaxConnectionDuration) {
-                WSDLOG_INFO("{}: dropping stale connection from {}", m_serverDesc, con->remoteAddress().to_string());
+                WSDLOG_INFO_LIMITED(con->remoteAddress(), "{}: dropping stale connection from {}", m_serverDesc, con->remoteAddress().to_string());
+                if (auto * metrics = con->metrics())
+                    metrics->httpConnectionsExpired.add();
                 con->stop();
                 it = m_connections.erase(it);
             } else {
@@ -229,21 +512,22 @@ void HttpServerImpl::scheduleGC() {
     });
 }
 
-void HttpServerImpl::onConnectionFinished(const refcnt_ptr<HttpConnection> & connection) {
+void HttpListener::onConnectionFinished(const refcnt_ptr<HttpConnection> & connection) {
     m_connections.erase(connection);
     connection->stop();
     if (m_connections.empty())
         m_gcTimer.cancel();
 }
 
-auto HttpServerImpl::handleHttpRequest(std::unique_ptr<XmlDoc> doc) -> std::optional<XmlCharBuffer> {
+auto HttpListener::handleHttpRequest(const ip::address & routeAddr, const ip::address & peer, 
+                                     std::unique_ptr<XmlDoc> doc) -> std::optional<XmlCharBuffer> {
     
-    if (m_handler)
-        return m_handler->handleHttpRequest(std::move(doc));
+    if (auto it = m_routes.find(routeAddr); it != m_routes.end())
+        return it->second.handler->handleHttpRequest(peer, std::move(doc));
     return std::nullopt;
 }
 
-void HttpConnection::start(HttpServerImpl & owner) {
+void HttpConnection::start(HttpListener & owner) {
     m_owner = &owner;
     m_connDesc = sys_format("{}, from {}", owner.serverDesc(), m_remoteAddr.to_string());
     read();
@@ -271,8 +555,26 @@ void HttpConnection::read() {
             
             return;
         }
+        
+        if (m_metrics)
+            m_metrics->httpBytesReceived.add(bytesRead);
+        if (!m_requestStart)
+            m_requestStart = std::chrono::steady_clock::now();
 
         auto parseRes = parseIncoming(m_readBuffer.data(), m_readBuffer.data() + bytesRead);
+        if (parseRes != ParseResult::Continue) {
+            m_requestStart.reset();
+            m_bodyParseTime = {};
+            //the metrics endpoint is not part of the protocol history
+            if (m_metrics) {
+                //for rejected requests the last bytes read are the likely culprit
+                bool rejected = (parseRes == ParseResult::Error);
+                FlightRecorder::record({.event = FlightEvent::HttpRequest, 
+                                        .outcome = rejected ? FlightOutcome::Rejected : FlightOutcome::Replied,
+                                        .ifIndex = unsigned(m_ifIndex), .bytesIn = rejected ? bytesRead : m_contentLength},
+                                       m_remoteAddr, 0, rejected ? m_readBuffer.data() : nullptr, rejected ? bytesRead : 0);
+            }
+        }
         switch(parseRes) {
             break;case ParseResult::Continue: read();
             break;case ParseResult::Done:     write(!m_keepAlive);
@@ -284,7 +586,7 @@ void HttpConnection::read() {
 void HttpConnection::write(bool finalWrite)
 {
     asio::async_write(m_socket, m_response.makeBuffers(),
-        [this, holder = refcnt_retain(this), finalWrite](asio::error_code ec, size_t) {
+        [this, holder = refcnt_retain(this), finalWrite, start = std::chrono::steady_clock::now()](asio::error_code ec, size_t bytesWritten) {
         
         if (!m_owner)
             return;
@@ -297,6 +599,11 @@ void HttpConnection::write(bool finalWrite)
             
             return;
         }
+        
+        if (m_metrics) {
+            m_metrics->httpBytesSent.add(bytesWritten);
+            Latency::record(LatencyStage::HttpWrite, start);
+        }
 
         if (!finalWrite) {
             read();
@@ -328,7 +635,9 @@ auto HttpConnection::parseHeader(const std::byte * first, const std::byte * last
     auto [res, readEnd] = m_headerParser.parse(m_request, first, last);
 
     if (res == HttpRequestParser::Bad) {
-        WSDLOG_INFO("{}: bad HTTP request", m_connDesc);
+        WSDLOG_INFO_LIMITED(m_remoteAddr, "{}: bad HTTP request", m_connDesc);
+        if (m_metrics)
+            m_metrics->parseFailures.add();
         m_response = HttpResponse::makeStockResponse(HttpResponse::BadRequest);
         return {ParseResult::Error, readEnd};
     }
@@ -340,6 +649,17 @@ auto HttpConnection::parseHeader(const std::byte * first, const std::byte * last
 
     WSDLOG_DEBUG("{}: {} {}", m_connDesc, m_request.method, m_request.uri);
     
+    if (m_owner->servesMetrics()) {
+        if (m_request.method != S("GET") || m_request.uri != S("/metrics")) {
+            m_response = HttpResponse::makeStockResponse(HttpResponse::NotFound);
+            return {ParseResult::Error, readEnd};
+        }
+        m_response = HttpResponse::makeTextReply(Metrics::format(), S("text/plain; version=0.0.4; charset=utf-8"));
+        m_keepAlive = false;
+        m_headerParser.reset();
+        return {ParseResult::Done, readEnd};
+    }
+    
     if (m_request.method != S("POST") || m_request.uri != S("/") + m_config->httpPath()) {
         m_response = HttpResponse::makeStockResponse(HttpResponse::NotFound);
         return {ParseResult::Error, readEnd};
@@ -347,37 +667,38 @@ auto HttpConnection::parseHeader(const std::byte * first, const std::byte * last
 
     auto contentLengthRes = m_request.getContentLength();
     if (!contentLengthRes || !contentLengthRes.assume_value()) {
-        WSDLOG_INFO("{}: missing Content-Length header", m_connDesc);
+        WSDLOG_INFO_LIMITED(m_remoteAddr, "{}: missing Content-Length header", m_connDesc);
         m_response = HttpResponse::makeStockResponse(HttpResponse::BadRequest);
         return {ParseResult::Error, readEnd};
     }
     auto contentLength = *contentLengthRes.assume_value();
     if (contentLength > g_httpMaxContentLength) {
-        WSDLOG_INFO("{}: Content-Length {} is too big", m_connDesc, contentLength);
+        WSDLOG_INFO_LIMITED(m_remoteAddr, "{}: Content-Length {} is too big", m_connDesc, contentLength);
         m_response = HttpResponse::makeStockResponse(HttpResponse::BadRequest);
         return {ParseResult::Error, readEnd};
     }
+    m_contentLength = contentLength;
     m_contentRemaining = contentLength;
     
 
     auto contentTypeRes = m_request.getContentType();
     if (!contentTypeRes) {
-        WSDLOG_INFO("{}: missing Content-Type header", m_connDesc);
+        WSDLOG_INFO_LIMITED(m_remoteAddr, "{}: missing Content-Type header", m_connDesc);
         m_response = HttpResponse::makeStockResponse(HttpResponse::BadRequest);
         return {ParseResult::Error, readEnd};
     }
     if (contentTypeRes.assume_value()) {
         const std::vector<sys_string> & contentTypeParts = *contentTypeRes.assume_value();
         if (contentTypeParts.size() < 1 || contentTypeParts.size() > 2 || contentTypeParts[0] != S("application/soap+xml")) {
-            WSDLOG_INFO("{}: invalid Content-Type '{}'", m_connDesc,
-                         S(",").join(contentTypeParts.begin(), contentTypeParts.end()));
+            WSDLOG_INFO_LIMITED(m_remoteAddr, "{}: invalid Content-Type '{}'", m_connDesc,
+                                S(",").join(contentTypeParts.begin(), contentTypeParts.end()));
             m_response = HttpResponse::makeStockResponse(HttpResponse::BadRequest);
             return {ParseResult::Error, readEnd};
         }
         if (contentTypeParts.size() == 2) {
             if (!contentTypeParts[1].starts_with(S("charset="))) {
-                WSDLOG_INFO("{}: invalid Content-Type '{}'", m_connDesc,
-                             S(",").join(contentTypeParts.begin(), contentTypeParts.end()));
+                WSDLOG_INFO_LIMITED(m_remoteAddr, "{}: invalid Content-Type '{}'", m_connDesc,
+                                    S(",").join(contentTypeParts.begin(), contentTypeParts.end()));
                 m_response = HttpResponse::makeStockResponse(HttpResponse::BadRequest);
                 return {ParseResult::Error, readEnd};
             }
@@ -409,10 +730,14 @@ auto HttpConnection::parseBody(const std::byte * first, const std::byte * last)
     WSDLOG_TRACE("{}: received {}", m_connDesc, std::string_view((const char *)first, chunkSize));
     
     try {
+        auto parseStart = std::chrono::steady_clock::now();
         //int cast is safe because our buffer is much much smaller than max int (8192 currently)
         m_contentParser->parseChunk((const uint8_t *)first, int(chunkSize), m_contentRemaining == 0);
+        m_bodyParseTime += std::chrono::steady_clock::now() - parseStart;
     } catch(std::exception & ex) {
-        WSDLOG_INFO("{}: error parsing XML {}", m_connDesc, ex.what());
+        WSDLOG_INFO_LIMITED(m_remoteAddr, "{}: error parsing XML {}", m_connDesc, ex.what());
+        if (m_metrics)
+            m_metrics->parseFailures.add();
         WSDLOG_TRACE("{}", formatCaughtExceptionBacktrace());
         m_response = HttpResponse::makeStockResponse(HttpResponse::BadRequest);
         return {ParseResult::Error, first + chunkSize};
@@ -420,17 +745,30 @@ auto HttpConnection::parseBody(const std::byte * first, const std::byte * last)
     
     if (m_contentRemaining == 0) {
         if (!m_contentParser->wellFormed()) {
-            WSDLOG_INFO("{}: XML is not well formed", m_connDesc);
+            WSDLOG_INFO_LIMITED(m_remoteAddr, "{}: XML is not well formed", m_connDesc);
+            if (m_metrics)
+                m_metrics->parseFailures.add();
             m_response = HttpResponse::makeStockResponse(HttpResponse::BadRequest);
             return {ParseResult::Error, first + chunkSize};
         }
 
+        //the metrics endpoint is not part of the pipeline being measured
+        if (m_metrics && m_requestStart) {
+            auto readTime = std::chrono::steady_clock::now() - *m_requestStart;
+            Latency::histogram(LatencyStage::HttpRead).record(readTime);
+            Latency::histogram(LatencyStage::HttpParse).record(m_bodyParseTime);
+            WSDDN_PROBE(http_request_complete, m_ifIndex, m_contentLength, probeNs(readTime));
+        }
+
+        LogFieldsScope logFields([&](LogFields & fields) {
+            fields.peer = sys_string(m_remoteAddr.to_string());
+        });
         auto doc = m_contentParser->extractDoc();
         std::optional<XmlCharBuffer> maybeReply;
         try {
-            maybeReply = m_owner->handleHttpRequest(std::move(doc));
+            maybeReply = m_owner->handleHttpRequest(m_routeAddr, m_remoteAddr, std::move(doc));
         } catch(std::exception & ex) {
-            WSDLOG_ERROR("{}: error handling request: {}", m_connDesc, ex.what());
+            WSDLOG_ERROR_LIMITED(m_remoteAddr, "{}: error handling request: {}", m_connDesc, ex.what());
             WSDLOG_TRACE("{}", formatCaughtExceptionBacktrace());
         }
 
@@ -6,6 +6,7 @@
 
 #include "config.h"
 #include "xml_wrapper.h"
+#include "handoff.h"
 
 struct NetworkInterface;
 
@@ -15,7 +16,7 @@ class HttpServer : public ref_counted<HttpServer> {
 public:
     class Handler {
     public:
-        virtual auto handleHttpRequest(std::unique_ptr<XmlDoc> doc) -> std::optional<XmlCharBuffer> = 0;
+        virtual auto handleHttpRequest(const ip::address & peer, std::unique_ptr<XmlDoc> doc) -> std::optional<XmlCharBuffer> = 0;
         virtual void onFatalHttpError() = 0;
     protected:
         ~Handler() {}
@@ -23,6 +24,8 @@ public:
 public:
     virtual void start(Handler & handler) = 0;
     virtual void stop() = 0;
+    //Stops the server passing its listening socket, if it still has one, to dest
+    virtual void handOff(SocketHandoff & dest) = 0;
 protected:
     HttpServer() {
     }
@@ -30,12 +33,21 @@ protected:
     }
 };
 
-using HttpServerFactoryT = auto (asio::io_context & ctxt,
+using HttpServerFactoryT = auto (const Strand & strand,
                                  const refcnt_ptr<Config> & config,
                                  const NetworkInterface & iface,
                                  const ip::tcp::endpoint & endpoint) -> refcnt_ptr<HttpServer>;
 using HttpServerFactory = std::function<HttpServerFactoryT>;
 
+//Listens on the endpoint's own address
 HttpServerFactoryT createHttpServer;
+//Shares one wildcard listener per address family between all servers
+HttpServerFactoryT createSharedHttpServer;
+
+//Answers GET /metrics with all metrics in Prometheus text format. Meant to listen on loopback only.
+//Its handler is never asked to handle requests
+auto createMetricsHttpServer(const Strand & strand,
+                             const refcnt_ptr<Config> & config,
+                             const ip::tcp::endpoint & endpoint) -> refcnt_ptr<HttpServer>;
 
 #endif 
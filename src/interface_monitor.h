@@ -28,7 +28,7 @@ protected:
     }
 };
 
-using InterfaceMonitorFactoryT = auto (asio::io_context & ctxt, const refcnt_ptr<Config> & config) -> refcnt_ptr<InterfaceMonitor>;
+using InterfaceMonitorFactoryT = auto (const Strand & strand, const refcnt_ptr<Config> & config) -> refcnt_ptr<InterfaceMonitor>;
 using InterfaceMonitorFactory = std::function<InterfaceMonitorFactoryT>;
 
 InterfaceMonitorFactoryT createInterfaceMonitor;
@@ -45,13 +45,13 @@ private:
         std::optional<NetworkInterface> iface;
     };
 public:
-    InterfaceMonitorImpl(asio::io_context & ctxt,  const refcnt_ptr<Config> & config):
+    InterfaceMonitorImpl(const Strand & strand,  const refcnt_ptr<Config> & config):
         m_config(config),
 #if HAVE_PF_ROUTE
-        m_socket(ctxt, raw_protocol(PF_ROUTE, AF_UNSPEC)),
+        m_socket(strand, raw_protocol(PF_ROUTE, AF_UNSPEC)),
         m_recvBuffer(m_config->pageSize())
 #else
-        m_socket(ctxt, datagram_protocol(AF_INET, 0))
+        m_socket(strand, datagram_protocol(AF_INET, 0))
 #endif
     {}
 
@@ -369,8 +369,8 @@ private:
 #endif
 };
 
-auto createInterfaceMonitor(asio::io_context & ctxt, const refcnt_ptr<Config> & config) -> refcnt_ptr<InterfaceMonitor> {
-    return refcnt_attach(new InterfaceMonitorImpl(ctxt, config));
+auto createInterfaceMonitor(const Strand & strand, const refcnt_ptr<Config> & config) -> refcnt_ptr<InterfaceMonitor> {
+    return refcnt_attach(new InterfaceMonitorImpl(strand, config));
 }
 
 #endif
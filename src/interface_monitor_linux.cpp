@@ -8,40 +8,71 @@
 
 #include <linux/netlink.h>
 #include <linux/rtnetlink.h>
+#include <linux/filter.h>
 #include <sys/socket.h>
 #include <asm/types.h>
 
 using namespace asio::generic;
 
+//Failed resyncs are retried after this, doubling up to the maximum
+static constexpr auto g_resyncRetryMin = std::chrono::milliseconds(100);
+static constexpr auto g_resyncRetryMax = std::chrono::seconds(30);
+
+template<int Level, int Name, class T>
+class RawSocketOption {
+public:
+    RawSocketOption(const T & value): m_value(value) {}
+
+    template<class Protocol> auto level(const Protocol &) const -> int { return Level; }
+    template<class Protocol> auto name(const Protocol &) const -> int { return Name; }
+    template<class Protocol> auto data(const Protocol &) const -> const void * { return &m_value; }
+    template<class Protocol> auto size(const Protocol &) const -> size_t { return sizeof(m_value); }
+private:
+    T m_value;
+};
+
 class InterfaceMonitorImpl : public InterfaceMonitor {
 
 private:
     enum ParseStatus {
         Done,
         ExpectMore,
-        BufferTooSmall,
         Error
     };
 
+    using AddressKey = std::pair<NetworkInterface, ip::address>;
+
     struct RtParseResult {
         std::optional<ip::address> addr;
         std::optional<NetworkInterface> iface;
     };
 
 public:
-    InterfaceMonitorImpl(asio::io_context & ctxt,  const refcnt_ptr<Config> & config):
+    InterfaceMonitorImpl(const Strand & strand,  const refcnt_ptr<Config> & config):
         m_config(config),
-        m_socket(ctxt, raw_protocol(AF_NETLINK, NETLINK_ROUTE)),
-        m_recvBuffer(2 * m_config->pageSize()) {
+        m_socket(strand, raw_protocol(AF_NETLINK, NETLINK_ROUTE)),
+        m_recvBuffer(2 * m_config->pageSize()),
+        m_resyncTimer(strand) {
 
         sockaddr_nl addr = {};
         addr.nl_family = AF_NETLINK;
-        addr.nl_groups = RTMGRP_LINK;
+        addr.nl_groups = 0;
         if (m_config->enableIPv4())
             addr.nl_groups |= RTMGRP_IPV4_IFADDR;
         if (m_config->enableIPv6()) 
             addr.nl_groups |= RTMGRP_IPV6_IFADDR;
         m_socket.bind(raw_protocol::endpoint(&addr, sizeof(addr)));
+        m_socket.non_blocking(true);
+
+        attachFilter();
+
+    #if defined(SOL_NETLINK) && defined(NETLINK_GET_STRICT_CHK)
+        asio::error_code ec;
+        m_socket.set_option(RawSocketOption<SOL_NETLINK, NETLINK_GET_STRICT_CHK, int>(1), ec);
+        m_strictCheck = !ec;
+        if (ec)
+            WSDLOG_DEBUG("Netlink strict checking is not available: {}", ec.message());
+    #endif
     }
 
     void start(Handler & handler) override {
@@ -54,10 +85,128 @@ public:
     void stop() override {
         WSDLOG_INFO("Stopping interface monitor");
         m_socket.close();
+        m_resyncTimer.cancel();
         m_handler = nullptr;
+        m_knownAddresses.clear();
+        m_dumpedAddresses.reset();
+        m_pendingDumpFamilies.clear();
     }
 private:
+    /*
+     Makes the kernel drop messages we would ignore anyway: link updates,
+     disabled address families, non link-local IPv6 and addresses with flags
+     that disqualify them. BPF loads are big endian while netlink headers are in
+     host order, hence the hton* on the constants.
+     Dump replies may pack many messages into one datagram and the filter only
+     sees the first one, so those are always let through.
+    */
+    void attachFilter() {
+        constexpr uint32_t typeOffset = offsetof(nlmsghdr, nlmsg_type);
+        constexpr uint32_t flagsOffset = offsetof(nlmsghdr, nlmsg_flags);
+        constexpr uint32_t familyOffset = NLMSG_HDRLEN + offsetof(ifaddrmsg, ifa_family);
+        constexpr uint32_t addrFlagsOffset = NLMSG_HDRLEN + offsetof(ifaddrmsg, ifa_flags);
+        constexpr uint32_t scopeOffset = NLMSG_HDRLEN + offsetof(ifaddrmsg, ifa_scope);
+        constexpr uint32_t ignoredAddrFlags = IFA_F_DADFAILED | IFA_F_HOMEADDRESS | IFA_F_DEPRECATED | IFA_F_TENTATIVE;
+
+        constexpr uint8_t checkFlags = 13, reject = 15, accept = 16;
+        auto to = [](uint8_t from, uint8_t target) { return uint8_t(target - from - 1); };
+        
+        bool v4 = m_config->enableIPv4(), v6 = m_config->enableIPv6();
+
+        sock_filter code[] = {
+            /*  0 */ BPF_STMT(BPF_LD  | BPF_H | BPF_ABS, typeOffset),
+            /*  1 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, htons(NLMSG_DONE), to(1, accept), 0),
+            /*  2 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, htons(NLMSG_ERROR), to(2, accept), 0),
+            /*  3 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, htons(NLMSG_OVERRUN), to(3, accept), 0),
+            /*  4 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, htons(RTM_NEWADDR), 1, 0),
+            /*  5 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, htons(RTM_DELADDR), 0, to(5, reject)),
+            /*  6 */ BPF_STMT(BPF_LD  | BPF_H | BPF_ABS, flagsOffset),
+            /*  7 */ BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, htons(NLM_F_MULTI), to(7, accept), 0),
+            /*  8 */ BPF_STMT(BPF_LD  | BPF_B | BPF_ABS, familyOffset),
+            /*  9 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, AF_INET, to(9, v4 ? checkFlags : reject), 0),
+            /* 10 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, AF_INET6, uint8_t(v6 ? 0 : to(10, reject)), to(10, reject)),
+            /* 11 */ BPF_STMT(BPF_LD  | BPF_B | BPF_ABS, scopeOffset),
+            /* 12 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, RT_SCOPE_LINK, 0, to(12, reject)),
+            /* 13 */ BPF_STMT(BPF_LD  | BPF_B | BPF_ABS, addrFlagsOffset),
+            /* 14 */ BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, ignoredAddrFlags, to(14, reject), to(14, accept)),
+            /* 15 */ BPF_STMT(BPF_RET | BPF_K, 0),
+            /* 16 */ BPF_STMT(BPF_RET | BPF_K, std::numeric_limits<uint32_t>::max())
+        };
+        static_assert(sizeof(code) / sizeof(code[0]) == accept + 1);
+
+        sock_fprog program = {};
+        program.len = std::size(code);
+        program.filter = code;
+        asio::error_code ec;
+        m_socket.set_option(RawSocketOption<SOL_SOCKET, SO_ATTACH_FILTER, sock_fprog>(program), ec);
+        if (ec)
+            WSDLOG_WARN("Unable to attach netlink socket filter, all messages will be processed: {}", ec.message());
+    }
+
+    /*
+     Re-reads all addresses from the kernel. The result is diffed against
+     m_knownAddresses when the dump completes so only real changes reach the handler.
+     Only one dump can be in flight on a netlink socket, so a resync requested
+     while one is running is deferred until it finishes.
+    */
+    void resync() {
+        if (m_dumpedAddresses) {
+            m_resyncPending = true;
+            return;
+        }
+        WSDLOG_INFO("Resynchronizing network addresses");
+        requestAll();
+    }
+
+    /*
+     Called when a dump failed or a message could not be parsed. Retrying at once would spin
+     if the kernel keeps failing us, so consecutive failures back off exponentially.
+    */
+    void retryResync() {
+        if (m_resyncRetryScheduled)
+            return;
+        auto delay = g_resyncRetryMin * (1u << std::min(m_resyncFailures, 10u));
+        if (delay > g_resyncRetryMax)
+            delay = g_resyncRetryMax;
+        ++m_resyncFailures;
+        WSDLOG_DEBUG("Retrying address resynchronization in {}ms", std::chrono::duration_cast<std::chrono::milliseconds>(delay).count());
+        m_resyncRetryScheduled = true;
+        m_resyncTimer.expires_after(delay);
+        m_resyncTimer.async_wait([this, holder = refcnt_retain(this)](asio::error_code ec) {
+            m_resyncRetryScheduled = false;
+            if (ec || !m_handler)
+                return;
+            resync();
+        });
+    }
+
+    //Older kernels accept NETLINK_GET_STRICT_CHK but reject dump requests filtered by it
+    void disableStrictCheck() {
+    #if defined(SOL_NETLINK) && defined(NETLINK_GET_STRICT_CHK)
+        WSDLOG_INFO("Netlink strict checking is not supported by the kernel, dumping all addresses");
+        asio::error_code ec;
+        m_socket.set_option(RawSocketOption<SOL_NETLINK, NETLINK_GET_STRICT_CHK, int>(0), ec);
+    #endif
+        m_strictCheck = false;
+    }
+
+    /*
+     With strict checking the kernel filters dumps by family for us, so we dump
+     each enabled family in turn. Otherwise a single dump returns everything.
+    */
     void requestAll() {
+        m_dumpedAddresses.emplace();
+        m_resyncPending = false;
+        m_pendingDumpFamilies.clear();
+        if (m_strictCheck) {
+            if (m_config->enableIPv4())
+                m_pendingDumpFamilies.push_back(AF_INET);
+            if (m_config->enableIPv6())
+                m_pendingDumpFamilies.push_back(AF_INET6);
+            requestNextFamily();
+            return;
+        }
+        
         struct {
             nlmsghdr header;
             rtgenmsg msg;
@@ -65,20 +214,80 @@ private:
         message.header.nlmsg_len = sizeof(message);
         message.header.nlmsg_type = RTM_GETADDR;
         message.header.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
-        message.header.nlmsg_seq = 1;
+        message.header.nlmsg_seq = ++m_dumpSeq;
         message.header.nlmsg_pid = 0;
         message.msg.rtgen_family = AF_PACKET;
 
+        sendRequest(&message, sizeof(message));
+    }
+
+    void requestNextFamily() {
+        struct {
+            nlmsghdr header;
+            ifaddrmsg msg;
+        } message = {};
+        message.header.nlmsg_len = sizeof(message);
+        message.header.nlmsg_type = RTM_GETADDR;
+        message.header.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+        message.header.nlmsg_seq = ++m_dumpSeq;
+        message.header.nlmsg_pid = 0;
+        message.msg.ifa_family = m_pendingDumpFamilies.front();
+        m_pendingDumpFamilies.pop_front();
+        
+        sendRequest(&message, sizeof(message));
+    }
+
+    void sendRequest(const void * message, size_t size) {
         sockaddr_nl addr = {};
         addr.nl_family = AF_NETLINK;
 
-        m_socket.send_to(asio::buffer(&message, sizeof(message)), raw_protocol::endpoint(&addr, sizeof(addr)));
+        m_socket.send_to(asio::buffer(message, size), raw_protocol::endpoint(&addr, sizeof(addr)));
+    }
+
+    void onDumpDone() {
+        if (!m_pendingDumpFamilies.empty() && !m_resyncPending) {
+            requestNextFamily();
+            return;
+        }
+        finishDump();
+    }
+
+    void finishDump() {
+        auto dumped = std::move(*m_dumpedAddresses);
+        m_dumpedAddresses.reset();
+
+        if (m_resyncPending) {
+            WSDLOG_DEBUG("Address dump may be stale, discarding");
+            resync();
+            return;
+        }
+
+        std::vector<AddressKey> removed;
+        std::set_difference(m_knownAddresses.begin(), m_knownAddresses.end(), dumped.begin(), dumped.end(), 
+                            std::back_inserter(removed));
+        std::vector<AddressKey> added;
+        std::set_difference(dumped.begin(), dumped.end(), m_knownAddresses.begin(), m_knownAddresses.end(), 
+                            std::back_inserter(added));
+        
+        WSDLOG_DEBUG("Address dump complete: {} addresses, {} added, {} removed", dumped.size(), added.size(), removed.size());
+        m_resyncFailures = 0;
+        
+        m_knownAddresses = std::move(dumped);
+        for (auto & [iface, addr]: removed) {
+            m_handler->removeAddress(iface, addr);
+            if (!m_handler)
+                return;
+        }
+        for (auto & [iface, addr]: added) {
+            m_handler->addAddress(iface, addr);
+            if (!m_handler)
+                return;
+        }
     }
 
     void read() {
-        asio::mutable_buffer buffer(m_recvBuffer.data(), m_recvBuffer.size());
-        m_socket.async_receive(buffer, 
-            [this, holder = refcnt_retain(this)](const asio::error_code & ec, size_t bytesRead){
+        m_socket.async_wait(raw_protocol::socket::wait_read,
+            [this, holder = refcnt_retain(this)](asio::error_code ec) {
 
             if (!m_handler)
                 return;
@@ -92,49 +301,97 @@ private:
                 return;
             }
 
-            auto res = parseBuffer(m_recvBuffer.data(), m_recvBuffer.data() + bytesRead);
-            switch (res) {
-            case Done:
-            case ExpectMore:
-                break;
-            case BufferTooSmall:
-                WSDLOG_WARN("interface monitor buffer is insufficient to hold a single message, increasing");
-                m_recvBuffer.resize(m_recvBuffer.size() * 2);
-                //fallthrough
-            case Error:
-                requestAll();
+            for ( ; ; ) {
+                //Peek first to learn the exact size of the pending datagram
+                size_t size = receive(nullptr, 0, MSG_PEEK | MSG_TRUNC, ec);
+                if (!ec) {
+                    if (size > m_recvBuffer.size())
+                        m_recvBuffer.resize(size);
+                    size = receive(m_recvBuffer.data(), m_recvBuffer.size(), 0, ec);
+                }
+                if (ec) {
+                    if (ec == std::errc::operation_would_block || ec == std::errc::resource_unavailable_try_again) 
+                        break;
+                    if (ec == std::errc::no_buffer_space) {
+                        //Kernel dropped notifications because our socket buffer overflowed
+                        WSDLOG_WARN("netlink socket overrun, some interface changes were lost");
+                        resync();
+                        continue;
+                    }
+                    WSDLOG_CRITICAL("error reading from netlink socket {}", ec.message());
+                    m_handler->onFatalInterfaceMonitorError(ec);
+                    return;
+                }
+
+                if (parseBuffer(m_recvBuffer.data(), m_recvBuffer.data() + size) == Error) {
+                    //Any failed or malformed dump is no longer in progress
+                    m_dumpedAddresses.reset();
+                    retryResync();
+                }
+                if (!m_handler)
+                    return;
             }
 
             read();
         });
     }
 
+    auto receive(void * buf, size_t size, int flags, asio::error_code & ec) -> size_t {
+        iovec iov[] = {{buf, size}};
+        msghdr msg{};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = std::size(iov);
+        for ( ; ; ) {
+            auto ret = ptl::receiveSocket(m_socket, &msg, flags, ec);
+            if (ec != std::errc::interrupted)
+                return ret;
+        }
+    }
+
     auto parseBuffer(const std::byte * first, const std::byte * last) ->  ParseStatus {
 
         std::unordered_map<int, bool> knownIfaces; 
 
         for(size_t len = 0; size_t(last - first) != 0; first += len) {
 
-            if (size_t(last - first) < sizeof(nlmsghdr::nlmsg_len))
-                return BufferTooSmall;
+            if (size_t(last - first) < NLMSG_HDRLEN) {
+                WSDLOG_WARN("netlink datagram is truncated");
+                return Error;
+            }
 
             auto cur = first;
             auto header = (const nlmsghdr *)cur;
-            len = NLMSG_ALIGN(header->nlmsg_len);
-            if (len > size_t(last - first)) 
-                return BufferTooSmall;
+            len = std::min(size_t(NLMSG_ALIGN(header->nlmsg_len)), size_t(last - first));
+            if (header->nlmsg_len > size_t(last - first)) {
+                WSDLOG_WARN("nlmsghdr reported size {0} exceeds datagram size", header->nlmsg_len);
+                return Error;
+            }
 
             if (len < NLMSG_HDRLEN) {
                 WSDLOG_WARN("nlmsghdr reported size {0} is less than size of nlmsghdr", len);
                 return Error;
             }
 
+            bool isDump = m_dumpedAddresses && (header->nlmsg_flags & NLM_F_MULTI) && header->nlmsg_seq == m_dumpSeq;
+
             switch (header->nlmsg_type) {
-            case NLMSG_ERROR:
+            case NLMSG_ERROR: {
+                if (len < NLMSG_HDRLEN + sizeof(nlmsgerr))
+                    return Error;
+                auto err = (const nlmsgerr *)NLMSG_DATA(header);
+                //an acknowledgement, which we never ask for
+                if (err->error == 0)
+                    continue;
+                WSDLOG_DEBUG("netlink error: {}", std::system_category().message(-err->error));
+                if (err->error == -EINVAL && m_strictCheck && m_dumpedAddresses && header->nlmsg_seq == m_dumpSeq)
+                    disableStrictCheck();
                 return Error;
+            }
             case NLMSG_OVERRUN:
-                return BufferTooSmall;
+                return Error;
             case NLMSG_DONE:
+                if (isDump)
+                    onDumpDone();
                 return Done;
             case RTM_NEWADDR:
             case RTM_DELADDR:
@@ -169,7 +426,12 @@ private:
                 continue;
             }
 
-            handleDetected(header->nlmsg_type == RTM_NEWADDR, *iface, *addr, knownIfaces);
+            if (isDump)
+                handleDumped(*iface, *addr, knownIfaces);
+            else
+                handleDetected(header->nlmsg_type == RTM_NEWADDR, *iface, *addr, knownIfaces);
+            if (!m_handler)
+                break;
         }
         return ExpectMore;
     }
@@ -219,29 +481,49 @@ private:
         return res;
     }
 
+    void handleDumped(NetworkInterface iface, ip::address addr, std::unordered_map<int, bool> & knownIfaces) {
+
+        if (isUsable(iface, addr, knownIfaces))
+            m_dumpedAddresses->emplace(std::move(iface), std::move(addr));
+    }
+
     void handleDetected(bool isAdded, NetworkInterface iface, ip::address addr, std::unordered_map<int, bool> & knownIfaces) {
         
+        AddressKey key(std::move(iface), std::move(addr));
         if (isAdded) {
-            bool ignore = true;
-            if (auto it = knownIfaces.find(iface.index); it == knownIfaces.end()) {
-                if (auto flagsRes = ioctlSocket<GetInterfaceFlags>(m_socket, iface.name)) {
-                    auto flags = flagsRes.assume_value();
-                    ignore = (flags & IFF_LOOPBACK) || !(flags & IFF_MULTICAST);
-                    knownIfaces[iface.index] = ignore;
-                } else {
-                    WSDLOG_ERROR("Unable to obtain flags for interface {0}, {1}", iface, flagsRes.assume_error().message());
-                }
+            if (!isUsable(key.first, key.second, knownIfaces))
+                return;
+            //Keep an in-flight dump consistent with changes that raced it
+            if (m_dumpedAddresses)
+                m_dumpedAddresses->insert(key);
+            if (m_knownAddresses.insert(key).second)
+                m_handler->addAddress(key.first, key.second);
+        } else {
+            if (m_dumpedAddresses)
+                m_dumpedAddresses->erase(key);
+            if (m_knownAddresses.erase(key))
+                m_handler->removeAddress(key.first, key.second);
+        }
+    }
+
+    auto isUsable(const NetworkInterface & iface, const ip::address & addr, std::unordered_map<int, bool> & knownIfaces) -> bool {
+
+        bool ignore = true;
+        if (auto it = knownIfaces.find(iface.index); it == knownIfaces.end()) {
+            if (auto flagsRes = ioctlSocket<GetInterfaceFlags>(m_socket, iface.name)) {
+                auto flags = flagsRes.assume_value();
+                ignore = (flags & IFF_LOOPBACK) || !(flags & IFF_MULTICAST);
+                knownIfaces[iface.index] = ignore;
             } else {
-                ignore = it->second;
+                WSDLOG_ERROR("Unable to obtain flags for interface {0}, {1}", iface, flagsRes.assume_error().message());
             }
-                
-            if (!ignore)
-                m_handler->addAddress(iface, addr);
-            else
-                WSDLOG_DEBUG("Interface {}, addr {} is loopback or doesn't support multicast - ignoring", iface, addr.to_string());
         } else {
-            m_handler->removeAddress(iface, addr);
+            ignore = it->second;
         }
+            
+        if (ignore)
+            WSDLOG_DEBUG("Interface {}, addr {} is loopback or doesn't support multicast - ignoring", iface, addr.to_string());
+        return !ignore;
     }
 
 private:
@@ -250,10 +532,23 @@ private:
 
     raw_protocol::socket m_socket;
     std::vector<std::byte> m_recvBuffer;
+
+    //Addresses reported to the handler
+    std::set<AddressKey> m_knownAddresses;
+    //Addresses collected by an in-flight dump, engaged only while it runs
+    std::optional<std::set<AddressKey>> m_dumpedAddresses;
+    std::deque<unsigned char> m_pendingDumpFamilies;
+    uint32_t m_dumpSeq = 0;
+    bool m_resyncPending = false;
+    bool m_strictCheck = false;
+
+    asio::steady_timer m_resyncTimer;
+    unsigned m_resyncFailures = 0;
+    bool m_resyncRetryScheduled = false;
 };
 
-auto createInterfaceMonitor(asio::io_context & ctxt, const refcnt_ptr<Config> & config) -> refcnt_ptr<InterfaceMonitor> {
-    return refcnt_attach(new InterfaceMonitorImpl(ctxt, config));
+auto createInterfaceMonitor(const Strand & strand, const refcnt_ptr<Config> & config) -> refcnt_ptr<InterfaceMonitor> {
+    return refcnt_attach(new InterfaceMonitorImpl(strand, config));
 }
 
 #endif
@@ -0,0 +1,85 @@
+// Copyright (c) 2022, Eugene Gershnik
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "journald_sink.h"
+#include "log_fields.h"
+
+#if HAVE_SYSTEMD
+
+static constexpr size_t g_maxJournalFields = 12;
+
+JournaldSink::JournaldSink(SendFunc * send, spdlog::sink_ptr fallback):
+    m_send(send),
+    m_fallback(std::move(fallback)) {
+
+    LogFields::setWanted();
+}
+
+static auto journalPriority(spdlog::level::level_enum level) -> char {
+    switch(level) {
+        case spdlog::level::critical:   return '2';
+        case spdlog::level::err:        return '3';
+        case spdlog::level::warn:       return '4';
+        case spdlog::level::info:       return '6';
+        default:                        return '7';
+    }
+}
+
+void JournaldSink::log(const spdlog::details::log_msg & msg) {
+
+    //fields are appended to one buffer and the iovecs made once it stops moving
+    spdlog::memory_buf_t buf;
+    std::array<std::pair<size_t, size_t>, g_maxJournalFields> ranges;
+    size_t count = 0;
+    auto add = [&](std::string_view name, auto value) {
+        auto start = buf.size();
+        buf.append(name.data(), name.data() + name.size());
+        buf.push_back('=');
+        fmt::format_to(std::back_inserter(buf), "{}", value);
+        ranges[count++] = {start, buf.size() - start};
+    };
+    auto addIfSet = [&](std::string_view name, const sys_string & value) {
+        if (!value.empty())
+            add(name, value);
+    };
+
+    add("MESSAGE", std::string_view(msg.payload.data(), msg.payload.size()));
+    add("PRIORITY", journalPriority(msg.level));
+    add("SYSLOG_IDENTIFIER", WSDDN_PROGNAME);
+    if (!msg.source.empty()) {
+        add("CODE_FILE", msg.source.filename);
+        add("CODE_LINE", msg.source.line);
+        add("CODE_FUNC", msg.source.funcname);
+    }
+    if (auto * fields = LogFields::current()) {
+        addIfSet("INTERFACE", fields->interface);
+        addIfSet("ADDRESS", fields->address);
+        addIfSet("ACTION", fields->action);
+        //MESSAGE_ID is journald's own catalog identifier
+        addIfSet("WSD_MESSAGE_ID", fields->messageId);
+        addIfSet("PEER", fields->peer);
+    }
+
+    std::array<iovec, g_maxJournalFields> iov;
+    for (size_t i = 0; i < count; ++i)
+        iov[i] = iovec{buf.data() + ranges[i].first, ranges[i].second};
+
+    if (m_send(iov.data(), int(count)) < 0)
+        m_fallback->log(msg);
+}
+
+auto JournaldSink::isStdoutJournal() -> bool {
+
+    auto * stream = getenv("JOURNAL_STREAM");
+    if (!stream)
+        return false;
+    unsigned long long dev, ino;
+    if (sscanf(stream, "%llu:%llu", &dev, &ino) != 2)
+        return false;
+    struct stat st;
+    if (fstat(fileno(stdout), &st) != 0)
+        return false;
+    return st.st_dev == dev && st.st_ino == ino;
+}
+
+#endif
@@ -0,0 +1,45 @@
+// Copyright (c) 2022, Eugene Gershnik
+// SPDX-License-Identifier: BSD-3-Clause
+
+#ifndef HEADER_JOURNALD_SINK_H_INCLUDED
+#define HEADER_JOURNALD_SINK_H_INCLUDED
+
+#if HAVE_SYSTEMD
+
+/*
+ An spdlog sink that sends messages straight to journald with sd_journal_sendv instead of
+ writing text for it to parse from standard output. Messages are not formatted: journald
+ has its own timestamps and the priority is a field. LogFields in effect become the
+ INTERFACE, ADDRESS, ACTION, WSD_MESSAGE_ID and PEER fields.
+
+ Messages journald does not accept, for example because its socket is not visible after
+ chroot, go to the fallback sink.
+ */
+class JournaldSink : public spdlog::sinks::sink {
+public:
+    //Signature of sd_journal_sendv, which is loaded dynamically
+    using SendFunc = int (const struct iovec * iov, int n);
+
+    JournaldSink(SendFunc * send, spdlog::sink_ptr fallback);
+
+    void log(const spdlog::details::log_msg & msg) override;
+    void flush() override {
+        m_fallback->flush();
+    }
+    void set_pattern(const std::string & pattern) override {
+        m_fallback->set_pattern(pattern);
+    }
+    void set_formatter(std::unique_ptr<spdlog::formatter> formatter) override {
+        m_fallback->set_formatter(std::move(formatter));
+    }
+
+    //Whether our standard output is connected to the journal, per $JOURNAL_STREAM
+    static auto isStdoutJournal() -> bool;
+private:
+    SendFunc * m_send;
+    spdlog::sink_ptr m_fallback;
+};
+
+#endif
+
+#endif
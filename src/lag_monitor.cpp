@@ -0,0 +1,51 @@
+// Copyright (c) 2022, Eugene Gershnik
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "lag_monitor.h"
+#include "latency.h"
+
+static constexpr auto g_lagCheckInterval = std::chrono::milliseconds(250);
+//Nothing we do should take anywhere near this long
+static constexpr auto g_stallThreshold = std::chrono::milliseconds(500);
+
+void LagMonitor::start() {
+    asio::dispatch(m_timer.get_executor(), [this, holder = refcnt_retain(this)]() {
+        if (!m_stopped)
+            schedule();
+    });
+}
+
+void LagMonitor::stop() {
+    asio::dispatch(m_timer.get_executor(), [this, holder = refcnt_retain(this)]() {
+        m_stopped = true;
+        m_timer.cancel();
+    });
+}
+
+void LagMonitor::schedule() {
+    auto expected = Clock::now() + g_lagCheckInterval;
+    m_timer.expires_at(expected);
+    m_timer.async_wait([this, holder = refcnt_retain(this), expected](asio::error_code ec) {
+        if (ec || m_stopped)
+            return;
+        check(expected);
+        schedule();
+    });
+}
+
+void LagMonitor::check(Clock::time_point expected) {
+    auto now = Clock::now();
+    auto lag = now - expected;
+    Latency::histogram(LatencyStage::LoopLag).record(lag);
+
+    if (lag > g_stallThreshold) {
+        WSDLOG_WARN("Event loop stalled: a timer ran {}ms late",
+                    std::chrono::duration_cast<std::chrono::milliseconds>(lag).count());
+        return;
+    }
+
+    if (m_onAlive && now - m_lastAlive >= m_aliveInterval) {
+        m_lastAlive = now;
+        m_onAlive();
+    }
+}
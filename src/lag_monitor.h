@@ -0,0 +1,50 @@
+// Copyright (c) 2022, Eugene Gershnik
+// SPDX-License-Identifier: BSD-3-Clause
+
+#ifndef HEADER_LAG_MONITOR_H_INCLUDED
+#define HEADER_LAG_MONITOR_H_INCLUDED
+
+#include "util.h"
+
+/*
+ Detects a stalled event loop by measuring how late a periodic timer runs.
+
+ Every lateness is recorded in the loop_lag latency histogram and ones above a threshold
+ are logged. While the loop keeps up, the alive callback is called at most once per alive
+ interval, which is meant for watchdog notifications: a wedged loop never gets to run it.
+
+ The timer runs on its own strand so it does not queue behind servers. With several
+ threads a single stuck one may go unnoticed as long as others keep running.
+ */
+class LagMonitor : public ref_counted<LagMonitor> {
+    friend ref_counted<LagMonitor>;
+public:
+    using Clock = std::chrono::steady_clock;
+    using AliveCallback = std::function<void ()>;
+public:
+    LagMonitor(asio::io_context & ctxt, AliveCallback onAlive, Clock::duration aliveInterval):
+        m_timer(asio::make_strand(ctxt)),
+        m_onAlive(std::move(onAlive)),
+        m_aliveInterval(aliveInterval) {
+    }
+
+    //These can be called from any thread. The io_context does not run out of work until stop()
+    void start();
+    void stop();
+
+private:
+    ~LagMonitor() noexcept {
+    }
+
+    void schedule();
+    void check(Clock::time_point expected);
+
+private:
+    asio::steady_timer m_timer;
+    AliveCallback m_onAlive;
+    Clock::duration m_aliveInterval;
+    Clock::time_point m_lastAlive;
+    bool m_stopped = false;
+};
+
+#endif
@@ -0,0 +1,96 @@
+// Copyright (c) 2022, Eugene Gershnik
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "latency.h"
+
+std::array<LatencyHistogram, g_latencyStageCount> Latency::s_histograms;
+
+static const char * const g_stageNames[] = {
+    "udp_queue",
+    "udp_parse",
+    "handle",
+    "build",
+    "dump",
+    "udp_send",
+    "http_read",
+    "http_parse",
+    "http_write",
+    "reply",
+    "loop_lag"
+};
+static_assert(std::size(g_stageNames) == g_latencyStageCount);
+
+static constexpr double g_reportedQuantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+//the bucket math must cover the value range it claims to
+static_assert(LatencyHistogram::bucketIndex(0) == 0);
+static_assert(LatencyHistogram::bucketIndex(15) == 15);
+static_assert(LatencyHistogram::bucketIndex(16) == 16);
+static_assert(LatencyHistogram::bucketIndex(uint64_t(1) << 40) == LatencyHistogram::bucketCount - 1);
+static_assert(LatencyHistogram::bucketUpperBound(LatencyHistogram::bucketIndex(1000)) > 1000);
+static_assert(LatencyHistogram::bucketUpperBound(LatencyHistogram::bucketIndex(1000) - 1) <= 1000);
+
+auto LatencyHistogram::snapshot() const -> Snapshot {
+    Snapshot ret;
+    ret.count = 0;
+    for (size_t i = 0; i < bucketCount; ++i) {
+        ret.buckets[i] = m_buckets[i].load(std::memory_order_relaxed);
+        ret.count += ret.buckets[i];
+    }
+    ret.sumNs = m_sumNs.load(std::memory_order_relaxed);
+    return ret;
+}
+
+auto LatencyHistogram::Snapshot::quantile(double q) const -> uint64_t {
+    if (count == 0)
+        return 0;
+    auto rank = std::max(uint64_t(1), uint64_t(std::ceil(q * double(count))));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < bucketCount; ++i) {
+        seen += buckets[i];
+        if (seen >= rank)
+            return bucketUpperBound(i);
+    }
+    return bucketUpperBound(bucketCount - 1);
+}
+
+auto LatencyHistogram::Snapshot::max() const -> uint64_t {
+    for (size_t i = bucketCount; i > 0; --i) {
+        if (buckets[i - 1])
+            return bucketUpperBound(i - 1);
+    }
+    return 0;
+}
+
+void Latency::format(std::string & dest) {
+
+    auto out = std::back_inserter(dest);
+    fmt::format_to(out, "# HELP wsddn_stage_latency_seconds Time spent in each stage of request processing\n"
+                        "# TYPE wsddn_stage_latency_seconds summary\n");
+    for (size_t i = 0; i < g_latencyStageCount; ++i) {
+        auto snap = s_histograms[i].snapshot();
+        for (auto q: g_reportedQuantiles)
+            fmt::format_to(out, "wsddn_stage_latency_seconds{{stage=\"{}\",quantile=\"{}\"}} {}\n",
+                           g_stageNames[i], q, double(snap.quantile(q)) / 1e9);
+        fmt::format_to(out, "wsddn_stage_latency_seconds_sum{{stage=\"{}\"}} {}\n", g_stageNames[i], double(snap.sumNs) / 1e9);
+        fmt::format_to(out, "wsddn_stage_latency_seconds_count{{stage=\"{}\"}} {}\n", g_stageNames[i], snap.count);
+    }
+}
+
+void Latency::log() {
+
+    auto toMicro = [](uint64_t ns) { return double(ns) / 1000; };
+
+    WSDLOG_INFO("Stage latencies in microseconds since start:");
+    for (size_t i = 0; i < g_latencyStageCount; ++i) {
+        auto snap = s_histograms[i].snapshot();
+        if (snap.count == 0) {
+            WSDLOG_INFO("  {}: no samples", g_stageNames[i]);
+            continue;
+        }
+        WSDLOG_INFO("  {}: count={} mean={:.1f} p50={:.1f} p90={:.1f} p99={:.1f} p99.9={:.1f} max={:.1f}",
+                    g_stageNames[i], snap.count, toMicro(snap.sumNs) / double(snap.count),
+                    toMicro(snap.quantile(0.5)), toMicro(snap.quantile(0.9)), toMicro(snap.quantile(0.99)),
+                    toMicro(snap.quantile(0.999)), toMicro(snap.max()));
+    }
+}
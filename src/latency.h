@@ -0,0 +1,140 @@
+// Copyright (c) 2022, Eugene Gershnik
+// SPDX-License-Identifier: BSD-3-Clause
+
+#ifndef HEADER_LATENCY_H_INCLUDED
+#define HEADER_LATENCY_H_INCLUDED
+
+/*
+ Fixed memory latency histograms for the stages a message goes through.
+
+ Buckets are log-linear in the manner of HDR histograms: values below 16ns get a bucket
+ each and every power of two above that is split into 16 sub-buckets, so any recorded
+ value is known to within 1/16 (6.25%) of itself. Anything above ~18 minutes lands in the
+ last bucket. Recording is a couple of relaxed atomic increments and can be done from any
+ thread, so the histograms are always on.
+ */
+
+enum class LatencyStage : unsigned {
+    UdpQueue,       //kernel receiving a datagram until we read it, where kernel timestamps are available
+    UdpParse,       //XmlDoc::readMemory of a received datagram
+    Handle,         //processing a parsed request up to having the response content
+    Build,          //building response XML document
+    Dump,           //serializing response XML document
+    UdpSend,        //async_send_to of a response or announcement until completion
+    HttpRead,       //first bytes of an HTTP request until all of it is received
+    HttpParse,      //time spent parsing HTTP request body XML
+    HttpWrite,      //async_write of an HTTP response until completion
+    Reply,          //datagram arrival until the first copy of the reply to it is sent
+    LoopLag         //not a message stage: how late the event loop runs a periodic timer
+};
+constexpr size_t g_latencyStageCount = size_t(LatencyStage::LoopLag) + 1;
+
+class LatencyHistogram {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    static constexpr unsigned subBucketBits = 4;
+    static constexpr unsigned maxExponent = 39;
+    static constexpr size_t subBucketCount = size_t(1) << subBucketBits;
+    static constexpr size_t bucketCount = (maxExponent - subBucketBits + 2) * subBucketCount;
+
+    struct Snapshot {
+        std::array<uint64_t, bucketCount> buckets;
+        uint64_t count;
+        uint64_t sumNs;
+
+        //Upper edge of the bucket the given quantile falls in. 0 if nothing has been recorded
+        auto quantile(double q) const -> uint64_t;
+        auto max() const -> uint64_t;
+    };
+public:
+    void record(Clock::duration elapsed) noexcept {
+        auto ns = uint64_t(std::max(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count(), std::chrono::nanoseconds::rep(0)));
+        m_buckets[bucketIndex(ns)].fetch_add(1, std::memory_order_relaxed);
+        m_sumNs.fetch_add(ns, std::memory_order_relaxed);
+    }
+    void recordSince(Clock::time_point start) noexcept {
+        record(Clock::now() - start);
+    }
+
+    //Not atomic as a whole but every bucket is counted exactly once
+    auto snapshot() const -> Snapshot;
+
+    static constexpr auto bucketIndex(uint64_t ns) noexcept -> size_t {
+        if (ns < subBucketCount)
+            return size_t(ns);
+        unsigned exponent = unsigned(std::bit_width(ns)) - 1;
+        if (exponent > maxExponent)
+            return bucketCount - 1;
+        unsigned shift = exponent - subBucketBits;
+        return (shift + 1) * subBucketCount + size_t((ns >> shift) - subBucketCount);
+    }
+    //Smallest value that does not fall into the bucket
+    static constexpr auto bucketUpperBound(size_t idx) noexcept -> uint64_t {
+        if (idx < subBucketCount)
+            return idx + 1;
+        auto shift = unsigned(idx / subBucketCount - 1);
+        return (subBucketCount + idx % subBucketCount + 1) << shift;
+    }
+private:
+    std::array<std::atomic<uint64_t>, bucketCount> m_buckets{};
+    std::atomic<uint64_t> m_sumNs = 0;
+};
+
+class Latency {
+public:
+    static auto histogram(LatencyStage stage) noexcept -> LatencyHistogram & {
+        return s_histograms[size_t(stage)];
+    }
+
+    static void record(LatencyStage stage, LatencyHistogram::Clock::time_point start) noexcept {
+        histogram(stage).recordSince(start);
+    }
+
+    //Replies slower than this are logged. Zero means no target
+    static auto replySlo() noexcept -> std::chrono::milliseconds {
+        return std::chrono::milliseconds(s_replySloMs.load(std::memory_order_relaxed));
+    }
+    static void setReplySlo(std::chrono::milliseconds slo) noexcept {
+        s_replySloMs.store(slo.count(), std::memory_order_relaxed);
+    }
+
+    //Appends summaries in Prometheus text format
+    static void format(std::string & dest);
+    //Writes a line per stage with count and percentiles to the log
+    static void log();
+private:
+    static std::array<LatencyHistogram, g_latencyStageCount> s_histograms;
+    static inline std::atomic<std::chrono::milliseconds::rep> s_replySloMs = 0;
+};
+
+//Records time from construction to stop() or destruction, whichever comes first
+class LatencyTimer {
+public:
+    explicit LatencyTimer(LatencyStage stage) noexcept:
+        m_stage(stage),
+        m_start(LatencyHistogram::Clock::now()) {
+    }
+    ~LatencyTimer() noexcept {
+        stop();
+    }
+    LatencyTimer(const LatencyTimer &) = delete;
+    LatencyTimer & operator=(const LatencyTimer &) = delete;
+
+    //Returns the recorded time
+    auto stop() noexcept -> LatencyHistogram::Clock::duration {
+        if (m_active) {
+            m_elapsed = LatencyHistogram::Clock::now() - m_start;
+            Latency::histogram(m_stage).record(m_elapsed);
+            m_active = false;
+        }
+        return m_elapsed;
+    }
+private:
+    LatencyStage m_stage;
+    LatencyHistogram::Clock::time_point m_start;
+    LatencyHistogram::Clock::duration m_elapsed{};
+    bool m_active = true;
+};
+
+#endif
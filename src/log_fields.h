@@ -0,0 +1,74 @@
+// Copyright (c) 2022, Eugene Gershnik
+// SPDX-License-Identifier: BSD-3-Clause
+
+#ifndef HEADER_LOG_FIELDS_H_INCLUDED
+#define HEADER_LOG_FIELDS_H_INCLUDED
+
+/*
+ Structured fields describing what the current thread is working on, for log destinations
+ that store them separately from the message text (journald). Messages logged while a
+ LogFieldsScope exists carry its fields. Unless such a destination is in use scopes do
+ nothing, so setting them on hot paths is free.
+
+ Empty values mean "not set".
+ */
+struct LogFields {
+    sys_string interface;
+    sys_string address;
+    sys_string action;
+    sys_string messageId;
+    sys_string peer;
+
+    //Fields in effect on this thread, nullptr if none
+    static auto current() noexcept -> const LogFields * {
+        return t_current;
+    }
+    static auto wanted() noexcept -> bool {
+        return s_wanted.load(std::memory_order_relaxed);
+    }
+    //Called by destinations that use the fields. There is no going back
+    static void setWanted() noexcept {
+        s_wanted.store(true, std::memory_order_relaxed);
+    }
+private:
+    friend class LogFieldsScope;
+
+    static inline thread_local const LogFields * t_current = nullptr;
+    static inline std::atomic<bool> s_wanted = false;
+};
+
+class LogFieldsScope {
+public:
+    //Adds to or overrides the fields of the enclosing scope. The setter is only called if fields are wanted
+    template<class Setter>
+    explicit LogFieldsScope(Setter && setter) {
+        if (!LogFields::wanted())
+            return;
+        m_previous = LogFields::t_current;
+        if (m_previous)
+            m_fields = *m_previous;
+        else
+            m_fields.emplace();
+        std::forward<Setter>(setter)(*m_fields);
+        LogFields::t_current = &*m_fields;
+        m_active = true;
+    }
+    //Makes the given fields, which must outlive the scope, current. Used to carry them across threads
+    explicit LogFieldsScope(const LogFields * fields) noexcept:
+        m_previous(LogFields::t_current),
+        m_active(true) {
+        LogFields::t_current = fields;
+    }
+    ~LogFieldsScope() noexcept {
+        if (m_active)
+            LogFields::t_current = m_previous;
+    }
+    LogFieldsScope(const LogFieldsScope &) = delete;
+    LogFieldsScope & operator=(const LogFieldsScope &) = delete;
+private:
+    std::optional<LogFields> m_fields;
+    const LogFields * m_previous = nullptr;
+    bool m_active = false;
+};
+
+#endif
@@ -0,0 +1,73 @@
+// Copyright (c) 2022, Eugene Gershnik
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "log_limiter.h"
+
+LogLimiter::LogLimiter(spdlog::level::level_enum level, const char * file, int line) noexcept:
+    m_level(level),
+    m_file(file),
+    m_line(line),
+    m_next(s_first.load(std::memory_order_relaxed)) {
+
+    //__FILE__ might be a full path
+    if (auto * slash = strrchr(file, '/'))
+        m_file = slash + 1;
+    //the list only grows so a reader never sees a dangling pointer
+    while (!s_first.compare_exchange_weak(m_next, this, std::memory_order_release, std::memory_order_relaxed))
+        ;
+}
+
+auto LogLimiter::takeExpired(Clock::time_point now) -> Decision {
+
+    Decision ret;
+    if (now - m_windowStart >= interval) {
+        if (m_suppressed) {
+            ret.suppressed = std::exchange(m_suppressed, 0);
+            ret.suppressedOver = now - m_windowStart;
+        }
+        m_windowStart = now;
+        m_loggedInWindow = 0;
+    }
+    return ret;
+}
+
+auto LogLimiter::admit(const ip::address & peer) -> Decision {
+
+    auto now = Clock::now();
+    auto & slot = m_peers[std::hash<ip::address>()(peer) % peerSlots];
+
+    std::lock_guard lock(m_mutex);
+    auto ret = takeExpired(now);
+    bool peerAllowed = !slot.used || slot.peer != peer || now - slot.lastLogged >= interval;
+    if (!peerAllowed || m_loggedInWindow >= siteBudget) {
+        ++m_suppressed;
+        return ret;
+    }
+    slot.peer = peer;
+    slot.lastLogged = now;
+    slot.used = true;
+    ++m_loggedInWindow;
+    ret.admitted = true;
+    return ret;
+}
+
+void LogLimiter::logSuppressed(const Decision & decision) const {
+
+    auto seconds = std::chrono::duration_cast<std::chrono::seconds>(decision.suppressedOver).count();
+    spdlog::log(m_level, "{} messages from {}:{} were suppressed in the last {}s", 
+                decision.suppressed, m_file, m_line, seconds);
+}
+
+void LogLimiter::reportExpired() {
+
+    auto now = Clock::now();
+    for (auto * limiter = s_first.load(std::memory_order_acquire); limiter; limiter = limiter->m_next) {
+        Decision decision;
+        {
+            std::lock_guard lock(limiter->m_mutex);
+            decision = limiter->takeExpired(now);
+        }
+        if (decision.suppressed)
+            limiter->logSuppressed(decision);
+    }
+}
@@ -0,0 +1,84 @@
+// Copyright (c) 2022, Eugene Gershnik
+// SPDX-License-Identifier: BSD-3-Clause
+
+#ifndef HEADER_LOG_LIMITER_H_INCLUDED
+#define HEADER_LOG_LIMITER_H_INCLUDED
+
+/*
+ Rate limiting for log messages that other hosts can trigger at will.
+
+ Every call site using WSDLOG_XXX_LIMITED macros has its own limiter. The first message
+ about a given peer is logged and further ones about it within the interval are counted
+ instead. Regardless of peers a site logs at most siteBudget messages per interval, so
+ spoofing source addresses does not get around it. Once an interval with suppressed 
+ messages is over, how many were suppressed is logged, naming the site's source location.
+ This happens on the next call from the site, whether it is logged or not, or from 
+ reportExpired() which the event loop calls periodically for sites that went quiet.
+
+ When a message is not going to be logged at all because of its level nothing of this runs.
+ */
+class LogLimiter {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    static constexpr Clock::duration interval = std::chrono::seconds(10);
+    static constexpr unsigned siteBudget = 10;
+    static constexpr size_t peerSlots = 32;
+
+    struct Decision {
+        bool admitted = false;
+        //Messages suppressed in an interval that has just ended and how long ago it started
+        uint64_t suppressed = 0;
+        Clock::duration suppressedOver{};
+    };
+public:
+    //Limiters must live forever, they are registered for reportExpired()
+    LogLimiter(spdlog::level::level_enum level, const char * file, int line) noexcept;
+    LogLimiter(const LogLimiter &) = delete;
+    LogLimiter & operator=(const LogLimiter &) = delete;
+
+    auto admit(const ip::address & peer) -> Decision;
+
+    void logSuppressed(const Decision & decision) const;
+
+    //Logs suppression counts of all sites whose interval has ended
+    static void reportExpired();
+private:
+    auto takeExpired(Clock::time_point now) -> Decision;
+private:
+    struct PeerState {
+        ip::address peer;
+        Clock::time_point lastLogged;
+        bool used = false;
+    };
+
+    spdlog::level::level_enum m_level;
+    const char * m_file;
+    int m_line;
+    LogLimiter * m_next;
+    std::mutex m_mutex;
+    //peers that collide simply evict each other, the site budget still applies
+    std::array<PeerState, peerSlots> m_peers;
+    Clock::time_point m_windowStart;
+    unsigned m_loggedInWindow = 0;
+    uint64_t m_suppressed = 0;
+
+    static inline std::atomic<LogLimiter *> s_first = nullptr;
+};
+
+#define WSDLOG_LIMITED(level, peer, ...) do { \
+        if (spdlog::should_log(level)) { \
+            static LogLimiter wsdLogLimiter(level, __FILE__, __LINE__); \
+            auto wsdLogDecision = wsdLogLimiter.admit(peer); \
+            if (wsdLogDecision.suppressed) \
+                wsdLogLimiter.logSuppressed(wsdLogDecision); \
+            if (wsdLogDecision.admitted) \
+                spdlog::log(level, __VA_ARGS__); \
+        } \
+    } while(false)
+
+#define WSDLOG_INFO_LIMITED(peer, ...)  WSDLOG_LIMITED(spdlog::level::info, peer, __VA_ARGS__)
+#define WSDLOG_WARN_LIMITED(peer, ...)  WSDLOG_LIMITED(spdlog::level::warn, peer, __VA_ARGS__)
+#define WSDLOG_ERROR_LIMITED(peer, ...) WSDLOG_LIMITED(spdlog::level::err,  peer, __VA_ARGS__)
+
+#endif
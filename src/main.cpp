@@ -3,18 +3,26 @@
 
 #include "app_state.h"
 #include "server_manager.h"
+#include "handoff.h"
+#include "file_watcher.h"
+#include "latency.h"
+#include "lag_monitor.h"
 #include "exc_handling.h"
+#include "flight_recorder.h"
+#include "log_limiter.h"
 
 #define EXIT_RELOAD 2
 
 static_assert(EXIT_RELOAD != EXIT_FAILURE);
 
 
-static std::random_device g_RandomDevice;
-std::mt19937 g_Random(g_RandomDevice());
+thread_local std::mt19937 g_Random(std::random_device{}());
 
 static std::optional<ptl::ChildProcess> g_maybeChildProcess;
 static std::atomic<sig_atomic_t> g_reload = 0;
+static std::atomic<sig_atomic_t> g_handoff = 0;
+static std::atomic<sig_atomic_t> g_filesChanged = 0;
+static std::atomic<sig_atomic_t> g_updatesCompleted = 0;
 static ptl::SignalSet g_controlSignals;
 
 
@@ -25,10 +33,358 @@ static inline void unblockSignals() {
     ptl::setSignalProcessMask(SIG_UNBLOCK, g_controlSignals);
 }
 
-static auto waitForChild() -> std::optional<int> {
+/*
+ The parent sends configuration updates and handoff requests to the child over the same 
+ socket the child uses to detect parent's exit. Each message is a native endian uint32_t size 
+ followed by that many bytes of TOML holding either the serialized Config and the current 
+ log level or a handoff flag. The child answers the latter with a SocketHandoff.
+ */
+
+static void writeAll(const ptl::FileDescriptor & fd, const void * data, size_t size) {
+    auto * ptr = static_cast<const std::byte *>(data);
+    while (size) {
+        ptl::AllowedErrors<EINTR> ec;
+        auto written = size_t(writeFile(fd, ptr, size, ec));
+        if (ec)
+            continue;
+        ptr += written;
+        size -= written;
+    }
+}
+
+static void sendToChild(const ptl::FileDescriptor & fd, const toml::table & message) {
+    std::ostringstream out;
+    out << message;
+    auto body = std::move(out).str();
+    
+    auto size = uint32_t(body.size());
+    writeAll(fd, &size, sizeof(size));
+    writeAll(fd, body.data(), body.size());
+}
+
+static void sendConfigToChild(const ptl::FileDescriptor & fd, const Config & config) {
+    toml::table message;
+    message.insert("log-level", int64_t(spdlog::get_level()));
+    message.insert("config", config.serialize());
+    sendToChild(fd, message);
+}
+
+static auto tryReloadInPlace(AppState & appState) -> bool {
+    
+    appState.notify(AppState::DaemonStatus::Reloading);
+    if (!appState.reloadInPlace()) {
+        WSDLOG_INFO("New configuration requires restart");
+        return false;
+    }
+    appState.notify(AppState::DaemonStatus::Ready);
+    return true;
+}
+
+static auto reloadChild(AppState & appState, const ptl::FileDescriptor & controlFd) -> bool {
+    
+    if (!tryReloadInPlace(appState))
+        return false;
+    try {
+        sendConfigToChild(controlFd, *appState.config());
+    } catch(std::system_error & ex) {
+        WSDLOG_ERROR("Unable to send configuration to child: {}", ex.what());
+        return false;
+    }
+    return true;
+}
+
+static void updateChild(const ptl::FileDescriptor & controlFd, const Config & config) {
+    
+    try {
+        sendConfigToChild(controlFd, config);
+    } catch(std::system_error & ex) {
+        //the child is gone and waitForChild() will deal with it
+        WSDLOG_ERROR("Unable to send configuration to child: {}", ex.what());
+    }
+}
+
+static auto requestHandOffFromChild(const ptl::FileDescriptor & controlFd) -> refcnt_ptr<SocketHandoff> {
+    
+    WSDLOG_INFO("Requesting handoff from child");
+    try {
+        sendToChild(controlFd, toml::table{{"handoff", true}});
+        return SocketHandoff::receive(controlFd);
+    } catch(std::exception & ex) {
+        WSDLOG_ERROR("Unable to obtain handoff from child: {}", ex.what());
+        return nullptr;
+    }
+}
+
+static auto handOver(AppState & appState, const SocketHandoff & handoff) -> bool {
+    
+    WSDLOG_INFO("Starting new instance to take over {} servers", handoff.serverCount());
+    try {
+        auto [pid, channel] = SocketHandoff::startSuccessor(appState.successorArgs());
+        appState.handOver(pid);
+        handoff.send(channel);
+        WSDLOG_INFO("Handed over to process {}", pid);
+    } catch(std::exception & ex) {
+        WSDLOG_ERROR("Unable to hand over to new instance: {}", ex.what());
+        return false;
+    }
+    return true;
+}
+
+//Makes servers started from now on pick up where the previous owner of the sockets left
+static void adoptHandOff(AppState & appState, const refcnt_ptr<SocketHandoff> & handoff) {
+    
+    auto & config = *appState.config();
+    if (handoff->endpointIdentifier() == config.endpointIdentifier()) {
+        config.continueInstanceOf(handoff->instanceIdentifier());
+    } else {
+        WSDLOG_WARN("Endpoint identifier has changed across handoff, servers will announce themselves anew");
+        handoff->forgetProtocolState();
+    }
+    WSDLOG_INFO("Taking over {} servers", handoff->serverCount());
+    SocketHandoff::install(handoff);
+}
+
+/*
+ Watches the files the current configuration has been read from and reports their changes 
+ on the strand. Watching starts only once identity detection is complete since it re-reads 
+ smb.conf anyway.
+ */
+class ConfigFileWatch : private FileWatcher::Handler {
+public:
+    using Callback = std::function<void (const std::set<std::filesystem::path> &)>;
+    
+    ConfigFileWatch(const Strand & strand, Callback callback):
+        m_strand(strand),
+        m_callback(std::move(callback)) {
+    }
+    ~ConfigFileWatch() {
+        stop();
+    }
+    ConfigFileWatch(const ConfigFileWatch &) = delete;
+    ConfigFileWatch & operator=(const ConfigFileWatch &) = delete;
+    
+    //These must be called on the strand
+    void update(const Config & config) {
+        if (config.isIdentityProvisional())
+            return;
+        auto files = config.watchedFiles();
+        if (m_watcher && files == m_files)
+            return;
+        stop();
+        m_files = std::move(files);
+        if (m_files.empty())
+            return;
+        try {
+            m_watcher = createFileWatcher(m_strand, m_files);
+            m_watcher->start(*this);
+        } catch(std::system_error & ex) {
+            WSDLOG_ERROR("Unable to watch configuration files: {}", ex.what());
+            m_watcher.reset();
+        }
+    }
+    void stop() {
+        if (m_watcher) {
+            m_watcher->stop();
+            m_watcher.reset();
+        }
+    }
+    
+private:
+    void onFilesChanged(const std::set<std::filesystem::path> & files) override {
+        m_callback(files);
+    }
+    
+private:
+    Strand m_strand;
+    Callback m_callback;
+    std::set<std::filesystem::path> m_files;
+    refcnt_ptr<FileWatcher> m_watcher;
+};
+
+/*
+ Wakes the parent up from waiting for the child. Whoever needs attention sets its flag 
+ first and then writes a byte here, so a wakeup that comes after the flags were checked 
+ but before the wait started is not lost. Notifying is async-signal-safe.
+ */
+class ParentWakeup {
+public:
+    ParentWakeup(): ParentWakeup(createSocketPair()) {
+    }
+    ~ParentWakeup() {
+        s_notifyFd = -1;
+    }
+    ParentWakeup(const ParentWakeup &) = delete;
+    ParentWakeup & operator=(const ParentWakeup &) = delete;
+
+    static void notify() noexcept {
+        int fd = s_notifyFd.load(std::memory_order_relaxed);
+        if (fd < 0)
+            return;
+        int savedErrno = errno;
+        char c = 0;
+        //if the buffer is full a wakeup is already pending
+        (void)::write(fd, &c, 1);
+        errno = savedErrno;
+    }
+
+    //Also returns when extraFd, unless it is -1, becomes readable and tells whether it has
+    auto wait(int extraFd) -> bool {
+        std::array<pollfd, 2> pfds{{{m_waitFd.get(), POLLIN, 0}, {extraFd, POLLIN, 0}}};
+        if (::poll(pfds.data(), nfds_t(extraFd < 0 ? 1 : 2), -1) < 0) {
+            if (errno != EINTR)
+                ptl::throwErrorCode(errno, "poll");
+            return false;
+        }
+        char buf[64];
+        while (::read(m_waitFd.get(), buf, sizeof(buf)) > 0)
+            ;
+        return pfds[1].revents != 0;
+    }
+private:
+    ParentWakeup(std::pair<ptl::FileDescriptor, ptl::FileDescriptor> fds):
+        m_waitFd(std::move(fds.first)),
+        m_notifyFd(std::move(fds.second)) {
+
+        for (int fd: {m_waitFd.get(), m_notifyFd.get()}) {
+            int flags = fcntl(fd, F_GETFL);
+            if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+                ptl::throwErrorCode(errno, "fcntl(F_SETFL)");
+        }
+        s_notifyFd = m_notifyFd.get();
+    }
+private:
+    ptl::FileDescriptor m_waitFd;
+    ptl::FileDescriptor m_notifyFd;
+    static inline std::atomic<int> s_notifyFd = -1;
+};
+
+/*
+ The parent has no event loop so it watches files on a thread of its own. Changes are 
+ accumulated here and the main thread is woken up from its wait for the child via 
+ ParentWakeup.
+ */
+class ParentFileWatch {
+public:
+    ParentFileWatch():
+        m_strand(asio::make_strand(m_ctxt)),
+        m_work(asio::make_work_guard(m_ctxt)),
+        m_watch(m_strand, [this](const std::set<std::filesystem::path> & files) {
+            {
+                std::lock_guard lock(m_mutex);
+                m_changes.insert(files.begin(), files.end());
+            }
+            g_filesChanged = 1;
+            ParentWakeup::notify();
+        }),
+        m_thread([this]() {
+            try {
+                m_ctxt.run();
+            } catch(std::exception & ex) {
+                WSDLOG_ERROR("Watching configuration files failed: {}", ex.what());
+            }
+        }) {
+    }
+    ~ParentFileWatch() {
+        asio::post(m_strand, [this]() {
+            m_watch.stop();
+        });
+        m_work.reset();
+        m_thread.join();
+    }
+    ParentFileWatch(const ParentFileWatch &) = delete;
+    ParentFileWatch & operator=(const ParentFileWatch &) = delete;
+    
+    void update(const refcnt_ptr<Config> & config) {
+        asio::post(m_strand, [this, config]() {
+            m_watch.update(*config);
+        });
+    }
+    
+    auto takeChanges() -> std::set<std::filesystem::path> {
+        std::lock_guard lock(m_mutex);
+        return std::exchange(m_changes, {});
+    }
+    
+private:
+    asio::io_context m_ctxt;
+    Strand m_strand;
+    asio::executor_work_guard<asio::io_context::executor_type> m_work;
+    ConfigFileWatch m_watch;
+    std::mutex m_mutex;
+    std::set<std::filesystem::path> m_changes;
+    std::thread m_thread;
+};
+
+/*
+ The parent has no event loop so slow configuration updates run on threads of their own.
+ What to do with their results is queued here and done on the main thread once it is woken 
+ up from its wait for the child via ParentWakeup.
+ */
+class ParentUpdates {
+public:
+    using Update = std::function<auto () -> refcnt_ptr<Config>>;
+    using Completion = std::function<void (const refcnt_ptr<Config> & base, const refcnt_ptr<Config> & updated)>;
+    
+    ParentUpdates() = default;
+    ParentUpdates(const ParentUpdates &) = delete;
+    ParentUpdates & operator=(const ParentUpdates &) = delete;
+    
+    //Must be called with control signals unblocked
+    void start(refcnt_ptr<Config> base, Update update, Completion complete) {
+        std::erase_if(m_running, [](const std::future<void> & running) {
+            return running.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+        });
+        //the updating thread inherits blocked control signals
+        blockSignals();
+        m_running.push_back(std::async(std::launch::async, [this, base, update, complete]() {
+            auto updated = update();
+            if (!updated)
+                return;
+            {
+                std::lock_guard lock(m_mutex);
+                m_completions.push_back([=]() {
+                    complete(base, updated);
+                });
+            }
+            g_updatesCompleted = 1;
+            ParentWakeup::notify();
+        }));
+        unblockSignals();
+    }
+    
+    auto takeCompletions() -> std::vector<std::function<void ()>> {
+        std::lock_guard lock(m_mutex);
+        return std::exchange(m_completions, {});
+    }
+    
+private:
+    std::mutex m_mutex;
+    std::vector<std::function<void ()>> m_completions;
+    //destroyed first, the futures' destructors wait for the threads to finish
+    std::vector<std::future<void>> m_running;
+};
+
+//Whether the child has exited, without reaping it
+static auto childHasExited() -> bool {
+    for ( ; ; ) {
+        siginfo_t info{};
+        if (::waitid(P_PID, id_t(g_maybeChildProcess->get()), &info, WEXITED | WNOHANG | WNOWAIT) == 0)
+            return info.si_pid != 0;
+        //let the real wait report any other error
+        if (errno != EINTR)
+            return true;
+    }
+}
+
+//aliveFd, if valid, receives a byte from the child every time it wants the watchdog notified
+static auto waitForChild(AppState & appState, const ptl::FileDescriptor & controlFd,
+                         const ptl::FileDescriptor & aliveFd,
+                         refcnt_ptr<SocketHandoff> & handoff) -> std::optional<int> {
     
     WSDLOG_INFO("Waiting for child");
     
+    ParentWakeup wakeup;
+    
     auto oldSigInt = ptl::setSignalHandler(SIGINT, [](int) {
         assert(g_maybeChildProcess);
         (void)::kill(g_maybeChildProcess->get(), SIGINT);
@@ -39,14 +395,101 @@ static auto waitForChild() -> std::optional<int> {
     });
     auto oldSigHup = ptl::setSignalHandler(SIGHUP, [](int) {
         g_reload = 1;
+        ParentWakeup::notify();
+    });
+    auto oldSigUsr2 = ptl::setSignalHandler(SIGUSR2, [](int) {
+        g_handoff = 1;
+        ParentWakeup::notify();
+    });
+    auto oldSigChld = ptl::setSignalHandler(SIGCHLD, [](int) {
+        ParentWakeup::notify();
+    });
+    //requests are processed by the child
+    auto oldSigUsr1 = ptl::setSignalHandler(SIGUSR1, [](int) {
         assert(g_maybeChildProcess);
-        (void)::kill(g_maybeChildProcess->get(), SIGINT);
+        (void)::kill(g_maybeChildProcess->get(), SIGUSR1);
     });
     
+    //the watching thread inherits blocked control signals
+    std::optional<ParentFileWatch> fileWatch;
+    fileWatch.emplace();
+    fileWatch->update(appState.config());
+    
     unblockSignals();
     
+    ParentUpdates updates;
+    //the child is already serving with provisional configuration, it cannot run detection itself
+    auto startIdentityDetection = [&]() {
+        auto detectIdentity = appState.identityDetection();
+        if (!detectIdentity)
+            return;
+        updates.start(appState.config(), detectIdentity, [&](const refcnt_ptr<Config> & provisional, const refcnt_ptr<Config> & detected) {
+            if (!appState.completeUpdate(provisional, detected))
+                return;
+            WSDLOG_INFO("Identity detection completed");
+            updateChild(controlFd, *detected);
+            fileWatch->update(detected);
+        });
+    };
+    std::function<void (const std::set<std::filesystem::path> &)> startFileRefresh = [&](const std::set<std::filesystem::path> & files) {
+        updates.start(appState.config(), appState.fileRefresh(files), [&, files](const refcnt_ptr<Config> & base, const refcnt_ptr<Config> & refreshed) {
+            //the configuration has been replaced meanwhile so re-read the files on top of the new one
+            if (!appState.completeUpdate(base, refreshed))
+                return startFileRefresh(files);
+            updateChild(controlFd, *refreshed);
+            fileWatch->update(refreshed);
+        });
+    };
+    startIdentityDetection();
+    
     int status = 0;
+    bool stoppingChild = false;
+    int aliveWaitFd = aliveFd ? aliveFd.get() : -1;
     for ( ; ; ) {
+        //once the child handed off its sockets it is just waiting to exit
+        if (g_handoff && !stoppingChild && !handoff) {
+            g_handoff = 0;
+            if (!appState.canHandOver()) {
+                WSDLOG_WARN("Handoff is not supported under this service manager");
+            } else if (!(handoff = requestHandOffFromChild(controlFd))) {
+                //the child is in unknown state, so restart it
+                g_reload = 1;
+                stoppingChild = true;
+                (void)::kill(g_maybeChildProcess->get(), SIGINT);
+            }
+        }
+        if (g_reload && !stoppingChild && !handoff) {
+            g_reload = 0;
+            if (!reloadChild(appState, controlFd)) {
+                g_reload = 1;
+                stoppingChild = true;
+                (void)::kill(g_maybeChildProcess->get(), SIGINT);
+            } else {
+                startIdentityDetection();
+                fileWatch->update(appState.config());
+            }
+        }
+        if (g_filesChanged && !stoppingChild && !handoff) {
+            g_filesChanged = 0;
+            startFileRefresh(fileWatch->takeChanges());
+        }
+        if (g_updatesCompleted && !stoppingChild && !handoff) {
+            g_updatesCompleted = 0;
+            for (auto & complete: updates.takeCompletions())
+                complete();
+        }
+        
+        if (!childHasExited()) {
+            if (wakeup.wait(aliveWaitFd)) {
+                char buf[64];
+                auto res = ::read(aliveWaitFd, buf, sizeof(buf));
+                if (res > 0)
+                    appState.notify(AppState::DaemonStatus::Alive);
+                else if (res == 0)  //the child is exiting
+                    aliveWaitFd = -1;
+            }
+            continue;
+        }
         ptl::AllowedErrors<EINTR> ec;
         auto maybeStatus = g_maybeChildProcess->wait(ec);
         if (maybeStatus) {
@@ -54,9 +497,15 @@ static auto waitForChild() -> std::optional<int> {
             break;
         }
     }
+    fileWatch.reset();
+    g_filesChanged = 0;
+    g_updatesCompleted = 0;
     ptl::setSignalHandler(SIGINT, oldSigInt);
     ptl::setSignalHandler(SIGTERM, oldSigTerm);
     ptl::setSignalHandler(SIGHUP, oldSigHup);
+    ptl::setSignalHandler(SIGUSR2, oldSigUsr2);
+    ptl::setSignalHandler(SIGUSR1, oldSigUsr1);
+    ptl::setSignalHandler(SIGCHLD, oldSigChld);
     
     assert(!*g_maybeChildProcess);
     g_maybeChildProcess = std::nullopt;
@@ -86,67 +535,339 @@ static auto waitForChild() -> std::optional<int> {
 }
 
 
-static void serve(const refcnt_ptr<Config> & config, ptl::FileDescriptor * monitorDesc) {
+static void runContext(asio::io_context & ctxt, const Config & config) {
+    
+    auto threadCount = config.threadCount();
+    if (threadCount == 1) {
+        ctxt.run();
+        return;
+    }
     
-    static char dummyBuffer[1];
+    WSDLOG_INFO("Processing on {} threads", threadCount);
+    
+    std::mutex errorMutex;
+    std::exception_ptr error;
+    
+    std::vector<std::thread> workers;
+    workers.reserve(threadCount);
+    for (unsigned i = 0; i < threadCount; ++i) {
+        workers.emplace_back([&, i]() {
+            if (config.threadAffinity() && !pinCurrentThreadToCpu(i))
+                WSDLOG_WARN("Unable to set CPU affinity for thread {}", i);
+            try {
+                ctxt.run();
+            } catch(...) {
+                std::lock_guard lock(errorMutex);
+                if (!error)
+                    error = std::current_exception();
+                ctxt.stop();
+            }
+        });
+    }
+    for (auto & worker: workers)
+        worker.join();
+    
+    if (error)
+        std::rethrow_exception(error);
+}
+
+static void applyConfig(ServerManager & serverManager, const refcnt_ptr<Config> & config) {
+    
+    auto changes = config->changesFrom(*serverManager.config());
+    if (!changes.any()) {
+        WSDLOG_INFO("Configuration is unchanged");
+        return;
+    }
+    WSDLOG_INFO("Applying new configuration without restart");
+    serverManager.reconfigure(config, changes);
+}
+
+static void applyConfigFromParent(ServerManager & serverManager, const toml::table & table) {
+    
+    if (auto level = table["log-level"].value<int64_t>())
+        spdlog::set_level(spdlog::level::level_enum(*level));
+    auto * configData = table["config"].as_table();
+    if (!configData)
+        throw std::runtime_error("invalid configuration message from parent");
+    applyConfig(serverManager, Config::deserialize(*configData));
+}
+
+//What a process that can read its own configuration does beyond serving. 
+//The child of a forked parent leaves all of these empty except for notifyAlive.
+struct ServeCallbacks {
+    //Returns new configuration or nullptr if a full restart is needed
+    std::function<auto () -> refcnt_ptr<Config>> reloadInPlace;
+    //Returns a function to run on a separate thread, while servers already run with the current provisional 
+    //configuration, or nullptr if it is not provisional. Its result is applied if completeUpdate accepts it
+    std::function<auto () -> std::function<auto () -> refcnt_ptr<Config>>> identityDetection;
+    //Returns a function to run on a separate thread that makes new configuration after the given files 
+    //changed or nullptr if nothing needs to change. Its result is applied if completeUpdate accepts it.
+    //If present the files configuration is read from are watched
+    std::function<auto (const std::set<std::filesystem::path> &) -> std::function<auto () -> refcnt_ptr<Config>>> fileRefresh;
+    std::function<auto (const refcnt_ptr<Config> & base, const refcnt_ptr<Config> & updated) -> bool> completeUpdate;
+    bool handOffOnSignal = false;
+    //If present called every notifyAliveInterval or so while the event loop is responsive
+    std::function<void ()> notifyAlive;
+    std::chrono::steady_clock::duration notifyAliveInterval{};
+};
+
+static void setWatchdog(AppState & appState, ServeCallbacks & callbacks) {
+    auto interval = appState.watchdogInterval();
+    if (!interval)
+        return;
+    WSDLOG_DEBUG("Watchdog enabled, interval {}ms", std::chrono::duration_cast<std::chrono::milliseconds>(*interval).count());
+    //as systemd recommends
+    callbacks.notifyAliveInterval = *interval / 2;
+    callbacks.notifyAlive = [&appState]() {
+        appState.notify(AppState::DaemonStatus::Alive);
+    };
+}
+
+//The child cannot notify the service manager itself: only the main process is allowed to
+//and the child might not even see its socket from chroot. It asks the parent instead.
+static void setChildWatchdog(std::chrono::microseconds interval, const ptl::FileDescriptor & aliveFd, 
+                             ServeCallbacks & callbacks) {
+    callbacks.notifyAliveInterval = interval / 2;
+    callbacks.notifyAlive = [fd = aliveFd.get()]() {
+        char c = 0;
+        //a parent that does not read is not notifying either, so dropping this is fine
+        (void)::send(fd, &c, 1, MSG_DONTWAIT);
+    };
+}
+
+//Returns the handoff for a successor if one has been requested via SIGUSR2 (if handOffOnSignal)
+//or by the parent
+static auto serve(const refcnt_ptr<Config> & config, ptl::FileDescriptor * monitorDesc,
+                  const ServeCallbacks & callbacks) -> refcnt_ptr<SocketHandoff> {
     
     WSDLOG_INFO("Starting processing");
     
-    asio::io_context ctxt;
+    asio::io_context ctxt(int(config->threadCount()));
+    
+    HttpServerFactory httpServerFactory = createHttpServer;
+    if (config->httpListenerMode() == HttpListenerMode::Shared)
+        httpServerFactory = createSharedHttpServer;
     
-    ServerManager serverManager(ctxt, config, createInterfaceMonitor, createHttpServer, createUdpServer);
+    ServerManager serverManager(ctxt, config, createInterfaceMonitor, httpServerFactory, createUdpServer);
     
+    //signal and parent monitoring handlers touch the server manager so they need to run on its strand
     std::shared_ptr<asio::readable_pipe> monitorPipe;
-    asio::signal_set signals(ctxt, SIGINT, SIGTERM, SIGHUP);
+    asio::signal_set signals(serverManager.strand(), SIGINT, SIGTERM, SIGHUP, SIGUSR1);
+    if (callbacks.handOffOnSignal)
+        signals.add(SIGUSR2);
     
-    signals.async_wait([&](const asio::error_code & ec, int signo){
-        if (ec)
-            throw std::system_error(ec, "async waiting for signal failed");
-        WSDLOG_INFO("Received signal: {}", ptl::signalName(signo));
-        serverManager.stop(true);
+    refcnt_ptr<SocketHandoff> handoff;
+    bool stopping = false;
+    
+    auto lagMonitor = make_refcnt<LagMonitor>(ctxt, callbacks.notifyAlive, callbacks.notifyAliveInterval);
+    
+    //sites that stopped logging still need to report what they suppressed
+    asio::steady_timer logLimiterTimer(serverManager.strand());
+    std::function<void ()> reportSuppressedLogs = [&]() {
+        logLimiterTimer.expires_after(LogLimiter::interval);
+        logLimiterTimer.async_wait([&](const asio::error_code & ec) {
+            if (ec)
+                return;
+            LogLimiter::reportExpired();
+            reportSuppressedLogs();
+        });
+    };
+    
+    std::function<void (const std::set<std::filesystem::path> &)> startFileRefresh;
+    ConfigFileWatch fileWatch(serverManager.strand(), [&](const std::set<std::filesystem::path> & files) {
+        if (stopping || handoff)
+            return;
+        startFileRefresh(files);
+    });
+    auto updateFileWatch = [&](const Config & current) {
+        if (callbacks.fileRefresh)
+            fileWatch.update(current);
+    };
+    
+    //what the callbacks last made current, slow updates start from it
+    refcnt_ptr<Config> currentConfig = config;
+    auto adoptConfig = [&](const refcnt_ptr<Config> & newConfig) {
+        currentConfig = newConfig;
+        applyConfig(serverManager, newConfig);
+        updateFileWatch(*newConfig);
+    };
+    
+    //Slow updates of the configuration run on separate threads and only their results are handled on 
+    //the strand. The futures' destructors wait for them to finish before the server manager goes away
+    std::vector<std::future<void>> updates;
+    auto startUpdate = [&](std::function<auto () -> refcnt_ptr<Config>> update, 
+                           std::function<void (const refcnt_ptr<Config> & base, const refcnt_ptr<Config> & updated)> complete) {
+        std::erase_if(updates, [](const std::future<void> & running) {
+            return running.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+        });
+        updates.push_back(std::async(std::launch::async, [&, update, complete, base = currentConfig]() {
+            auto updated = update();
+            if (!updated)
+                return;
+            asio::post(serverManager.strand(), [&, complete, base, updated]() {
+                if (stopping || handoff)
+                    return;
+                complete(base, updated);
+            });
+        }));
+    };
+    auto startIdentityDetection = [&]() {
+        if (!callbacks.identityDetection)
+            return;
+        auto detectIdentity = callbacks.identityDetection();
+        if (!detectIdentity)
+            return;
+        startUpdate(detectIdentity, [&](const refcnt_ptr<Config> & provisional, const refcnt_ptr<Config> & detected) {
+            if (!callbacks.completeUpdate(provisional, detected))
+                return;
+            WSDLOG_INFO("Identity detection completed");
+            adoptConfig(detected);
+        });
+    };
+    startFileRefresh = [&](const std::set<std::filesystem::path> & files) {
+        startUpdate(callbacks.fileRefresh(files), [&, files](const refcnt_ptr<Config> & base, const refcnt_ptr<Config> & refreshed) {
+            //the configuration has been replaced meanwhile so re-read the files on top of the new one
+            if (!callbacks.completeUpdate(base, refreshed))
+                return startFileRefresh(files);
+            adoptConfig(refreshed);
+        });
+    };
+    
+    auto startHandOff = [&]() {
+        WSDLOG_INFO("Handing off to a new instance");
+        handoff = make_refcnt<SocketHandoff>(serverManager.config()->instanceIdentifier(), 
+                                             serverManager.config()->endpointIdentifier());
+        serverManager.handOff(handoff);
+        signals.cancel();
+        fileWatch.stop();
+        lagMonitor->stop();
+        logLimiterTimer.cancel();
         if (monitorPipe)
             monitorPipe.reset();
-        if (signo == SIGHUP)
-            g_reload = 1;
-    });
+    };
+    
+    std::function<void ()> waitForSignal = [&]() {
+        signals.async_wait([&](const asio::error_code & ec, int signo){
+            if (ec == asio::error::operation_aborted && handoff)
+                return;
+            if (ec)
+                throw std::system_error(ec, "async waiting for signal failed");
+            WSDLOG_INFO("Received signal: {}", ptl::signalName(signo));
+            if (signo == SIGUSR1) {
+                Latency::log();
+                FlightRecorder::dump("SIGUSR1");
+                waitForSignal();
+                return;
+            }
+            if (signo == SIGUSR2) {
+                startHandOff();
+                return;
+            }
+            if (signo == SIGHUP && callbacks.reloadInPlace) {
+                if (auto newConfig = callbacks.reloadInPlace()) {
+                    adoptConfig(newConfig);
+                    startIdentityDetection();
+                    waitForSignal();
+                    return;
+                }
+            }
+            stopping = true;
+            fileWatch.stop();
+            lagMonitor->stop();
+            logLimiterTimer.cancel();
+            serverManager.stop(true);
+            if (monitorPipe)
+                monitorPipe.reset();
+            if (signo == SIGHUP)
+                g_reload = 1;
+        });
+    };
+    waitForSignal();
     unblockSignals();
     
     
-    if (monitorDesc) {
-        monitorPipe = std::make_shared<asio::readable_pipe>(ctxt, monitorDesc->get());
-        monitorDesc->detach();
-        monitorPipe->async_read_some(asio::buffer(dummyBuffer), [&](asio::error_code /*ec*/, size_t /*bytesRead*/) {
+    uint32_t messageSize = 0;
+    std::string message;
+    auto onParentExit = [&]() {
+        WSDLOG_INFO("Parent process exited");
+        kill(getpid(), SIGINT);
+    };
+    std::function<void ()> readFromParent = [&]() {
+        asio::async_read(*monitorPipe, asio::buffer(&messageSize, sizeof(messageSize)), [&](asio::error_code ec, size_t /*bytesRead*/) {
             if (!monitorPipe)
                 return;
-            WSDLOG_INFO("Parent process exited");
-            kill(getpid(), SIGINT);
+            if (ec)
+                return onParentExit();
+            message.resize(messageSize);
+            asio::async_read(*monitorPipe, asio::buffer(message), [&](asio::error_code ec, size_t /*bytesRead*/) {
+                if (!monitorPipe)
+                    return;
+                if (ec)
+                    return onParentExit();
+                auto table = toml::parse(message);
+                if (table["handoff"].value_or(false)) {
+                    startHandOff();
+                    return;
+                }
+                applyConfigFromParent(serverManager, table);
+                readFromParent();
+            });
         });
+    };
+    if (monitorDesc) {
+        //the descriptor itself is still needed to send a handoff back
+        auto dup = ptl::duplicate(*monitorDesc);
+        monitorPipe = std::make_shared<asio::readable_pipe>(serverManager.strand(), dup.get());
+        dup.detach();
+        readFromParent();
     }
     
     serverManager.start();
+    updateFileWatch(*config);
+    lagMonitor->start();
+    reportSuppressedLogs();
+    
+    startIdentityDetection();
     
-    ctxt.run();
+    runContext(ctxt, *config);
     
     WSDLOG_INFO("Stopped processing");
+    return handoff;
 }
 
 auto runServer(AppState & appState) -> int {
     
     try {
+        //a predecessor might be waiting to hand its sockets to us
+        auto handoff = SocketHandoff::receiveFromPredecessor();
+        
         for ( ; ; ) {
             
-            ptl::Pipe monitorPipe;
+            ptl::FileDescriptor controlChannel;
+            ptl::FileDescriptor childControlChannel;
+            ptl::FileDescriptor aliveChannel;
+            ptl::FileDescriptor childAliveChannel;
+            std::optional<std::chrono::microseconds> watchdogInterval;
             
             blockSignals();
             
+            markStartupBegin();
             appState.reload();
             g_reload = 0;
+            g_handoff = 0;
+            
+            if (handoff) {
+                adoptHandOff(appState, handoff);
+                handoff.reset();
+            }
             
             if (appState.shouldFork()) {
                 
                 WSDLOG_INFO("Starting child");
                 
-                monitorPipe = ptl::Pipe::create();
+                std::tie(controlChannel, childControlChannel) = createSocketPair();
+                if ((watchdogInterval = appState.watchdogInterval()))
+                    std::tie(aliveChannel, childAliveChannel) = createSocketPair();
                 
                 appState.preFork();
                 
@@ -156,9 +877,32 @@ auto runServer(AppState & appState) -> int {
             if (!g_maybeChildProcess) { //standalone
                 
                 appState.notify(AppState::DaemonStatus::Ready);
-                serve(appState.config(), nullptr);
+                ServeCallbacks callbacks;
+                callbacks.reloadInPlace = [&appState]() -> refcnt_ptr<Config> {
+                    if (!tryReloadInPlace(appState))
+                        return nullptr;
+                    return appState.config();
+                };
+                callbacks.identityDetection = [&appState]() {
+                    return appState.identityDetection();
+                };
+                callbacks.fileRefresh = [&appState](const std::set<std::filesystem::path> & files) {
+                    return appState.fileRefresh(files);
+                };
+                callbacks.completeUpdate = [&appState](const refcnt_ptr<Config> & base, 
+                                                       const refcnt_ptr<Config> & updated) {
+                    return appState.completeUpdate(base, updated);
+                };
+                callbacks.handOffOnSignal = appState.canHandOver();
+                setWatchdog(appState, callbacks);
+                handoff = serve(appState.config(), nullptr, callbacks);
                 
-                if (!g_reload) {
+                if (handoff) {
+                    if (handOver(appState, *handoff))
+                        return EXIT_SUCCESS;
+                    //keep the sockets and carry on ourselves
+                    g_reload = 1;
+                } else if (!g_reload) {
                     appState.notify(AppState::DaemonStatus::Stopping);
                     return EXIT_SUCCESS;
                 }
@@ -173,21 +917,46 @@ auto runServer(AppState & appState) -> int {
                 
                 appState.postForkInServerProcess();
                 
-                monitorPipe.writeEnd.close();
+                controlChannel.close();
+                if (aliveChannel)
+                    aliveChannel.close();
                                 
-                serve(appState.config(), &monitorPipe.readEnd);
+                //configuration cannot be re-read here, the parent sends it instead
+                ServeCallbacks callbacks;
+                if (childAliveChannel)
+                    setChildWatchdog(*watchdogInterval, childAliveChannel, callbacks);
+                auto childHandoff = serve(appState.config(), &childControlChannel, callbacks);
+                if (childHandoff) {
+                    try {
+                        childHandoff->send(childControlChannel);
+                    } catch(std::exception & ex) {
+                        WSDLOG_ERROR("Unable to send handoff to parent: {}", ex.what());
+                        return EXIT_RELOAD;
+                    }
+                    return EXIT_SUCCESS;
+                }
                 
                 return g_reload ? EXIT_RELOAD : EXIT_SUCCESS;
                 
             } else { //parent
                 
-                monitorPipe.readEnd.close();
+                appState.postFork();
+                childControlChannel.close();
+                if (childAliveChannel)
+                    childAliveChannel.close();
+                //the child owns adopted sockets now
+                SocketHandoff::uninstall(false);
                 
                 appState.notify(AppState::DaemonStatus::Ready);
-                if (auto res = waitForChild())
+                if (auto res = waitForChild(appState, controlChannel, aliveChannel, handoff))
                     return *res;
                 
-                if (!g_reload) {
+                if (handoff) {
+                    if (handOver(appState, *handoff))
+                        return EXIT_SUCCESS;
+                    //start a new child with the sockets the old one left
+                    g_reload = 1;
+                } else if (!g_reload) {
                     appState.notify(AppState::DaemonStatus::Stopping);
                     return EXIT_SUCCESS;
                 }
@@ -200,6 +969,7 @@ auto runServer(AppState & appState) -> int {
     } catch (std::exception & ex) {
         WSDLOG_ERROR("Exception: {}", ex.what());
         WSDLOG_ERROR("{}", formatCaughtExceptionBacktrace());
+        FlightRecorder::dump("exception");
     }
     return EXIT_FAILURE;
 }
@@ -211,6 +981,8 @@ int main(int argc, char * argv[]) {
         g_controlSignals.add(SIGINT);
         g_controlSignals.add(SIGTERM);
         g_controlSignals.add(SIGHUP);
+        g_controlSignals.add(SIGUSR2);
+        g_controlSignals.add(SIGUSR1);
         blockSignals();
         
         //set default handlers
@@ -221,16 +993,23 @@ int main(int argc, char * argv[]) {
             exit(EXIT_SUCCESS);
         });
         ptl::setSignalHandler(SIGHUP, SIG_IGN);
+        ptl::setSignalHandler(SIGUSR2, SIG_IGN);
+        ptl::setSignalHandler(SIGUSR1, SIG_IGN);
+        //a child gone while we are sending it configuration must not kill us
+        ptl::setSignalHandler(SIGPIPE, SIG_IGN);
                 
         umask(S_IRWXG | S_IRWXO);
         
-        AppState appState(argc, argv, {SIGINT, SIGTERM, SIGHUP});
+        AppState appState(argc, argv, {SIGINT, SIGTERM, SIGHUP, SIGUSR2, SIGUSR1});
+        //after AppState since daemonizing resets signal handlers
+        FlightRecorder::installCrashHandlers();
         
         return runServer(appState);
         
     } catch (std::exception & ex) {
         fmt::print(stderr, "Exception: {}\n", ex.what());
         fmt::print(stderr, "{}", formatCaughtExceptionBacktrace());
+        FlightRecorder::dump("exception");
     }
     return EXIT_FAILURE;
 }
@@ -0,0 +1,141 @@
+// Copyright (c) 2022, Eugene Gershnik
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "metrics.h"
+#include "latency.h"
+
+//Interfaces come and go (think container veths) and each keeps its series forever,
+//so past this many all new ones share a single catch-all label
+static constexpr size_t g_maxLabelledServers = 256;
+static const sys_string g_overflowInterfaceName = S("_other");
+
+static const char * const g_actionNames[] = {
+    "Hello",
+    "Bye",
+    "Probe",
+    "ProbeMatches",
+    "Resolve",
+    "ResolveMatches",
+    "other"
+};
+static_assert(std::size(g_actionNames) == g_wsdActionCount);
+
+auto wsdActionName(WsdAction action) noexcept -> const char * {
+    return g_actionNames[size_t(action)];
+}
+
+using ServerKey = std::pair<sys_string, bool>;
+
+static std::mutex g_metricsMutex;
+static std::map<ServerKey, std::unique_ptr<ServerMetrics>> g_serverMetrics;
+static MetricsCounter g_unroutedHttpConnections;
+static MetricsCounter g_logMessagesDropped;
+
+auto Metrics::forServer(const sys_string & interfaceName, bool isV6) -> ServerMetrics & {
+
+    std::lock_guard lock(g_metricsMutex);
+    auto it = g_serverMetrics.find(ServerKey(interfaceName, isV6));
+    if (it == g_serverMetrics.end()) {
+        auto & name = g_serverMetrics.size() < g_maxLabelledServers ? interfaceName : g_overflowInterfaceName;
+        it = g_serverMetrics.try_emplace(ServerKey(name, isV6)).first;
+        if (!it->second)
+            it->second = std::make_unique<ServerMetrics>();
+    }
+    return *it->second;
+}
+
+auto Metrics::unroutedHttpConnections() -> MetricsCounter & {
+    return g_unroutedHttpConnections;
+}
+
+auto Metrics::logMessagesDropped() -> MetricsCounter & {
+    return g_logMessagesDropped;
+}
+
+static void appendLabelValue(std::string & dest, const sys_string & value) {
+    sys_string::char_access access(value);
+    for (const char * p = access.c_str(); *p; ++p) {
+        switch (char c = *p) {
+            break; case '\\': dest += "\\\\";
+            break; case '"':  dest += "\\\"";
+            break; case '\n': dest += "\\n";
+            break; default:   dest += c;
+        }
+    }
+}
+
+auto Metrics::format() -> std::string {
+
+    //snapshot the map so that formatting does not block servers starting on other threads
+    std::vector<std::pair<std::string, const ServerMetrics *>> servers;
+    {
+        std::lock_guard lock(g_metricsMutex);
+        servers.reserve(g_serverMetrics.size());
+        for (auto & [key, metrics]: g_serverMetrics) {
+            std::string labels = "interface=\"";
+            appendLabelValue(labels, key.first);
+            labels += key.second ? "\",family=\"ipv6\"" : "\",family=\"ipv4\"";
+            servers.emplace_back(std::move(labels), metrics.get());
+        }
+    }
+
+    std::string ret;
+    auto header = [&](const char * name, const char * type, const char * help) {
+        fmt::format_to(std::back_inserter(ret), "# HELP {0} {2}\n# TYPE {0} {1}\n", name, type, help);
+    };
+    auto perServer = [&](const char * name, const char * type, const char * help, auto getValue) {
+        header(name, type, help);
+        for (auto & [labels, metrics]: servers)
+            fmt::format_to(std::back_inserter(ret), "{}{{{}}} {}\n", name, labels, getValue(*metrics));
+    };
+    auto perAction = [&](const char * name, const char * help, auto getArray) {
+        header(name, "counter", help);
+        for (auto & [labels, metrics]: servers) {
+            auto & counters = getArray(*metrics);
+            for (size_t i = 0; i < g_wsdActionCount; ++i)
+                fmt::format_to(std::back_inserter(ret), "{}{{{},action=\"{}\"}} {}\n", name, labels, g_actionNames[i], counters[i].value());
+        }
+    };
+
+    perServer("wsddn_servers", "gauge", "Running WS-Discovery servers",
+              [](const ServerMetrics & m) { return m.runningServers.value(); });
+    perAction("wsddn_messages_received_total", "WS-Discovery messages received over UDP",
+              [](const ServerMetrics & m) -> auto & { return m.messagesReceived; });
+    perAction("wsddn_messages_sent_total", "WS-Discovery messages sent over UDP, not counting repeats",
+              [](const ServerMetrics & m) -> auto & { return m.messagesSent; });
+    perAction("wsddn_messages_dropped_total", "WS-Discovery messages received but not acted upon",
+              [](const ServerMetrics & m) -> auto & { return m.messagesDropped; });
+    perServer("wsddn_duplicate_message_ids_total", "counter", "Messages ignored because their MessageID was seen before",
+              [](const ServerMetrics & m) { return m.duplicateMessageIds.value(); });
+    perServer("wsddn_parse_failures_total", "counter", "Malformed UDP datagrams and HTTP requests",
+              [](const ServerMetrics & m) { return m.parseFailures.value(); });
+    perServer("wsddn_http_connections_accepted_total", "counter", "HTTP connections accepted",
+              [](const ServerMetrics & m) { return m.httpConnectionsAccepted.value(); });
+    perServer("wsddn_http_connections_dropped_total", "counter", "HTTP connections dropped due to too many from the same address",
+              [](const ServerMetrics & m) { return m.httpConnectionsDropped.value(); });
+    perServer("wsddn_http_connections_expired_total", "counter", "HTTP connections closed for taking too long",
+              [](const ServerMetrics & m) { return m.httpConnectionsExpired.value(); });
+    perServer("wsddn_gets_served_total", "counter", "Metadata Get requests answered",
+              [](const ServerMetrics & m) { return m.getsServed.value(); });
+    perServer("wsddn_udp_received_bytes_total", "counter", "Bytes received in UDP datagrams",
+              [](const ServerMetrics & m) { return m.udpBytesReceived.value(); });
+    perServer("wsddn_udp_sent_bytes_total", "counter", "Bytes sent in UDP datagrams, including repeats",
+              [](const ServerMetrics & m) { return m.udpBytesSent.value(); });
+    perServer("wsddn_udp_receive_drops_total", "counter", "Datagrams dropped by the kernel because the receive queue was full",
+              [](const ServerMetrics & m) { return m.udpReceiveDrops.value(); });
+    perServer("wsddn_udp_receive_buffer_bytes", "gauge", "Receive buffer size of the multicast socket as reported by the system",
+              [](const ServerMetrics & m) { return m.udpReceiveBufferBytes.value(); });
+    perServer("wsddn_http_received_bytes_total", "counter", "Bytes received on HTTP connections",
+              [](const ServerMetrics & m) { return m.httpBytesReceived.value(); });
+    perServer("wsddn_http_sent_bytes_total", "counter", "Bytes sent on HTTP connections",
+              [](const ServerMetrics & m) { return m.httpBytesSent.value(); });
+
+    header("wsddn_http_connections_unrouted_total", "counter", "HTTP connections to addresses no server uses");
+    fmt::format_to(std::back_inserter(ret), "wsddn_http_connections_unrouted_total {}\n", g_unroutedHttpConnections.value());
+    header("wsddn_log_messages_dropped_total", "counter", "Log messages dropped because the asynchronous log buffer was full");
+    fmt::format_to(std::back_inserter(ret), "wsddn_log_messages_dropped_total {}\n", g_logMessagesDropped.value());
+
+    Latency::format(ret);
+
+    return ret;
+}
@@ -0,0 +1,93 @@
+// Copyright (c) 2022, Eugene Gershnik
+// SPDX-License-Identifier: BSD-3-Clause
+
+#ifndef HEADER_METRICS_H_INCLUDED
+#define HEADER_METRICS_H_INCLUDED
+
+/*
+ Counters and gauges describing the work servers do, rendered in Prometheus text format.
+
+ Each interface and address family gets its own ServerMetrics. They live for the rest of
+ the process, so counters never go backwards as servers come and go and the references
+ handed out stay valid. All updates are relaxed atomics and can be made from any thread.
+ */
+
+class MetricsCounter {
+public:
+    void add(uint64_t val = 1) noexcept
+        { m_value.fetch_add(val, std::memory_order_relaxed); }
+    auto value() const noexcept -> uint64_t
+        { return m_value.load(std::memory_order_relaxed); }
+private:
+    std::atomic<uint64_t> m_value = 0;
+};
+
+class MetricsGauge {
+public:
+    void add(int64_t val = 1) noexcept
+        { m_value.fetch_add(val, std::memory_order_relaxed); }
+    void sub(int64_t val = 1) noexcept
+        { m_value.fetch_sub(val, std::memory_order_relaxed); }
+    void set(int64_t val) noexcept
+        { m_value.store(val, std::memory_order_relaxed); }
+    auto value() const noexcept -> int64_t
+        { return m_value.load(std::memory_order_relaxed); }
+private:
+    std::atomic<int64_t> m_value = 0;
+};
+
+enum class WsdAction : unsigned {
+    Hello,
+    Bye,
+    Probe,
+    ProbeMatches,
+    Resolve,
+    ResolveMatches,
+    Other
+};
+constexpr size_t g_wsdActionCount = size_t(WsdAction::Other) + 1;
+
+auto wsdActionName(WsdAction action) noexcept -> const char *;
+
+struct ServerMetrics {
+    //WS-Discovery messages, each counted once regardless of UDP repeats
+    std::array<MetricsCounter, g_wsdActionCount> messagesReceived;
+    std::array<MetricsCounter, g_wsdActionCount> messagesSent;
+    //received but not acted upon: repeated, malformed or not for us
+    std::array<MetricsCounter, g_wsdActionCount> messagesDropped;
+    MetricsCounter duplicateMessageIds;
+    MetricsCounter parseFailures;
+
+    MetricsCounter httpConnectionsAccepted;
+    MetricsCounter httpConnectionsDropped;
+    MetricsCounter httpConnectionsExpired;
+    MetricsCounter getsServed;
+
+    MetricsCounter udpBytesReceived;
+    MetricsCounter udpBytesSent;
+    //datagrams the kernel dropped because the receive queue was full, where reported
+    MetricsCounter udpReceiveDrops;
+    MetricsGauge udpReceiveBufferBytes;
+    MetricsCounter httpBytesReceived;
+    MetricsCounter httpBytesSent;
+
+    MetricsGauge runningServers;
+
+    auto received(WsdAction action) -> MetricsCounter &     { return messagesReceived[size_t(action)]; }
+    auto sent(WsdAction action) -> MetricsCounter &         { return messagesSent[size_t(action)]; }
+    auto dropped(WsdAction action) -> MetricsCounter &      { return messagesDropped[size_t(action)]; }
+};
+
+class Metrics {
+public:
+    //Can be called from any thread
+    static auto forServer(const sys_string & interfaceName, bool isV6) -> ServerMetrics &;
+    //Connections that arrive on a shared HTTP listener for an address no server uses
+    static auto unroutedHttpConnections() -> MetricsCounter &;
+    //Log messages lost because the asynchronous log buffer was full
+    static auto logMessagesDropped() -> MetricsCounter &;
+
+    static auto format() -> std::string;
+};
+
+#endif
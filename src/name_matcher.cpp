@@ -0,0 +1,599 @@
+// Copyright (c) 2022, Eugene Gershnik
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "name_matcher.h"
+
+namespace {
+
+    using ByteSet = std::bitset<256>;
+
+    struct UnsupportedPattern {};
+
+    /*
+     ECMAScript does not allow a quantifier to follow another one (other than the lazy ?)
+     or to start an alternative but std::regex implementations differ on whether they
+     report it. Reject these everywhere so that a pattern means the same thing regardless
+     of how it ends up being matched.
+     */
+    void checkRepetitions(std::string_view pattern) {
+        bool canRepeat = false;     //previous token is an atom
+        bool afterQuantifier = false;
+        for (size_t pos = 0; pos < pattern.size(); ) {
+            char c = pattern[pos++];
+            switch (c) {
+            case '\\':
+                if (pos < pattern.size())
+                    ++pos;
+                canRepeat = true;
+                afterQuantifier = false;
+                break;
+            case '[':
+                if (pos < pattern.size() && pattern[pos] == '^')
+                    ++pos;
+                if (pos < pattern.size() && pattern[pos] == ']')
+                    ++pos;
+                while (pos < pattern.size() && pattern[pos] != ']') {
+                    if (pattern[pos] == '\\')
+                        ++pos;
+                    ++pos;
+                }
+                ++pos;
+                canRepeat = true;
+                afterQuantifier = false;
+                break;
+            case '*': case '+': case '?': case '{':
+                if (c == '{') {
+                    auto end = pattern.find('}', pos);
+                    if (end == pattern.npos)
+                        throw std::regex_error(std::regex_constants::error_brace);
+                    pos = end + 1;
+                }
+                if (c == '?' && afterQuantifier) {
+                    afterQuantifier = false;
+                    break;
+                }
+                if (!canRepeat)
+                    throw std::regex_error(std::regex_constants::error_badrepeat);
+                canRepeat = false;
+                afterQuantifier = true;
+                break;
+            case '(':
+                if (pos < pattern.size() && pattern[pos] == '?') {
+                    //skip the group type so its ? is not taken for a quantifier
+                    ++pos;
+                    if (pos < pattern.size() && pattern[pos] == '<')
+                        ++pos;
+                    if (pos < pattern.size())
+                        ++pos;
+                }
+                canRepeat = false;
+                afterQuantifier = false;
+                break;
+            case '|':
+            case '^':
+                canRepeat = false;
+                afterQuantifier = false;
+                break;
+            default:
+                canRepeat = true;
+                afterQuantifier = false;
+            }
+        }
+    }
+
+    auto isLineTerminator(char c) -> bool {
+        return c == '\n' || c == '\r';
+    }
+
+    auto anyByte() -> ByteSet {
+        ByteSet res;
+        res.set();
+        res.reset('\n');
+        res.reset('\r');
+        return res;
+    }
+
+    auto rangeSet(unsigned char first, unsigned char last) -> ByteSet {
+        ByteSet res;
+        for (unsigned c = first; c <= last; ++c)
+            res.set(c);
+        return res;
+    }
+
+    auto digitSet() -> ByteSet {
+        return rangeSet('0', '9');
+    }
+
+    auto wordSet() -> ByteSet {
+        auto res = rangeSet('a', 'z') | rangeSet('A', 'Z') | rangeSet('0', '9');
+        res.set('_');
+        return res;
+    }
+
+    auto spaceSet() -> ByteSet {
+        ByteSet res;
+        for (char c: {' ', '\t', '\n', '\v', '\f', '\r'})
+            res.set((unsigned char)c);
+        return res;
+    }
+
+    /*
+     Thompson NFA built directly by a recursive descent parser of the
+     ECMAScript subset we can express as a DFA
+     */
+    class NfaBuilder {
+    public:
+        struct State {
+            ByteSet bytes;
+            bool consumes = false;
+            int next = -1;
+            int alt = -1;
+        };
+
+    private:
+        struct Fragment {
+            int start;
+            std::vector<int> outs; //states whose next (or alt if negative-encoded) is dangling
+        };
+
+    public:
+        NfaBuilder(std::string_view pattern):
+            m_pattern(pattern) {
+        }
+
+        auto build() -> int {
+            //regex_match anchors both ends, so leading ^ and trailing $ are no-ops
+            if (!m_pattern.empty() && m_pattern.front() == '^')
+                m_pattern.remove_prefix(1);
+            if (!m_pattern.empty() && m_pattern.back() == '$' && !isEscaped(m_pattern.size() - 1))
+                m_pattern.remove_suffix(1);
+
+            auto frag = parseAlternation();
+            if (m_pos != m_pattern.size())
+                throw UnsupportedPattern();
+            m_acceptState = addState();
+            patch(frag, m_acceptState);
+            return frag.start;
+        }
+
+        auto states() const -> const std::vector<State> & { return m_states; }
+        auto acceptState() const -> int { return m_acceptState; }
+
+    private:
+        auto isEscaped(size_t pos) const -> bool {
+            size_t count = 0;
+            while (pos > 0 && m_pattern[--pos] == '\\')
+                ++count;
+            return count % 2 == 1;
+        }
+
+        auto addState() -> int {
+            m_states.emplace_back();
+            if (m_states.size() > s_maxStates)
+                throw UnsupportedPattern();
+            return int(m_states.size() - 1);
+        }
+
+        auto addBytes(const ByteSet & bytes) -> Fragment {
+            int idx = addState();
+            m_states[idx].bytes = bytes;
+            m_states[idx].consumes = true;
+            return {idx, {idx}};
+        }
+
+        auto addSplit(int first, int second) -> int {
+            int idx = addState();
+            m_states[idx].next = first;
+            m_states[idx].alt = second;
+            return idx;
+        }
+
+        void patch(const Fragment & frag, int target) {
+            for (int out: frag.outs) {
+                if (out >= 0)
+                    m_states[out].next = target;
+                else
+                    m_states[-out - 1].alt = target;
+            }
+        }
+
+        auto atEnd() const -> bool { return m_pos == m_pattern.size(); }
+        auto peek() const -> char { return m_pattern[m_pos]; }
+
+        auto parseAlternation() -> Fragment {
+            auto res = parseConcatenation();
+            while (!atEnd() && peek() == '|') {
+                ++m_pos;
+                auto other = parseConcatenation();
+                int split = addSplit(res.start, other.start);
+                res.start = split;
+                res.outs.insert(res.outs.end(), other.outs.begin(), other.outs.end());
+            }
+            return res;
+        }
+
+        auto parseConcatenation() -> Fragment {
+            std::optional<Fragment> res;
+            while (!atEnd() && peek() != '|' && peek() != ')') {
+                auto item = parseRepetition();
+                if (!res) {
+                    res = std::move(item);
+                } else {
+                    patch(*res, item.start);
+                    res->outs = std::move(item.outs);
+                }
+            }
+            if (!res) {
+                //empty sequence: a pass-through state
+                int idx = addState();
+                res.emplace(Fragment{idx, {idx}});
+            }
+            return std::move(*res);
+        }
+
+        auto parseRepetition() -> Fragment {
+            auto atom = parseAtom();
+            while (!atEnd()) {
+                char c = peek();
+                if (c == '{')
+                    throw UnsupportedPattern();
+                if (c != '*' && c != '+' && c != '?')
+                    break;
+                ++m_pos;
+                //lazy quantifiers match the same set of strings
+                if (!atEnd() && peek() == '?')
+                    ++m_pos;
+
+                int split = addSplit(atom.start, -1);
+                switch (c) {
+                case '*':
+                    patch(atom, split);
+                    atom = Fragment{split, {-split - 1}};
+                    break;
+                case '+':
+                    patch(atom, split);
+                    atom.outs = {-split - 1};
+                    break;
+                case '?':
+                    atom.start = split;
+                    atom.outs.push_back(-split - 1);
+                    break;
+                }
+            }
+            return atom;
+        }
+
+        auto parseAtom() -> Fragment {
+            char c = m_pattern[m_pos++];
+            switch (c) {
+            case '(': {
+                if (!atEnd() && peek() == '?') {
+                    if (m_pos + 1 < m_pattern.size() && m_pattern[m_pos + 1] == ':')
+                        m_pos += 2;
+                    else
+                        throw UnsupportedPattern();
+                }
+                auto res = parseAlternation();
+                if (atEnd() || peek() != ')')
+                    throw UnsupportedPattern();
+                ++m_pos;
+                return res;
+            }
+            case '[':
+                return addBytes(parseClass());
+            case '.':
+                return addBytes(anyByte());
+            case '\\':
+                return addBytes(parseEscape(false));
+            case '^': case '$': case ')': case '*': case '+': case '?': case '{': case '}': case ']':
+                throw UnsupportedPattern();
+            default: {
+                ByteSet res;
+                res.set((unsigned char)c);
+                return addBytes(res);
+            }
+            }
+        }
+
+        auto parseEscape(bool inClass) -> ByteSet {
+            if (atEnd())
+                throw UnsupportedPattern();
+            char c = m_pattern[m_pos++];
+            ByteSet res;
+            switch (c) {
+            case 'd': return digitSet();
+            case 'D': return ~digitSet();
+            case 'w': return wordSet();
+            case 'W': return ~wordSet();
+            case 's': return spaceSet();
+            case 'S': return ~spaceSet();
+            case 't': res.set('\t'); return res;
+            case 'n': res.set('\n'); return res;
+            case 'r': res.set('\r'); return res;
+            case 'f': res.set('\f'); return res;
+            case 'v': res.set('\v'); return res;
+            case 'b':
+                if (!inClass)
+                    throw UnsupportedPattern();
+                res.set('\b');
+                return res;
+            }
+            //Only identity escapes of punctuation have an unambiguous meaning
+            if (isalnum((unsigned char)c) || (unsigned char)c >= 0x80)
+                throw UnsupportedPattern();
+            res.set((unsigned char)c);
+            return res;
+        }
+
+        auto parseClassAtom(bool & isSingle) -> ByteSet {
+            char c = m_pattern[m_pos++];
+            isSingle = true;
+            if (c == '\\') {
+                auto res = parseEscape(true);
+                isSingle = (res.count() == 1);
+                return res;
+            }
+            if (c == '[' && !atEnd() && (peek() == ':' || peek() == '.' || peek() == '='))
+                throw UnsupportedPattern();
+            ByteSet res;
+            res.set((unsigned char)c);
+            return res;
+        }
+
+        static auto singleByte(const ByteSet & set) -> unsigned char {
+            for (unsigned i = 0; i < 256; ++i) {
+                if (set.test(i))
+                    return (unsigned char)i;
+            }
+            return 0;
+        }
+
+        auto parseClass() -> ByteSet {
+            bool negate = false;
+            if (!atEnd() && peek() == '^') {
+                negate = true;
+                ++m_pos;
+            }
+            ByteSet res;
+            for ( ; ; ) {
+                if (atEnd())
+                    throw UnsupportedPattern();
+                if (peek() == ']') {
+                    ++m_pos;
+                    break;
+                }
+                bool isSingle;
+                auto first = parseClassAtom(isSingle);
+                if (isSingle && m_pos + 1 < m_pattern.size() && peek() == '-' && m_pattern[m_pos + 1] != ']') {
+                    ++m_pos;
+                    bool isLastSingle;
+                    auto last = parseClassAtom(isLastSingle);
+                    if (!isLastSingle)
+                        throw UnsupportedPattern();
+                    auto from = singleByte(first), to = singleByte(last);
+                    if (from > to)
+                        throw UnsupportedPattern();
+                    res |= rangeSet(from, to);
+                } else {
+                    res |= first;
+                }
+            }
+            return negate ? ~res : res;
+        }
+
+    private:
+        static constexpr size_t s_maxStates = 4096;
+
+        std::string_view m_pattern;
+        size_t m_pos = 0;
+        std::vector<State> m_states;
+        int m_acceptState = -1;
+    };
+}
+
+NameMatcher::NameMatcher(const std::string & pattern):
+    m_pattern(pattern) {
+
+    checkRepetitions(pattern);
+
+    if (auto segments = parseGlob(pattern)) {
+        m_segments = std::move(*segments);
+        if (m_segments.size() == 1)
+            m_kind = Literal;
+        else if (m_segments.size() == 2 && m_segments[1].empty())
+            m_kind = Prefix;
+        else
+            m_kind = Glob;
+        //.* does not match line terminators so names containing them go through the DFA
+        if (m_kind != Literal)
+            m_dfa = compileDfa(pattern);
+        return;
+    }
+
+    if ((m_dfa = compileDfa(pattern))) {
+        m_kind = Dfa;
+        return;
+    }
+
+    m_kind = Regex;
+    m_regex.emplace(pattern, std::regex::ECMAScript | std::regex::optimize | std::regex::nosubs);
+}
+
+auto NameMatcher::matches(std::string_view name) const -> bool {
+    switch (m_kind) {
+    case Literal:
+        return name == m_segments[0];
+    case Prefix:
+    case Glob:
+        if (m_dfa && std::any_of(name.begin(), name.end(), isLineTerminator))
+            return matchDfa(name);
+        return matchGlob(name);
+    case Dfa:
+        return matchDfa(name);
+    case Regex:
+        return std::regex_match(name.begin(), name.end(), *m_regex);
+    }
+    return false;
+}
+
+auto NameMatcher::parseGlob(std::string_view pattern) -> std::optional<std::vector<std::string>> {
+
+    if (!pattern.empty() && pattern.front() == '^')
+        pattern.remove_prefix(1);
+
+    std::vector<std::string> res(1);
+    for (size_t i = 0; i < pattern.size(); ++i) {
+        char c = pattern[i];
+        switch (c) {
+        case '\\': {
+            if (++i == pattern.size())
+                return std::nullopt;
+            char escaped = pattern[i];
+            if (isalnum((unsigned char)escaped) || (unsigned char)escaped >= 0x80)
+                return std::nullopt;
+            res.back() += escaped;
+            break;
+        }
+        case '.':
+            if (i + 1 == pattern.size() || pattern[i + 1] != '*')
+                return std::nullopt;
+            ++i;
+            //.*? matches the same set
+            if (i + 1 < pattern.size() && pattern[i + 1] == '?')
+                ++i;
+            res.emplace_back();
+            break;
+        case '$':
+            if (i + 1 != pattern.size())
+                return std::nullopt;
+            break;
+        case '^': case '*': case '+': case '?': case '(': case ')':
+        case '[': case ']': case '{': case '}': case '|':
+            return std::nullopt;
+        default:
+            res.back() += c;
+        }
+    }
+    return res;
+}
+
+auto NameMatcher::compileDfa(std::string_view pattern) -> std::optional<DfaTable> {
+
+    constexpr size_t maxDfaStates = 1024;
+
+    NfaBuilder builder(pattern);
+    int start;
+    try {
+        start = builder.build();
+    } catch (UnsupportedPattern &) {
+        return std::nullopt;
+    }
+    auto & states = builder.states();
+
+    //Partition bytes into classes that no state distinguishes
+    DfaTable res;
+    {
+        std::map<std::vector<bool>, uint8_t> signatures;
+        for (unsigned b = 0; b < 256; ++b) {
+            std::vector<bool> signature;
+            for (auto & state: states) {
+                if (state.consumes)
+                    signature.push_back(state.bytes.test(b));
+            }
+            auto [it, inserted] = signatures.try_emplace(std::move(signature), uint8_t(signatures.size()));
+            res.byteClasses[b] = it->second;
+        }
+        res.classCount = signatures.size();
+    }
+    std::vector<unsigned> representatives(res.classCount);
+    for (unsigned b = 256; b-- > 0; )
+        representatives[res.byteClasses[b]] = b;
+
+    auto closure = [&](std::vector<int> set) {
+        std::vector<int> stack(set);
+        std::vector<bool> seen(states.size());
+        for (int idx: set)
+            seen[idx] = true;
+        while (!stack.empty()) {
+            int idx = stack.back();
+            stack.pop_back();
+            auto & state = states[idx];
+            if (state.consumes)
+                continue;
+            for (int next: {state.next, state.alt}) {
+                if (next >= 0 && !seen[next]) {
+                    seen[next] = true;
+                    set.push_back(next);
+                    stack.push_back(next);
+                }
+            }
+        }
+        std::sort(set.begin(), set.end());
+        return set;
+    };
+
+    std::map<std::vector<int>, uint16_t> known;
+    std::vector<std::vector<int>> pending;
+
+    auto addDfaState = [&](std::vector<int> set) -> std::optional<uint16_t> {
+        if (set.empty())
+            return DfaTable::dead;
+        auto it = known.find(set);
+        if (it != known.end())
+            return it->second;
+        if (known.size() == maxDfaStates)
+            return std::nullopt;
+        auto idx = uint16_t(known.size());
+        res.accepting.push_back(std::binary_search(set.begin(), set.end(), builder.acceptState()));
+        res.transitions.resize(res.transitions.size() + res.classCount, DfaTable::dead);
+        known.emplace(set, idx);
+        pending.push_back(std::move(set));
+        return idx;
+    };
+
+    addDfaState(closure({start}));
+    for (uint16_t current = 0; current < pending.size(); ++current) {
+        for (size_t cls = 0; cls < res.classCount; ++cls) {
+            std::vector<int> next;
+            for (int idx: pending[current]) {
+                auto & state = states[idx];
+                if (state.consumes && state.bytes.test(representatives[cls]))
+                    next.push_back(state.next);
+            }
+            auto target = addDfaState(closure(std::move(next)));
+            if (!target)
+                return std::nullopt;
+            res.transitions[current * res.classCount + cls] = *target;
+        }
+    }
+    return res;
+}
+
+auto NameMatcher::matchGlob(std::string_view name) const -> bool {
+    auto & first = m_segments.front();
+    auto & last = m_segments.back();
+    if (name.size() < first.size() + last.size())
+        return false;
+    if (!name.starts_with(first) || !name.ends_with(last))
+        return false;
+    name.remove_prefix(first.size());
+    name.remove_suffix(last.size());
+    for (size_t i = 1; i < m_segments.size() - 1; ++i) {
+        auto & segment = m_segments[i];
+        auto pos = name.find(segment);
+        if (pos == name.npos)
+            return false;
+        name.remove_prefix(pos + segment.size());
+    }
+    return true;
+}
+
+auto NameMatcher::matchDfa(std::string_view name) const -> bool {
+    uint16_t state = 0;
+    for (char c: name) {
+        state = m_dfa->transitions[state * m_dfa->classCount + m_dfa->byteClasses[(unsigned char)c]];
+        if (state == DfaTable::dead)
+            return false;
+    }
+    return m_dfa->accepting[state];
+}
@@ -0,0 +1,58 @@
+// Copyright (c) 2022, Eugene Gershnik
+// SPDX-License-Identifier: BSD-3-Clause
+
+#ifndef HEADER_NAME_MATCHER_H_INCLUDED
+#define HEADER_NAME_MATCHER_H_INCLUDED
+
+/*
+ Matches names against an ECMAScript regex with std::regex_match semantics.
+
+ Patterns are compiled once into the cheapest representation that preserves
+ the semantics: an exact literal, a literal prefix, a glob made of literals
+ separated by .* or a byte DFA. Anything the DFA compiler does not understand
+ (backreferences, assertions, counted repetitions etc.) falls back to std::regex.
+ */
+class NameMatcher {
+public:
+    //Throws std::regex_error if the pattern is invalid
+    explicit NameMatcher(const std::string & pattern);
+
+    auto matches(std::string_view name) const -> bool;
+
+    auto pattern() const -> const std::string &
+        { return m_pattern; }
+
+private:
+    enum Kind {
+        Literal,
+        Prefix,
+        Glob,
+        Dfa,
+        Regex
+    };
+
+    struct DfaTable {
+        static constexpr uint16_t dead = std::numeric_limits<uint16_t>::max();
+
+        std::array<uint8_t, 256> byteClasses;
+        size_t classCount;
+        std::vector<uint16_t> transitions;
+        std::vector<bool> accepting;
+    };
+
+    static auto parseGlob(std::string_view pattern) -> std::optional<std::vector<std::string>>;
+    static auto compileDfa(std::string_view pattern) -> std::optional<DfaTable>;
+
+    auto matchGlob(std::string_view name) const -> bool;
+    auto matchDfa(std::string_view name) const -> bool;
+
+private:
+    std::string m_pattern;
+    Kind m_kind;
+    //Literal pieces separated by .* for Literal, Prefix and Glob kinds
+    std::vector<std::string> m_segments;
+    std::optional<DfaTable> m_dfa;
+    std::optional<std::regex> m_regex;
+};
+
+#endif
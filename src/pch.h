@@ -76,6 +76,7 @@
 #include <spdlog/sinks/stdout_sinks.h>
 #include <spdlog/sinks/stdout_color_sinks.h>
 #include <spdlog/sinks/base_sink.h>
+#include <spdlog/details/log_msg_buffer.h>
 #include <spdlog/pattern_formatter.h>
 
 #include <sys_string/sys_string.h>
@@ -87,6 +88,11 @@
 #if HAVE_SYSTEMD
     #include <dlfcn.h>
     #include <systemd/sd-daemon.h>
+    #include <sys/uio.h>
+#endif
+
+#if HAVE_USDT
+    #include <sys/sdt.h>
 #endif
 
 #include <memory>
@@ -94,6 +100,14 @@
 #include <vector>
 #include <array>
 #include <set>
+#include <map>
+#include <bitset>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+#include <future>
+#include <limits>
 #include <deque>
 #include <optional>
 #include <variant>
@@ -103,10 +117,21 @@
 #include <filesystem>
 #include <regex>
 #include <chrono>
+#include <bit>
+#include <cmath>
+#include <sstream>
 
 #include <stdio.h>
 
 #include <sys/mman.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#if defined(__linux__)
+    #include <sched.h>
+#endif
 
 #if WSDDN_PLATFORM_APPLE
 
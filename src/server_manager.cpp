@@ -3,48 +3,344 @@
 
 #include "server_manager.h"
 #include "exc_handling.h"
+#include "latency.h"
+
+//How long servers have to claim handed off sockets after the initial settle time
+static constexpr auto g_handoffClaimTime = std::chrono::seconds(5);
+//Graceful stop does not wait for Byes longer than this
+static constexpr auto g_byeDeadline = std::chrono::seconds(2);
+
+void ServerManager::start() {
+    
+    Latency::setReplySlo(m_config->replySlo());
+    m_interfaceMonitor->start(*this);
+    startMetricsServers();
+    
+    if (SocketHandoff::isInstalled()) {
+        //sockets for addresses that are gone by now would otherwise stay open forever
+        m_handoffTimer.expires_after(m_config->settleTime() + g_handoffClaimTime);
+        m_handoffTimer.async_wait([](asio::error_code ec) {
+            if (ec)
+                return;
+            SocketHandoff::uninstall(true);
+        });
+    }
+}
+
+void ServerManager::stop(bool gracefully) {
+    
+    m_interfaceMonitor->stop();
+    m_settleTimer.cancel();
+    m_handoffTimer.cancel();
+    m_announcementScheduler->shutdown(gracefully ? std::chrono::steady_clock::duration(g_byeDeadline) : 
+                                                   std::chrono::steady_clock::duration::zero());
+    SocketHandoff::uninstall(false);
+    m_pendingChanges.clear();
+    stopMetricsServers();
+    for(auto & [_, server]: m_serversByAddress) {
+        if (server)
+            asio::dispatch(server->strand(), [server, gracefully]() { server->stop(gracefully); });
+    }
+    m_serversByAddress.clear();
+}
+
+void ServerManager::handOff(const refcnt_ptr<SocketHandoff> & dest) {
+    
+    m_interfaceMonitor->stop();
+    m_announcementScheduler->shutdown(std::chrono::steady_clock::duration::zero());
+    m_settleTimer.cancel();
+    m_handoffTimer.cancel();
+    m_pendingChanges.clear();
+    for (auto & server: m_metricsServers)
+        server->handOff(*dest);
+    m_metricsServers.clear();
+    for(auto & [_, server]: m_serversByAddress) {
+        if (server)
+            asio::dispatch(server->strand(), [server, dest]() { server->handOff(*dest); });
+    }
+    m_serversByAddress.clear();
+}
+
+void ServerManager::startMetricsServers() {
+    
+    auto port = m_config->metricsPort();
+    if (port == 0)
+        return;
+    
+    std::vector<ip::address> addresses;
+    if (m_config->enableIPv4())
+        addresses.emplace_back(ip::address_v4::loopback());
+    if (m_config->enableIPv6())
+        addresses.emplace_back(ip::address_v6::loopback());
+    for (auto & addr: addresses) {
+        ip::tcp::endpoint endpoint(addr, port);
+        try {
+            auto server = createMetricsHttpServer(m_strand, m_config, endpoint);
+            server->start(*this);
+            m_metricsServers.emplace_back(std::move(server));
+        } catch(std::system_error & ex) {
+            WSDLOG_ERROR("Unable to serve metrics on {}: error: {}", makeHttpUrl(endpoint), ex.what());
+        }
+    }
+}
+
+void ServerManager::stopMetricsServers() {
+    for (auto & server: m_metricsServers)
+        server->stop();
+    m_metricsServers.clear();
+}
+
+void ServerManager::onFatalHttpError() {
+    //metrics are not worth bringing everything down for
+    WSDLOG_ERROR("Metrics listener failed, metrics will not be served until restart");
+    stopMetricsServers();
+}
 
 auto ServerManager::createServer(const NetworkInterface & interface, const ip::address & addr) -> refcnt_ptr<WsdServer> {
     refcnt_ptr<WsdServer> server;
     try {
-        server = createWsdServer(m_ctxt, m_config, m_httpServerFactory, m_udpServerFactory, interface, addr);
+        server = createWsdServer(makeServerStrand(), m_config, m_announcementScheduler, m_httpServerFactory, m_udpServerFactory, interface, addr);
     } catch(std::system_error & ex) {
         WSDLOG_ERROR("Unable to start WSD server on interface {}, addr {}: error: {}", interface, addr.to_string(), ex.what());
         WSDLOG_DEBUG("{}", formatCaughtExceptionBacktrace());
         return nullptr;
     }
-    server->start();
+    asio::dispatch(server->strand(), [server]() { server->start(); });
     return server;
 }
 
+auto ServerManager::makeServerStrand() -> Strand {
+    //A shared HTTP listener calls into every server of its family synchronously
+    //so all of them have to be on the same strand
+    if (m_config->httpListenerMode() == HttpListenerMode::Shared)
+        return m_strand;
+    return asio::make_strand(m_ctxt);
+}
+
 void ServerManager::onFatalInterfaceMonitorError(asio::error_code ec) {
     //nothing left to do if the monitor died
     throw std::system_error(ec, "fatal interface monitor error");
 }
 
 void ServerManager::addAddress(const NetworkInterface & interface, const ip::address & addr) {
-    auto & server = m_serversByAddress[addr];
+    queueChange(interface, addr, true);
+}
+
+void ServerManager::removeAddress(const NetworkInterface & interface, const ip::address & addr) {
+    queueChange(interface, addr, false);
+}
+
+void ServerManager::queueChange(const NetworkInterface & interface, const ip::address & addr, bool added) {
     
-    if (server && server->interface() == interface && server->state() == WsdServer::Running)
+    auto settleTime = m_config->settleTime();
+    if (settleTime.count() == 0) {
+        if (added)
+            doAddAddress(interface, addr);
+        else
+            doRemoveAddress(interface, addr);
         return;
+    }
+    
+    bool wasEmpty = m_pendingChanges.empty();
+    
+    auto & change = m_pendingChanges.try_emplace(AddressKey(interface, addr), PendingChange{added}).first->second;
+    change.added = added;
+    ++change.eventCount;
+    
+    if (!wasEmpty)
+        return;
+    
+    m_settleTimer.expires_after(settleTime);
+    m_settleTimer.async_wait([this](asio::error_code ec) {
+        if (ec)
+            return;
+        applyPendingChanges();
+    });
+}
+
+void ServerManager::applyPendingChanges() {
+    
+    auto changes = std::move(m_pendingChanges);
+    m_pendingChanges.clear();
+    
+    size_t suppressed = rebindReplacedAddresses(changes);
+    auto apply = [&](bool added) {
+        for (auto & [key, change]: changes) {
+            if (change.added != added)
+                continue;
+            const auto & [interface, addr] = key;
+            bool applied = added ? doAddAddress(interface, addr) : doRemoveAddress(interface, addr);
+            suppressed += change.eventCount - (applied ? 1 : 0);
+        }
+    };
+    //removals go first so that an address moving between interfaces is handled correctly
+    apply(false);
+    apply(true);
+    
+    if (suppressed) {
+        m_suppressedChurnCount += suppressed;
+        WSDLOG_DEBUG("Suppressed {} interface change events with no net effect ({} total)", suppressed, m_suppressedChurnCount);
+    }
+}
+
+auto ServerManager::rebindReplacedAddresses(std::map<AddressKey, PendingChange> & changes) -> size_t {
+    
+    size_t suppressed = 0;
+    for (auto itRemoved = changes.begin(); itRemoved != changes.end(); ) {
+        const PendingChange & removedChange = itRemoved->second;
+        const NetworkInterface & interface = itRemoved->first.first;
+        const ip::address & oldAddr = itRemoved->first.second;
+        
+        auto itServer = m_serversByAddress.find(oldAddr);
+        if (removedChange.added || itServer == m_serversByAddress.end() || !itServer->second || 
+            itServer->second->interface() != interface || itServer->second->state() == WsdServer::Stopped) {
+            ++itRemoved;
+            continue;
+        }
+        
+        auto itAdded = std::find_if(changes.begin(), changes.end(), [&](const auto & item) {
+            const AddressKey & key = item.first;
+            return item.second.added && key.first == interface && key.second.is_v4() == oldAddr.is_v4() &&
+                   !m_serversByAddress.contains(key.second) && isAllowedAddress(key.first, key.second);
+        });
+        if (itAdded == changes.end()) {
+            ++itRemoved;
+            continue;
+        }
+        
+        const auto & newAddr = itAdded->first.second;
+        WSDLOG_INFO("Replacing addr {} with {} on interface {}", oldAddr.to_string(), newAddr.to_string(), interface);
+        
+        auto server = std::move(itServer->second);
+        m_serversByAddress.erase(itServer);
+        rebindServer(server, interface, newAddr);
+        m_serversByAddress[newAddr] = std::move(server);
+        
+        suppressed += (removedChange.eventCount - 1) + (itAdded->second.eventCount - 1);
+        changes.erase(itAdded);
+        itRemoved = changes.erase(itRemoved);
+    }
+    return suppressed;
+}
+
+void ServerManager::rebindServer(const refcnt_ptr<WsdServer> & server, const NetworkInterface & interface, const ip::address & addr) {
+    
+    asio::dispatch(server->strand(), [this, server, interface, addr]() {
+        //the server might have died on its own since we looked at it
+        if (server->state() == WsdServer::Running) {
+            try {
+                server->rebind(addr);
+                return;
+            } catch(std::system_error & ex) {
+                WSDLOG_ERROR("Unable to rebind WSD server on interface {} to addr {}: error: {}", interface, addr.to_string(), ex.what());
+                WSDLOG_DEBUG("{}", formatCaughtExceptionBacktrace());
+                server->stop(false);
+            }
+        }
+        recreateFailedServer(server, interface, addr);
+    });
+}
+
+void ServerManager::reconfigureServer(const refcnt_ptr<WsdServer> & server, const ip::address & addr, const Config::Changes & changes) {
+    
+    asio::dispatch(server->strand(), [this, server, addr, config = m_config, changes]() {
+        try {
+            server->reconfigure(config, changes);
+            return;
+        } catch(std::system_error & ex) {
+            WSDLOG_ERROR("Unable to reconfigure WSD server on interface {}, addr {}: error: {}", server->interface(), addr.to_string(), ex.what());
+            WSDLOG_DEBUG("{}", formatCaughtExceptionBacktrace());
+            server->stop(false);
+        }
+        recreateFailedServer(server, server->interface(), addr);
+    });
+}
+
+void ServerManager::recreateFailedServer(const refcnt_ptr<WsdServer> & server, const NetworkInterface & interface, const ip::address & addr) {
+    
+    asio::dispatch(m_strand, [this, server, interface, addr]() {
+        auto it = m_serversByAddress.find(addr);
+        if (it != m_serversByAddress.end() && it->second == server)
+            it->second = createServer(interface, addr);
+    });
+}
+
+void ServerManager::reconfigure(const refcnt_ptr<Config> & config, const Config::Changes & changes) {
+    
+    assert(!changes.requiresRestart());
+    
+    m_config = config;
+    
+    if (changes.settings) {
+        m_announcementScheduler->setRate(m_config->announceRate());
+        Latency::setReplySlo(m_config->replySlo());
+    }
+    
+    if (changes.interfaces) {
+        //servers that are no longer allowed go away quietly and a fresh monitor reports
+        //everything that is present now, which picks up newly allowed ones
+        m_interfaceMonitor->stop();
+        for (auto it = m_serversByAddress.begin(); it != m_serversByAddress.end(); ) {
+            auto & [addr, server] = *it;
+            if (!server || isAllowedAddress(server->interface(), addr)) {
+                ++it;
+                continue;
+            }
+            WSDLOG_INFO("Removing interface {}, addr {} excluded by new configuration", server->interface(), addr.to_string());
+            asio::dispatch(server->strand(), [server]() { server->stop(false); });
+            it = m_serversByAddress.erase(it);
+        }
+    }
+    
+    for (auto & [addr, server]: m_serversByAddress) {
+        if (server)
+            reconfigureServer(server, addr, changes);
+    }
+    
+    if (changes.interfaces) {
+        m_interfaceMonitor = m_interfaceMonitorFactory(m_strand, m_config);
+        m_interfaceMonitor->start(*this);
+        //address families may have changed
+        stopMetricsServers();
+        startMetricsServers();
+    }
+}
+
+auto ServerManager::isAllowedAddress(const NetworkInterface & interface, const ip::address & addr) const -> bool {
+    if (addr.is_v4() ? !m_config->enableIPv4() : !m_config->enableIPv6())
+        return false;
+    return m_config->isAllowedInterface(interface.name);
+}
+
+auto ServerManager::doAddAddress(const NetworkInterface & interface, const ip::address & addr) -> bool {
+    //changes queued before a reconfiguration were filtered by the old one
+    if (!isAllowedAddress(interface, addr))
+        return false;
+    
+    auto & server = m_serversByAddress[addr];
+    
+    //a server that has not started yet is as good as running, its start is already queued
+    if (server && server->interface() == interface && server->state() != WsdServer::Stopped)
+        return false;
     
     WSDLOG_INFO("Adding interface {}, addr {}", interface, addr.to_string());
     server = createServer(interface, addr);
+    return true;
 }
 
-void ServerManager::removeAddress(const NetworkInterface & interface, const ip::address & addr) {
+auto ServerManager::doRemoveAddress(const NetworkInterface & interface, const ip::address & addr) -> bool {
     
     auto itServer = m_serversByAddress.find(addr);
     if (itServer == m_serversByAddress.end())
-        return;
+        return false;
     
     auto & server = itServer->second;
     if (server && server->interface() != interface)
-        return;
+        return false;
     
     WSDLOG_INFO("Removing interface {}, addr {}", interface, addr.to_string());
     if (server)
-        server->stop(false);
+        asio::dispatch(server->strand(), [server]() { server->stop(false); });
     m_serversByAddress.erase(itServer);
-        
+    return true;
 }
@@ -6,9 +6,10 @@
 
 #include "wsd_server.h"
 #include "interface_monitor.h"
+#include "announcement_scheduler.h"
 
 
-class ServerManager : public InterfaceMonitor::Handler {
+class ServerManager : public InterfaceMonitor::Handler, private HttpServer::Handler {
 
 public:
     ServerManager(asio::io_context & ctxt, 
@@ -18,39 +19,91 @@ public:
                   UdpServerFactory udpServerFactory) :
         m_ctxt(ctxt),
         m_config(config),
-        m_interfaceMonitor(ifaceMonitorFactory(ctxt, config)),
+        m_strand(asio::make_strand(ctxt)),
+        m_interfaceMonitorFactory(ifaceMonitorFactory),
+        m_interfaceMonitor(ifaceMonitorFactory(m_strand, config)),
         m_httpServerFactory(httpServerFactory),
-        m_udpServerFactory(udpServerFactory) {
+        m_udpServerFactory(udpServerFactory),
+        m_announcementScheduler(refcnt_attach(new AnnouncementScheduler(ctxt, config->announceRate()))),
+        m_settleTimer(m_strand),
+        m_handoffTimer(m_strand) {
 
     }
 
-    void start() {
-        m_interfaceMonitor->start(*this);
+    //The manager and the interface monitor run on this strand. 
+    //start() and stop() must be called on it or before the context runs
+    auto strand() const -> const Strand & {
+        return m_strand;
     }
+
+    void start();
+    
+    void stop(bool gracefully);
+
+    auto config() const -> const refcnt_ptr<Config> & {
+        return m_config;
+    }
+    
+    //Applies a configuration that does not require restart without disturbing unaffected servers.
+    //Must be called on strand()
+    void reconfigure(const refcnt_ptr<Config> & config, const Config::Changes & changes);
     
-    void stop(bool gracefully) {
-        m_interfaceMonitor->stop();
-        for(auto & [_, server]: m_serversByAddress) {
-            if (server)
-                server->stop(gracefully);
-        }
-        m_serversByAddress.clear();
+    //Stops all servers passing their sockets and state to dest. Must be called on strand().
+    //dest is complete once the io_context runs out of work
+    void handOff(const refcnt_ptr<SocketHandoff> & dest);
+
+    auto suppressedChurnCount() const -> size_t {
+        return m_suppressedChurnCount;
     }
 
 private:
+    using AddressKey = std::pair<NetworkInterface, ip::address>;
+    
+    struct PendingChange {
+        bool added;
+        size_t eventCount = 0;
+    };
+    
     void addAddress(const NetworkInterface & interface, const ip::address & addr) override;
     void removeAddress(const NetworkInterface & interface, const ip::address & addr) override;
     void onFatalInterfaceMonitorError(asio::error_code ec) override;
     
+    //the metrics endpoint never passes requests on
+    auto handleHttpRequest(const ip::address & /*peer*/, std::unique_ptr<XmlDoc> /*doc*/) -> std::optional<XmlCharBuffer> override
+        { return std::nullopt; }
+    void onFatalHttpError() override;
+    void startMetricsServers();
+    void stopMetricsServers();
+    
+    void queueChange(const NetworkInterface & interface, const ip::address & addr, bool added);
+    void applyPendingChanges();
+    auto rebindReplacedAddresses(std::map<AddressKey, PendingChange> & changes) -> size_t;
+    auto doAddAddress(const NetworkInterface & interface, const ip::address & addr) -> bool;
+    auto doRemoveAddress(const NetworkInterface & interface, const ip::address & addr) -> bool;
+    
     auto createServer(const NetworkInterface & interface, const ip::address & addr) -> refcnt_ptr<WsdServer>;
+    auto makeServerStrand() -> Strand;
+    void rebindServer(const refcnt_ptr<WsdServer> & server, const NetworkInterface & interface, const ip::address & addr);
+    void reconfigureServer(const refcnt_ptr<WsdServer> & server, const ip::address & addr, const Config::Changes & changes);
+    void recreateFailedServer(const refcnt_ptr<WsdServer> & server, const NetworkInterface & interface, const ip::address & addr);
+    auto isAllowedAddress(const NetworkInterface & interface, const ip::address & addr) const -> bool;
 
 private:
     asio::io_context & m_ctxt;
-    const refcnt_ptr<Config> m_config;
+    refcnt_ptr<Config> m_config;
+    Strand m_strand;
+    InterfaceMonitorFactory m_interfaceMonitorFactory;
     refcnt_ptr<InterfaceMonitor> m_interfaceMonitor;
     HttpServerFactory m_httpServerFactory;
     UdpServerFactory m_udpServerFactory;
+    refcnt_ptr<AnnouncementScheduler> m_announcementScheduler;
     std::map<ip::address, refcnt_ptr<WsdServer>> m_serversByAddress;
+    std::vector<refcnt_ptr<HttpServer>> m_metricsServers;
+    
+    asio::steady_timer m_settleTimer;
+    std::map<AddressKey, PendingChange> m_pendingChanges;
+    asio::steady_timer m_handoffTimer;
+    size_t m_suppressedChurnCount = 0;
 };
 
 #endif
@@ -0,0 +1,233 @@
+// Copyright (c) 2022, Eugene Gershnik
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "smb_conf_scanner.h"
+#include "sys_util.h"
+
+using namespace std::literals;
+
+static auto isBlank(char c) -> bool {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+static auto trimLeft(std::string_view str) -> std::string_view {
+    while(!str.empty() && isBlank(str.front()))
+        str.remove_prefix(1);
+    return str;
+}
+
+static auto trimRight(std::string_view str) -> std::string_view {
+    while(!str.empty() && isBlank(str.back()))
+        str.remove_suffix(1);
+    return str;
+}
+
+static auto trim(std::string_view str) -> std::string_view {
+    return trimRight(trimLeft(str));
+}
+
+//Samba compares section and parameter names ignoring case and whitespace. 
+//expected must be in lower case
+static auto isSambaName(std::string_view name, std::string_view expected) -> bool {
+    auto it = expected.begin();
+    const auto end = expected.end();
+    for (char c: name) {
+        if (isBlank(c))
+            continue;
+        while (it != end && *it == ' ')
+            ++it;
+        if (c >= 'A' && c <= 'Z')
+            c += 'a' - 'A';
+        if (it == end || *it != c)
+            return false;
+        ++it;
+    }
+    while (it != end && *it == ' ')
+        ++it;
+    return it == end;
+}
+
+auto SmbConfScanner::read(const std::filesystem::path & path) -> bool {
+    
+    if (!scanFile(path))
+        return false;
+    
+    for (unsigned switches = 0; m_nextConfigFile; ++switches) {
+        
+        auto next = std::move(*m_nextConfigFile);
+        m_nextConfigFile.reset();
+        
+        if (switches == s_maxDepth) {
+            WSDLOG_DEBUG("too many smb.conf config file switches");
+            m_complete = false;
+            break;
+        }
+        
+        WSDLOG_TRACE("smb.conf continues in '{}'", next.c_str());
+        m_params = Config::SambaParams();
+        m_inGlobalSection = true;
+        m_stopped = false;
+        if (!scanFile(next)) {
+            WSDLOG_DEBUG("smb.conf config file '{}' cannot be read", next.c_str());
+            m_complete = false;
+            break;
+        }
+    }
+    return true;
+}
+
+auto SmbConfScanner::scanFile(const std::filesystem::path & path) -> bool {
+
+    if (m_depth == s_maxDepth) {
+        WSDLOG_DEBUG("smb.conf includes are nested too deeply at '{}'", path.c_str());
+        m_complete = false;
+        return true;
+    }
+
+    std::error_code ec;
+    auto file = ptl::FileDescriptor::open(path.c_str(), O_RDONLY, ec);
+    if (!file)
+        return false;
+
+    struct ::stat st;
+    getStatus(file, st, ec);
+    if (ec)
+        return false;
+
+    m_files.push_back(path);
+    
+    //mapping an empty file fails
+    if (st.st_size == 0)
+        return true;
+    
+    ptl::MemoryMap bytes(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, c_fd(file), 0, ec);
+    if (ec)
+        return false;
+
+    WSDLOG_TRACE("reading '{}'", path.c_str());
+    ++m_depth;
+    scan(std::string_view((const char *)bytes.data(), bytes.size()));
+    --m_depth;
+    WSDLOG_TRACE("done reading '{}'", path.c_str());
+    return true;
+}
+
+void SmbConfScanner::scan(std::string_view content) {
+
+    auto cur = content.data();
+    const auto end = cur + content.size();
+
+    auto nextLine = [&]() {
+        auto lineEnd = static_cast<const char *>(memchr(cur, '\n', size_t(end - cur)));
+        if (!lineEnd)
+            lineEnd = end;
+        std::string_view line(cur, size_t(lineEnd - cur));
+        cur = (lineEnd == end ? end : lineEnd + 1);
+        return line;
+    };
+
+    while (cur != end && !m_stopped) {
+
+        auto line = trimLeft(nextLine());
+        if (line.empty() || line.front() == '#' || line.front() == ';')
+            continue;
+
+        if (line.front() == '[') {
+            auto close = line.find(']');
+            if (close == line.npos)
+                continue;
+            m_inGlobalSection = isSambaName(trim(line.substr(1, close - 1)), "global"sv);
+            continue;
+        }
+
+        line = trimRight(line);
+        if (line.back() == '\\') {
+            m_continuedLine.assign(line.data(), line.size() - 1);
+            while (cur != end) {
+                auto next = trim(nextLine());
+                bool more = !next.empty() && next.back() == '\\';
+                if (more)
+                    next.remove_suffix(1);
+                m_continuedLine.append(next);
+                if (!more)
+                    break;
+            }
+            line = m_continuedLine;
+        }
+
+        auto eq = line.find('=');
+        if (eq == line.npos)
+            continue;
+        processParameter(trimRight(line.substr(0, eq)), trim(line.substr(eq + 1)));
+    }
+}
+
+void SmbConfScanner::processParameter(std::string_view name, std::string_view value) {
+
+    if (m_followDirectives) {
+        if (isSambaName(name, "include"sv)) {
+            include(value);
+            return;
+        }
+        if (m_inGlobalSection && isSambaName(name, "config file"sv)) {
+            switchConfigFile(value);
+            return;
+        }
+        if (m_inGlobalSection && isSambaName(name, "config backend"sv)) {
+            if (isSambaName(value, "registry"sv)) {
+                WSDLOG_DEBUG("smb.conf uses registry configuration");
+                m_complete = false;
+            }
+            return;
+        }
+    }
+
+    if (!m_inGlobalSection)
+        return;
+
+    if (isSambaName(name, "workgroup"sv)) {
+        WSDLOG_TRACE("smb.conf workgroup is: {}", value);
+        m_params.workgroup.emplace(value);
+    } else if (isSambaName(name, "security"sv)) {
+        WSDLOG_TRACE("smb.conf security is: {}", value);
+        m_params.security.emplace(value);
+    } else if (isSambaName(name, "netbios name"sv)) {
+        WSDLOG_TRACE("smb.conf netbios name is: {}", value);
+        m_params.hostName.emplace(value);
+    } else if (isSambaName(name, "server string"sv)) {
+        WSDLOG_TRACE("smb.conf server string is: {}", value);
+        m_params.hostDescription.emplace(value);
+    }
+}
+
+void SmbConfScanner::include(std::string_view value) {
+
+    if (value.empty())
+        return;
+    if (isSambaName(value, "registry"sv)) {
+        WSDLOG_DEBUG("smb.conf includes registry configuration");
+        m_complete = false;
+        return;
+    }
+    //substitutions like %m depend on the connecting client and testparm does not expand them either
+    if (value.find('%') != value.npos) {
+        WSDLOG_DEBUG("ignoring smb.conf include with substitutions: {}", value);
+        return;
+    }
+    //like Samba, ignore includes that do not exist
+    std::filesystem::path path(value);
+    if (!scanFile(path))
+        WSDLOG_DEBUG("smb.conf include '{}' cannot be read, ignoring", value);
+}
+
+void SmbConfScanner::switchConfigFile(std::string_view value) {
+
+    if (value.empty() || value.find('%') != value.npos)
+        return;
+    std::filesystem::path path(value);
+    //switching to a file we have already read is a no-op
+    if (std::find(m_files.begin(), m_files.end(), path) != m_files.end())
+        return;
+    m_nextConfigFile = std::move(path);
+    m_stopped = true;
+}
@@ -0,0 +1,59 @@
+// Copyright (c) 2022, Eugene Gershnik
+// SPDX-License-Identifier: BSD-3-Clause
+
+#ifndef HEADER_SMB_CONF_SCANNER_H_INCLUDED
+#define HEADER_SMB_CONF_SCANNER_H_INCLUDED
+
+#include "config.h"
+
+/*
+ Single pass smb.conf scanner that extracts the parameters we care about.
+ It works directly on the mapped file and only allocates for continued lines.
+
+ The rules follow Samba's own parser:
+ - lines whose first non-blank character is # or ; are comments
+ - a backslash at the end of a line continues it, leading blanks of the next line are dropped
+ - section and parameter names are compared ignoring case and whitespace
+ - parameters before the first section header belong to [global] and [global] can appear many times
+ - include = file is read in place, config file = file discards everything and starts over from that file
+ Configuration stored in the registry cannot be read this way and makes the result incomplete.
+ */
+class SmbConfScanner {
+public:
+    //testparm output is already fully resolved so directives in it must not be followed
+    explicit SmbConfScanner(bool followDirectives):
+        m_followDirectives(followDirectives) {
+    }
+
+    //Reads the main config file. Returns false if it cannot be read
+    auto read(const std::filesystem::path & path) -> bool;
+    void scan(std::string_view content);
+
+    //False if part of the configuration comes from somewhere we cannot read
+    auto isComplete() const -> bool
+        { return m_complete; }
+    //All the files the result depends on
+    auto files() const -> const std::vector<std::filesystem::path> &
+        { return m_files; }
+    auto result() && -> Config::SambaParams
+        { return std::move(m_params); }
+private:
+    auto scanFile(const std::filesystem::path & path) -> bool;
+    void processParameter(std::string_view name, std::string_view value);
+    void include(std::string_view value);
+    void switchConfigFile(std::string_view value);
+private:
+    static constexpr unsigned s_maxDepth = 16;
+
+    Config::SambaParams m_params;
+    std::vector<std::filesystem::path> m_files;
+    std::optional<std::filesystem::path> m_nextConfigFile;
+    std::string m_continuedLine;
+    unsigned m_depth = 0;
+    const bool m_followDirectives;
+    bool m_inGlobalSection = true;
+    bool m_complete = true;
+    bool m_stopped = false;
+};
+
+#endif
@@ -22,6 +22,12 @@ namespace ptl {
             { return socket.native_handle();}
     };
 
+    template<class Protocol, class Executor> 
+    struct FileDescriptorTraits<asio::basic_raw_socket<Protocol, Executor>> {
+        [[gnu::always_inline]] static int c_fd(asio::basic_raw_socket<Protocol, Executor> & socket) noexcept
+            { return socket.native_handle();}
+    };
+
 }
 
 #define    IN6_IS_SCOPE_LINKLOCAL(a)    \
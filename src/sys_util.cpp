@@ -79,6 +79,60 @@ const char * OsLogHandle::s_category = "main";
 
 #endif
 
+auto pinCurrentThreadToCpu([[maybe_unused]] unsigned idx) -> bool {
+
+#if defined(__linux__)
+
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+        return false;
+    int count = CPU_COUNT(&allowed);
+    if (count == 0)
+        return false;
+    int remaining = int(idx % unsigned(count));
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (!CPU_ISSET(cpu, &allowed) || remaining-- != 0)
+            continue;
+        cpu_set_t target;
+        CPU_ZERO(&target);
+        CPU_SET(cpu, &target);
+        return pthread_setaffinity_np(pthread_self(), sizeof(target), &target) == 0;
+    }
+    return false;
+
+#else
+
+    return false;
+
+#endif
+}
+
+auto cacheDirectory() -> std::filesystem::path {
+    if (auto * dirs = getenv("CACHE_DIRECTORY"); dirs && *dirs) {
+        std::string_view first(dirs);
+        return std::filesystem::path(first.substr(0, first.find(':')));
+    }
+    return std::filesystem::path(WSDDN_DEFAULT_CACHE_DIR);
+}
+
+auto createSocketPair() -> std::pair<ptl::FileDescriptor, ptl::FileDescriptor> {
+    int fds[2];
+    if (::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+        ptl::throwErrorCode(errno, "socketpair");
+    std::pair<ptl::FileDescriptor, ptl::FileDescriptor> ret{ptl::FileDescriptor(fds[0]), ptl::FileDescriptor(fds[1])};
+    setCloseOnExec(ret.first, true);
+    setCloseOnExec(ret.second, true);
+    return ret;
+}
+
+void setCloseOnExec(const ptl::FileDescriptor & fd, bool value) {
+    int flags = fcntl(fd.get(), F_GETFD);
+    if (flags != -1)
+        flags = fcntl(fd.get(), F_SETFD, value ? (flags | FD_CLOEXEC) : (flags & ~FD_CLOEXEC));
+    if (flags == -1)
+        ptl::throwErrorCode(errno, "fcntl(F_SETFD)");
+}
+
 int run(const ptl::StringRefArray & args) {
     ptl::SpawnAttr spawnAttr;
 #if !defined(__HAIKU__) && !defined(__DragonFly__)
@@ -99,6 +153,39 @@ int run(const ptl::StringRefArray & args) {
     throw std::runtime_error(fmt::format("`{} finished with status 0x{:X}`", args, stat));
 }
 
+extern char ** environ;
+
+auto spawnDetached(const std::vector<std::string> & args) -> pid_t {
+    std::vector<char *> argv;
+    for (auto & arg: args)
+        argv.push_back(const_cast<char *>(arg.c_str()));
+    argv.push_back(nullptr);
+
+    posix_spawnattr_t attr;
+    if (int res = posix_spawnattr_init(&attr); res != 0)
+        ptl::throwErrorCode(res, "posix_spawnattr_init");
+    short flags = POSIX_SPAWN_SETSIGMASK;
+    sigset_t noSignals;
+    sigemptyset(&noSignals);
+    posix_spawnattr_setsigmask(&attr, &noSignals);
+#if !defined(__HAIKU__) && !defined(__DragonFly__)
+    flags |= POSIX_SPAWN_SETSIGDEF;
+    sigset_t allSignals;
+    sigfillset(&allSignals);
+    sigdelset(&allSignals, SIGKILL);
+    sigdelset(&allSignals, SIGSTOP);
+    posix_spawnattr_setsigdefault(&attr, &allSignals);
+#endif
+    posix_spawnattr_setflags(&attr, flags);
+
+    pid_t pid = -1;
+    int res = posix_spawnp(&pid, argv[0], nullptr, &attr, argv.data(), environ);
+    posix_spawnattr_destroy(&attr);
+    if (res != 0)
+        ptl::throwErrorCode(res, fmt::format("posix_spawn({})", args[0]));
+    return pid;
+}
+
 void shell(const ptl::StringRefArray & args, bool suppressStdErr, std::function<void (const ptl::FileDescriptor & fd)> reader) {
     auto [read, write] = ptl::Pipe::create();
     ptl::SpawnAttr spawnAttr;
@@ -169,6 +169,10 @@ inline void createMissingDirs(const std::filesystem::path & path, mode_t mode,
     }
 }
 
+//Where to keep files that can be recreated: $CACHE_DIRECTORY, set by systemd when the unit 
+//has CacheDirectory=, or WSDDN_DEFAULT_CACHE_DIR
+auto cacheDirectory() -> std::filesystem::path;
+
 template<class Sink>
 class LineReader {
 public:
@@ -221,7 +225,17 @@ private:
     Sink m_sink;
 };
 
+//Pins the calling thread to the idx-th CPU (modulo count) it is currently allowed to run on.
+//Returns false if not supported on this platform or failed
+auto pinCurrentThreadToCpu(unsigned idx) -> bool;
+
+//Both ends are close-on-exec
+auto createSocketPair() -> std::pair<ptl::FileDescriptor, ptl::FileDescriptor>;
+void setCloseOnExec(const ptl::FileDescriptor & fd, bool value);
+
 int run(const ptl::StringRefArray & args);
+//Starts a process without waiting for it or keeping track of it. Signal mask and dispositions are reset.
+auto spawnDetached(const std::vector<std::string> & args) -> pid_t;
 void shell(const ptl::StringRefArray & args, bool suppressStdErr, std::function<void (const ptl::FileDescriptor & fd)> reader);
 
 #if WSDDN_PLATFORM_APPLE
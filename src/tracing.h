@@ -0,0 +1,44 @@
+// Copyright (c) 2022, Eugene Gershnik
+// SPDX-License-Identifier: BSD-3-Clause
+
+#ifndef HEADER_TRACING_H_INCLUDED
+#define HEADER_TRACING_H_INCLUDED
+
+/*
+ USDT static tracepoints for bpftrace, perf or SystemTap under provider "wsddn".
+
+ A probe compiles to a single nop plus a note describing where its arguments live, so it
+ costs nothing measurable until a tracer attaches. Arguments are evaluated regardless, so
+ to keep it that way only pass values that are computed anyway. Durations are in
+ nanoseconds, negative when unknown. Where <sys/sdt.h> is not available probes compile
+ to nothing.
+
+ Probes and their arguments:
+   datagram_received      ifindex, bytes, queue_ns
+   parse_done             ifindex, bytes, parse_ns, ok
+   action_dispatched      ifindex, action (WsdAction), is_http
+   reply_built            ifindex, bytes, build_and_dump_ns
+   reply_sent             ifindex, bytes, arrival_to_sent_ns
+   http_accept            ifindex, connection_count
+   http_request_complete  ifindex, body_bytes, read_ns
+   server_add             ifindex, is_v6
+   server_remove          ifindex, is_v6
+
+ See tools/bpftrace for examples.
+ */
+
+#if HAVE_USDT
+    #define WSDDN_PROBE(name, ...) STAP_PROBEV(wsddn, name, __VA_ARGS__)
+#else
+    //arguments are still "used" so that values computed only for probes do not cause warnings
+    template<class... Args>
+    inline void wsddnNoProbe(const Args & ...) noexcept {}
+    #define WSDDN_PROBE(name, ...) wsddnNoProbe(__VA_ARGS__)
+#endif
+
+template<class Rep, class Period>
+inline auto probeNs(std::chrono::duration<Rep, Period> dur) noexcept -> int64_t {
+    return int64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(dur).count());
+}
+
+#endif
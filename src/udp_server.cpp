@@ -3,6 +3,12 @@
 
 #include "udp_server.h"
 #include "sys_socket.h"
+#include "metrics.h"
+#include "latency.h"
+#include "tracing.h"
+#include "log_fields.h"
+#include "log_limiter.h"
+#include "flight_recorder.h"
 #include "exc_handling.h"
 
 #if defined(IP_RECVIF)
@@ -10,39 +16,43 @@
 #endif
 
 static constexpr size_t g_wsdMaxDatagramLength = 32767;
+//drops this far apart are reported as separate episodes
+static constexpr auto g_dropEpisodeGap = std::chrono::seconds(10);
+//give a grown buffer a chance to absorb the burst before growing it again
+static constexpr auto g_recvBufferGrowthInterval = std::chrono::seconds(1);
 
 class UdpServerImpl : public UdpServer {
 public:
-    UdpServerImpl(asio::io_context & ctxt,
+    UdpServerImpl(const Strand & strand,
                   const refcnt_ptr<Config> & config,
                   const NetworkInterface & iface,
                   const ip::address & addr):
         m_config(config),
-        m_recvSocket(ctxt),
-        m_multicastSendSocket(ctxt),
-        m_unicastSendSocket(ctxt),
+        m_recvSocket(strand),
+        m_multicastSendSocket(strand),
+        m_unicastSendSocket(strand),
         m_recvBuffer(g_wsdMaxDatagramLength),
+        m_iface(iface),
         m_ifaceIdx(iface.index),
         m_isV4(addr.is_v4()),
-        m_serverDesc(sys_format("UDP on {}({})", iface.name, m_isV4 ? "v4" : "v6")) {
+        m_serverDesc(sys_format("UDP on {}({})", iface.name, m_isV4 ? "v4" : "v6")),
+        m_metrics(Metrics::forServer(iface.name, !m_isV4)) {
 
-        auto prot = m_isV4 ? ip::udp::v4() : ip::udp::v6();
-
-        m_recvSocket.open(prot);
-        m_multicastSendSocket.open(prot);
-        m_unicastSendSocket.open(prot);
-        
-        m_recvSocket.non_blocking(true);
-        m_unicastSendSocket.non_blocking(true);
-
-        m_recvSocket.set_option(ip::udp::socket::reuse_address(true));
-        m_unicastSendSocket.set_option(ip::udp::socket::reuse_address(true));
+        if (auto adopted = SocketHandoff::takeUdpSockets(iface, addr)) {
+            adoptSockets(std::move(*adopted));
+            return;
+        }
 
-        if (m_isV4)
-            initAddresses(addr.to_v4(), iface);
-        else
-            initAddresses(addr.to_v6(), iface);
+        openRecvSocket();
+        openSendSockets();
 
+        if (m_isV4) {
+            initRecvSocket(addr.to_v4());
+            initSendSockets(addr.to_v4());
+        } else {
+            initRecvSocket(addr.to_v6());
+            initSendSockets(addr.to_v6());
+        }
     }
 
     void start(Handler & handler) override {
@@ -64,26 +74,125 @@ public:
          write(std::move(data), &UdpServerImpl::m_multicastSendSocket, m_multicastDest, false, continuation);
      }
 
+    void rebind(const ip::address & addr) override {
+        WSDLOG_INFO("{}: rebinding to {}", m_serverDesc, addr.to_string());
+
+        //IPv4 multicast membership is tied to the interface address, IPv6 one only to the interface index
+        bool rebindRecv = m_isV4;
+        if (rebindRecv)
+            m_recvSocket.close();
+        m_multicastSendSocket.close();
+        m_unicastSendSocket.close();
+
+        if (rebindRecv)
+            openRecvSocket();
+        openSendSockets();
+
+        if (m_isV4) {
+            initRecvSocket(addr.to_v4());
+            initSendSockets(addr.to_v4());
+        } else {
+            initSendSockets(addr.to_v6());
+        }
+
+        if (m_handler) {
+            if (rebindRecv)
+                read(&UdpServerImpl::m_recvSocket);
+            read(&UdpServerImpl::m_unicastSendSocket);
+        }
+    }
+
+    auto handOff() -> std::vector<ptl::FileDescriptor> override {
+        WSDLOG_INFO("{}: handing off sockets", m_serverDesc);
+        m_handler = nullptr;
+        std::vector<ptl::FileDescriptor> ret;
+        ret.emplace_back(m_recvSocket.release());
+        ret.emplace_back(m_multicastSendSocket.release());
+        ret.emplace_back(m_unicastSendSocket.release());
+        return ret;
+    }
+
 private:
     
     ~UdpServerImpl() noexcept {
     }
 
-    void initAddresses(const ip::address_v4 & addr, [[maybe_unused]] const NetworkInterface & iface) {
+    //Takes over sockets in handOff() order that are already bound and joined to the multicast group
+    void adoptSockets(std::vector<ptl::FileDescriptor> && sockets) {
+        if (sockets.size() != 3)
+            throw std::runtime_error("unexpected number of handed off UDP sockets");
         
-        auto multicastGroupAddress = ip::make_address_v4(g_WsdMulticastGroupV4);
+        WSDLOG_DEBUG("{}: adopting handed off sockets", m_serverDesc);
         
-        m_multicastDest = ip::udp::endpoint(multicastGroupAddress, g_WsdUdpPort);
+        auto prot = m_isV4 ? ip::udp::v4() : ip::udp::v6();
+        ip::udp::socket UdpServerImpl::* targets[] = {
+            &UdpServerImpl::m_recvSocket, 
+            &UdpServerImpl::m_multicastSendSocket, 
+            &UdpServerImpl::m_unicastSendSocket
+        };
+        for (size_t i = 0; i < std::size(targets); ++i) {
+            (this->*targets[i]).assign(prot, sockets[i].get());
+            sockets[i].detach();
+        }
+        m_recvSocket.non_blocking(true);
+        m_unicastSendSocket.non_blocking(true);
+        //in case the previous owner did not ask for them
+        ReadMessageControl::applyDiagnostics(m_recvSocket, m_serverDesc);
+        ReadMessageControl::applyDiagnostics(m_unicastSendSocket, m_serverDesc);
+        resetReceiveQueue(&UdpServerImpl::m_recvSocket, true);
+        resetReceiveQueue(&UdpServerImpl::m_unicastSendSocket, true);
+        
+        if (m_isV4) {
+            m_multicastDest = ip::udp::endpoint(ip::make_address_v4(g_WsdMulticastGroupV4), g_WsdUdpPort);
+        } else {
+            auto destAddr = ip::make_address_v6(g_WsdMulticastGroupV6);
+            destAddr.scope_id(m_iface.index);
+            m_multicastDest = ip::udp::endpoint(destAddr, g_WsdUdpPort);
+        }
+    }
+
+    void openRecvSocket() {
+        m_recvSocket.open(m_isV4 ? ip::udp::v4() : ip::udp::v6());
+        m_recvSocket.non_blocking(true);
+        m_recvSocket.set_option(ip::udp::socket::reuse_address(true));
+        ReadMessageControl::applyDiagnostics(m_recvSocket, m_serverDesc);
+        resetReceiveQueue(&UdpServerImpl::m_recvSocket, false);
+    }
+
+    void openSendSockets() {
+        auto prot = m_isV4 ? ip::udp::v4() : ip::udp::v6();
+
+        m_multicastSendSocket.open(prot);
+        m_unicastSendSocket.open(prot);
+        
+        m_unicastSendSocket.non_blocking(true);
+        m_unicastSendSocket.set_option(ip::udp::socket::reuse_address(true));
+        ReadMessageControl::applyDiagnostics(m_unicastSendSocket, m_serverDesc);
+        resetReceiveQueue(&UdpServerImpl::m_unicastSendSocket, false);
+    }
+
+    auto makeMulticastGroupRequest(const ip::address_v4 & addr) const {
+        auto multicastGroupAddress = ip::make_address_v4(g_WsdMulticastGroupV4);
 
     #if PTL_HAVE_IP_MREQN
         ip_mreqn multicastGroupRequest;
         multicastGroupRequest.imr_address.s_addr = htonl(addr.to_uint());
-        multicastGroupRequest.imr_ifindex = iface.index;
+        multicastGroupRequest.imr_ifindex = m_iface.index;
     #else
         ip_mreq multicastGroupRequest;
         multicastGroupRequest.imr_interface.s_addr = htonl(addr.to_uint());
     #endif
         multicastGroupRequest.imr_multiaddr.s_addr = htonl(multicastGroupAddress.to_uint());
+        return multicastGroupRequest;
+    }
+
+    void initRecvSocket(const ip::address_v4 & addr) {
+        
+        auto multicastGroupAddress = ip::make_address_v4(g_WsdMulticastGroupV4);
+        
+        m_multicastDest = ip::udp::endpoint(multicastGroupAddress, g_WsdUdpPort);
+
+        auto multicastGroupRequest = makeMulticastGroupRequest(addr);
 
         setSocketOption(m_recvSocket, ptl::SockOptIPv4AddMembership, multicastGroupRequest);
 
@@ -94,6 +203,12 @@ private:
         ReadMessageControl::applyV4(m_recvSocket);
             
         m_recvSocket.bind(ip::udp::endpoint(multicastGroupAddress, g_WsdUdpPort));
+    }
+
+    void initSendSockets(const ip::address_v4 & addr) {
+
+        auto multicastGroupRequest = makeMulticastGroupRequest(addr);
+
         m_unicastSendSocket.bind(ip::udp::endpoint(addr, g_WsdUdpPort));
 
         setSocketOption(m_unicastSendSocket, ptl::SockOptIPv4MulticastLoop, false);
@@ -111,8 +226,9 @@ private:
             m_multicastSendSocket.bind(ip::udp::endpoint(addr, m_config->sourcePort()));
     }
 
-    void initAddresses(const ip::address_v6 & addr, const NetworkInterface & iface) {
+    void initRecvSocket(const ip::address_v6 & /*addr*/) {
         
+        auto & iface = m_iface;
         auto multicastGroupAddress = ip::make_address_v6(g_WsdMulticastGroupV6);
         
         auto destAddr = multicastGroupAddress;
@@ -127,6 +243,12 @@ private:
         #endif
 
         m_recvSocket.bind(ip::udp::endpoint(ip::address_v6(multicastGroupAddress.to_bytes(), iface.index), g_WsdUdpPort));
+    }
+
+    void initSendSockets(const ip::address_v6 & addr) {
+        
+        auto & iface = m_iface;
+
         m_unicastSendSocket.bind(ip::udp::endpoint(ip::address_v6(addr.to_bytes(), iface.index), g_WsdUdpPort));
 
         setSocketOption(m_unicastSendSocket, ptl::SockOptIPv6MulticastLoop, false);
@@ -139,15 +261,39 @@ private:
 
     }
     
-#if !defined(__linux__) && defined(IP_RECVIF)
+    //Ancillary data requested with received datagrams: the receiving interface of IPv4 ones 
+    //on platforms that report it via IP_RECVIF, kernel arrival time and, on Linux, the number 
+    //of datagrams the socket dropped so far where supported
     class ReadMessageControl {
     private:
-        alignas(cmsghdr) uint8_t m_data[CMSG_SPACE(sizeof(sockaddr_dl))];
+    #if !defined(__linux__) && defined(IP_RECVIF)
+        static constexpr size_t s_recvIfSpace = CMSG_SPACE(sizeof(sockaddr_dl));
+    #else
+        static constexpr size_t s_recvIfSpace = 0;
+    #endif
+    #if defined(SO_TIMESTAMPNS)
+        static constexpr size_t s_timestampSpace = CMSG_SPACE(sizeof(timespec));
+    #elif defined(SO_TIMESTAMP)
+        static constexpr size_t s_timestampSpace = CMSG_SPACE(sizeof(timeval));
+    #else
+        static constexpr size_t s_timestampSpace = 0;
+    #endif
+    #if defined(SO_RXQ_OVFL)
+        static constexpr size_t s_dropCountSpace = CMSG_SPACE(sizeof(uint32_t));
+    #else
+        static constexpr size_t s_dropCountSpace = 0;
+    #endif
+        static constexpr size_t s_size = s_recvIfSpace + s_timestampSpace + s_dropCountSpace;
+        
+        alignas(cmsghdr) uint8_t m_data[s_size ? s_size : 1];
     public:
-        static constexpr size_t size() noexcept { return sizeof(m_data); }
-        cmsghdr * data() noexcept { return reinterpret_cast<cmsghdr *>(m_data); }
+        static constexpr size_t size() noexcept { return s_size; }
+        cmsghdr * data() noexcept { return s_size ? reinterpret_cast<cmsghdr *>(m_data) : nullptr; }
         
-        static bool checkInterfaceIndexV4(msghdr & msg, int ifIndex, const sys_string & serverDesc) {
+        static bool checkInterfaceIndexV4([[maybe_unused]] msghdr & msg, 
+                                          [[maybe_unused]] int ifIndex, 
+                                          [[maybe_unused]] const sys_string & serverDesc) {
+        #if !defined(__linux__) && defined(IP_RECVIF)
             if (msg.msg_flags & MSG_CTRUNC) {
                 WSDLOG_ERROR("{}: control info is truncated", serverDesc);
                 return true;
@@ -163,26 +309,85 @@ private:
                     return sdl.sdl_index == ifIndex;
                 }
             }
-            
+        #endif
             return true;
         }
         
-        static void applyV4(ip::udp::socket & sock) {
+        //When the datagram was queued to the socket, by the realtime clock
+        static auto kernelTimestamp([[maybe_unused]] msghdr & msg) -> std::optional<std::chrono::system_clock::time_point> {
+        #if defined(SO_TIMESTAMPNS) || defined(SO_TIMESTAMP)
+            if (msg.msg_controllen < sizeof(struct cmsghdr))
+                return std::nullopt;
+            
+            for (cmsghdr * cmptr = CMSG_FIRSTHDR(&msg); cmptr; cmptr = CMSG_NXTHDR(&msg, cmptr)) {
+                if (cmptr->cmsg_level != SOL_SOCKET)
+                    continue;
+            #if defined(SO_TIMESTAMPNS)
+                if (cmptr->cmsg_type == SCM_TIMESTAMPNS) {
+                    timespec ts;
+                    memcpy(&ts, CMSG_DATA(cmptr), sizeof(ts));
+                    auto sinceEpoch = std::chrono::seconds(ts.tv_sec) + std::chrono::nanoseconds(ts.tv_nsec);
+                    return std::chrono::system_clock::time_point(std::chrono::duration_cast<std::chrono::system_clock::duration>(sinceEpoch));
+                }
+            #else
+                if (cmptr->cmsg_type == SCM_TIMESTAMP) {
+                    timeval tv;
+                    memcpy(&tv, CMSG_DATA(cmptr), sizeof(tv));
+                    auto sinceEpoch = std::chrono::seconds(tv.tv_sec) + std::chrono::microseconds(tv.tv_usec);
+                    return std::chrono::system_clock::time_point(std::chrono::duration_cast<std::chrono::system_clock::duration>(sinceEpoch));
+                }
+            #endif
+            }
+        #endif
+            return std::nullopt;
+        }
+        
+        //Total dropped by the socket when the datagram was queued. Absent until the first drop
+        static auto dropCount([[maybe_unused]] msghdr & msg) -> std::optional<uint32_t> {
+        #if defined(SO_RXQ_OVFL)
+            if (msg.msg_controllen < sizeof(struct cmsghdr))
+                return std::nullopt;
+            
+            for (cmsghdr * cmptr = CMSG_FIRSTHDR(&msg); cmptr; cmptr = CMSG_NXTHDR(&msg, cmptr)) {
+                if (cmptr->cmsg_level == SOL_SOCKET && cmptr->cmsg_type == SO_RXQ_OVFL) {
+                    uint32_t count;
+                    memcpy(&count, CMSG_DATA(cmptr), sizeof(count));
+                    return count;
+                }
+            }
+        #endif
+            return std::nullopt;
+        }
+        
+        static void applyV4([[maybe_unused]] ip::udp::socket & sock) {
+        #if !defined(__linux__) && defined(IP_RECVIF)
             int val = 1;
             ptl::setSocketOption(sock, IPPROTO_IP, IP_RECVIF, &val, sizeof(val));
+        #endif
         }
-    };
-#else
-    class ReadMessageControl {
-    public:
-        static constexpr size_t size() noexcept { return 0; }
-        static cmsghdr * data() noexcept { return nullptr; }
-        
-        static bool checkInterfaceIndexV4(msghdr & /*msg*/, int /*ifIndex*/, const sys_string & /*serverDesc*/) { return true; }
         
-        static void applyV4(ip::udp::socket & /*sock*/) {}
+        //Timestamps and drop counts are a diagnostic nicety so failing to enable them is not an error
+        static void applyDiagnostics([[maybe_unused]] ip::udp::socket & sock, [[maybe_unused]] const sys_string & serverDesc) {
+        #if defined(SO_TIMESTAMPNS) || defined(SO_TIMESTAMP)
+            int val = 1;
+            std::error_code ec;
+            #if defined(SO_TIMESTAMPNS)
+                ptl::setSocketOption(sock, SOL_SOCKET, SO_TIMESTAMPNS, &val, sizeof(val), ec);
+            #else
+                ptl::setSocketOption(sock, SOL_SOCKET, SO_TIMESTAMP, &val, sizeof(val), ec);
+            #endif
+            if (ec)
+                WSDLOG_DEBUG("{}: unable to enable receive timestamps: {}", serverDesc, ec.message());
+        #endif
+        #if defined(SO_RXQ_OVFL)
+            int dropsVal = 1;
+            std::error_code dropsEc;
+            ptl::setSocketOption(sock, SOL_SOCKET, SO_RXQ_OVFL, &dropsVal, sizeof(dropsVal), dropsEc);
+            if (dropsEc)
+                WSDLOG_DEBUG("{}: unable to enable drop counting: {}", serverDesc, dropsEc.message());
+        #endif
+        }
     };
-#endif
 
     void read(ip::udp::socket UdpServerImpl::*socketPtr) {
         (this->*socketPtr).async_wait(ip::udp::socket::wait_read,
@@ -243,8 +448,13 @@ private:
                     continue;
                 }
                 
+                m_metrics.udpBytesReceived.add(bytesRecvd);
+                auto arrival = arrivalTime(msg, bytesRecvd);
+                if (auto dropCount = ReadMessageControl::dropCount(msg))
+                    noteDrops(socketPtr, *dropCount);
+                
                 if (msg.msg_flags & MSG_TRUNC)
-                    WSDLOG_ERROR("{}: read data truncated", m_serverDesc);
+                    WSDLOG_ERROR_LIMITED(m_recvSender.address(), "{}: read data truncated", m_serverDesc);
                 
                 if (m_isV4 && !ReadMessageControl::checkInterfaceIndexV4(msg, m_ifaceIdx, m_serverDesc)) {
                     continue;
@@ -256,28 +466,161 @@ private:
                 else
                     WSDLOG_DEBUG("{}: received {} bytes from {}:{}", m_serverDesc, bytesRecvd, m_recvSender.address().to_string(), m_recvSender.port());
 
+                auto doc = parseDatagram(bytesRecvd);
+                recordReceived(bytesRecvd, !doc ? FlightOutcome::Malformed : 
+                                           (msg.msg_flags & MSG_TRUNC) ? FlightOutcome::Truncated : FlightOutcome::Ok);
+                if (!doc)
+                    continue;
+                
+                LogFieldsScope logFields([&](LogFields & fields) {
+                    fields.peer = sys_string(m_recvSender.address().to_string());
+                });
                 std::optional<XmlCharBuffer> maybeReply;
                 try {
-                    int options = 0;
-                    #if LIBXML_VERSION >= 21300
-                        options = XML_PARSE_NO_XXE;
-                    #endif
-                    auto doc = XmlDoc::readMemory(m_recvBuffer.data(), int(bytesRecvd), nullptr, nullptr, options);
-                    maybeReply = m_handler->handleUdpRequest(std::move(doc));
+                    maybeReply = m_handler->handleUdpRequest(m_recvSender.address(), std::move(doc));
                 } catch (std::exception & ex) {
-                    WSDLOG_ERROR("{}: error handling request: {}", m_serverDesc, ex.what());
+                    WSDLOG_ERROR_LIMITED(m_recvSender.address(), "{}: error handling request: {}", m_serverDesc, ex.what());
                     WSDLOG_TRACE("{}", formatCaughtExceptionBacktrace());
                 }
 
                 if (maybeReply)
-                    write(std::move(*maybeReply), &UdpServerImpl::m_unicastSendSocket, m_recvSender, true);
+                    write(std::move(*maybeReply), &UdpServerImpl::m_unicastSendSocket, m_recvSender, true, nullptr, arrival);
             }
         });
     }
 
+    //Drop accounting and buffer sizing of a socket we receive on
+    struct ReceiveQueue {
+        //nullopt until the baseline of an adopted socket is known
+        std::optional<uint32_t> lastDropCount = 0;
+        //as reported by the system, which may be more than requested
+        int bufferSize = 0;
+        bool atLimit = false;
+        std::chrono::steady_clock::time_point lastDrop;
+        std::chrono::steady_clock::time_point lastGrowth;
+    };
+
+    auto receiveQueueFor(ip::udp::socket UdpServerImpl::*socketPtr) -> ReceiveQueue & {
+        return socketPtr == &UdpServerImpl::m_recvSocket ? m_recvQueue : m_unicastQueue;
+    }
+
+    //Drop counts of handed off sockets include drops seen by the previous owner so the first 
+    //one only sets the baseline
+    void resetReceiveQueue(ip::udp::socket UdpServerImpl::*socketPtr, bool adopted) {
+        auto & queue = receiveQueueFor(socketPtr);
+        queue = ReceiveQueue{};
+        if (adopted)
+            queue.lastDropCount.reset();
+        queue.bufferSize = receiveBufferSize(this->*socketPtr);
+        if (socketPtr == &UdpServerImpl::m_recvSocket)
+            m_metrics.udpReceiveBufferBytes.set(queue.bufferSize);
+    }
+
+    static auto receiveBufferSize(ip::udp::socket & socket) -> int {
+        asio::error_code ec;
+        ip::udp::socket::receive_buffer_size size;
+        socket.get_option(size, ec);
+        return ec ? 0 : size.value();
+    }
+
+    void noteDrops(ip::udp::socket UdpServerImpl::*socketPtr, uint32_t dropCount) {
+        auto & queue = receiveQueueFor(socketPtr);
+        if (!queue.lastDropCount) {
+            queue.lastDropCount = dropCount;
+            return;
+        }
+        //the kernel counter wraps around
+        uint32_t newDrops = dropCount - *queue.lastDropCount;
+        queue.lastDropCount = dropCount;
+        if (newDrops == 0)
+            return;
+        
+        m_metrics.udpReceiveDrops.add(newDrops);
+        
+        auto now = std::chrono::steady_clock::now();
+        bool newEpisode = now - queue.lastDrop > g_dropEpisodeGap;
+        queue.lastDrop = now;
+        
+        bool grown = false;
+        auto limit = int(std::min(m_config->recvBufferMax(), unsigned(std::numeric_limits<int>::max())));
+        if (!queue.atLimit && queue.bufferSize < limit && now - queue.lastGrowth >= g_recvBufferGrowthInterval) {
+            auto & socket = this->*socketPtr;
+            auto requested = queue.bufferSize > limit / 2 ? limit : std::max(queue.bufferSize * 2, 1);
+            asio::error_code ec;
+            socket.set_option(ip::udp::socket::receive_buffer_size(requested), ec);
+            auto newSize = receiveBufferSize(socket);
+            if (ec || newSize <= queue.bufferSize) {
+                //most likely capped by a system wide maximum such as net.core.rmem_max
+                WSDLOG_DEBUG("{}: unable to grow receive buffer beyond {} bytes", m_serverDesc, queue.bufferSize);
+                queue.atLimit = true;
+            } else {
+                queue.bufferSize = newSize;
+                queue.lastGrowth = now;
+                grown = true;
+                if (socketPtr == &UdpServerImpl::m_recvSocket)
+                    m_metrics.udpReceiveBufferBytes.set(newSize);
+            }
+        }
+        
+        if (newEpisode) {
+            if (grown)
+                WSDLOG_WARN("{}: receive queue overflowed, {} datagrams dropped, receive buffer grown to {} bytes", 
+                            m_serverDesc, newDrops, queue.bufferSize);
+            else
+                WSDLOG_WARN("{}: receive queue overflowed, {} datagrams dropped, receive buffer is {} bytes", 
+                            m_serverDesc, newDrops, queue.bufferSize);
+        }
+    }
+
+    //Without kernel timestamps this is when we read the datagram, which misses time spent in the queue
+    auto arrivalTime(msghdr & msg, size_t size) -> std::chrono::steady_clock::time_point {
+        auto now = std::chrono::steady_clock::now();
+        auto ret = now;
+        int64_t queuedNs = -1;
+        if (auto kernelTime = ReadMessageControl::kernelTimestamp(msg)) {
+            //realtime clock can jump, so don't trust it beyond sanity
+            auto queued = std::chrono::system_clock::now() - *kernelTime;
+            if (queued >= queued.zero() && queued <= std::chrono::minutes(1)) {
+                Latency::histogram(LatencyStage::UdpQueue).record(queued);
+                queuedNs = probeNs(queued);
+                ret = now - std::chrono::duration_cast<std::chrono::steady_clock::duration>(queued);
+            }
+        }
+        WSDDN_PROBE(datagram_received, m_ifaceIdx, size, queuedNs);
+        return ret;
+    }
+
+    auto parseDatagram(size_t size) -> std::unique_ptr<XmlDoc> {
+        std::unique_ptr<XmlDoc> ret;
+        LatencyTimer timer(LatencyStage::UdpParse);
+        try {
+            int options = 0;
+            #if LIBXML_VERSION >= 21300
+                options = XML_PARSE_NO_XXE;
+            #endif
+            ret = XmlDoc::readMemory(m_recvBuffer.data(), int(size), nullptr, nullptr, options);
+        } catch (std::exception & ex) {
+            WSDLOG_ERROR_LIMITED(m_recvSender.address(), "{}: error handling request: {}", m_serverDesc, ex.what());
+            m_metrics.parseFailures.add();
+        }
+        auto elapsed = timer.stop();
+        WSDDN_PROBE(parse_done, m_ifaceIdx, size, probeNs(elapsed), ret != nullptr);
+        return ret;
+    }
+
+    //Only failures are worth keeping the payload of
+    void recordReceived(size_t size, FlightOutcome outcome) {
+        bool keepPayload = (outcome != FlightOutcome::Ok);
+        FlightRecorder::record({.event = FlightEvent::UdpReceived, .outcome = outcome, .ifIndex = unsigned(m_ifaceIdx), .bytesIn = size},
+                               m_recvSender.address(), m_recvSender.port(), 
+                               keepPayload ? m_recvBuffer.data() : nullptr, keepPayload ? size : 0);
+    }
+
+    //arrival is when the request being replied to was received, if any
     void write(XmlCharBuffer && data, ip::udp::socket UdpServerImpl::*socketPtr, ip::udp::endpoint dest,
-               bool isUnicast, std::function<void (asio::error_code)> continuation = nullptr) {
-        int repeatCount = (socketPtr == &UdpServerImpl::m_multicastSendSocket ? 4 : 2);
+               bool isUnicast, std::function<void (asio::error_code)> continuation = nullptr,
+               std::optional<std::chrono::steady_clock::time_point> arrival = std::nullopt) {
+        int repeatCount = (socketPtr == &UdpServerImpl::m_multicastSendSocket ? g_WsdMulticastRepeatCount : 2);
         RefCountedContainerBuffer buffer(std::move(data));
         auto & socket = this->*socketPtr;
 
@@ -289,8 +632,11 @@ private:
             bool isUnicast;
             int repeatCount;
             std::function<void (asio::error_code)> continuation;
+            std::chrono::steady_clock::time_point sendStart;
+            std::optional<std::chrono::steady_clock::time_point> arrival;
+            bool isFirstCopy = true;
 
-            void operator()(asio::error_code ec, size_t /*bytesSent, ip::udp::socket * socket*/) {
+            void operator()(asio::error_code ec, size_t bytesSent) {
                 
                 if (!me->m_handler)
                     return;
@@ -307,7 +653,8 @@ private:
 
                 if (ec) {
                     if (ec != asio::error::operation_aborted) {
-                        WSDLOG_ERROR("{}: error writing: {}", me->m_serverDesc, ec.message());
+                        WSDLOG_ERROR_LIMITED(dest.address(), "{}: error writing: {}", me->m_serverDesc, ec.message());
+                        me->recordSent(dest, buffer.begin()->size(), FlightOutcome::Failed);
                         
                         if (continuation)
                             continuation(ec);
@@ -316,6 +663,18 @@ private:
                     }
                     return;
                 }
+                
+                me->m_metrics.udpBytesSent.add(bytesSent);
+                Latency::record(LatencyStage::UdpSend, sendStart);
+                if (isFirstCopy) {
+                    me->recordSent(dest, bytesSent, FlightOutcome::Ok);
+                    isFirstCopy = false;
+                }
+                if (arrival) {
+                    //only the first copy of a reply counts
+                    me->checkReplyLatency(*arrival, dest, bytesSent);
+                    arrival.reset();
+                }
 
                 if (--repeatCount == 0) {
                     if (continuation)
@@ -332,7 +691,9 @@ private:
                     if (ec || !socket.is_open())
                         return;
                     
-                    socket.async_send_to(buffer, dest, Callback{*this});
+                    auto next = *this;
+                    next.sendStart = std::chrono::steady_clock::now();
+                    socket.async_send_to(buffer, dest, std::move(next));
                 });
             }
         };
@@ -343,7 +704,23 @@ private:
         else
             WSDLOG_DEBUG("{}: sending {} bytes to {}:{}", m_serverDesc, buffer.begin()->size(), dest.address().to_string(), m_recvSender.port());
         
-        socket.async_send_to(buffer, dest, Callback{refcnt_retain(this), buffer, socket, dest, isUnicast, repeatCount, continuation});
+        socket.async_send_to(buffer, dest, Callback{refcnt_retain(this), buffer, socket, dest, isUnicast, repeatCount, continuation,
+                                                      std::chrono::steady_clock::now(), arrival});
+    }
+
+    void recordSent(const ip::udp::endpoint & dest, size_t size, FlightOutcome outcome) {
+        FlightRecorder::record({.event = FlightEvent::UdpSent, .outcome = outcome, .ifIndex = unsigned(m_ifaceIdx), .bytesOut = size},
+                               dest.address(), dest.port());
+    }
+
+    void checkReplyLatency(std::chrono::steady_clock::time_point arrival, const ip::udp::endpoint & dest, size_t bytesSent) {
+        auto elapsed = std::chrono::steady_clock::now() - arrival;
+        Latency::histogram(LatencyStage::Reply).record(elapsed);
+        WSDDN_PROBE(reply_sent, m_ifaceIdx, bytesSent, probeNs(elapsed));
+        auto slo = Latency::replySlo();
+        if (slo != slo.zero() && elapsed > slo)
+            WSDLOG_WARN_LIMITED(dest.address(), "{}: reply to {} sent {}us after request arrived, over the {}ms target", m_serverDesc, 
+                                dest.address().to_string(), std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count(), slo.count());
     }
 
 private:
@@ -357,17 +734,21 @@ private:
     ip::udp::endpoint m_multicastDest;
     std::vector<std::byte> m_recvBuffer;
     ip::udp::endpoint m_recvSender;
+    ReceiveQueue m_recvQueue;
+    ReceiveQueue m_unicastQueue;
 
+    const NetworkInterface m_iface;
     int m_ifaceIdx;
     bool m_isV4;
     sys_string m_serverDesc;
+    ServerMetrics & m_metrics;
 };
 
-refcnt_ptr<UdpServer> createUdpServer(asio::io_context & ctxt,
+refcnt_ptr<UdpServer> createUdpServer(const Strand & strand,
                                       const refcnt_ptr<Config> & config,
                                       const NetworkInterface & iface,
                                       const ip::address & addr) {
 
-    return refcnt_attach(new UdpServerImpl(ctxt, config, iface, addr));
+    return refcnt_attach(new UdpServerImpl(strand, config, iface, addr));
     
 }
@@ -7,6 +7,7 @@
 #include "xml_wrapper.h"
 #include "util.h"
 #include "config.h"
+#include "handoff.h"
 
 class UdpServer : public ref_counted<UdpServer> {
     friend ref_counted<UdpServer>;
@@ -14,7 +15,7 @@ class UdpServer : public ref_counted<UdpServer> {
 public:
     class Handler {
     public:
-        virtual auto handleUdpRequest(std::unique_ptr<XmlDoc> doc) -> std::optional<XmlCharBuffer> = 0;
+        virtual auto handleUdpRequest(const ip::address & peer, std::unique_ptr<XmlDoc> doc) -> std::optional<XmlCharBuffer> = 0;
         virtual void onFatalUdpError() = 0;
     protected:
         ~Handler() {}
@@ -23,6 +24,11 @@ public:
     virtual void start(Handler & handler) = 0;
     virtual void stop() = 0;
     virtual void broadcast(XmlCharBuffer && data, std::function<void (asio::error_code)> continuation = nullptr) = 0;
+    //Re-binds sockets tied to the interface address to a new address on the same interface
+    virtual void rebind(const ip::address & addr) = 0;
+    //Stops the server and gives up ownership of its sockets. They can be passed to the factory 
+    //of another process via SocketHandoff
+    virtual auto handOff() -> std::vector<ptl::FileDescriptor> = 0;
 
 protected:
     UdpServer() {
@@ -31,7 +37,7 @@ protected:
     }    
 };
 
-using UdpServerFactoryT = auto (asio::io_context & ctxt,
+using UdpServerFactoryT = auto (const Strand & strand,
                                 const refcnt_ptr<Config> & config,
                                 const NetworkInterface & iface,
                                 const ip::address & addr) -> refcnt_ptr<UdpServer>;
@@ -39,6 +39,19 @@ struct WindowsWorkgroup {
 
 using MemberOf = std::variant<WindowsWorkgroup, WindowsDomain>;
 
+//Runs handlers of one server sequentially even when the io_context has multiple threads
+using Strand = asio::strand<asio::io_context::executor_type>;
+
+enum class HttpListenerMode {
+    PerAddress,
+    Shared
+};
+
+enum class LogOverflow {
+    Drop,
+    Block
+};
+
 enum class DaemonType {
     Unix
 #if HAVE_SYSTEMD
@@ -165,7 +178,7 @@ constexpr decltype(auto) makeDependentOn(Arg && arg) {
 }
 
 
-extern std::mt19937 g_Random; 
+extern thread_local std::mt19937 g_Random;
 
 
 #endif
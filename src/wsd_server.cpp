@@ -2,9 +2,18 @@
 // SPDX-License-Identifier: BSD-3-Clause
 
 #include "wsd_server.h"
+#include "metrics.h"
+#include "latency.h"
+#include "tracing.h"
+#include "log_fields.h"
+#include "log_limiter.h"
+#include "flight_recorder.h"
 
 static constexpr size_t g_maxKnownMessages = 50;
 
+//steady clock ticks at the last markStartupBegin() or 0 once reported
+static std::atomic<std::chrono::steady_clock::rep> g_startupBegin = 0;
+
 const sys_string g_soapUri = S("http://www.w3.org/2003/05/soap-envelope");
 const sys_string g_wsaUri  = S("http://schemas.xmlsoap.org/ws/2004/08/addressing");
 const sys_string g_wsdUri  = S("http://schemas.xmlsoap.org/ws/2005/04/discovery");
@@ -38,19 +47,20 @@ public:
 
     struct Hello {
         sys_string endpointIdentifier;
-        ip::tcp::endpoint httpEndpoint;
-        sys_string httpPath;
+        sys_string xaddrs;
+        size_t metadataVersion;
     };
     struct Bye {
         sys_string endpointIdentifier;
     };
     struct ProbeMatch {
         sys_string endpointIdentifier;
+        size_t metadataVersion;
     };
     struct ResolveMatch {
         sys_string endpointIdentifier;
-        ip::tcp::endpoint httpEndpoint;
-        sys_string httpPath;
+        sys_string xaddrs;
+        size_t metadataVersion;
     };
     struct ResponseToGet {
         sys_string endpointIdentifier;
@@ -132,8 +142,8 @@ private:
     void addTypes(const Namespaces & ns, XmlNode & node) {
         node.newTextChild(ns.wsd, u8"Types", u8"wsdp:Device pub:Computer");
     }
-    void addMetadataVersion(const Namespaces & ns, XmlNode & node) {
-        node.newTextChild(ns.wsd, u8"MetadataVersion", u8"1");
+    void addMetadataVersion(const Namespaces & ns, XmlNode & node, size_t version) {
+        node.newTextChild(ns.wsd, u8"MetadataVersion", xml_str(std::to_string(version)));
     }
 
     void fill(const std::monostate &, XmlNode &, const Namespaces &) {
@@ -143,9 +153,8 @@ private:
     void fill(const Hello & val, XmlNode & bodyNode, const Namespaces & ns) {
         auto & hello = bodyNode.newChild(ns.wsd, u8"Hello");
         addEndpointReference(ns, hello, val.endpointIdentifier);
-        sys_string xaddr = makeHttpUrl(val.httpEndpoint) + S("/") + val.httpPath;
-        hello.newTextChild(ns.wsd, u8"XAddrs", xml_str(xaddr));
-        addMetadataVersion(ns, hello);
+        hello.newTextChild(ns.wsd, u8"XAddrs", xml_str(val.xaddrs));
+        addMetadataVersion(ns, hello, val.metadataVersion);
     }
     
     void fill(const Bye & val, XmlNode & bodyNode, const Namespaces & ns) {
@@ -158,7 +167,7 @@ private:
         auto & probeMatch = probeMatches.newChild(ns.wsd, u8"ProbeMatch");
         addEndpointReference(ns, probeMatch, val.endpointIdentifier);
         addTypes(ns, probeMatch);
-        addMetadataVersion(ns, probeMatch);
+        addMetadataVersion(ns, probeMatch, val.metadataVersion);
     }
 
     void fill(const ResolveMatch & val, XmlNode & bodyNode, const Namespaces & ns) {
@@ -166,9 +175,8 @@ private:
         auto & resolveMatch = resolveMatches.newChild(ns.wsd, u8"ResolveMatch");
         addEndpointReference(ns, resolveMatch, val.endpointIdentifier);
         addTypes(ns, resolveMatch);
-        sys_string xaddr = makeHttpUrl(val.httpEndpoint) + S("/") + val.httpPath;
-        resolveMatch.newTextChild(ns.wsd, u8"XAddrs", xml_str(xaddr));
-        addMetadataVersion(ns, resolveMatch);
+        resolveMatch.newTextChild(ns.wsd, u8"XAddrs", xml_str(val.xaddrs));
+        addMetadataVersion(ns, resolveMatch, val.metadataVersion);
     }
 
     void fill(const ResponseToGet & val, XmlNode & bodyNode, const Namespaces & ns) {
@@ -337,20 +345,39 @@ private:
         Http
     };
 public:
-    WsdServerImpl(asio::io_context & ctxt,
+    WsdServerImpl(const Strand & strand,
                   const refcnt_ptr<Config> & config,
+                  const refcnt_ptr<AnnouncementScheduler> & scheduler,
                   HttpServerFactory httpFactory,
                   UdpServerFactory udpFactory,
                   const NetworkInterface & iface,
                   const ip::address & addr):
-        WsdServer(iface),
+        WsdServer(strand, iface),
         m_config(config),
+        m_scheduler(scheduler),
+        m_httpFactory(httpFactory),
+        m_udpFactory(udpFactory),
         m_iface(iface),
         m_httpAddress(addr, g_WsdHttpPort),
+        m_xaddrs(makeXAddrs()),
         m_fullComputerName(buildFullComputerName(*config)),
         m_serverDesc(sys_format("WSD on {}({})", m_iface.name, addr.is_v6() ? "v6" : "v4")),
-        m_udpServer(udpFactory(ctxt, config, iface, addr)),
-        m_httpServer(httpFactory(ctxt, config, iface, m_httpAddress)) {
+        m_metrics(Metrics::forServer(iface.name, addr.is_v6())),
+        m_udpServer(udpFactory(strand, config, iface, addr)),
+        m_httpIdleTimer(strand) {
+        
+        bool httpActive = false;
+        if (auto state = SocketHandoff::takeServerState(iface, addr)) {
+            m_isResumed = true;
+            m_messageNumber = state->messageNumber;
+            for (auto & messageId: state->knownMessageIds)
+                checkNewMessageId(messageId);
+            httpActive = state->httpActive;
+        }
+        
+        //with idle timeout the listener is only opened on demand
+        if (!isLazyHttp() || httpActive)
+            m_httpServer = httpFactory(strand, config, iface, m_httpAddress);
     }
 
     void start() override {
@@ -358,9 +385,22 @@ public:
         if (m_state != NotStarted)
             std::terminate();
         m_udpServer->start(*this);
-        m_httpServer->start(*this);
+        if (m_httpServer) {
+            m_httpServer->start(*this);
+            if (isLazyHttp()) {
+                m_lastHttpActivity = std::chrono::steady_clock::now();
+                scheduleHttpIdleCheck(m_config->httpIdleTimeout());
+            }
+        }
         m_state = Running;
-        sendHello();
+        m_metrics.runningServers.add();
+        WSDDN_PROBE(server_add, m_iface.index, m_httpAddress.address().is_v6());
+        FlightRecorder::record({.event = FlightEvent::ServerAdded, .ifIndex = unsigned(m_iface.index)}, m_httpAddress.address());
+        //the previous instance has already announced us and nobody noticed the switch
+        if (m_isResumed)
+            WSDLOG_INFO("{}: resumed from previous instance", m_serverDesc);
+        else
+            queueHello();
     }
     
     void stop(bool graceful) override {
@@ -369,35 +409,201 @@ public:
         
         if (m_state == Running) {
             if (graceful) {
-                WSDLOG_INFO("{}: sending Bye", m_serverDesc);
-                sendBye();
+                queueBye();
             } else {
                 WSDLOG_INFO("{}: stopping server", m_serverDesc);
-                m_udpServer->stop();
-                m_httpServer->stop();
+                m_httpIdleTimer.cancel();
+                if (m_udpServer)
+                    m_udpServer->stop();
+                if (m_httpServer)
+                    m_httpServer->stop();
                 m_udpServer.reset();
                 m_httpServer.reset();
-                m_state = Stopped;
+                markStopped();
+            }
+        }
+    }
+
+    void rebind(const ip::address & addr) override {
+        if (m_state != Running)
+            std::terminate();
+        
+        WSDLOG_INFO("{}: rebinding to {}", m_serverDesc, addr.to_string());
+        
+        //the HTTP listener is bound to the old address so it cannot be reused
+        bool hadHttpServer = bool(m_httpServer);
+        if (m_httpServer) {
+            m_httpServer->stop();
+            m_httpServer.reset();
+        }
+        
+        m_httpAddress = ip::tcp::endpoint(addr, g_WsdHttpPort);
+        m_xaddrs = makeXAddrs();
+        
+        m_udpServer->rebind(addr);
+        if (hadHttpServer) {
+            m_httpServer = m_httpFactory(m_strand, m_config, m_iface, m_httpAddress);
+            m_httpServer->start(*this);
+        }
+        queueHello();
+    }
+    
+    void reconfigure(const refcnt_ptr<Config> & config, const Config::Changes & changes) override {
+        if (m_state != Running)
+            return;
+        
+        WSDLOG_INFO("{}: applying new configuration", m_serverDesc);
+        
+        bool metadataVersionChanged = config->metadataVersion() != m_config->metadataVersion();
+        
+        //responses are built from the current config so swapping it is all metadata changes need
+        m_config = config;
+        m_fullComputerName = buildFullComputerName(*m_config);
+        
+        if (changes.transport) {
+            m_udpServer->stop();
+            m_udpServer = m_udpFactory(m_strand, m_config, m_iface, m_httpAddress.address());
+            m_udpServer->start(*this);
+        }
+        
+        if (!isLazyHttp()) {
+            m_httpIdleTimer.cancel();
+            if (!m_httpServer) {
+                m_httpServer = m_httpFactory(m_strand, m_config, m_iface, m_httpAddress);
+                m_httpServer->start(*this);
             }
+        } else if (m_httpServer) {
+            scheduleHttpIdleCheck(m_config->httpIdleTimeout());
         }
+        
+        //clients that have fetched the old metadata re-fetch it when they see a new version
+        if (metadataVersionChanged)
+            queueHello();
+    }
+    
+    void handOff(SocketHandoff & dest) override {
+        if (m_state != Running)
+            return;
+        
+        WSDLOG_INFO("{}: handing off", m_serverDesc);
+        
+        SocketHandoff::ServerState state;
+        state.messageNumber = m_messageNumber;
+        for (auto it = m_knownMessageIdsLRU.rbegin(); it != m_knownMessageIdsLRU.rend(); ++it)
+            state.knownMessageIds.push_back(**it);
+        state.httpActive = bool(m_httpServer);
+        
+        m_httpIdleTimer.cancel();
+        if (m_httpServer)
+            m_httpServer->handOff(dest);
+        dest.addServer(m_iface, m_httpAddress.address(), std::move(state), m_udpServer->handOff());
+        m_udpServer.reset();
+        m_httpServer.reset();
+        markStopped();
     }
     
 private:
     ~WsdServerImpl() noexcept {
     }
     
+    void markStopped() {
+        m_state = Stopped;
+        m_metrics.runningServers.sub();
+        WSDDN_PROBE(server_remove, m_iface.index, m_httpAddress.address().is_v6());
+        FlightRecorder::record({.event = FlightEvent::ServerRemoved, .ifIndex = unsigned(m_iface.index)}, m_httpAddress.address());
+    }
+    
     void onFatalUdpError() override {
+        FlightRecorder::record({.event = FlightEvent::FatalError, .outcome = FlightOutcome::Failed, .ifIndex = unsigned(m_iface.index)}, 
+                               m_httpAddress.address());
+        FlightRecorder::dumpAfterError("fatal UDP error");
         stop(false);
     }
     void onFatalHttpError() override {
+        FlightRecorder::record({.event = FlightEvent::FatalError, .outcome = FlightOutcome::Failed, .ifIndex = unsigned(m_iface.index)}, 
+                               m_httpAddress.address());
+        FlightRecorder::dumpAfterError("fatal HTTP error");
         stop(false);
     }
 
-    auto handleUdpRequest(std::unique_ptr<XmlDoc> doc) -> std::optional<XmlCharBuffer> override {
-        return handleRequest(Udp, std::move(doc));
+    auto handleUdpRequest(const ip::address & peer, std::unique_ptr<XmlDoc> doc) -> std::optional<XmlCharBuffer> override {
+        return handleRequest(Udp, peer, std::move(doc));
+    }
+    auto handleHttpRequest(const ip::address & peer, std::unique_ptr<XmlDoc> doc) -> std::optional<XmlCharBuffer> override  {
+        m_lastHttpActivity = std::chrono::steady_clock::now();
+        return handleRequest(Http, peer, std::move(doc));
+    }
+
+    auto isLazyHttp() const -> bool {
+        return m_config->httpIdleTimeout().count() != 0;
+    }
+
+    void activateHttp() {
+        if (!isLazyHttp())
+            return;
+        
+        m_lastHttpActivity = std::chrono::steady_clock::now();
+        if (m_httpServer)
+            return;
+        
+        WSDLOG_DEBUG("{}: opening HTTP listener", m_serverDesc);
+        try {
+            m_httpServer = m_httpFactory(m_strand, m_config, m_iface, m_httpAddress);
+            m_httpServer->start(*this);
+        } catch(std::system_error & ex) {
+            WSDLOG_ERROR("{}: unable to open HTTP listener: {}", m_serverDesc, ex.what());
+            m_httpServer.reset();
+            return;
+        }
+        scheduleHttpIdleCheck(m_config->httpIdleTimeout());
+    }
+
+    void scheduleHttpIdleCheck(std::chrono::steady_clock::duration delay) {
+        m_httpIdleTimer.expires_after(delay);
+        m_httpIdleTimer.async_wait([this, holder = refcnt_retain(this)](asio::error_code ec) {
+            if (ec || m_state != Running || !m_httpServer)
+                return;
+            
+            auto timeout = m_config->httpIdleTimeout();
+            auto idle = std::chrono::steady_clock::now() - m_lastHttpActivity;
+            if (idle < timeout) {
+                scheduleHttpIdleCheck(timeout - idle);
+                return;
+            }
+            
+            WSDLOG_DEBUG("{}: closing idle HTTP listener", m_serverDesc);
+            m_httpServer->stop();
+            m_httpServer.reset();
+        });
     }
-    auto handleHttpRequest(std::unique_ptr<XmlDoc> doc) -> std::optional<XmlCharBuffer> override  {
-        return handleRequest(Http, std::move(doc));
+    
+    //A Hello already waiting for its turn will carry the state current when it is sent
+    void queueHello() {
+        if (m_helloQueued)
+            return;
+        m_helloQueued = true;
+        m_scheduler->request(m_strand, AnnouncementScheduler::Hello, [this, holder = refcnt_retain(this)](bool granted) {
+            m_helloQueued = false;
+            if (granted && m_state == Running && !m_byeQueued)
+                sendHello();
+        });
+    }
+    
+    void queueBye() {
+        if (m_byeQueued)
+            return;
+        m_byeQueued = true;
+        m_scheduler->request(m_strand, AnnouncementScheduler::Bye, [this, holder = refcnt_retain(this)](bool granted) {
+            if (m_state != Running)
+                return;
+            if (!granted) {
+                WSDLOG_INFO("{}: no time left to send Bye, stopping server", m_serverDesc);
+                stop(false);
+                return;
+            }
+            WSDLOG_INFO("{}: sending Bye", m_serverDesc);
+            sendBye();
+        });
     }
     
     void sendHello() {
@@ -411,13 +617,20 @@ private:
         });
         builder.setBody(WSDResponseBuilder::Hello{
             .endpointIdentifier = m_config->endpointIdentifier(),
-            .httpEndpoint = m_httpAddress,
-            .httpPath = m_config->httpPath()
+            .xaddrs = m_xaddrs,
+            .metadataVersion = m_config->metadataVersion()
         });
         
-        auto doc = builder.build();
-        auto buf = doc->dump();
+        auto doc = buildTimed(builder);
+        auto buf = dumpTimed(*doc);
         m_udpServer->broadcast(std::move(buf));
+        m_metrics.sent(WsdAction::Hello).add();
+        
+        if (auto begin = g_startupBegin.exchange(0)) {
+            auto elapsed = std::chrono::steady_clock::now() - std::chrono::steady_clock::time_point(std::chrono::steady_clock::duration(begin));
+            WSDLOG_INFO("{}: first Hello sent {}ms after start", m_serverDesc, 
+                        std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count());
+        }
     }
     
     void sendBye() {
@@ -434,34 +647,71 @@ private:
             .endpointIdentifier = m_config->endpointIdentifier()
         });
         
-        auto doc = builder.build();
-        auto buf = doc->dump();
+        auto doc = buildTimed(builder);
+        auto buf = dumpTimed(*doc);
         
         m_udpServer->broadcast(std::move(buf), [this, holder = refcnt_retain(this)](asio::error_code) {
             stop(false);
         });
+        m_metrics.sent(WsdAction::Bye).add();
+    }
+    
+    static auto buildTimed(WSDResponseBuilder & builder) -> std::unique_ptr<XmlDoc> {
+        LatencyTimer timer(LatencyStage::Build);
+        return builder.build();
     }
     
-    auto handleRequest(RequestType type, std::unique_ptr<XmlDoc> doc)  -> std::optional<XmlCharBuffer> {
+    static auto dumpTimed(XmlDoc & doc) -> XmlCharBuffer {
+        LatencyTimer timer(LatencyStage::Dump);
+        return doc.dump();
+    }
+    
+    auto handleRequest(RequestType type, const ip::address & peer, std::unique_ptr<XmlDoc> doc)  -> std::optional<XmlCharBuffer> {
+        LatencyTimer handleTimer(LatencyStage::Handle);
+        LogFieldsScope serverFields([&](LogFields & fields) {
+            fields.interface = m_iface.name;
+            fields.address = sys_string(m_httpAddress.address().to_string());
+        });
+        
         auto xpathCtxt = XPathContext::create(*doc);
         xpathCtxt->registerNs(u8"soap", xml_str(g_soapUri));
         xpathCtxt->registerNs(u8"wsa",  xml_str(g_wsaUri));
         xpathCtxt->registerNs(u8"wsd",  xml_str(g_wsdUri));
         
         auto headerNode = xpathCtxt->eval(u8"/soap:Envelope/soap:Header")->firstNode();
-        if (!headerNode)
+        if (!headerNode) {
+            if (type == Udp) {
+                m_metrics.received(WsdAction::Other).add();
+                m_metrics.dropped(WsdAction::Other).add();
+            }
+            recordRequest(peer, WsdAction::Other, FlightOutcome::Malformed);
             return std::nullopt;
+        }
         
         xpathCtxt->setContextNode(*headerNode);
 
+        sys_string action = xpathCtxt->eval(u8"string(./wsa:Action)")->stringval();
+        const auto & [uri, method] = action.partition_at_last(U'/').value_or(std::pair(S(""), S("")));
+        auto wsdAction = classifyAction(uri, method);
+        if (type == Udp)
+            m_metrics.received(wsdAction).add();
+
         sys_string messageId = xpathCtxt->eval(u8"string(./wsa:MessageID)")->stringval();
+        //not all compilers we support can capture structured bindings directly
+        LogFieldsScope messageFields([&messageId, &method = method](LogFields & fields) {
+            fields.action = method;
+            fields.messageId = messageId;
+        });
         if (!checkNewMessageId(messageId)) {
             WSDLOG_DEBUG("{}: repeated message {}, ignoring", m_serverDesc, messageId);
+            m_metrics.duplicateMessageIds.add();
+            if (type == Udp)
+                m_metrics.dropped(wsdAction).add();
+            recordRequest(peer, wsdAction, FlightOutcome::Duplicate);
             return std::nullopt;
         }
 
-        sys_string action = xpathCtxt->eval(u8"string(./wsa:Action)")->stringval();
-        const auto & [uri, method] = action.partition_at_last(U'/').value_or(std::pair(S(""), S("")));
+        WSDDN_PROBE(action_dispatched, m_iface.index, unsigned(wsdAction), type == Http);
 
         WSDResponseBuilder responseBuilder;
         bool handled = false;
@@ -470,14 +720,18 @@ private:
             if (uri == g_wsdUri) {
                 if (method == S("Probe")) {
                     WSDLOG_DEBUG("{}: Probe message", m_serverDesc);
-                    handled = handleProbe(*doc, *xpathCtxt, responseBuilder);
+                    handled = handleProbe(peer, *doc, *xpathCtxt, responseBuilder);
+                    if (handled)
+                        activateHttp();
                 } else if (method == S("Resolve")) {
                     WSDLOG_DEBUG("{}: Resolve message", m_serverDesc);
-                    handled = handleResolve(*doc, *xpathCtxt, responseBuilder);
+                    handled = handleResolve(peer, *doc, *xpathCtxt, responseBuilder);
+                    if (handled)
+                        activateHttp();
                 } else if (method == S("Hello") || method == S("Bye")) {
                     WSDLOG_TRACE("{}: Ignoring UDP message, {}/{}", m_serverDesc, uri, method);
                 } else {
-                    WSDLOG_WARN("{}: Unknown UDP message, {}/{}", m_serverDesc, uri, method);
+                    WSDLOG_WARN_LIMITED(peer, "{}: Unknown UDP message, {}/{}", m_serverDesc, uri, method);
                 }
             }
             break;
@@ -486,59 +740,99 @@ private:
                 if (method == S("Get")) {
                     handled = handleGet(*doc, *xpathCtxt, responseBuilder);
                 } else {
-                    WSDLOG_WARN("{}: Unknown HTTP message, {}/{}", m_serverDesc, uri, method);
+                    WSDLOG_WARN_LIMITED(peer, "{}: Unknown HTTP message, {}/{}", m_serverDesc, uri, method);
                 }
             }
             break;
         }
-        if (!handled)
+        if (!handled) {
+            //other hosts announcing themselves is business as usual
+            if (type == Udp && wsdAction != WsdAction::Hello && wsdAction != WsdAction::Bye)
+                m_metrics.dropped(wsdAction).add();
+            recordRequest(peer, wsdAction, FlightOutcome::Ignored);
             return std::nullopt;
+        }
+        if (type == Udp)
+            m_metrics.sent(wsdAction == WsdAction::Probe ? WsdAction::ProbeMatches : WsdAction::ResolveMatches).add();
+        else
+            m_metrics.getsServed.add();
 
         responseBuilder.setTo(g_wsaUri + S("/role/anonymous"));
         responseBuilder.setRelatesTo(messageId);
 
+        handleTimer.stop();
+        
+        LatencyTimer buildTimer(LatencyStage::Build);
         auto responseDoc = responseBuilder.build();
-        return responseDoc->dump();
+        auto buildTime = buildTimer.stop();
+        
+        LatencyTimer dumpTimer(LatencyStage::Dump);
+        auto ret = responseDoc->dump();
+        auto dumpTime = dumpTimer.stop();
+        
+        WSDDN_PROBE(reply_built, m_iface.index, ret.size(), probeNs(buildTime + dumpTime));
+        recordRequest(peer, wsdAction, FlightOutcome::Replied, ret.size());
+        return ret;
+    }
+
+    void recordRequest(const ip::address & peer, WsdAction action, FlightOutcome outcome, size_t replySize = 0) {
+        FlightRecorder::record({.event = FlightEvent::Request, .outcome = outcome, .ifIndex = unsigned(m_iface.index), 
+                                .action = action, .bytesOut = replySize}, peer);
     }
     
-    auto handleProbe(XmlDoc & doc, XPathContext & xpathCtxt, WSDResponseBuilder & responseBuilder) -> bool {
+    static auto classifyAction(const sys_string & uri, const sys_string & method) -> WsdAction {
+        if (uri != g_wsdUri)
+            return WsdAction::Other;
+        if (method == S("Hello"))
+            return WsdAction::Hello;
+        if (method == S("Bye"))
+            return WsdAction::Bye;
+        if (method == S("Probe"))
+            return WsdAction::Probe;
+        if (method == S("Resolve"))
+            return WsdAction::Resolve;
+        return WsdAction::Other;
+    }
+    
+    auto handleProbe(const ip::address & peer, XmlDoc & doc, XPathContext & xpathCtxt, WSDResponseBuilder & responseBuilder) -> bool {
         
         xpathCtxt.setContextNode(*doc.asNode());
         auto probeNode = xpathCtxt.eval(u8"/soap:Envelope/soap:Body/wsd:Probe")->firstNode();
         if (!probeNode) {
-            WSDLOG_WARN("{}: No wsd:Probe in Probe message", m_serverDesc);
+            WSDLOG_WARN_LIMITED(peer, "{}: No wsd:Probe in Probe message", m_serverDesc);
             return false;
         }
 
         xpathCtxt.setContextNode(*probeNode);
         auto scopesNode = xpathCtxt.eval(u8"./wsd:Scopes")->firstNode();
         if (scopesNode) {
-            WSDLOG_WARN("{}: Unexpected wsd:Scopes in Probe message", m_serverDesc);
+            WSDLOG_WARN_LIMITED(peer, "{}: Unexpected wsd:Scopes in Probe message", m_serverDesc);
             return false;
         }
 
         auto typesNode = xpathCtxt.eval(u8"./wsd:Types")->firstNode();
         if (!typesNode) {
-            WSDLOG_WARN("{}: No wsd:Types in Probe message", m_serverDesc);
+            WSDLOG_WARN_LIMITED(peer, "{}: No wsd:Types in Probe message", m_serverDesc);
             return false;
         }
 
         sys_string types = typesNode->getContent();
         const auto & [prefix, type] = types.partition_at_first(U':').value_or(std::pair(S(""), S("")));
         if (prefix.empty() || type != S("Device")) {
-            WSDLOG_WARN("{}: Invalid type '{}' in Probe message", m_serverDesc, type);
+            WSDLOG_WARN_LIMITED(peer, "{}: Invalid type '{}' in Probe message", m_serverDesc, type);
             return false;
         }
 
         auto prefixNs = doc.searchNs(*typesNode, xml_str(prefix));
         if (!prefixNs || prefixNs->href() != g_wsdpUri) {
-            WSDLOG_WARN("{}: Invalid type prefix '{}' in Probe message", m_serverDesc, prefix);
+            WSDLOG_WARN_LIMITED(peer, "{}: Invalid type prefix '{}' in Probe message", m_serverDesc, prefix);
             return false;
         }
 
         responseBuilder.setAction(g_wsdUri + S("/ProbeMatches"));
         responseBuilder.setBody(WSDResponseBuilder::ProbeMatch{
-            .endpointIdentifier = m_config->endpointIdentifier()
+            .endpointIdentifier = m_config->endpointIdentifier(),
+            .metadataVersion = m_config->metadataVersion()
         });
         responseBuilder.setAppSequence(WSDResponseBuilder::AppSequence{
             .instanceId = m_config->instanceIdentifier(),
@@ -548,12 +842,12 @@ private:
         return true;
     }
     
-    auto handleResolve(XmlDoc & doc, XPathContext & xpathCtxt, WSDResponseBuilder & responseBuilder) -> bool {
+    auto handleResolve(const ip::address & peer, XmlDoc & doc, XPathContext & xpathCtxt, WSDResponseBuilder & responseBuilder) -> bool {
         
         xpathCtxt.setContextNode(*doc.asNode());
         sys_string resolveAddr = xpathCtxt.eval(u8"string(/soap:Envelope/soap:Body/wsd:Resolve/wsa:EndpointReference/wsa:Address)")->stringval();
         if (resolveAddr.empty()) {
-            WSDLOG_WARN("{}: No wsa:Address in Resolve message", m_serverDesc);
+            WSDLOG_WARN_LIMITED(peer, "{}: No wsa:Address in Resolve message", m_serverDesc);
             return false;
         }
         if (resolveAddr != m_config->endpointIdentifier()) {
@@ -564,8 +858,8 @@ private:
         responseBuilder.setAction(g_wsdUri + S("/ResolveMatches"));
         responseBuilder.setBody(WSDResponseBuilder::ResolveMatch{
             .endpointIdentifier = m_config->endpointIdentifier(),
-            .httpEndpoint = m_httpAddress,
-            .httpPath = m_config->httpPath()});
+            .xaddrs = m_xaddrs,
+            .metadataVersion = m_config->metadataVersion()});
         responseBuilder.setAppSequence(WSDResponseBuilder::AppSequence{
             .instanceId = m_config->instanceIdentifier(),
             .messageNumber = m_messageNumber++
@@ -600,6 +894,10 @@ private:
         return true;
     }
     
+    auto makeXAddrs() const -> sys_string {
+        return makeHttpUrl(m_httpAddress) + S("/") + m_config->httpPath();
+    }
+
     static auto buildFullComputerName(Config & config) -> sys_string {
         auto & info = config.winNetInfo();
 
@@ -623,27 +921,42 @@ private:
     }
 
 private:
-    const refcnt_ptr<Config> m_config;
+    refcnt_ptr<Config> m_config;
+    const refcnt_ptr<AnnouncementScheduler> m_scheduler;
+    const HttpServerFactory m_httpFactory;
+    const UdpServerFactory m_udpFactory;
     const NetworkInterface m_iface;
-    const ip::tcp::endpoint m_httpAddress;
-    const sys_string m_fullComputerName;
+    ip::tcp::endpoint m_httpAddress;
+    sys_string m_xaddrs;
+    sys_string m_fullComputerName;
     const sys_string m_serverDesc;
+    ServerMetrics & m_metrics;
 
     refcnt_ptr<UdpServer> m_udpServer;
     refcnt_ptr<HttpServer> m_httpServer;
+    asio::steady_timer m_httpIdleTimer;
+    std::chrono::steady_clock::time_point m_lastHttpActivity;
 
 
     std::set<sys_string> m_knownMessageIds;
     std::deque<std::set<sys_string>::iterator> m_knownMessageIdsLRU;
     size_t m_messageNumber = 0;
+    bool m_isResumed = false;
+    bool m_helloQueued = false;
+    bool m_byeQueued = false;
 };
 
-auto createWsdServer(asio::io_context & ctxt,
+auto createWsdServer(const Strand & strand,
                      const refcnt_ptr<Config> & config,
+                     const refcnt_ptr<AnnouncementScheduler> & scheduler,
                      HttpServerFactory httpFactory,
                      UdpServerFactory udpFactory,
                      const NetworkInterface & iface,
                      const ip::address & addr) -> refcnt_ptr<WsdServer> {
     
-    return refcnt_attach(new WsdServerImpl(ctxt, config, httpFactory, udpFactory, iface, addr));
+    return refcnt_attach(new WsdServerImpl(strand, config, scheduler, httpFactory, udpFactory, iface, addr));
+}
+
+void markStartupBegin() {
+    g_startupBegin = std::chrono::steady_clock::now().time_since_epoch().count();
 }
@@ -6,6 +6,7 @@
 
 #include "udp_server.h"
 #include "http_server.h"
+#include "announcement_scheduler.h"
 
 
 class WsdServer : public ref_counted<WsdServer> {
@@ -19,7 +20,14 @@ public:
 public:
     virtual void start() = 0;
     virtual void stop(bool graceful) = 0;
+    //Moves a running server to a new address on the same interface keeping its state
+    virtual void rebind(const ip::address & addr) = 0;
+    //Switches a running server to a configuration with the same identity without announcing anything
+    virtual void reconfigure(const refcnt_ptr<Config> & config, const Config::Changes & changes) = 0;
+    //Passes sockets and protocol state to dest and stops without saying Bye
+    virtual void handOff(SocketHandoff & dest) = 0;
     
+    //Can be called from any thread. The methods above must be called on strand()
     auto state() const -> State {
         return m_state;
     }
@@ -27,20 +35,28 @@ public:
     auto interface() const -> const NetworkInterface & {
         return m_interface;
     }
+    
+    auto strand() const -> const Strand & {
+        return m_strand;
+    }
 protected:
-    WsdServer(const NetworkInterface & iface): m_interface(iface) {
+    WsdServer(const Strand & strand, const NetworkInterface & iface): 
+        m_strand(strand),
+        m_interface(iface) {
     }
     virtual ~WsdServer() noexcept {
     }
     
 protected:
+    const Strand m_strand;
     const NetworkInterface m_interface;
     
-    State m_state = NotStarted;
+    std::atomic<State> m_state = NotStarted;
 };
 
-using WsdServerFactoryT = auto (asio::io_context & ctxt,
+using WsdServerFactoryT = auto (const Strand & strand,
                                 const refcnt_ptr<Config> & config,
+                                const refcnt_ptr<AnnouncementScheduler> & scheduler,
                                 HttpServerFactory httpFactory,
                                 UdpServerFactory udpFactory,
                                 const NetworkInterface & iface,
@@ -49,5 +65,8 @@ using WsdServerFactory = std::function<WsdServerFactoryT>;
 
 WsdServerFactoryT createWsdServer;
 
+//Marks the beginning of a (re)start. The first Hello sent afterwards logs how long it took to get there.
+void markStartupBegin();
+
 
 #endif 
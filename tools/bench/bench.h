@@ -0,0 +1,59 @@
+// Copyright (c) 2022, Eugene Gershnik
+// SPDX-License-Identifier: BSD-3-Clause
+
+#ifndef HEADER_BENCH_H_INCLUDED
+#define HEADER_BENCH_H_INCLUDED
+
+/*
+ Minimal timing helpers shared by the benchmarks. Each measurement doubles the number of
+ iterations until a run takes long enough to make clock resolution irrelevant and reports
+ the average time per iteration.
+ */
+
+namespace Bench {
+
+    //Prevents the compiler from optimizing away computation of val
+    template<class T>
+    inline void keep(const T & val) {
+        asm volatile("" : : "r"(&val) : "memory");
+    }
+
+    template<class Func>
+    auto nsPerCall(Func && func, std::chrono::nanoseconds minTime = std::chrono::milliseconds(200)) -> double {
+        using clock = std::chrono::steady_clock;
+
+        for (size_t iterations = 1; ; iterations *= 2) {
+            auto start = clock::now();
+            for (size_t i = 0; i < iterations; ++i)
+                func();
+            auto elapsed = clock::now() - start;
+            if (elapsed >= minTime)
+                return double(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()) / double(iterations);
+        }
+    }
+
+    //For code whose cost changes once it has run many times, each call gets its own index
+    template<class Func>
+    auto nsPerCall(size_t iterations, Func && func) -> double {
+        using clock = std::chrono::steady_clock;
+
+        auto start = clock::now();
+        for (size_t i = 0; i < iterations; ++i)
+            func(i);
+        auto elapsed = clock::now() - start;
+        return double(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()) / double(iterations);
+    }
+
+    inline void report(std::string_view name, double ns) {
+        if (ns >= 1'000'000)
+            fmt::print("{:<48} {:>10.1f} ms\n", name, ns / 1'000'000);
+        else
+            fmt::print("{:<48} {:>10.1f} ns\n", name, ns);
+    }
+
+    inline void reportRate(std::string_view name, double perSecond) {
+        fmt::print("{:<48} {:>10.0f} /s\n", name, perSecond);
+    }
+}
+
+#endif
@@ -0,0 +1,6 @@
+// Copyright (c) 2022, Eugene Gershnik
+// SPDX-License-Identifier: BSD-3-Clause
+
+//Globals that wsddn defines in main.cpp, which benchmarks do not link
+
+thread_local std::mt19937 g_Random(std::random_device{}());
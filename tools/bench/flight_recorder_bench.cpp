@@ -0,0 +1,54 @@
+// Copyright (c) 2022, Eugene Gershnik
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "bench.h"
+
+#include "flight_recorder.h"
+
+//Cost of recording an event on the message path and of writing out a full ring
+int main() {
+
+    auto peer = ip::make_address("192.168.1.17");
+    static constexpr std::string_view payload = "<?xml version=\"1.0\" encoding=\"utf-8\"?><soap:Envelope xmlns:soap=";
+
+    auto recordNs = Bench::nsPerCall([&]() {
+        FlightRecorder::record({.event = FlightEvent::UdpReceived, .ifIndex = 2, .bytesIn = 812}, peer, 3702);
+    });
+    auto payloadNs = Bench::nsPerCall([&]() {
+        FlightRecorder::record({.event = FlightEvent::UdpReceived, .outcome = FlightOutcome::Malformed, .ifIndex = 2, .bytesIn = 812},
+                               peer, 3702, payload.data(), payload.size());
+    });
+
+    //every thread takes its slot from the same counter
+    auto threadCount = std::max(std::thread::hardware_concurrency(), 2u);
+    std::atomic<bool> stop = false;
+    std::vector<std::thread> others;
+    for (unsigned i = 1; i < threadCount; ++i) {
+        others.emplace_back([&]() {
+            while (!stop.load(std::memory_order_relaxed))
+                FlightRecorder::record({.event = FlightEvent::UdpReceived, .ifIndex = 2, .bytesIn = 812}, peer, 3702);
+        });
+    }
+    auto contendedNs = Bench::nsPerCall([&]() {
+        FlightRecorder::record({.event = FlightEvent::UdpReceived, .ifIndex = 2, .bytesIn = 812}, peer, 3702);
+    });
+    stop = true;
+    for (auto & thread: others)
+        thread.join();
+
+    //the ring is full of payload records now, the worst case for a dump
+    ptl::FileDescriptor devNull(::open("/dev/null", O_WRONLY | O_CLOEXEC));
+    if (!devNull) {
+        fmt::print(stderr, "cannot open /dev/null: {}\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    FlightRecorder::setDumpFile(std::move(devNull));
+    auto dumpNs = Bench::nsPerCall([]() {
+        FlightRecorder::dump("benchmark");
+    });
+
+    Bench::report("FlightRecorder::record", recordNs);
+    Bench::report("FlightRecorder::record with payload", payloadNs);
+    Bench::report(fmt::format("FlightRecorder::record, {} threads", threadCount), contendedNs);
+    Bench::report(fmt::format("FlightRecorder::dump of {} events", FlightRecorder::capacity), dumpNs);
+}
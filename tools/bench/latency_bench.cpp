@@ -0,0 +1,45 @@
+// Copyright (c) 2022, Eugene Gershnik
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "bench.h"
+
+#include "latency.h"
+
+//Cost of timing a stage with LatencyTimer compared to just reading the clock twice
+int main() {
+
+    using Clock = LatencyHistogram::Clock;
+
+    auto clockNs = Bench::nsPerCall([]() {
+        auto start = Clock::now();
+        Bench::keep(Clock::now() - start);
+    });
+    auto timerNs = Bench::nsPerCall([]() {
+        LatencyTimer timer(LatencyStage::Handle);
+    });
+    auto recordNs = Bench::nsPerCall([]() {
+        Latency::histogram(LatencyStage::Handle).record(std::chrono::microseconds(150));
+    });
+
+    //all threads hitting the same histogram is the worst case for the atomic increments
+    auto threadCount = std::max(std::thread::hardware_concurrency(), 2u);
+    std::atomic<bool> stop = false;
+    std::vector<std::thread> others;
+    for (unsigned i = 1; i < threadCount; ++i) {
+        others.emplace_back([&]() {
+            while (!stop.load(std::memory_order_relaxed))
+                LatencyTimer timer(LatencyStage::Handle);
+        });
+    }
+    auto contendedNs = Bench::nsPerCall([]() {
+        LatencyTimer timer(LatencyStage::Handle);
+    });
+    stop = true;
+    for (auto & thread: others)
+        thread.join();
+
+    Bench::report("two steady_clock::now() calls", clockNs);
+    Bench::report("LatencyTimer", timerNs);
+    Bench::report("LatencyHistogram::record", recordNs);
+    Bench::report(fmt::format("LatencyTimer, {} threads", threadCount), contendedNs);
+}
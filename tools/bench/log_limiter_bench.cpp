@@ -0,0 +1,61 @@
+// Copyright (c) 2022, Eugene Gershnik
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "bench.h"
+
+#include "log_limiter.h"
+
+#include <spdlog/sinks/null_sink.h>
+
+//Cost of a rate limited message that is suppressed or admitted compared to logging it normally.
+//Logging goes to a null sink so only formatting and spdlog overhead are counted
+int main() {
+
+    auto logger = std::make_shared<spdlog::logger>("bench", std::make_shared<spdlog::sinks::null_sink_mt>());
+    spdlog::set_default_logger(logger);
+    spdlog::set_level(spdlog::level::info);
+
+    auto peer = ip::make_address("192.168.1.20");
+    std::string_view desc = "UDP on eth0(v4)";
+    std::string_view uri = "http://schemas.xmlsoap.org/ws/2005/04/discovery";
+    std::string_view method = "Unknown";
+
+    auto plainNs = Bench::nsPerCall([&]() {
+        WSDLOG_WARN("{}: Unknown UDP message, {}/{}", desc, uri, method);
+    });
+    //all but the first call within each interval are suppressed
+    auto limitedNs = Bench::nsPerCall([&]() {
+        WSDLOG_WARN_LIMITED(peer, "{}: Unknown UDP message, {}/{}", desc, uri, method);
+    });
+    //what a flood of spoofed addresses costs
+    uint32_t addr = 0x0A000000;
+    auto spoofedNs = Bench::nsPerCall([&]() {
+        WSDLOG_WARN_LIMITED(ip::address_v4(++addr), "{}: Unknown UDP message, {}/{}", desc, uri, method);
+    });
+
+    //A site admits siteBudget messages per interval, so to measure messages that get through
+    //every batch of that many goes to a site of its own, each about a new peer. This is what
+    //WSDLOG_WARN_LIMITED expands to, minus the static.
+    constexpr size_t admittedCount = 100'000;
+    std::deque<LogLimiter> sites;
+    for (size_t i = 0; i < admittedCount / LogLimiter::siteBudget; ++i)
+        sites.emplace_back(spdlog::level::warn, __FILE__, __LINE__);
+    auto admittedNs = Bench::nsPerCall(admittedCount, [&](size_t i) {
+        auto & site = sites[i / LogLimiter::siteBudget];
+        auto decision = site.admit(ip::address_v4(0x0B000000 + uint32_t(i)));
+        if (decision.suppressed)
+            site.logSuppressed(decision);
+        if (decision.admitted)
+            spdlog::log(spdlog::level::warn, "{}: Unknown UDP message, {}/{}", desc, uri, method);
+    });
+    auto plainSameCountNs = Bench::nsPerCall(admittedCount, [&](size_t) {
+        WSDLOG_WARN("{}: Unknown UDP message, {}/{}", desc, uri, method);
+    });
+
+    Bench::report("plain WSDLOG_WARN", plainNs);
+    Bench::report("suppressed WSDLOG_WARN_LIMITED, one peer", limitedNs);
+    Bench::report("suppressed WSDLOG_WARN_LIMITED, changing peers", spoofedNs);
+    Bench::report(fmt::format("plain WSDLOG_WARN, {} calls", admittedCount), plainSameCountNs);
+    Bench::report(fmt::format("admitted WSDLOG_WARN_LIMITED, {} calls", admittedCount), admittedNs);
+    Bench::report("admitted overhead over plain", admittedNs - plainSameCountNs);
+}
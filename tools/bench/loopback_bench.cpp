@@ -0,0 +1,296 @@
+// Copyright (c) 2022, Eugene Gershnik
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "bench.h"
+
+#include "config.h"
+#include "command_line.h"
+#include "wsd_server.h"
+#include "announcement_scheduler.h"
+
+/*
+ Requests per second that real servers answer over loopback with the io_context running
+ on 1, 2, 4... threads, the way --threads N runs it. Every server has a 127.0.0.x address
+ of its own and so its own strand. Linux answers on all of 127/8, elsewhere the addresses
+ need to be added to the loopback interface first.
+
+ Clients are blocking sockets on threads of their own, each with one request outstanding:
+ unicast Probes over UDP and metadata Gets over keep-alive HTTP connections. They compete
+ with the servers for CPUs so on a machine with few cores the numbers flatten early.
+
+ Usage: bench_loopback [servers [clients-per-server [seconds-per-phase]]]
+ */
+
+static constexpr char g_probeTemplate[] =
+    R"(<?xml version="1.0" encoding="utf-8"?>)"
+    R"(<soap:Envelope xmlns:soap="http://www.w3.org/2003/05/soap-envelope" )"
+        R"(xmlns:wsa="http://schemas.xmlsoap.org/ws/2004/08/addressing" )"
+        R"(xmlns:wsd="http://schemas.xmlsoap.org/ws/2005/04/discovery" )"
+        R"(xmlns:wsdp="http://schemas.xmlsoap.org/ws/2006/02/devprof">)"
+    R"(<soap:Header>)"
+        R"(<wsa:To>urn:schemas-xmlsoap-org:ws:2005:04:discovery</wsa:To>)"
+        R"(<wsa:Action>http://schemas.xmlsoap.org/ws/2005/04/discovery/Probe</wsa:Action>)"
+        R"(<wsa:MessageID>{}</wsa:MessageID>)"
+    R"(</soap:Header>)"
+    R"(<soap:Body><wsd:Probe><wsd:Types>wsdp:Device</wsd:Types></wsd:Probe></soap:Body>)"
+    R"(</soap:Envelope>)";
+
+static constexpr char g_getTemplate[] =
+    R"(<?xml version="1.0" encoding="utf-8"?>)"
+    R"(<soap:Envelope xmlns:soap="http://www.w3.org/2003/05/soap-envelope" )"
+        R"(xmlns:wsa="http://schemas.xmlsoap.org/ws/2004/08/addressing">)"
+    R"(<soap:Header>)"
+        R"(<wsa:To>{}</wsa:To>)"
+        R"(<wsa:Action>http://schemas.xmlsoap.org/ws/2004/09/transfer/Get</wsa:Action>)"
+        R"(<wsa:MessageID>{}</wsa:MessageID>)"
+        R"(<wsa:ReplyTo><wsa:Address>http://schemas.xmlsoap.org/ws/2004/08/addressing/role/anonymous</wsa:Address></wsa:ReplyTo>)"
+    R"(</soap:Header>)"
+    R"(<soap:Body/>)"
+    R"(</soap:Envelope>)";
+
+#if WSDDN_PLATFORM_APPLE
+    static constexpr const char * g_loopbackName = "lo0";
+#else
+    static constexpr const char * g_loopbackName = "lo";
+#endif
+
+namespace {
+
+    struct ClientStats {
+        uint64_t completed = 0;
+        //timed out, refused or cut by the server closing a connection
+        uint64_t failed = 0;
+    };
+
+    enum class Protocol {
+        Udp,
+        Http
+    };
+}
+
+static auto serverAddress(size_t idx) -> ip::address_v4 {
+    return ip::address_v4(ip::address_v4::loopback().to_uint() + uint32_t(idx));
+}
+
+//Servers reject repeated MessageIDs so every request needs a new one
+static auto makeMessageId(size_t client, uint64_t counter) -> std::string {
+    return fmt::format("urn:uuid:{:08x}-0000-4000-8000-{:012x}", client, counter);
+}
+
+static auto connectTo(const ip::address_v4 & addr, uint16_t port, int type) -> ptl::FileDescriptor {
+
+    ptl::FileDescriptor fd(::socket(AF_INET, type, 0));
+    if (!fd)
+        throw std::system_error(errno, std::system_category(), "socket() failed");
+    timeval timeout{.tv_sec = 1, .tv_usec = 0};
+    ::setsockopt(fd.get(), SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    sockaddr_in dest{};
+    dest.sin_family = AF_INET;
+    dest.sin_port = htons(port);
+    dest.sin_addr.s_addr = htonl(addr.to_uint());
+    if (::connect(fd.get(), (const sockaddr *)&dest, sizeof(dest)) != 0)
+        return ptl::FileDescriptor();
+    return fd;
+}
+
+static auto sendAll(const ptl::FileDescriptor & fd, std::string_view data) -> bool {
+    while (!data.empty()) {
+        auto res = ::send(fd.get(), data.data(), data.size(), 0);
+        if (res < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        data.remove_prefix(size_t(res));
+    }
+    return true;
+}
+
+//Reads one response delimited by its Content-Length and returns whether it is a success
+static auto readHttpResponse(const ptl::FileDescriptor & fd, std::string & response) -> bool {
+
+    response.clear();
+    std::array<char, 8192> buf;
+    size_t headerEnd = std::string::npos;
+    size_t total = 0;
+    for ( ; ; ) {
+        auto res = ::recv(fd.get(), buf.data(), buf.size(), 0);
+        if (res <= 0)
+            return false;
+        response.append(buf.data(), size_t(res));
+        if (headerEnd == std::string::npos) {
+            headerEnd = response.find("\r\n\r\n");
+            if (headerEnd == std::string::npos)
+                continue;
+            headerEnd += 4;
+            auto lengthPos = response.find("Content-Length: ");
+            if (lengthPos == std::string::npos || lengthPos > headerEnd)
+                return false;
+            total = headerEnd + size_t(strtoul(response.c_str() + lengthPos + 16, nullptr, 10));
+        }
+        if (response.size() >= total)
+            return response.starts_with("HTTP/1.0 200 ");
+    }
+}
+
+static void udpClient(const ip::address_v4 & server, size_t clientIdx, const std::atomic<bool> & stop, ClientStats & stats) {
+
+    auto fd = connectTo(server, g_WsdUdpPort, SOCK_DGRAM);
+    if (!fd)
+        throw std::system_error(errno, std::system_category(), "connect() failed");
+
+    std::vector<char> reply(65536);
+    for (uint64_t counter = 0; !stop.load(std::memory_order_relaxed); ++counter) {
+        auto messageId = makeMessageId(clientIdx, counter);
+        if (!sendAll(fd, fmt::format(g_probeTemplate, messageId))) {
+            ++stats.failed;
+            continue;
+        }
+        //every reply is sent twice, the second copy of an earlier one can come first
+        for ( ; ; ) {
+            auto res = ::recv(fd.get(), reply.data(), reply.size(), 0);
+            if (res < 0) {
+                ++stats.failed;
+                break;
+            }
+            if (std::string_view(reply.data(), size_t(res)).find(messageId) != std::string_view::npos) {
+                ++stats.completed;
+                break;
+            }
+        }
+    }
+}
+
+static void httpClient(const ip::address_v4 & server, const Config & config, size_t clientIdx,
+                       const std::atomic<bool> & stop, ClientStats & stats) {
+
+    ptl::FileDescriptor fd;
+    std::string response;
+    for (uint64_t counter = 0; !stop.load(std::memory_order_relaxed); ++counter) {
+        if (!fd) {
+            fd = connectTo(server, g_WsdHttpPort, SOCK_STREAM);
+            if (!fd) {
+                ++stats.failed;
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                continue;
+            }
+        }
+        auto body = fmt::format(g_getTemplate, config.endpointIdentifier(), makeMessageId(clientIdx, counter));
+        auto request = fmt::format("POST /{} HTTP/1.1\r\n"
+                                   "Host: {}:{}\r\n"
+                                   "Content-Type: application/soap+xml\r\n"
+                                   "Content-Length: {}\r\n"
+                                   "Connection: keep-alive\r\n"
+                                   "\r\n"
+                                   "{}",
+                                   config.httpPath(), server.to_string(), g_WsdHttpPort, body.size(), body);
+        if (!sendAll(fd, request) || !readHttpResponse(fd, response)) {
+            //the server closes connections older than a few seconds
+            fd.close();
+            ++stats.failed;
+            continue;
+        }
+        ++stats.completed;
+    }
+}
+
+static auto runClients(Protocol protocol, const Config & config, size_t serverCount, size_t clientsPerServer,
+                       std::chrono::seconds duration) -> ClientStats {
+
+    std::atomic<bool> stop = false;
+    std::vector<ClientStats> stats(serverCount * clientsPerServer);
+    std::vector<std::thread> clients;
+    clients.reserve(stats.size());
+    for (size_t i = 0; i < stats.size(); ++i) {
+        clients.emplace_back([&, i]() {
+            auto server = serverAddress(i % serverCount);
+            try {
+                if (protocol == Protocol::Udp)
+                    udpClient(server, i, stop, stats[i]);
+                else
+                    httpClient(server, config, i, stop, stats[i]);
+            } catch (std::exception & ex) {
+                fmt::print(stderr, "client for {}: {}\n", server.to_string(), ex.what());
+            }
+        });
+    }
+    std::this_thread::sleep_for(duration);
+    stop = true;
+    for (auto & client: clients)
+        client.join();
+
+    ClientStats ret;
+    for (auto & item: stats) {
+        ret.completed += item.completed;
+        ret.failed += item.failed;
+    }
+    return ret;
+}
+
+static void runWithThreads(unsigned threadCount, size_t serverCount, size_t clientsPerServer, std::chrono::seconds duration) {
+
+    CommandLine cmdline;
+    cmdline.threads = threadCount;
+    cmdline.allowedAddressFamily = IPv4Only;
+    auto config = Config::make(cmdline, false);
+
+    asio::io_context ctxt;
+    auto work = asio::make_work_guard(ctxt);
+    auto scheduler = refcnt_attach(new AnnouncementScheduler(ctxt, config->announceRate()));
+
+    NetworkInterface loopback(int(if_nametoindex(g_loopbackName)), sys_string(g_loopbackName));
+    std::vector<refcnt_ptr<WsdServer>> servers;
+    for (size_t i = 0; i < serverCount; ++i) {
+        auto server = createWsdServer(asio::make_strand(ctxt), config, scheduler, createHttpServer, createUdpServer,
+                                      loopback, serverAddress(i));
+        asio::dispatch(server->strand(), [server]() { server->start(); });
+        servers.emplace_back(std::move(server));
+    }
+
+    std::vector<std::thread> workers;
+    for (unsigned i = 0; i < threadCount; ++i)
+        workers.emplace_back([&]() { ctxt.run(); });
+
+    auto udp = runClients(Protocol::Udp, *config, serverCount, clientsPerServer, duration);
+    auto http = runClients(Protocol::Http, *config, serverCount, clientsPerServer, duration);
+
+    for (size_t i = 0; i < servers.size(); ++i) {
+        if (servers[i]->state() != WsdServer::Running)
+            fmt::print(stderr, "server on {} has stopped, see the log\n", serverAddress(i).to_string());
+    }
+    scheduler->shutdown(std::chrono::steady_clock::duration::zero());
+    for (auto & server: servers)
+        asio::dispatch(server->strand(), [server]() { server->stop(false); });
+    work.reset();
+    for (auto & worker: workers)
+        worker.join();
+
+    auto seconds = double(duration.count());
+    Bench::reportRate(fmt::format("UDP Probe, {} threads", threadCount), double(udp.completed) / seconds);
+    Bench::reportRate(fmt::format("HTTP Get, {} threads", threadCount), double(http.completed) / seconds);
+    if (udp.failed || http.failed)
+        fmt::print("{:<48} {:>10} UDP, {} HTTP\n", "failed requests", udp.failed, http.failed);
+}
+
+int main(int argc, char * argv[]) {
+
+    spdlog::set_level(spdlog::level::warn);
+    //writing to a connection the server has just closed must not kill us
+    signal(SIGPIPE, SIG_IGN);
+
+    size_t serverCount = argc > 1 ? size_t(atoi(argv[1])) : 8;
+    size_t clientsPerServer = argc > 2 ? size_t(atoi(argv[2])) : 2;
+    auto duration = std::chrono::seconds(argc > 3 ? atoi(argv[3]) : 3);
+    if (serverCount == 0 || clientsPerServer == 0 || duration.count() <= 0) {
+        fmt::print(stderr, "usage: {} [servers [clients-per-server [seconds-per-phase]]]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    auto maxThreads = std::max(std::thread::hardware_concurrency(), 1u);
+    for (unsigned threadCount = 1; ; threadCount = std::min(threadCount * 2, maxThreads)) {
+        runWithThreads(threadCount, serverCount, clientsPerServer, duration);
+        if (threadCount == maxThreads)
+            break;
+    }
+}
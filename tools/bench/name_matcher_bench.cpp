@@ -0,0 +1,130 @@
+// Copyright (c) 2022, Eugene Gershnik
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "bench.h"
+
+#include "name_matcher.h"
+#include "config.h"
+#include "command_line.h"
+
+//Interface names of a busy container host: mostly veths and bridges with random suffixes
+static auto makeNames(size_t count) -> std::vector<std::string> {
+
+    std::mt19937 rng(12345);
+    auto hex = [&](size_t digits) {
+        std::string ret;
+        for (size_t i = 0; i < digits; ++i)
+            ret += "0123456789abcdef"[rng() % 16];
+        return ret;
+    };
+
+    std::vector<std::string> ret;
+    ret.reserve(count);
+    for (size_t i = 0; ret.size() < count; ++i) {
+        switch (i % 10) {
+        case 0:  ret.push_back(fmt::format("eth{}", rng() % 64)); break;
+        case 1:  ret.push_back(fmt::format("enp{}s{}", rng() % 8, rng() % 32)); break;
+        case 2:  ret.push_back(fmt::format("br-{}", hex(12))); break;
+        case 3:  ret.push_back(fmt::format("wlan{}", rng() % 4)); break;
+        case 4:  ret.push_back(fmt::format("tun{}", rng() % 16)); break;
+        default: ret.push_back(fmt::format("veth{}", hex(7))); break;
+        }
+    }
+    return ret;
+}
+
+//Ten patterns of each kind NameMatcher compiles to
+static auto makePatterns() -> std::vector<std::string> {
+
+    static const char * const prefixes[] = {
+        "veth", "docker", "br-", "tun", "tap", "wg", "vlan", "bond", "virbr", "cni"
+    };
+    static const char * const suffixes[] = {
+        "lan", "guest", "iot", "dmz", "mgmt", "vpn", "lab", "cam", "voip", "wan"
+    };
+
+    std::vector<std::string> ret;
+    for (int i = 0; i < 10; ++i) {
+        ret.push_back(fmt::format("eth{}", i));                                 //literal
+        ret.push_back(fmt::format("{}.*", prefixes[i]));                        //prefix
+        ret.push_back(fmt::format("br-.*-{}.*", suffixes[i]));                  //glob
+        ret.push_back(fmt::format("(enp|ens){}s[0-9]+", i));                    //DFA
+        ret.push_back(fmt::format("(?!lo)[a-z]+{}\\d", i));                     //std::regex fallback
+    }
+    return ret;
+}
+
+//Compares NameMatcher against the std::regex_match it replaced for every pattern kind,
+//then times Config::isAllowedInterface with its per-name cache on the same workload
+int main() {
+
+    spdlog::set_level(spdlog::level::off);
+
+    auto names = makeNames(10'000);
+    auto patterns = makePatterns();
+
+    for (size_t kind = 0; kind < 5; ++kind) {
+        std::vector<NameMatcher> matchers;
+        std::vector<std::regex> regexes;
+        for (size_t i = kind; i < patterns.size(); i += 5) {
+            matchers.emplace_back(patterns[i]);
+            regexes.emplace_back(patterns[i], std::regex::ECMAScript);
+        }
+        auto matcherNs = Bench::nsPerCall([&]() {
+            for (auto & name: names) {
+                for (auto & matcher: matchers)
+                    Bench::keep(matcher.matches(name));
+            }
+        });
+        auto regexNs = Bench::nsPerCall([&]() {
+            for (auto & name: names) {
+                for (auto & regex: regexes)
+                    Bench::keep(std::regex_match(name, regex));
+            }
+        });
+        auto matchCount = double(names.size() * matchers.size());
+        Bench::report(fmt::format("{} NameMatcher", patterns[kind]), matcherNs / matchCount);
+        Bench::report(fmt::format("{} std::regex_match", patterns[kind]), regexNs / matchCount);
+    }
+
+    //Half the patterns include, half exclude, as in a real configuration
+    CommandLine cmdline;
+    for (size_t i = 0; i < patterns.size(); ++i)
+        (i % 2 ? cmdline.excludePatterns : cmdline.includePatterns).emplace_back(patterns[i]);
+
+    std::vector<sys_string> sysNames(names.begin(), names.end());
+    std::vector<std::regex> includeRegexes, excludeRegexes;
+    for (auto & pattern: cmdline.includePatterns)
+        includeRegexes.emplace_back(sys_string::char_access(pattern).c_str(), std::regex::ECMAScript);
+    for (auto & pattern: cmdline.excludePatterns)
+        excludeRegexes.emplace_back(sys_string::char_access(pattern).c_str(), std::regex::ECMAScript);
+
+    //what isAllowedInterface did before: every pattern through std::regex on every call
+    auto regexConfigNs = Bench::nsPerCall([&]() {
+        for (auto & name: sysNames) {
+            sys_string::char_access access(name);
+            auto matches = [&](const std::regex & regex) { return std::regex_match(access.c_str(), regex); };
+            Bench::keep(std::any_of(includeRegexes.begin(), includeRegexes.end(), matches) &&
+                        std::none_of(excludeRegexes.begin(), excludeRegexes.end(), matches));
+        }
+    });
+    //each pass over all names evicts what the previous one cached, so every call misses
+    auto missConfig = Config::make(cmdline, false);
+    auto missNs = Bench::nsPerCall([&]() {
+        for (auto & name: sysNames)
+            Bench::keep(missConfig->isAllowedInterface(name));
+    });
+    //the usual case: the same interfaces coming up again and again
+    constexpr size_t workingSet = 1'000;
+    auto hitConfig = Config::make(cmdline, false);
+    auto hitNs = Bench::nsPerCall([&]() {
+        for (size_t i = 0; i < workingSet; ++i)
+            Bench::keep(hitConfig->isAllowedInterface(sysNames[i]));
+    });
+
+    Bench::report(fmt::format("{} names, {} patterns, std::regex", names.size(), patterns.size()), regexConfigNs);
+    Bench::report(fmt::format("{} names, {} patterns, isAllowedInterface miss", names.size(), patterns.size()), missNs);
+    Bench::report(fmt::format("{} names, {} patterns, isAllowedInterface hit", workingSet, patterns.size()), hitNs);
+    Bench::report("isAllowedInterface miss, per name", missNs / double(names.size()));
+    Bench::report("isAllowedInterface hit, per name", hitNs / double(workingSet));
+}
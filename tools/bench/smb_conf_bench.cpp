@@ -0,0 +1,77 @@
+// Copyright (c) 2022, Eugene Gershnik
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "bench.h"
+
+#include "smb_conf_scanner.h"
+
+using namespace std::literals;
+
+//The regex based [global] section parser SmbConfScanner replaced
+static auto regexScan(std::string_view content) -> std::optional<std::string_view> {
+
+    static const std::regex sectionRe(R"##(\s*\[([^\]]*)\].*)##", std::regex_constants::ECMAScript);
+    static const std::regex entryRe(R"##(\s*([^ \t#;=][^=#;]*)\s*=\s*((?:[^ \t#;][^#;]*)?).*)##", std::regex_constants::ECMAScript);
+
+    std::optional<std::string_view> workgroup;
+    bool inGlobalSection = false;
+    std::match_results<std::string_view::const_iterator> m;
+    for (size_t pos = 0; pos < content.size(); ) {
+        auto end = content.find('\n', pos);
+        if (end == content.npos)
+            end = content.size();
+        auto line = content.substr(pos, end - pos);
+        pos = end + 1;
+
+        if (std::regex_match(line.begin(), line.end(), m, sectionRe)) {
+            bool isGlobal = (std::string_view(m[1].first, size_t(m[1].length())) == "global"sv);
+            if (!isGlobal && inGlobalSection)
+                break;
+            inGlobalSection = isGlobal;
+            continue;
+        }
+        if (!inGlobalSection || !std::regex_match(line.begin(), line.end(), m, entryRe))
+            continue;
+        if (std::string_view(m[1].first, size_t(m[1].length())).starts_with("workgroup"sv))
+            workgroup = std::string_view(m[2].first, size_t(m[2].length()));
+    }
+    return workgroup;
+}
+
+//A [global] section of lineCount lines with the parameter we look for at the very end
+static auto generateSmbConf(size_t lineCount) -> std::string {
+    std::string ret = "[global]\n";
+    for (size_t i = 1; i < lineCount - 1; ++i) {
+        switch (i % 4) {
+        case 0: fmt::format_to(std::back_inserter(ret), "   # comment number {}\n", i); break;
+        case 1: fmt::format_to(std::back_inserter(ret), "   parameter {} = value {}\n", i, i); break;
+        case 2: fmt::format_to(std::back_inserter(ret), "\tAnother Parameter{}=some longer value for line {}\n", i, i); break;
+        case 3: fmt::format_to(std::back_inserter(ret), "   ; other comment {}\n", i); break;
+        }
+    }
+    ret += "   workgroup = BENCHMARK\n";
+    return ret;
+}
+
+int main() {
+
+    spdlog::set_level(spdlog::level::off);
+
+    auto content = generateSmbConf(600'000);
+
+    auto scannerNs = Bench::nsPerCall([&]() {
+        SmbConfScanner scanner(false);
+        scanner.scan(content);
+        auto res = std::move(scanner).result();
+        if (res.workgroup != S("BENCHMARK"))
+            abort();
+    });
+    auto regexNs = Bench::nsPerCall([&]() {
+        auto res = regexScan(content);
+        if (res != "BENCHMARK"sv)
+            abort();
+    });
+
+    Bench::report("600k line smb.conf SmbConfScanner", scannerNs);
+    Bench::report("600k line smb.conf std::regex", regexNs);
+}
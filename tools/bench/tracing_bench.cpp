@@ -0,0 +1,37 @@
+// Copyright (c) 2022, Eugene Gershnik
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "bench.h"
+
+#include "tracing.h"
+
+//Cost of a USDT probe with no tracer attached, on top of a loop body of comparable
+//size to the code probes sit in. Attach a tracer to see the cost when enabled, e.g.
+//  bpftrace -e 'usdt:./bench_tracing:wsddn:parse_done { @ = count(); }'
+int main() {
+
+    fmt::print("USDT probes are {}\n", HAVE_USDT ? "compiled in" : "not available, probes compile to nothing");
+
+    uint32_t ifIndex = 2;
+    uint64_t state = 0x9E3779B97F4A7C15;
+
+    auto step = [&]() {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return state;
+    };
+
+    auto plainNs = Bench::nsPerCall([&]() {
+        auto val = step();
+        Bench::keep(val);
+    });
+    auto probedNs = Bench::nsPerCall([&]() {
+        auto val = step();
+        WSDDN_PROBE(parse_done, ifIndex, size_t(val & 0xFFFF), int64_t(val >> 48), (val & 1) != 0);
+        Bench::keep(val);
+    });
+
+    Bench::report("loop body", plainNs);
+    Bench::report("loop body with parse_done probe", probedNs);
+}